@@ -0,0 +1,640 @@
+/* Decode / encode throughput benchmark for ckv, ckv1 and ckv3.
+ *
+ *     BenchKV [iterations] [scale] [baseline [tolerance]]
+ *
+ * Writes a corpus into the current directory (npc unit files sharing a
+ * #base file, a vsndevts soundevent file and a dmx model, each a few MB
+ * times scale), then runs every decode and encode entry point on it in a
+ * fresh lua_State. Each case reports the best of iterations calls as
+ * MB/s of KV text, the tables decoded (or encoded) per second, the Lua
+ * heap bytes one call leaves allocated and the peak RSS seen while the
+ * case ran.
+ *
+ * baseline is the saved output of an earlier run. Cases more than
+ * tolerance percent (default 10) below the MB/s recorded there are
+ * reported as regressions and make the exit status 1, like a case that
+ * raised an error. */
+
+#include        <stdio.h>
+#include        <stdlib.h>
+#include        <string.h>
+#include        "lua/lua.h"
+#include        "lua/lualib.h"
+#include        "lua/lauxlib.h"
+
+#ifdef _WIN32
+#include        <windows.h>
+#include        <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include        <time.h>
+#include        <sys/resource.h>
+#endif
+
+#define DEFAULT_ITERATIONS  10
+#define DEFAULT_TOLERANCE   10.0
+#define NPC_HERO_FILES      8
+
+int luaopen_ckv(lua_State *l);
+int luaopen_ckv1(lua_State *l);
+int luaopen_ckv3(lua_State *l);
+
+/* ===== CORPUS ===== */
+
+enum {
+    NPC_BASE,
+    NPC_HERO,           /* First of NPC_HERO_FILES files */
+    SOUNDEVENTS = NPC_HERO + NPC_HERO_FILES,
+    MODEL,
+    CORPUS_FILES
+};
+
+static char corpus_path[CORPUS_FILES][32];
+static long corpus_size[CORPUS_FILES];
+
+static const char *unit_keys[] = {
+    "BaseClass", "Model", "ModelScale", "Ability1", "Ability2",
+    "ArmorPhysical", "AttackDamageMin", "AttackDamageMax", "AttackRate",
+    "BountyGoldMin", "MovementSpeed", "StatusHealth", "VisionDaytimeRange",
+    "HealthBarOffset", "SoundSet"
+};
+
+#define UNIT_KEYS (int)(sizeof(unit_keys) / sizeof(unit_keys[0]))
+
+static unsigned int seed = 12345;
+
+static unsigned int next_random(void)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) & 0x7fff;
+}
+
+/* Writes the "key" "value" lines of one unit at depth 2 */
+static void write_unit(FILE *f, const char *name)
+{
+    int i;
+
+    fprintf(f, "\t\"%s\"\n\t{\n", name);
+    for (i = 0; i < UNIT_KEYS; i++) {
+        switch (next_random() % 4) {
+        case 0:
+            fprintf(f, "\t\t\"%s\"\t\t\"%u\"\n", unit_keys[i], next_random());
+            break;
+        case 1:
+            fprintf(f, "\t\t\"%s\"\t\t\"0.%02u\"\n", unit_keys[i], next_random() % 100);
+            break;
+        case 2:
+            fprintf(f, "\t\t\"%s\"\t\t\"models/heroes/%s/%s.vmdl\"\n", unit_keys[i],
+                    unit_keys[next_random() % UNIT_KEYS],
+                    unit_keys[next_random() % UNIT_KEYS]);
+            break;
+        default:
+            fprintf(f, "\t\t\"%s\"\t\t\"esc\\\\aped \\\"%u\\\"\"\t// comment\n",
+                    unit_keys[i], next_random());
+            break;
+        }
+    }
+    fprintf(f, "\t\t\"Bounds\"\n\t\t{\n\t\t\t\"HullRadius\"\t\"%u\"\n"
+               "\t\t\t\"RingRadius\"\t\"%u\"\n\t\t}\n\t}\n",
+            next_random() % 64, next_random() % 128);
+}
+
+static void write_npc_base(FILE *f, int units)
+{
+    int i;
+
+    fprintf(f, "// Units shared by every npc_heroes file\n\"DOTAUnits\"\n{\n"
+               "\t\"Version\"\t\"1\"\n");
+    for (i = 0; i < units; i++) {
+        char name[32];
+
+        snprintf(name, sizeof(name), "npc_unit_%d", i);
+        write_unit(f, name);
+    }
+    fprintf(f, "}\n");
+}
+
+static void write_npc_heroes(FILE *f, int file, int units)
+{
+    int i;
+
+    fprintf(f, "#base \"npc_base.txt\"\n\n\"DOTAHeroes\"\n{\n");
+    for (i = 0; i < units; i++) {
+        char name[48];
+
+        snprintf(name, sizeof(name), "npc_dota_hero_%d_%d", file, i);
+        write_unit(f, name);
+    }
+    fprintf(f, "}\n");
+}
+
+static void write_soundevents(FILE *f, int events)
+{
+    int i;
+
+    fprintf(f, "<!-- kv3 encoding:text:version{e21c7f3c-8a33-41c5-9977-a76d3a32aa0d}"
+               " format:generic:version{7412167c-06e9-4698-aff2-e63eb59037e7} -->\n{\n");
+    for (i = 0; i < events; i++) {
+        fprintf(f, "\tHero_%d.Attack = \n\t{\n"
+                   "\t\ttype = \"dota_src1_3d\"\n"
+                   "\t\tvolume = 0.%02u\n"
+                   "\t\tpitch = %u\n"
+                   "\t\tsoundlevel = \"%u\"\n"
+                   "\t\tvsnd_files = \n\t\t[\n"
+                   "\t\t\t\"sounds/weapons/hero/h%d/attack01.vsnd\",\n"
+                   "\t\t\t\"sounds/weapons/hero/h%d/attack02.vsnd\",\n"
+                   "\t\t]\n"
+                   "\t\toperator_stacks = { update_stack = { reference_operator = "
+                   "{ operator = \"opvar\" opvar = \"hero_%d\" } } }\n"
+                   "\t\tmixgroup = Weapons\n\t}\n",
+                i, next_random() % 100, next_random() % 3, 70 + next_random() % 20,
+                i, i, i);
+    }
+    fprintf(f, "}\n");
+}
+
+static void write_model(FILE *f, int meshes)
+{
+    int i, j;
+
+    fprintf(f, "<!-- dmx encoding keyvalues2 1 format model 22 -->\n\"DmElement\"\n{\n"
+               "\t\"id\" \"elementid\" \"3f1e6f3e-0000-0000-0000-000000000001\"\n"
+               "\t\"name\" \"string\" \"root\"\n"
+               "\t\"children\" \"element_array\"\n\t[\n");
+    for (i = 0; i < meshes; i++) {
+        fprintf(f, "\t\t\"DmeMesh\"\n\t\t{\n"
+                   "\t\t\t\"id\" \"elementid\" \"3f1e6f3e-%012d\"\n"
+                   "\t\t\t\"name\" \"string\" \"mesh%d\"\n"
+                   "\t\t\t\"transform\" \"DmeTransform\"\n\t\t\t{\n"
+                   "\t\t\t\t\"position\" \"vector3\" \"%u %u %u\"\n"
+                   "\t\t\t\t\"orientation\" \"quaternion\" \"0 0 0 1\"\n\t\t\t}\n"
+                   "\t\t\t\"positions\" \"vector3_array\"\n\t\t\t[\n",
+                i, i, next_random() % 100, next_random() % 100, next_random() % 100);
+        for (j = 0; j < 32; j++) {
+            fprintf(f, "\t\t\t\t\"0.%04u 0.%04u 0.%04u\"%s\n", next_random() % 10000,
+                    next_random() % 10000, next_random() % 10000, j < 31 ? "," : "");
+        }
+        fprintf(f, "\t\t\t]\n\t\t\t\"indices\" \"int_array\" [ ");
+        for (j = 0; j < 48; j++)
+            fprintf(f, "\"%u\"%s", next_random() % 32, j < 47 ? ", " : " ");
+        fprintf(f, "]\n\t\t}%s\n", i < meshes - 1 ? "," : "");
+    }
+    fprintf(f, "\t]\n}\n");
+}
+
+static int write_corpus(int scale)
+{
+    int i;
+
+    for (i = 0; i < CORPUS_FILES; i++) {
+        FILE *f;
+
+        if (i == NPC_BASE)
+            strcpy(corpus_path[i], "npc_base.txt");
+        else if (i == SOUNDEVENTS)
+            strcpy(corpus_path[i], "bench_sounds.vsndevts");
+        else if (i == MODEL)
+            strcpy(corpus_path[i], "bench_model.dmx");
+        else
+            snprintf(corpus_path[i], sizeof(corpus_path[i]), "npc_heroes_%d.txt", i - NPC_HERO);
+
+        f = fopen(corpus_path[i], "wb");
+        if (!f) {
+            fprintf(stderr, "cannot write %s\n", corpus_path[i]);
+            return 0;
+        }
+        if (i == NPC_BASE)
+            write_npc_base(f, 4000 * scale);
+        else if (i == SOUNDEVENTS)
+            write_soundevents(f, 8000 * scale);
+        else if (i == MODEL)
+            write_model(f, 1200 * scale);
+        else
+            write_npc_heroes(f, i - NPC_HERO, 1000 * scale);
+        corpus_size[i] = ftell(f);
+        fclose(f);
+    }
+
+    return 1;
+}
+
+static void remove_corpus(void)
+{
+    int i;
+
+    for (i = 0; i < CORPUS_FILES; i++) {
+        char cache[sizeof(corpus_path[0]) + 8];
+
+        /* decode_file_cached() leaves path.ckvb next to the text */
+        snprintf(cache, sizeof(cache), "%.31s.ckvb", corpus_path[i]);
+        remove(cache);
+        remove(corpus_path[i]);
+    }
+    remove("bench_out.txt");
+}
+
+/* Returns the contents of a corpus file, the caller frees it */
+static char *read_corpus(int file)
+{
+    FILE *f = fopen(corpus_path[file], "rb");
+    char *data = (char *)malloc(corpus_size[file] + 1);
+
+    if (f) {
+        data[fread(data, 1, corpus_size[file], f)] = '\0';
+        fclose(f);
+    }
+
+    return data;
+}
+
+/* ===== MEASUREMENT ===== */
+
+static double now(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER count, freq;
+
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (double)count.QuadPart / freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+/* Linux can reset the RSS high-water mark, so every case gets its own
+ * peak. Elsewhere the peak only grows across the run */
+static void reset_peak_rss(void)
+{
+#ifdef __linux__
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+
+    if (f) {
+        fputs("5", f);
+        fclose(f);
+    }
+#endif
+}
+
+static double peak_rss_mb(void)
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+
+    GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc));
+    return pmc.PeakWorkingSetSize / (1024.0 * 1024.0);
+#else
+#ifdef __linux__
+    FILE *f = fopen("/proc/self/status", "r");
+    char line[128];
+    long kb = -1;
+
+    if (f) {
+        while (fgets(line, sizeof(line), f))
+            if (sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+                break;
+        fclose(f);
+    }
+    if (kb >= 0)
+        return kb / 1024.0;
+#endif
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+    return usage.ru_maxrss / 1024.0;
+#endif
+#endif
+}
+
+static double lua_heap_bytes(lua_State *L)
+{
+    return lua_gc(L, LUA_GCCOUNT, 0) * 1024.0 + lua_gc(L, LUA_GCCOUNTB, 0);
+}
+
+/* Counts the tables reachable from the value at idx, without metamethods */
+static long count_tables(lua_State *L, int idx)
+{
+    long count = 1;
+
+    if (lua_type(L, idx) != LUA_TTABLE)
+        return 0;
+
+    idx = lua_absindex(L, idx);
+    luaL_checkstack(L, 3, NULL);
+    lua_pushnil(L);
+    while (lua_next(L, idx) != 0) {
+        count += count_tables(L, -1);
+        lua_pop(L, 1);
+    }
+
+    return count;
+}
+
+/* ===== CASES ===== */
+
+typedef enum {
+    INPUT_TEXT,         /* Contents of file */
+    INPUT_PATH,         /* Path of file */
+    INPUT_PATHS,        /* Table with the paths of every npc_heroes file */
+    INPUT_TABLE,        /* Result of source(text) */
+    INPUT_BINARY        /* Result of encode_binary(source(text)) */
+} input_t;
+
+typedef enum {
+    OUTPUT_NONE,
+    OUTPUT_WRITER,      /* Second argument is a writer function */
+    OUTPUT_FILE         /* Second argument is an output path */
+} output_t;
+
+typedef struct {
+    const char *module;
+    const char *func;
+    int file;
+    input_t input;
+    const char *source;
+    output_t output;
+} bench_case_t;
+
+static const bench_case_t cases[] = {
+    { "ckv", "decode", NPC_BASE, INPUT_TEXT, NULL, OUTPUT_NONE },
+    { "ckv", "decode2", NPC_BASE, INPUT_TEXT, NULL, OUTPUT_NONE },
+    { "ckv", "decode_file_array", NPC_HERO, INPUT_PATH, NULL, OUTPUT_NONE },
+    { "ckv", "decode_file_cached", NPC_HERO, INPUT_PATH, NULL, OUTPUT_NONE },
+    { "ckv", "decode_files", NPC_HERO, INPUT_PATHS, NULL, OUTPUT_NONE },
+    { "ckv", "decode_binary", NPC_BASE, INPUT_BINARY, "decode", OUTPUT_NONE },
+    { "ckv", "encode", NPC_BASE, INPUT_TABLE, "decode", OUTPUT_NONE },
+    { "ckv", "encode2", NPC_BASE, INPUT_TABLE, "decode2", OUTPUT_NONE },
+    { "ckv", "encode_to", NPC_BASE, INPUT_TABLE, "decode", OUTPUT_WRITER },
+    { "ckv", "encode_to_file", NPC_BASE, INPUT_TABLE, "decode", OUTPUT_FILE },
+    { "ckv", "encode_binary", NPC_BASE, INPUT_TABLE, "decode", OUTPUT_NONE },
+
+    { "ckv1", "decode", SOUNDEVENTS, INPUT_TEXT, NULL, OUTPUT_NONE },
+    { "ckv1", "decode_array", SOUNDEVENTS, INPUT_TEXT, NULL, OUTPUT_NONE },
+    { "ckv1", "decode_lazy", SOUNDEVENTS, INPUT_TEXT, NULL, OUTPUT_NONE },
+    { "ckv1", "decode_file_cached", SOUNDEVENTS, INPUT_PATH, NULL, OUTPUT_NONE },
+    { "ckv1", "decode_binary", SOUNDEVENTS, INPUT_BINARY, "decode", OUTPUT_NONE },
+    { "ckv1", "encode", SOUNDEVENTS, INPUT_TABLE, "decode", OUTPUT_NONE },
+    { "ckv1", "encode_array", SOUNDEVENTS, INPUT_TABLE, "decode_array", OUTPUT_NONE },
+    { "ckv1", "encode_to", SOUNDEVENTS, INPUT_TABLE, "decode", OUTPUT_WRITER },
+    { "ckv1", "encode_to_file", SOUNDEVENTS, INPUT_TABLE, "decode", OUTPUT_FILE },
+    { "ckv1", "encode_array_to", SOUNDEVENTS, INPUT_TABLE, "decode_array", OUTPUT_WRITER },
+    { "ckv1", "encode_array_to_file", SOUNDEVENTS, INPUT_TABLE, "decode_array", OUTPUT_FILE },
+    { "ckv1", "encode_binary", SOUNDEVENTS, INPUT_TABLE, "decode", OUTPUT_NONE },
+
+    { "ckv3", "decode", MODEL, INPUT_TEXT, NULL, OUTPUT_NONE },
+    { "ckv3", "decode_file_cached", MODEL, INPUT_PATH, NULL, OUTPUT_NONE },
+    { "ckv3", "decode_binary", MODEL, INPUT_BINARY, "decode", OUTPUT_NONE },
+    { "ckv3", "encode", MODEL, INPUT_TABLE, "decode", OUTPUT_NONE },
+    { "ckv3", "encode_to", MODEL, INPUT_TABLE, "decode", OUTPUT_WRITER },
+    { "ckv3", "encode_to_file", MODEL, INPUT_TABLE, "decode", OUTPUT_FILE },
+    { "ckv3", "encode_binary", MODEL, INPUT_TABLE, "decode", OUTPUT_NONE },
+};
+
+#define CASES (int)(sizeof(cases) / sizeof(cases[0]))
+
+static int discard_chunk(lua_State *L)
+{
+    (void)L;
+    return 0;
+}
+
+/* Pushes module[func](value at idx), raising errors */
+static void call_module(lua_State *L, const char *func, int idx)
+{
+    idx = lua_absindex(L, idx);
+    lua_getfield(L, 1, func);
+    lua_pushvalue(L, idx);
+    lua_call(L, 1, 1);
+}
+
+/* Leaves the arguments of c at index 2 (and 3), returns the KV text bytes
+ * one call covers */
+static long push_input(lua_State *L, const bench_case_t *c)
+{
+    long bytes = corpus_size[c->file];
+    char *text;
+    int i;
+
+    switch (c->input) {
+    case INPUT_PATH:
+        lua_pushstring(L, corpus_path[c->file]);
+        if (c->file == NPC_HERO)
+            bytes += corpus_size[NPC_BASE];
+        break;
+    case INPUT_PATHS:
+        /* decode_files() skips #base, so only the hero files count */
+        lua_createtable(L, NPC_HERO_FILES, 0);
+        for (bytes = 0, i = 0; i < NPC_HERO_FILES; i++) {
+            lua_pushstring(L, corpus_path[NPC_HERO + i]);
+            lua_rawseti(L, -2, i + 1);
+            bytes += corpus_size[NPC_HERO + i];
+        }
+        break;
+    default:
+        text = read_corpus(c->file);
+        lua_pushlstring(L, text, corpus_size[c->file]);
+        free(text);
+        if (c->input != INPUT_TEXT) {
+            call_module(L, c->source, -1);
+            lua_remove(L, -2);
+        }
+        if (c->input == INPUT_BINARY) {
+            call_module(L, "encode_binary", -1);
+            lua_remove(L, -2);
+        }
+        break;
+    }
+
+    if (c->output == OUTPUT_WRITER)
+        lua_pushcfunction(L, discard_chunk);
+    else if (c->output == OUTPUT_FILE)
+        lua_pushstring(L, "bench_out.txt");
+
+    return bytes;
+}
+
+/* Protected push_input(): module, case -> arguments..., bytes */
+static int prepare_input(lua_State *L)
+{
+    const bench_case_t *c = (const bench_case_t *)lua_touserdata(L, 2);
+    long bytes;
+
+    lua_settop(L, 1);
+    lua_getfield(L, 1, c->func);
+    if (lua_isnil(L, -1))
+        return luaL_error(L, "%s.%s is missing", c->module, c->func);
+    lua_pop(L, 1);
+
+    bytes = push_input(L, c);
+    lua_pushnumber(L, (lua_Number)bytes);
+
+    return lua_gettop(L) - 1;
+}
+
+static lua_CFunction module_opener(const char *module)
+{
+    if (!strcmp(module, "ckv"))
+        return luaopen_ckv;
+    if (!strcmp(module, "ckv1"))
+        return luaopen_ckv1;
+    return luaopen_ckv3;
+}
+
+/* Times c in a fresh lua_State, storing its MB/s in mbs. Returns 0 when
+ * a call raised an error */
+static int run_case(const bench_case_t *c, int iterations, double *mbs)
+{
+    lua_State *L = luaL_newstate();
+    double best = 0, heap = 0, start, elapsed, before;
+    long bytes = 0, tables = 0;
+    int args = 0, i, ok;
+
+    luaL_openlibs(L);
+    reset_peak_rss();
+
+    lua_pushcfunction(L, module_opener(c->module));
+    lua_call(L, 0, 1);
+    lua_pushcfunction(L, prepare_input);
+    lua_pushvalue(L, 1);
+    lua_pushlightuserdata(L, (void *)c);
+    ok = lua_pcall(L, 2, LUA_MULTRET, 0) == 0;
+    if (ok) {
+        bytes = (long)lua_tonumber(L, -1);
+        lua_pop(L, 1);
+        args = lua_gettop(L) - 1;
+    }
+
+    for (i = 0; ok && i < iterations; i++) {
+        lua_gc(L, LUA_GCCOLLECT, 0);
+        lua_gc(L, LUA_GCSTOP, 0);
+        lua_getfield(L, 1, c->func);
+        lua_pushvalue(L, 2);
+        if (args > 1)
+            lua_pushvalue(L, 3);
+
+        before = lua_heap_bytes(L);
+        start = now();
+        ok = lua_pcall(L, args, 1, 0) == 0;
+        elapsed = now() - start;
+
+        if (ok && (i == 0 || elapsed < best)) {
+            best = elapsed;
+            heap = lua_heap_bytes(L) - before;
+        }
+        if (ok && i == 0) {
+            /* Tables built by decoders, or walked by encoders */
+            tables = count_tables(L, !strncmp(c->func, "decode", 6) ? -1 : 2);
+        }
+        if (ok)
+            lua_pop(L, 1);
+        lua_gc(L, LUA_GCRESTART, 0);
+    }
+
+    if (ok) {
+        if (best <= 0)
+            best = 1e-9;
+        *mbs = bytes / best / 1e6;
+        printf("%-5s %-22s %9.1f %12.0f %14.0f %10.1f\n", c->module, c->func,
+               *mbs, tables / best, heap, peak_rss_mb());
+    } else {
+        printf("%-5s %-22s error: %s\n", c->module, c->func, lua_tostring(L, -1));
+    }
+
+    lua_close(L);
+
+    return ok;
+}
+
+/* ===== BASELINE ===== */
+
+static double baseline_mbs[CASES];
+
+/* Reads the MB/s of every case from the rows of a saved run, the other
+ * lines of it do not parse as rows */
+static int read_baseline(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    char line[256], module[16], func[32];
+    double mbs;
+    int i;
+
+    if (!f) {
+        fprintf(stderr, "cannot read %s\n", path);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%15s %31s %lf", module, func, &mbs) != 3)
+            continue;
+        for (i = 0; i < CASES; i++) {
+            /* The first row wins over the regression report below it */
+            if (!strcmp(cases[i].module, module) && !strcmp(cases[i].func, func) &&
+                !baseline_mbs[i])
+                baseline_mbs[i] = mbs;
+        }
+    }
+    fclose(f);
+
+    return 1;
+}
+
+/* Returns the number of cases slower than baseline by more than
+ * tolerance percent */
+static int report_regressions(const double *mbs, double tolerance)
+{
+    int regressions = 0, i;
+
+    for (i = 0; i < CASES; i++) {
+        if (baseline_mbs[i] <= 0 || mbs[i] <= 0 ||
+            mbs[i] >= baseline_mbs[i] * (1 - tolerance / 100))
+            continue;
+        if (!regressions)
+            printf("\nslower than the baseline by more than %.0f%%:\n", tolerance);
+        printf("%-5s %-22s %9.1f MB/s, baseline %.1f (%+.1f%%)\n",
+               cases[i].module, cases[i].func, mbs[i], baseline_mbs[i],
+               (mbs[i] / baseline_mbs[i] - 1) * 100);
+        regressions++;
+    }
+
+    return regressions;
+}
+
+int main(int argc, char* argv[])
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+    int scale = argc > 2 ? atoi(argv[2]) : 1;
+    double tolerance = argc > 4 ? atof(argv[4]) : DEFAULT_TOLERANCE;
+    double mbs[CASES] = { 0 };
+    int failures = 0, i;
+
+    if (iterations < 1 || scale < 1 || tolerance < 0 || tolerance >= 100) {
+        fprintf(stderr, "usage: %s [iterations] [scale] [baseline [tolerance]]\n",
+                argv[0]);
+        return 2;
+    }
+    if (argc > 3 && !read_baseline(argv[3]))
+        return 2;
+    if (!write_corpus(scale))
+        return 1;
+
+    printf("corpus: npc_base %.1f MB, %d npc_heroes x %.1f MB, "
+           "vsndevts %.1f MB, dmx %.1f MB; best of %d\n\n",
+           corpus_size[NPC_BASE] / 1e6, NPC_HERO_FILES, corpus_size[NPC_HERO] / 1e6,
+           corpus_size[SOUNDEVENTS] / 1e6, corpus_size[MODEL] / 1e6, iterations);
+    printf("%-5s %-22s %9s %12s %14s %10s\n", "", "function", "MB/s",
+           "tables/s", "GC bytes/call", "RSS MB");
+
+    for (i = 0; i < CASES; i++)
+        failures += !run_case(&cases[i], iterations, &mbs[i]);
+    if (argc > 3)
+        failures += report_regressions(mbs, tolerance);
+
+    remove_corpus();
+
+    return failures ? 1 : 0;
+}
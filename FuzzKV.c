@@ -0,0 +1,562 @@
+/* libFuzzer targets for the ckv, ckv1 and ckv3 decoders.
+ *
+ *     clang -fsanitize=fuzzer,address -DFUZZ_MODULE=1 -DCKV_SNAP_MIN_JOB=1 \
+ *         FuzzKV.c ...
+ *
+ * FUZZ_MODULE picks the dialect: 0 ckv, 1 ckv1, 2 ckv3. Every input goes
+ * through each text decoder of the module and through decode_binary.
+ * Whatever decodes is encoded again and that text decoded once more, so
+ * the encoders are covered too. The decoders accept more than the
+ * encoders write back, so only with -DFUZZ_ROUND_TRIP does text an
+ * encoder wrote failing to decode abort like a crash would. The
+ * encoders that take { threads = N } have to fail where the serial
+ * encoder does and write the same bytes otherwise. CKV_SNAP_MIN_JOB=1
+ * cuts even small inputs into several jobs. ckv inputs with a #base
+ * line are also written to a file and read with decode_file_array(),
+ * which resolves the include.
+ *
+ * The other ways into a document are checked against decode(), a
+ * difference aborts: query() down a path taken from the decoded table,
+ * ckv1.decode_lazy() with every proxy parsed through __index or
+ * __pairs, ckv1.decode_async() yielding after every slice and
+ * ckv3.decoder() fed the input in chunks of sizes taken from it.
+ *
+ * Built with -DFUZZ_STANDALONE instead of -fsanitize=fuzzer, main() runs
+ * the files named on the command line once each, to replay a crash or a
+ * corpus without libFuzzer. */
+
+#include        <stdio.h>
+#include        <stdlib.h>
+#include        <string.h>
+#include        "lua/lua.h"
+#include        "lua/lualib.h"
+#include        "lua/lauxlib.h"
+
+#ifndef FUZZ_MODULE
+#define FUZZ_MODULE     0
+#endif
+
+/* Longer inputs only slow the fuzzer down */
+#define FUZZ_MAX_INPUT  (64 * 1024)
+
+#define FUZZ_BASE_FILE  "fuzz_base.txt"
+
+/* Keys followed down the decoded table for query() */
+#define FUZZ_MAX_PATH   6
+
+/* For the threaded encoders */
+#define FUZZ_THREADS    4
+
+int luaopen_ckv(lua_State *l);
+int luaopen_ckv1(lua_State *l);
+int luaopen_ckv3(lua_State *l);
+
+typedef struct {
+    const char *decode;
+    const char *encode;     /* Round trip for the decode result, or NULL */
+    int threaded;           /* encode also takes { threads = N } */
+} fuzz_pair_t;
+
+#if FUZZ_MODULE == 0
+#define FUZZ_OPEN       luaopen_ckv
+static const fuzz_pair_t pairs[] = {
+    { "decode", "encode", 0 },
+    { "decode2", "encode2", 0 },
+};
+#elif FUZZ_MODULE == 1
+#define FUZZ_OPEN       luaopen_ckv1
+static const fuzz_pair_t pairs[] = {
+    { "decode", "encode", 0 },
+    { "decode_array", "encode_array", 1 },
+    { "decode_lazy", NULL, 0 },
+};
+#elif FUZZ_MODULE == 2
+#define FUZZ_OPEN       luaopen_ckv3
+static const fuzz_pair_t pairs[] = {
+    { "decode", "encode", 1 },
+};
+#else
+#error FUZZ_MODULE must be 0 (ckv), 1 (ckv1) or 2 (ckv3)
+#endif
+
+#define PAIRS (int)(sizeof(pairs) / sizeof(pairs[0]))
+
+static lua_State *L;
+
+/* Pushes module[func](value at idx), or the error it raised. Returns 0
+ * for an error */
+static int try_call(const char *func, int idx)
+{
+    idx = lua_absindex(L, idx);
+    lua_getfield(L, 1, func);
+    lua_pushvalue(L, idx);
+
+    return lua_pcall(L, 1, 1, 0) == 0;
+}
+
+/* Encodes the table at idx again on FUZZ_THREADS threads, ok tells
+ * whether the serial encoder on top of the stack succeeded */
+static void threaded_encode(const fuzz_pair_t *pair, int idx, int ok)
+{
+    int same;
+
+    lua_getfield(L, 1, pair->encode);
+    lua_pushvalue(L, idx);
+    lua_createtable(L, 0, 1);
+    lua_pushinteger(L, FUZZ_THREADS);
+    lua_setfield(L, -2, "threads");
+    same = (lua_pcall(L, 2, 1, 0) == 0) == ok;
+    if (same && ok)
+        same = lua_rawequal(L, -1, -2);
+
+    if (!same) {
+        fprintf(stderr, "%s() on %d threads differs from the serial "
+                "encoder\n  got:  %s\n  want: %s\n", pair->encode,
+                FUZZ_THREADS, lua_tostring(L, -1), lua_tostring(L, -2));
+        abort();
+    }
+    lua_pop(L, 1);
+}
+
+static void round_trip(const fuzz_pair_t *pair, int idx)
+{
+    int ok;
+
+    if (!pair->encode || !lua_istable(L, idx))
+        return;
+
+    /* Encoders may refuse what a decoder accepted (eg. nesting too deep
+     * for the encoder) */
+    idx = lua_absindex(L, idx);
+    ok = try_call(pair->encode, idx);
+    if (pair->threaded)
+        threaded_encode(pair, idx, ok);
+    if (!ok) {
+        lua_pop(L, 1);
+        return;
+    }
+    if (!try_call(pair->decode, -1)) {
+#ifdef FUZZ_ROUND_TRIP
+        fprintf(stderr, "%s() rejects the output of %s(): %s\n%s\n",
+                pair->decode, pair->encode, lua_tostring(L, -1),
+                lua_tostring(L, -2));
+        abort();
+#endif
+    }
+    lua_pop(L, 2);
+}
+
+/* ===== PARITY WITH decode() ===== */
+
+typedef struct {
+    char *data;
+    size_t len;
+} text_t;
+
+static void text_add(text_t *t, const char *s, size_t len)
+{
+    t->data = (char *)realloc(t->data, t->len + len + 1);
+    memcpy(t->data + t->len, s, len);
+    t->len += len;
+    t->data[t->len] = '\0';
+}
+
+static int compare_items(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Appends the value at idx with table keys sorted, so tables filled in a
+ * different order compare equal */
+static void dump(int idx, text_t *out)
+{
+    const char *s;
+    size_t len;
+
+    idx = lua_absindex(L, idx);
+    switch (lua_type(L, idx)) {
+    case LUA_TTABLE: {
+        char **items = NULL;
+        int count = 0, i;
+
+        lua_pushnil(L);
+        while (lua_next(L, idx) != 0) {
+            text_t item = { NULL, 0 };
+
+            dump(-2, &item);
+            text_add(&item, "=", 1);
+            dump(-1, &item);
+            items = (char **)realloc(items, (count + 1) * sizeof(*items));
+            items[count++] = item.data;
+            lua_pop(L, 1);
+        }
+        if (count)
+            qsort(items, count, sizeof(*items), compare_items);
+
+        text_add(out, "{", 1);
+        for (i = 0; i < count; i++) {
+            text_add(out, items[i], strlen(items[i]));
+            text_add(out, ",", 1);
+            free(items[i]);
+        }
+        text_add(out, "}", 1);
+        free(items);
+        break;
+    }
+    case LUA_TSTRING:
+    case LUA_TNUMBER:
+        /* Convert a copy, lua_tolstring() on a key would confuse lua_next() */
+        lua_pushvalue(L, idx);
+        s = lua_tolstring(L, -1, &len);
+        text_add(out, lua_type(L, idx) == LUA_TSTRING ? "s:" : "n:", 2);
+        text_add(out, s, len);
+        lua_pop(L, 1);
+        break;
+    case LUA_TBOOLEAN:
+        text_add(out, lua_toboolean(L, idx) ? "true" : "false",
+                 lua_toboolean(L, idx) ? 4 : 5);
+        break;
+    default:
+        text_add(out, lua_typename(L, lua_type(L, idx)),
+                 strlen(lua_typename(L, lua_type(L, idx))));
+        break;
+    }
+}
+
+static char *dump_value(int idx)
+{
+    text_t out = { NULL, 0 };
+
+    dump(idx, &out);
+
+    return out.data;
+}
+
+/* Aborts unless the value at idx (when ok, the error message otherwise)
+ * dumps as want */
+static void expect_same(const char *what, int ok, int idx, const char *want)
+{
+    char *got;
+
+    if (!ok) {
+        fprintf(stderr, "%s fails where decode() does not: %s\n", what,
+                lua_tostring(L, idx));
+        abort();
+    }
+
+    got = dump_value(idx);
+    if (strcmp(got, want) != 0) {
+        fprintf(stderr, "%s differs from decode()\n  got:  %s\n  want: %s\n",
+                what, got, want);
+        abort();
+    }
+    free(got);
+}
+
+/* Pushes a path of up to FUZZ_MAX_PATH keys into the decoded table at idx
+ * and the value it leads to. Each level takes the nth key in lua_next()
+ * order, or the last one, with n read from the input. The path stops at
+ * keys a query path can't name: anything but a string at the root (the
+ * ckv root key may be any value) and anything but a string or an array
+ * index below it */
+static void pick_path(int idx, const unsigned char *data, size_t size)
+{
+    int path, n, k;
+
+    lua_newtable(L);
+    path = lua_gettop(L);
+    lua_pushvalue(L, idx);
+
+    for (k = 1; k <= FUZZ_MAX_PATH && lua_istable(L, -1); k++) {
+        n = size ? data[(k * 7) % size] % 4 : 0;
+
+        lua_pushnil(L);
+        if (!lua_next(L, -2))
+            break;
+        /* table, key, value */
+        while (n-- > 0) {
+            lua_pushvalue(L, -2);
+            if (!lua_next(L, -4))
+                break;
+            lua_remove(L, -3);
+            lua_remove(L, -3);
+        }
+        if (lua_type(L, -2) != LUA_TSTRING &&
+            (k == 1 || lua_type(L, -2) != LUA_TNUMBER)) {
+            lua_pop(L, 2);
+            break;
+        }
+        lua_pushvalue(L, -2);
+        lua_rawseti(L, path, k);
+        lua_remove(L, -2);
+        lua_remove(L, -2);
+    }
+}
+
+/* query() down a path of the decode() result at idx has to find the same
+ * value */
+static void query_path(int idx, const unsigned char *data, size_t size)
+{
+    char *want;
+    int ok;
+
+    idx = lua_absindex(L, idx);
+    if (!lua_istable(L, idx))
+        return;
+
+    pick_path(idx, data, size);
+    if (lua_rawlen(L, -2) == 0) {
+        lua_pop(L, 2);
+        return;
+    }
+    want = dump_value(-1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "query");
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, -3);
+    ok = lua_pcall(L, 2, 1, 0) == 0;
+    expect_same("query()", ok, -1, want);
+    lua_pop(L, 2);
+    free(want);
+
+    /* Arbitrary paths only have to fail cleanly */
+    lua_getfield(L, 1, "query");
+    lua_pushvalue(L, 2);
+    lua_pushlstring(L, (const char *)data, size < 16 ? size : 16);
+    lua_pcall(L, 2, 1, 0);
+    lua_pop(L, 1);
+}
+
+#if FUZZ_MODULE == 1
+/* Fills every decode_lazy() proxy below the table at index 1, calling
+ * __index at even depths and __pairs at odd ones */
+static int lazy_fill(lua_State *l)
+{
+    const int depth = (int)lua_tointeger(l, 2);
+
+    if (luaL_getmetafield(l, 1, depth % 2 ? "__pairs" : "__index")) {
+        lua_pushvalue(l, 1);
+        if (depth % 2) {
+            lua_call(l, 1, 3);
+            lua_pop(l, 3);
+        } else {
+            lua_pushboolean(l, 0);
+            lua_call(l, 2, 1);
+            lua_pop(l, 1);
+        }
+    }
+
+    lua_pushnil(l);
+    while (lua_next(l, 1) != 0) {
+        if (lua_istable(l, -1)) {
+            lua_pushcfunction(l, lazy_fill);
+            lua_pushvalue(l, -2);
+            lua_pushinteger(l, depth + 1);
+            lua_call(l, 2, 0);
+        }
+        lua_pop(l, 1);
+    }
+
+    return 0;
+}
+
+static void decode_lazy(const char *want)
+{
+    int ok;
+
+    ok = try_call("decode_lazy", 2);
+    if (ok && lua_istable(L, -1)) {
+        lua_pushcfunction(L, lazy_fill);
+        lua_pushvalue(L, -2);
+        lua_pushinteger(L, 0);
+        ok = lua_pcall(L, 2, 0, 0) == 0;
+        if (!ok)
+            lua_remove(L, -2);
+    }
+    expect_same("decode_lazy()", ok, -1, want);
+    lua_pop(L, 1);
+}
+
+static int resume(lua_State *co, int narg, int *nres)
+{
+#if LUA_VERSION_NUM >= 504
+    return lua_resume(co, L, narg, nres);
+#else
+    int status = lua_resume(co, L, narg);
+
+    *nres = lua_gettop(co);
+
+    return status;
+#endif
+}
+
+/* decode_async() with no budget yields after every slice */
+static void decode_async(const char *want)
+{
+    lua_State *co = lua_newthread(L);
+    int status, nres, narg = 2;
+
+    lua_getfield(L, 1, "decode_async");
+    lua_xmove(L, co, 1);
+    lua_pushvalue(L, 2);
+    lua_xmove(L, co, 1);
+    lua_pushinteger(co, 0);
+
+    while ((status = resume(co, narg, &nres)) == LUA_YIELD) {
+        lua_pop(co, nres);
+        narg = 0;
+    }
+
+    lua_xmove(co, L, 1);
+    expect_same("decode_async()", status == LUA_OK, -1, want);
+    lua_pop(L, 2);
+}
+#endif
+
+#if FUZZ_MODULE == 2
+/* Feeds the input to decoder() in chunks of 1 to 16 bytes, with sizes
+ * read from the input itself */
+static void decode_stream(const unsigned char *data, size_t size,
+                          const char *want)
+{
+    size_t pos = 0, n;
+    int dec, ok = 1;
+
+    lua_getfield(L, 1, "decoder");
+    lua_call(L, 0, 1);
+    dec = lua_gettop(L);
+
+    while (ok && pos < size) {
+        n = 1 + data[(pos * 31 + size) % size] % 16;
+        if (n > size - pos)
+            n = size - pos;
+        lua_getfield(L, dec, "feed");
+        lua_pushvalue(L, dec);
+        lua_pushlstring(L, (const char *)data + pos, n);
+        ok = lua_pcall(L, 2, 0, 0) == 0;
+        pos += n;
+    }
+    if (ok) {
+        lua_getfield(L, dec, "finish");
+        lua_pushvalue(L, dec);
+        ok = lua_pcall(L, 1, 1, 0) == 0;
+    }
+
+    expect_same("decoder()", ok, -1, want);
+    lua_settop(L, dec - 1);
+}
+#endif
+
+/* Checks the other decoders when decode() takes the input */
+static void parity(const unsigned char *data, size_t size)
+{
+    char *want;
+
+    if (!try_call("decode", 2) || !lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return;
+    }
+    want = dump_value(-1);
+    query_path(-1, data, size);
+    lua_pop(L, 1);
+
+#if FUZZ_MODULE == 1
+    decode_lazy(want);
+    decode_async(want);
+#elif FUZZ_MODULE == 2
+    /* A '\0' inside a chunk is an error to the decoder but ends the
+     * document for decode() */
+    if (memchr(data, '\0', size) == NULL)
+        decode_stream(data, size, want);
+#endif
+
+    free(want);
+}
+
+#if FUZZ_MODULE == 0
+/* decode_file_array() is the only way into the #base include code */
+static void decode_base_file(const char *data, size_t size)
+{
+    FILE *f;
+
+    if (!strstr(data, "#base"))
+        return;
+
+    f = fopen(FUZZ_BASE_FILE, "wb");
+    if (!f)
+        return;
+    fwrite(data, 1, size, f);
+    fclose(f);
+
+    lua_pushstring(L, FUZZ_BASE_FILE);
+    try_call("decode_file_array", -1);
+    lua_pop(L, 2);
+    remove(FUZZ_BASE_FILE);
+}
+#endif
+
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size)
+{
+    int i;
+
+    if (size > FUZZ_MAX_INPUT)
+        return 0;
+
+    if (!L) {
+        L = luaL_newstate();
+        luaL_openlibs(L);
+        lua_pushcfunction(L, FUZZ_OPEN);
+        lua_call(L, 0, 1);
+    }
+    lua_settop(L, 1);
+
+    /* Lua strings end with '\0', so this is the buffer the decoders see */
+    lua_pushlstring(L, (const char *)data, size);
+    for (i = 0; i < PAIRS; i++) {
+        if (try_call(pairs[i].decode, 2))
+            round_trip(&pairs[i], -1);
+        lua_pop(L, 1);
+    }
+    try_call("decode_binary", 2);
+    lua_pop(L, 1);
+    parity(data, size);
+#if FUZZ_MODULE == 0
+    decode_base_file(lua_tostring(L, 2), size);
+#endif
+
+    lua_settop(L, 1);
+    lua_gc(L, LUA_GCCOLLECT, 0);
+
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+int main(int argc, char* argv[])
+{
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        FILE *f = fopen(argv[i], "rb");
+        unsigned char *data;
+        long size;
+
+        if (!f) {
+            fprintf(stderr, "cannot read %s\n", argv[i]);
+            return 1;
+        }
+        fseek(f, 0, SEEK_END);
+        size = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        data = (unsigned char *)malloc(size + 1);
+        size = (long)fread(data, 1, size, f);
+        fclose(f);
+
+        LLVMFuzzerTestOneInput(data, (size_t)size);
+        free(data);
+    }
+    printf("%d inputs\n", argc - 1);
+
+    return 0;
+}
+#endif
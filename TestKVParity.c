@@ -0,0 +1,658 @@
+/* Decoder and encoder parity tests.
+ *
+ * The other ways into a document have to agree with plain decode() of
+ * the same text: the ckv3 streaming decoder fed in chunks of every small
+ * size and split at every offset, ckv1.decode_lazy() with every proxy
+ * parsed, query() down a path, and ckv1.decode_async() over many time
+ * slices. Tables are compared as dumps with sorted keys, the first
+ * mismatch of each check is printed.
+ *
+ * ckv1.encode_array() and ckv3.encode() with { threads = N } have to
+ * write the same bytes as without it, for every N up to MAX_THREADS. */
+
+#include        <stdio.h>
+#include        <stdlib.h>
+#include        <string.h>
+#include        "lua/lua.h"
+#include        "lua/lualib.h"
+#include        "lua/lauxlib.h"
+
+/* Stack indexes of the module tables */
+#define CKV         1
+#define CKV1        2
+#define CKV3        3
+
+#define MAX_CHUNK   8
+
+/* Entries of the generated decode_async() document, some 80 bytes each,
+ * so a zero budget yields many times */
+#define ASYNC_ITEMS 2000
+
+/* Items of the generated encode documents, 80 to 150 bytes each. The
+ * largest is cut into several jobs at every thread count */
+static const int encode_items[] = { 1, 100, 2000 };
+
+#define MAX_THREADS 8
+
+int luaopen_ckv(lua_State *l);
+int luaopen_ckv1(lua_State *l);
+int luaopen_ckv3(lua_State *l);
+
+static const char *stream_docs[] = {
+    "<!-- c1 --> <!-- c2 --> \"a\" \"t\" \"v\"",
+    "<!-- dmx encoding keyvalues2 1 format model 22 -->\n"
+    "\"DmElement\"\n"
+    "{\n"
+    "\t\"id\" \"elementid\" \"3f1e6f3e-0000-0000-0000-000000000001\"\n"
+    "\t<!-- between --><!-- pairs -->\n"
+    "\t\"name\" \"string\" \"back\\\\slash \\\"quoted\\\"\"\n"
+    "\t\"children\" \"element_array\"\n"
+    "\t[\n"
+    "\t\t\"DmeJoint\" { \"name\" \"string\" \"bone0\" },\n"
+    "\t\t\"DmeJoint\" { \"name\" \"string\" \"p\\\\\" } \" }\n"
+    "\t]\n"
+    "\t\"positions\" \"vector3_array\" [ \"0 0 0\", \"1.5 -2 3\" ]\n"
+    "\t\"empty\" \"int_array\" [ ]\n"
+    "}\n",
+    /* A run of backslashes takes the next character, a quote included */
+    "\"a\" { \"x\" \"t\" \"p\\\\\" } \" } \"b\" \"t\" \"w\"",
+};
+
+/* ckv1 documents for decode_lazy(), backslashes next to brackets and
+ * quotes */
+static const char *lazy_docs[] = {
+    "a = { x = \"p\\\\\" } \" y = { z = 1 } } b = [ 1, { c = \"d\" } ]",
+    "{ h = { s = \"p\\\\\" } ]\" y = [ \"a\\\\b\", { z = 1 } ] }\n  w = { v = \"ok\" } }",
+    "k = { w = a\\\\} x = { n = 2 } } j = { v = x\\\"y }",
+    "r = { a = { b = { c = { d = [ [ 1, 2 ], { e = \"f\\\\g\" } ] } } } }",
+    "r = { f = [ \"a\"b\"} 2b\"} 1e1] o = { n = 1 } }",
+    "r = { f = [ x } \"a\" { \"b\" ] o = { n = 1 } } a = { { \"b\" \"c\" = { d = 1 } }",
+};
+
+/* Up to four queries each, skipping containers that hold strings with
+ * backslashes on the way */
+static const struct {
+    int module;
+    const char *doc;
+    const char *paths[4];
+} query_docs[] = {
+    { CKV, "\"root\" { \"skip\" { \"s\" \"q\\\"} }\" \"t\" \"x\\\\\" }\n"
+           "\"want\" \"1\" \"deep\" { \"k\" { \"v\" \"2\" } } }",
+      { "root.want", "root.deep.k.v", "root.skip.s", "root.skip.t" } },
+    { CKV1, "a = { x = \"p\\\\\" } \" } b = 2",
+      { "b", "a.x", "a", "c" } },
+    { CKV1, "{ h = { s = \"p\\\\\" } ]\" y = [ \"a\\\\b\", { z = 1 } ] }\n"
+            "  w = { v = \"ok\" } }",
+      { "w.v", "h.y.2.z", "h.s", "w.v.x" } },
+    { CKV1, "r = { f = [ \"a\"b\", 2b\"} 1e1] o = 1 }",
+      { "r.o", "r.f.1", "r.f", "r.x" } },
+    { CKV1, "a = { { \"b\" \"c\" = \"d\" }",
+      { "b", "a.c", "a", "a.b" } },
+    { CKV1, "r = { f = [ x } \"a\", \"b\", ] o = 1 }",
+      { "r.o", "r.f.2", "r.f", "r.x" } },
+    { CKV1, "x { b [ 1 { 2 ] } y [ 3 } 4 ]",
+      { "y", "y.2", "x.b.2", "x.c" } },
+    { CKV1, "x { b [ 1 { 2 ] } y { z [ 3 } 4 ] }",
+      { "y.z", "y.z.2", "y", "x.b" } },
+    { CKV3, "\"a\" { \"x\" \"t\" \"p\\\\\" } \" } \"b\" \"t\" \"w\"",
+      { "b", "a.x", "a", "b.2" } },
+    { CKV3, "\"DmElement\" {\n"
+            "\t\"kids\" \"element_array\" [ \"DmeJoint\" { \"name\" \"string\" \"p\\\\\" } ] \" } ]\n"
+            "\t\"name\" \"string\" \"root\" }",
+      { "DmElement.name", "DmElement.kids.2.1.2.name", "DmElement.kids", "DmElement.none" } },
+};
+
+#define COUNT(a)    (int)(sizeof(a) / sizeof((a)[0]))
+
+typedef struct {
+    char *data;
+    size_t len;
+} text_t;
+
+static int checks, failures;
+
+static void text_add(text_t *t, const char *s, size_t len)
+{
+    t->data = (char *)realloc(t->data, t->len + len + 1);
+    memcpy(t->data + t->len, s, len);
+    t->len += len;
+    t->data[t->len] = '\0';
+}
+
+static void text_str(text_t *t, const char *s)
+{
+    text_add(t, s, strlen(s));
+}
+
+static int compare_items(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Appends the value at idx with table keys sorted */
+static void dump(lua_State *L, int idx, text_t *out)
+{
+    const char *s;
+    size_t len;
+
+    idx = lua_absindex(L, idx);
+    switch (lua_type(L, idx)) {
+    case LUA_TTABLE: {
+        char **items = NULL;
+        int count = 0, i;
+
+        lua_pushnil(L);
+        while (lua_next(L, idx) != 0) {
+            text_t item = { NULL, 0 };
+
+            dump(L, -2, &item);
+            text_add(&item, "=", 1);
+            dump(L, -1, &item);
+            items = (char **)realloc(items, (count + 1) * sizeof(*items));
+            items[count++] = item.data;
+            lua_pop(L, 1);
+        }
+        if (count)
+            qsort(items, count, sizeof(*items), compare_items);
+
+        text_add(out, "{", 1);
+        for (i = 0; i < count; i++) {
+            text_add(out, items[i], strlen(items[i]));
+            text_add(out, ",", 1);
+            free(items[i]);
+        }
+        text_add(out, "}", 1);
+        free(items);
+        break;
+    }
+    case LUA_TSTRING:
+    case LUA_TNUMBER:
+        /* Convert a copy, lua_tolstring() on a key would confuse lua_next() */
+        lua_pushvalue(L, idx);
+        s = lua_tolstring(L, -1, &len);
+        text_add(out, lua_type(L, idx) == LUA_TSTRING ? "s:" : "n:", 2);
+        text_add(out, s, len);
+        lua_pop(L, 1);
+        break;
+    case LUA_TBOOLEAN:
+        text_add(out, lua_toboolean(L, idx) ? "true" : "false",
+                 lua_toboolean(L, idx) ? 4 : 5);
+        break;
+    default:
+        text_add(out, lua_typename(L, lua_type(L, idx)),
+                 strlen(lua_typename(L, lua_type(L, idx))));
+        break;
+    }
+}
+
+/* Returns the dump of the value on top of the stack, or of the error
+ * message when status is not 0, and pops it */
+static char *pop_dump(lua_State *L, int status)
+{
+    text_t out = { NULL, 0 };
+
+    if (status != 0) {
+        text_add(&out, "error: ", 7);
+        text_add(&out, lua_tostring(L, -1), strlen(lua_tostring(L, -1)));
+    } else {
+        dump(L, -1, &out);
+    }
+    lua_pop(L, 1);
+
+    return out.data;
+}
+
+/* Returns the dump of module[func](doc) */
+static char *decode_dump(lua_State *L, int module, const char *func,
+                         const char *doc)
+{
+    lua_getfield(L, module, func);
+    lua_pushstring(L, doc);
+
+    return pop_dump(L, lua_pcall(L, 1, 1, 0));
+}
+
+/* Counts a check, got is freed. Returns 1 for a mismatch */
+static int expect(const char *what, const char *doc, char *got,
+                  const char *want)
+{
+    int failed = strcmp(got, want) != 0;
+
+    checks++;
+    if (failed) {
+        failures++;
+        printf("%s differs from decode() on\n%s\n  got:  %s\n  want: %s\n",
+               what, doc, got, want);
+    }
+    free(got);
+
+    return failed;
+}
+
+/* ===== STREAMING ===== */
+
+/* Returns the dump of a ckv3.decoder() fed first bytes of doc, then the
+ * rest in chunks of size bytes */
+static char *stream_dump(lua_State *L, const char *doc, size_t first,
+                         size_t size)
+{
+    const size_t len = strlen(doc);
+    size_t pos = 0, n = first;
+    int dec;
+
+    lua_getfield(L, CKV3, "decoder");
+    lua_call(L, 0, 1);
+    dec = lua_gettop(L);
+
+    while (pos < len) {
+        if (n > len - pos)
+            n = len - pos;
+        lua_getfield(L, dec, "feed");
+        lua_pushvalue(L, dec);
+        lua_pushlstring(L, doc + pos, n);
+        if (lua_pcall(L, 2, 0, 0) != 0) {
+            lua_remove(L, dec);
+            return pop_dump(L, 1);
+        }
+        pos += n;
+        n = size;
+    }
+
+    lua_getfield(L, dec, "finish");
+    lua_pushvalue(L, dec);
+    lua_remove(L, dec);
+
+    return pop_dump(L, lua_pcall(L, 1, 1, 0));
+}
+
+static void test_stream(lua_State *L)
+{
+    const char *doc;
+    char *want;
+    size_t len, n;
+    int i;
+
+    for (i = 0; i < COUNT(stream_docs); i++) {
+        doc = stream_docs[i];
+        len = strlen(doc);
+        want = decode_dump(L, CKV3, "decode", doc);
+
+        for (n = 1; n <= MAX_CHUNK; n++) {
+            if (expect("ckv3.decoder() in small chunks", doc,
+                       stream_dump(L, doc, n, n), want))
+                break;
+        }
+        for (n = 1; n < len; n++) {
+            if (expect("ckv3.decoder() split in two", doc,
+                       stream_dump(L, doc, n, len), want))
+                break;
+        }
+        free(want);
+    }
+}
+
+/* ===== LAZY DECODING ===== */
+
+/* Parses every decode_lazy() proxy below the table at idx, __len fills
+ * a proxy and drops its metatable */
+static void fill_proxies(lua_State *L, int idx)
+{
+    idx = lua_absindex(L, idx);
+    if (lua_getmetatable(L, idx)) {
+        lua_pop(L, 1);
+        lua_len(L, idx);
+        lua_pop(L, 1);
+    }
+
+    lua_pushnil(L);
+    while (lua_next(L, idx) != 0) {
+        if (lua_istable(L, -1))
+            fill_proxies(L, -1);
+        lua_pop(L, 1);
+    }
+}
+
+/* A proxy raises its parse error when it is filled */
+static int materialise(lua_State *L)
+{
+    fill_proxies(L, 1);
+    return 0;
+}
+
+/* decode_lazy() and decode() with decode_presize() both build their
+ * structure index over the source first */
+static void test_lazy(lua_State *L)
+{
+    const char *doc;
+    char *want;
+    int i, status;
+
+    for (i = 0; i < COUNT(lazy_docs); i++) {
+        doc = lazy_docs[i];
+        want = decode_dump(L, CKV1, "decode", doc);
+
+        lua_getfield(L, CKV1, "decode_lazy");
+        lua_pushstring(L, doc);
+        status = lua_pcall(L, 1, 1, 0);
+        if (status == 0) {
+            lua_pushcfunction(L, materialise);
+            lua_pushvalue(L, -2);
+            status = lua_pcall(L, 1, 0, 0);
+            if (status != 0)
+                lua_remove(L, -2);
+        }
+        expect("ckv1.decode_lazy()", doc, pop_dump(L, status), want);
+
+        lua_getfield(L, CKV1, "decode_presize");
+        lua_pushboolean(L, 1);
+        lua_call(L, 1, 0);
+        expect("ckv1.decode() with decode_presize", doc,
+               decode_dump(L, CKV1, "decode", doc), want);
+        lua_getfield(L, CKV1, "decode_presize");
+        lua_pushboolean(L, 0);
+        lua_call(L, 1, 0);
+
+        free(want);
+    }
+}
+
+/* ===== QUERY ===== */
+
+/* Replaces the table on top of the stack with its value at the dotted
+ * path, the way query() indexes the tables it decodes: a string key
+ * that misses and reads as a number indexes the array part */
+static void walk_path(lua_State *L, const char *path)
+{
+    const char *dot;
+    char *end;
+    long n;
+
+    while (path) {
+        if (!lua_istable(L, -1)) {
+            lua_pop(L, 1);
+            lua_pushnil(L);
+            return;
+        }
+        dot = strchr(path, '.');
+        lua_pushlstring(L, path, dot ? (size_t)(dot - path) : strlen(path));
+        lua_rawget(L, -2);
+        if (lua_isnil(L, -1)) {
+            n = strtol(path, &end, 10);
+            if (end != path && (*end == '.' || *end == '\0')) {
+                lua_pop(L, 1);
+                lua_rawgeti(L, -1, (lua_Integer)n);
+            }
+        }
+        lua_remove(L, -2);
+        path = dot ? dot + 1 : NULL;
+    }
+}
+
+static void test_query(lua_State *L)
+{
+    const char *doc, *path;
+    char *want;
+    int i, k, status;
+
+    for (i = 0; i < COUNT(query_docs); i++) {
+        doc = query_docs[i].doc;
+        for (k = 0; k < COUNT(query_docs[i].paths); k++) {
+            path = query_docs[i].paths[k];
+
+            lua_getfield(L, query_docs[i].module, "decode");
+            lua_pushstring(L, doc);
+            status = lua_pcall(L, 1, 1, 0);
+            if (status == 0)
+                walk_path(L, path);
+            want = pop_dump(L, status);
+
+            lua_getfield(L, query_docs[i].module, "query");
+            lua_pushstring(L, doc);
+            lua_pushstring(L, path);
+            expect(path, doc, pop_dump(L, lua_pcall(L, 2, 1, 0)), want);
+            free(want);
+        }
+    }
+}
+
+/* ===== ASYNC DECODING ===== */
+
+static int resume(lua_State *co, lua_State *from, int narg, int *nres)
+{
+#if LUA_VERSION_NUM >= 504
+    return lua_resume(co, from, narg, nres);
+#else
+    int status = lua_resume(co, from, narg);
+
+    *nres = lua_gettop(co);
+
+    return status;
+#endif
+}
+
+/* Returns the dump of ckv1.decode_async(doc, budget) run in a coroutine,
+ * resumed with a stray argument until it returns. *slices counts the
+ * resumes */
+static char *async_dump(lua_State *L, const char *doc, int budget,
+                        int *slices)
+{
+    lua_State *co = lua_newthread(L);
+    int status, nres, narg = 2;
+    char *got;
+
+    lua_getfield(L, CKV1, "decode_async");
+    lua_xmove(L, co, 1);
+    lua_pushstring(co, doc);
+    lua_pushinteger(co, budget);
+
+    *slices = 0;
+    while (1) {
+        (*slices)++;
+        status = resume(co, L, narg, &nres);
+        if (status != LUA_YIELD)
+            break;
+        lua_pop(co, nres);
+        lua_pushboolean(co, 1);
+        narg = 1;
+    }
+
+    got = pop_dump(co, status != LUA_OK);
+    lua_pop(L, 1);
+
+    return got;
+}
+
+static void test_async(lua_State *L)
+{
+    text_t doc = { NULL, 0 };
+    char item[128], *want;
+    int i, slices;
+
+    for (i = 0; i < ASYNC_ITEMS; i++) {
+        snprintf(item, sizeof(item),
+                 "item%d = { name = \"n%d\" path = \"a\\\\b\" "
+                 "list = [ %d, { q = \"p\\\\\" } \" } ] }\n", i, i, i);
+        text_add(&doc, item, strlen(item));
+    }
+
+    want = decode_dump(L, CKV1, "decode", doc.data);
+    if (!expect("ckv1.decode_async() with no budget", "(generated)",
+                async_dump(L, doc.data, 0, &slices), want) &&
+        LUA_VERSION_NUM >= 503 && slices < 2) {
+        printf("ckv1.decode_async() finished %u bytes in one slice\n",
+               (unsigned)doc.len);
+        failures++;
+    }
+    expect("ckv1.decode_async() in one slice", "(generated)",
+           async_dump(L, doc.data, 1000000000, &slices), want);
+
+    free(want);
+    free(doc.data);
+}
+
+/* ===== THREADED ENCODING ===== */
+
+/* Calls module[name](on) */
+static void set_option(lua_State *L, int module, const char *name, int on)
+{
+    lua_getfield(L, module, name);
+    lua_pushboolean(L, on);
+    lua_call(L, 1, 0);
+}
+
+/* Pushes module[func](value at idx, { threads = threads }), or without
+ * the options for 0 threads. Returns the text, or the error message when
+ * the call fails */
+static const char *encode_text(lua_State *L, int module, const char *func,
+                               int idx, int threads, size_t *len)
+{
+    idx = lua_absindex(L, idx);
+    lua_getfield(L, module, func);
+    lua_pushvalue(L, idx);
+    if (threads) {
+        lua_createtable(L, 0, 1);
+        lua_pushinteger(L, threads);
+        lua_setfield(L, -2, "threads");
+    }
+    lua_pcall(L, threads ? 2 : 1, 1, 0);
+
+    return lua_tolstring(L, -1, len);
+}
+
+/* Encodes the table on top of the stack with sort_keys and compact in
+ * every combination, on 1 to MAX_THREADS threads, against the serial
+ * encoder. A mismatch prints where the texts part */
+static void encode_threads(lua_State *L, int module, const char *func,
+                           const char *what, int items)
+{
+    const char *want, *got;
+    size_t want_len, got_len, at;
+    int mode, threads;
+
+    for (mode = 0; mode < 4; mode++) {
+        set_option(L, module, "encode_sort_keys", mode & 1);
+        set_option(L, module, "encode_compact", mode & 2);
+        want = encode_text(L, module, func, -1, 0, &want_len);
+
+        for (threads = 1; threads <= MAX_THREADS; threads++) {
+            got = encode_text(L, module, func, -2, threads, &got_len);
+            checks++;
+            if (got_len != want_len || memcmp(got, want, got_len) != 0) {
+                for (at = 0; at < got_len && at < want_len &&
+                             got[at] == want[at]; at++)
+                    ;
+                failures++;
+                printf("%s on %d threads (%d items%s%s) differs from "
+                       "the serial text at byte %u\n  got:  %.40s\n"
+                       "  want: %.40s\n", what, threads, items,
+                       mode & 1 ? ", sort_keys" : "",
+                       mode & 2 ? ", compact" : "", (unsigned)at,
+                       got + at, want + at);
+                lua_pop(L, 1);
+                break;
+            }
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+    set_option(L, module, "encode_sort_keys", 0);
+    set_option(L, module, "encode_compact", 0);
+}
+
+/* Half of the items go into one table at the root, so jobs start at
+ * both levels */
+static void ckv1_items(text_t *doc, int count)
+{
+    char item[160];
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (i == 0)
+            text_str(doc, "root = {\n");
+        if (i == count / 2)
+            text_str(doc, "}\n");
+        snprintf(item, sizeof(item),
+                 "item%d = { name = \"n%d\" path = \"a\\\\b\" e = \"\" "
+                 "list = [ %d, %d.25, -1e%d ] }\n", i, i, i, i, i % 300);
+        text_str(doc, item);
+    }
+}
+
+/* One root element, the way a .dmx file has it */
+static void ckv3_items(text_t *doc, int count)
+{
+    char item[256];
+    int i;
+
+    text_str(doc, "\"DmElement\" {\n\"name\" \"string\" \"root\"\n"
+                  "\"children\" \"element_array\" [\n");
+    for (i = 0; i < count; i++) {
+        snprintf(item, sizeof(item),
+                 "\"DmeJoint\" { \"name\" \"string\" \"bone%d\" "
+                 "\"index\" \"int\" \"%d\" "
+                 "\"pos\" \"vector3_array\" [ \"%d 0 0\", \"1.5 -2 3\" ] "
+                 "\"w\" \"float_array\" [ \"0.%d\" ] }%s\n",
+                 i, i, i, i, i + 1 < count ? "," : "");
+        text_str(doc, item);
+    }
+    text_str(doc, "]\n}\n");
+}
+
+static void test_threads(lua_State *L)
+{
+    text_t doc;
+    int i, packed;
+
+    for (i = 0; i < COUNT(encode_items); i++) {
+        doc.data = NULL;
+        doc.len = 0;
+        ckv1_items(&doc, encode_items[i]);
+        lua_getfield(L, CKV1, "decode_array");
+        lua_pushstring(L, doc.data);
+        lua_call(L, 1, 1);
+        encode_threads(L, CKV1, "encode_array", "ckv1.encode_array()",
+                       encode_items[i]);
+        lua_pop(L, 1);
+        free(doc.data);
+
+        doc.data = NULL;
+        doc.len = 0;
+        ckv3_items(&doc, encode_items[i]);
+        for (packed = 0; packed < 2; packed++) {
+            set_option(L, CKV3, "decode_packed_arrays", packed);
+            lua_getfield(L, CKV3, "decode");
+            lua_pushstring(L, doc.data);
+            lua_call(L, 1, 1);
+            encode_threads(L, CKV3, "encode", packed ?
+                           "ckv3.encode() with decode_packed_arrays" :
+                           "ckv3.encode()", encode_items[i]);
+            lua_pop(L, 1);
+        }
+        set_option(L, CKV3, "decode_packed_arrays", 0);
+        free(doc.data);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    lua_State *L = luaL_newstate();
+
+    luaL_openlibs(L);
+    lua_pushcfunction(L, luaopen_ckv);
+    lua_call(L, 0, 1);
+    lua_pushcfunction(L, luaopen_ckv1);
+    lua_call(L, 0, 1);
+    lua_pushcfunction(L, luaopen_ckv3);
+    lua_call(L, 0, 1);
+
+    test_stream(L);
+    test_lazy(L);
+    test_query(L);
+    test_async(L);
+    test_threads(L);
+
+    lua_close(L);
+    printf("%d checks: %d mismatches\n", checks, failures);
+
+    return failures ? 1 : 0;
+}
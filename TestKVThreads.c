@@ -0,0 +1,250 @@
+/* ckv1 multithreaded stress test.
+ *
+ * Every worker owns a lua_State and keeps alternating ckv1.decode,
+ * ckv1.decode_array and ckv1.encode_array on the same input, comparing
+ * each result with the one the main thread produced before the workers
+ * started. Neighbouring workers start in opposite modes, so a decode mode
+ * shared between calls would show up as a mismatch. */
+
+#include        <stdio.h>
+#include        <stdlib.h>
+#include        <string.h>
+#include        "lua/lua.h"
+#include        "lua/lualib.h"
+#include        "lua/lauxlib.h"
+
+#ifdef _WIN32
+#include        <windows.h>
+typedef HANDLE thread_t;
+#define THREAD_FUNC DWORD WINAPI
+#else
+#include        <pthread.h>
+typedef pthread_t thread_t;
+#define THREAD_FUNC void *
+#endif
+
+#define THREADS     8
+#define ITERATIONS  2000
+
+int luaopen_ckv1(lua_State *l);
+
+static const char *input =
+    "<!-- kv3 encoding:text:version{e21c7f3c-8a33-41c5-9977-a76d3a32aa0d} -->\n"
+    "{\n"
+    "\tHero_Axe.Attack = \n"
+    "\t{\n"
+    "\t\ttype = \"dota_src1_3d\"\n"
+    "\t\tvolume = 0.8\n"
+    "\t\tpitch = 1\n"
+    "\t\tvsnd_files = \n"
+    "\t\t[\n"
+    "\t\t\t\"sounds/weapons/hero/axe/attack01.vsnd\",\n"
+    "\t\t\t\"sounds/weapons/hero/axe/attack02.vsnd\",\n"
+    "\t\t]\n"
+    "\t\tnested = { inner = \"x\" deep = { d = 1 } }\n"
+    "\t\tmixgroup = Weapons\n"
+    "\t}\n"
+    "\tHero_Axe.Death = \n"
+    "\t{\n"
+    "\t\ttype = \"dota_src1_2d\"\n"
+    "\t\tlist = [ 1, 2, 3 ]\n"
+    "\t}\n"
+    "}\n";
+
+typedef struct {
+    char *data;
+    size_t len;
+} text_t;
+
+static void text_add(text_t *t, const char *s, size_t len)
+{
+    t->data = (char *)realloc(t->data, t->len + len + 1);
+    memcpy(t->data + t->len, s, len);
+    t->len += len;
+    t->data[t->len] = '\0';
+}
+
+static int compare_items(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Appends the value at idx with table keys sorted, so dumps from different
+ * lua_States (and hash seeds) compare equal */
+static void dump(lua_State *L, int idx, text_t *out)
+{
+    const char *s;
+    size_t len;
+
+    idx = lua_absindex(L, idx);
+    switch (lua_type(L, idx)) {
+    case LUA_TTABLE: {
+        char **items = NULL;
+        int count = 0, i;
+
+        lua_pushnil(L);
+        while (lua_next(L, idx) != 0) {
+            text_t item = { NULL, 0 };
+
+            dump(L, -2, &item);
+            text_add(&item, "=", 1);
+            dump(L, -1, &item);
+            items = (char **)realloc(items, (count + 1) * sizeof(*items));
+            items[count++] = item.data;
+            lua_pop(L, 1);
+        }
+        qsort(items, count, sizeof(*items), compare_items);
+
+        text_add(out, "{", 1);
+        for (i = 0; i < count; i++) {
+            text_add(out, items[i], strlen(items[i]));
+            text_add(out, ",", 1);
+            free(items[i]);
+        }
+        text_add(out, "}", 1);
+        free(items);
+        break;
+    }
+    case LUA_TSTRING:
+    case LUA_TNUMBER:
+        /* Convert a copy, lua_tolstring() on a key would confuse lua_next() */
+        lua_pushvalue(L, idx);
+        s = lua_tolstring(L, -1, &len);
+        text_add(out, lua_type(L, idx) == LUA_TSTRING ? "s:" : "n:", 2);
+        text_add(out, s, len);
+        lua_pop(L, 1);
+        break;
+    case LUA_TBOOLEAN:
+        text_add(out, lua_toboolean(L, idx) ? "true" : "false",
+                 lua_toboolean(L, idx) ? 4 : 5);
+        break;
+    default:
+        text_add(out, lua_typename(L, lua_type(L, idx)),
+                 strlen(lua_typename(L, lua_type(L, idx))));
+        break;
+    }
+}
+
+/* Returns the dump of ckv1[func](arg), the module table is at index 1 */
+static char *call_dump(lua_State *L, const char *func, int arg)
+{
+    text_t out = { NULL, 0 };
+
+    lua_getfield(L, 1, func);
+    lua_pushvalue(L, arg);
+    if (lua_pcall(L, 1, 1, 0) != 0) {
+        text_add(&out, "error: ", 7);
+        text_add(&out, lua_tostring(L, -1), strlen(lua_tostring(L, -1)));
+    } else {
+        dump(L, -1, &out);
+    }
+
+    return out.data;
+}
+
+typedef struct {
+    int id;
+    int failures;
+} worker_t;
+
+static char *expected[3];
+
+/* Runs the three checks in turn starting from mode, returns the failures */
+static int check(lua_State *L, int mode)
+{
+    char *got = NULL;
+    int failed;
+
+    lua_settop(L, 1);
+    lua_pushstring(L, input);
+    switch (mode) {
+    case 0:
+        got = call_dump(L, "decode", 2);
+        break;
+    case 1:
+        got = call_dump(L, "decode_array", 2);
+        break;
+    case 2:
+        lua_getfield(L, 1, "decode_array");
+        lua_pushvalue(L, 2);
+        lua_call(L, 1, 1);
+        got = call_dump(L, "encode_array", 3);
+        break;
+    }
+
+    failed = strcmp(got, expected[mode]) != 0;
+    free(got);
+
+    return failed;
+}
+
+static lua_State *open_state(void)
+{
+    lua_State *L = luaL_newstate();
+
+    lua_pushcfunction(L, luaopen_ckv1);
+    lua_call(L, 0, 1);
+
+    return L;
+}
+
+static THREAD_FUNC worker(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    lua_State *L = open_state();
+    int i;
+
+    for (i = 0; i < ITERATIONS; i++)
+        w->failures += check(L, (i + w->id) % 3);
+
+    lua_close(L);
+
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    thread_t threads[THREADS];
+    worker_t workers[THREADS];
+    lua_State *L = open_state();
+    int i, failures = 0;
+
+    /* Expected results, computed before any worker runs */
+    lua_pushstring(L, input);
+    expected[0] = call_dump(L, "decode", 2);
+    expected[1] = call_dump(L, "decode_array", 2);
+    lua_settop(L, 1);
+    lua_getfield(L, 1, "decode_array");
+    lua_pushstring(L, input);
+    lua_call(L, 1, 1);
+    expected[2] = call_dump(L, "encode_array", 2);
+    lua_close(L);
+
+    for (i = 0; i < THREADS; i++) {
+        workers[i].id = i;
+        workers[i].failures = 0;
+#ifdef _WIN32
+        threads[i] = CreateThread(NULL, 0, worker, &workers[i], 0, NULL);
+#else
+        pthread_create(&threads[i], NULL, worker, &workers[i]);
+#endif
+    }
+
+    for (i = 0; i < THREADS; i++) {
+#ifdef _WIN32
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#else
+        pthread_join(threads[i], NULL);
+#endif
+        failures += workers[i].failures;
+    }
+
+    for (i = 0; i < 3; i++)
+        free(expected[i]);
+
+    printf("%d threads x %d calls: %d mismatches\n", THREADS, ITERATIONS,
+           failures);
+
+    return failures ? 1 : 0;
+}
@@ -18,21 +18,2155 @@ void printLuaStack(lua_State* l)
     fflush(stdout);
 }
 
-void InitTabCache()
+#include <errno.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#define ckv_open(path)              _open(path, _O_RDONLY | _O_BINARY)
+#define ckv_close(fd)               _close(fd)
+#define ckv_read(fd, buf, len)      _read(fd, buf, (unsigned int)(len))
+typedef struct _stat64 ckv_stat_t;
+#define ckv_fstat(fd, st)           _fstat64(fd, st)
+#define ckv_stat(path, st)          _stat64(path, st)
+#define ckv_is_regular(st)          (((st)->st_mode & _S_IFMT) == _S_IFREG)
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#define ckv_open(path)              open(path, O_RDONLY)
+#define ckv_close(fd)               close(fd)
+#define ckv_read(fd, buf, len)      read(fd, buf, len)
+typedef struct stat ckv_stat_t;
+#define ckv_fstat(fd, st)           fstat(fd, st)
+#define ckv_stat(path, st)          stat(path, st)
+#define ckv_is_regular(st)          S_ISREG((st)->st_mode)
+#endif
+
+/* First buffer for files whose size stat() doesn't know */
+#define CKV_READ_CHUNK  65536
+
+static size_t ckv_page_size()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+#else
+    return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+static void *ckv_map(int fd, size_t len)
+{
+#ifdef _WIN32
+    void *view;
+    HANDLE mapping = CreateFileMappingA((HANDLE)_get_osfhandle(fd), NULL,
+                                        PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL)
+        return NULL;
+    view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    return view;
+#else
+    void *view = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (view == MAP_FAILED)
+        return NULL;
+#ifdef MADV_SEQUENTIAL
+    madvise(view, len, MADV_SEQUENTIAL);
+#endif
+    return view;
+#endif
+}
+
+static void ckv_unmap(void *view, size_t len)
+{
+#ifdef _WIN32
+    (void)len;
+    UnmapViewOfFile(view);
+#else
+    munmap(view, len);
+#endif
+}
+
+int ckv_file_open(ckv_file_t *file, const char *path)
+{
+    ckv_stat_t st;
+    char *buf, *grown;
+    size_t done = 0, size;
+    int fd, sized;
+
+    file->data = NULL;
+    file->len = 0;
+    file->map = NULL;
+    file->map_len = 0;
+
+    fd = ckv_open(path);
+    if (fd < 0)
+        return -1;
+
+    if (ckv_fstat(fd, &st) != 0) {
+        ckv_close(fd);
+        return -1;
+    }
+    /* Files in /proc are regular but claim to be empty */
+    sized = ckv_is_regular(&st) && st.st_size > 0;
+    file->len = sized ? (size_t)st.st_size : 0;
+
+    /* The bytes between the end of the file and the end of its last page
+     * read as zero, which gives the NULL terminator for free. A file that
+     * fills its last page exactly has no such tail and is read instead.
+     * Only regular files are mapped, and only when the size still holds
+     * once mapped: the pages past a file truncated under the mapping
+     * raise SIGBUS instead of reading as zero. */
+    if (sized && file->len % ckv_page_size() != 0) {
+        file->map = ckv_map(fd, file->len);
+        if (file->map && ckv_fstat(fd, &st) == 0 &&
+            (size_t)st.st_size == file->len) {
+            file->map_len = file->len;
+            file->data = (const char *)file->map;
+            ckv_close(fd);
+            return 0;
+        }
+        if (file->map)
+            ckv_unmap(file->map, file->len);
+        file->map = NULL;
+        file->len = (size_t)st.st_size;
+    }
+
+    /* Read into a buffer sized from the file. Pipes, devices and the like
+     * are read to their end, growing the buffer */
+    size = sized ? file->len + 1 : CKV_READ_CHUNK;
+    buf = (char *)malloc(size);
+    if (!buf) {
+        ckv_close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+    while (1) {
+        int nr;
+
+        if (done == size - 1) {
+            if (sized)
+                break;
+            grown = (char *)realloc(buf, size * 2);
+            if (!grown) {
+                free(buf);
+                ckv_close(fd);
+                errno = ENOMEM;
+                return -1;
+            }
+            buf = grown;
+            size *= 2;
+        }
+        nr = ckv_read(fd, buf + done, size - 1 - done);
+        if (nr <= 0)
+            break;
+        done += nr;
+    }
+    ckv_close(fd);
+
+    buf[done] = '\0';
+    file->len = done;
+    file->data = buf;
+
+    return 0;
+}
+
+void ckv_file_close(ckv_file_t *file)
+{
+    if (file->map)
+        ckv_unmap(file->map, file->map_len);
+    else
+        free((void *)file->data);
+
+    file->data = NULL;
+    file->map = NULL;
+}
+
+int ckv_file_stamp(const char *path, ckv_stamp_t *stamp)
+{
+    ckv_stat_t st;
+
+    if (ckv_stat(path, &st) != 0)
+        return -1;
+
+    stamp->mtime = (long long)st.st_mtime;
+    stamp->size = (long long)st.st_size;
+
+    return 0;
+}
+
+void ckv_resolve_path(const char *path, char *resolved, size_t size)
+{
+#ifdef _WIN32
+    if (_fullpath(resolved, path, size))
+        return;
+#else
+    char *full = realpath(path, NULL);
+
+    if (full && strlen(full) < size) {
+        memcpy(resolved, full, strlen(full) + 1);
+        free(full);
+        return;
+    }
+    free(full);
+#endif
+
+    snprintf(resolved, size, "%s", path);
+}
+
+/* A quoted string can not contain an unescaped quote, so no string is
+ * longer than the widest gap between quotes that aren't preceded by '\'.
+ * Escapes only ever shrink when decoded. */
+size_t ckv_longest_quoted(const char *data, size_t len)
+{
+    const char *end = data + len;
+    const char *prev = data;
+    const char *p = data;
+    size_t longest = 0;
+
+    while ((p = (const char *)memchr(p, '"', end - p)) != NULL) {
+        if (p == data || p[-1] != '\\') {
+            if ((size_t)(p - prev) > longest)
+                longest = p - prev;
+            prev = p + 1;
+        }
+        p++;
+    }
+
+    if ((size_t)(end - prev) > longest)
+        longest = end - prev;
+
+    return longest;
+}
+
+/* ===== TOKENIZER ===== */
+
+const char *ckv_token_type_name[] = {
+    "T_OBJ_BEGIN",
+    "T_OBJ_END",
+    "T_ARR_BEGIN",
+    "T_ARR_END",
+    "T_STRING",
+    "T_NUMBER",
+    "T_INTEGER",
+    "T_BOOLEAN",
+    "T_NULL",
+    "T_COLON",
+    "T_COMMA",
+    "T_REF",
+    "T_COMMENT",
+    "T_END",
+    "T_WHITESPACE",
+    "T_ERROR",
+    "T_UNKNOWN",
+    NULL
+};
+
+void ckv_lexer_init(ckv_lexer_t *lexer, int syntax)
+{
+    int i;
+
+    /* Tag all characters as an error */
+    for (i = 0; i < 256; i++)
+        lexer->ch2token[i] = T_ERROR;
+
+    /* Set tokens that require no further processing */
+    lexer->ch2token['{'] = T_OBJ_BEGIN;
+    lexer->ch2token['}'] = T_OBJ_END;
+    lexer->ch2token[','] = T_COMMA;
+    lexer->ch2token['\0'] = T_END;
+    lexer->ch2token[' '] = T_WHITESPACE;
+    lexer->ch2token['\t'] = T_WHITESPACE;
+    lexer->ch2token['\n'] = T_WHITESPACE;
+    lexer->ch2token['\r'] = T_WHITESPACE;
+    if (syntax & CKV_LEX_ARRAYS) {
+        lexer->ch2token['['] = T_ARR_BEGIN;
+        lexer->ch2token[']'] = T_ARR_END;
+        lexer->ch2token['='] = T_COLON;
+    }
+    if (syntax & CKV_LEX_REFS)
+        lexer->ch2token['#'] = T_REF;
+    if (syntax & CKV_LEX_SLASH_COMMENTS)
+        lexer->ch2token['/'] = T_COMMENT;
+
+    /* Update characters that require further processing */
+    lexer->ch2token['"'] = T_UNKNOWN;     /* string? */
+    lexer->ch2token['+'] = T_UNKNOWN;     /* number? */
+    lexer->ch2token['-'] = T_UNKNOWN;
+    for (i = 0; i < 10; i++)
+        lexer->ch2token['0' + i] = T_UNKNOWN;
+    if (syntax & CKV_LEX_XML_COMMENTS)
+        lexer->ch2token['<'] = T_UNKNOWN; /* comment? */
+    if (syntax & CKV_LEX_BARE_WORDS) {
+        for (i = 0; i < 26; i++) {
+            lexer->ch2token['a' + i] = T_UNKNOWN;
+            lexer->ch2token['A' + i] = T_UNKNOWN;
+        }
+    } else if (syntax & CKV_LEX_NUMBERS) {
+        lexer->ch2token['i'] = T_UNKNOWN; /* inf, infinity? */
+        lexer->ch2token['I'] = T_UNKNOWN;
+        lexer->ch2token['n'] = T_UNKNOWN; /* nan? */
+        lexer->ch2token['N'] = T_UNKNOWN;
+    }
+
+    /* Lookup table for parsing escape characters */
+    for (i = 0; i < 256; i++)
+        lexer->escape2char[i] = 0;          /* String error */
+    lexer->escape2char['"'] = '"';
+    lexer->escape2char['\\'] = '\\';
+    lexer->escape2char['/'] = '/';
+    lexer->escape2char['b'] = '\b';
+    lexer->escape2char['t'] = '\t';
+    lexer->escape2char['n'] = '\n';
+    lexer->escape2char['f'] = '\f';
+    lexer->escape2char['r'] = '\r';
+    lexer->escape2char['u'] = 'u';          /* Unicode parsing required */
+}
+
+static int hexdigit2int(char hex)
+{
+    if ('0' <= hex  && hex <= '9')
+        return hex - '0';
+
+    /* Force lowercase */
+    hex |= 0x20;
+    if ('a' <= hex && hex <= 'f')
+        return 10 + hex - 'a';
+
+    return -1;
+}
+
+static int decode_hex4(const char *hex)
+{
+    int digit[4];
+    int i;
+
+    /* Convert ASCII hex digit to numeric digit
+     * Note: this returns an error for invalid hex digits, including
+     *       NULL */
+    for (i = 0; i < 4; i++) {
+        digit[i] = hexdigit2int(hex[i]);
+        if (digit[i] < 0) {
+            return -1;
+        }
+    }
+
+    return (digit[0] << 12) +
+           (digit[1] << 8) +
+           (digit[2] << 4) +
+            digit[3];
+}
+
+/* Converts a Unicode codepoint to UTF-8.
+ * Returns UTF-8 string length, and up to 4 bytes in *utf8 */
+static int codepoint_to_utf8(char *utf8, int codepoint)
+{
+    /* 0xxxxxxx */
+    if (codepoint <= 0x7F) {
+        utf8[0] = codepoint;
+        return 1;
+    }
+
+    /* 110xxxxx 10xxxxxx */
+    if (codepoint <= 0x7FF) {
+        utf8[0] = (codepoint >> 6) | 0xC0;
+        utf8[1] = (codepoint & 0x3F) | 0x80;
+        return 2;
+    }
+
+    /* 1110xxxx 10xxxxxx 10xxxxxx */
+    if (codepoint <= 0xFFFF) {
+        utf8[0] = (codepoint >> 12) | 0xE0;
+        utf8[1] = ((codepoint >> 6) & 0x3F) | 0x80;
+        utf8[2] = (codepoint & 0x3F) | 0x80;
+        return 3;
+    }
+
+    /* 11110xxx 10xxxxxx 10xxxxxx 10xxxxxx */
+    if (codepoint <= 0x1FFFFF) {
+        utf8[0] = (codepoint >> 18) | 0xF0;
+        utf8[1] = ((codepoint >> 12) & 0x3F) | 0x80;
+        utf8[2] = ((codepoint >> 6) & 0x3F) | 0x80;
+        utf8[3] = (codepoint & 0x3F) | 0x80;
+        return 4;
+    }
+
+    return 0;
+}
+
+/* \u is guaranteed to exist, but the remaining hex characters may be
+ * missing */
+int ckv_append_unicode_escape(strbuf_t *tmp, const char **ptr)
+{
+    const char *p = *ptr;
+    char utf8[4];       /* Surrogate pairs require 4 UTF-8 bytes */
+    int codepoint;
+    int surrogate_low;
+    int len;
+    int escape_len = 6;
+
+    /* Fetch UTF-16 code unit */
+    codepoint = decode_hex4(p + 2);
+    if (codepoint < 0)
+        return -1;
+
+    /* UTF-16 surrogate pairs take the following 2 byte form:
+     *      11011 x yyyyyyyyyy
+     * When x = 0: y is the high 10 bits of the codepoint
+     *      x = 1: y is the low 10 bits of the codepoint
+     *
+     * Check for a surrogate pair (high or low) */
+    if ((codepoint & 0xF800) == 0xD800) {
+        /* Error if the 1st surrogate is not high */
+        if (codepoint & 0x400)
+            return -1;
+
+        /* Ensure the next code is a unicode escape */
+        if (p[escape_len] != '\\' || p[escape_len + 1] != 'u')
+            return -1;
+
+        /* Fetch the next codepoint */
+        surrogate_low = decode_hex4(p + 2 + escape_len);
+        if (surrogate_low < 0)
+            return -1;
+
+        /* Error if the 2nd code is not a low surrogate */
+        if ((surrogate_low & 0xFC00) != 0xDC00)
+            return -1;
+
+        /* Calculate Unicode codepoint */
+        codepoint = (codepoint & 0x3FF) << 10;
+        surrogate_low &= 0x3FF;
+        codepoint = (codepoint | surrogate_low) + 0x10000;
+        escape_len = 12;
+    }
+
+    /* Convert codepoint to UTF-8 */
+    len = codepoint_to_utf8(utf8, codepoint);
+    if (!len)
+        return -1;
+
+    /* Append bytes and advance parse index */
+    strbuf_append_mem_unsafe(tmp, utf8, len);
+    *ptr = p + escape_len;
+
+    return 0;
+}
+
+void ckv_token_error(lua_State *l, const char *exp, const ckv_token_t *token,
+                     size_t offset)
+{
+    /* Note: token->index is 0 based, display starting from 1 */
+    luaL_error(l, "Expected %s but found %s at character %d",
+               exp, ckv_token_found(token), (int)(offset + token->index + 1));
+}
+
+/* Appends a shape for the container opening at offset, returns its
+ * index in the list or -1 when out of memory */
+int ckv_index_push(ckv_index_t *index, int *size, size_t offset)
+{
+    ckv_shape_t *shapes;
+
+    if (index->count == *size) {
+        *size = *size ? *size * 2 : 64;
+        shapes = (ckv_shape_t *)realloc(index->shapes, *size * sizeof(*shapes));
+        if (!shapes)
+            return -1;
+        index->shapes = shapes;
+    }
+
+    shapes = &index->shapes[index->count];
+    shapes->offset = offset;
+    shapes->values = 0;
+    shapes->commas = 0;
+    shapes->end = offset;
+
+    return index->count++;
+}
+
+/* Past the number the lexer reads at p (at least one character), where
+ * a ckv1 bare word can start without whitespace */
+static const char *ckv_skip_number(const char *p)
+{
+    ckv_token_t token;
+    const char *end = ckv_lex_number(p, p, &token);
+
+    return end > p ? end : p + 1;
+}
+
+/* One pass over the source counting what sits directly inside every
+ * container. A value is any run of characters up to whitespace, '=',
+ * ',' or a bracket, a quoted string, or a nested container. Comments
+ * and strings are skipped the way the lexer reads them for syntax, so
+ * their brackets aren't counted.
+ *
+ * With CKV_LEX_BARE_WORDS a value starting with a letter runs to the
+ * next whitespace or '=' like the ckv1 tokenizer reads it, brackets,
+ * quotes and commas included. It can start right after a string or a
+ * number, which end their tokens without whitespace, so numbers are
+ * read with the lexer. */
+int ckv_index_build(ckv_index_t *index, const char *data, size_t len,
+                    int syntax)
+{
+    const char *end = data + len;
+    const char *p = data;
+    int *stack = NULL;
+    int depth = 0, stack_size = 0, size = 0;
+    int in_value = 0;
+    int i;
+
+    index->shapes = NULL;
+    index->count = 0;
+    index->next = 0;
+
+    while (p < end) {
+        switch (*p) {
+        case ' ': case '\t': case '\n': case '\r': case '=':
+            in_value = 0;
+            p++;
+            continue;
+        case ',':
+            if (depth)
+                index->shapes[stack[depth - 1]].commas++;
+            in_value = 0;
+            p++;
+            continue;
+        case '{': case '[':
+            if (depth)
+                index->shapes[stack[depth - 1]].values++;
+            if (depth == stack_size) {
+                int *grown;
+                stack_size = stack_size ? stack_size * 2 : 16;
+                grown = (int *)realloc(stack, stack_size * sizeof(*stack));
+                if (!grown)
+                    goto oom;
+                stack = grown;
+            }
+            i = ckv_index_push(index, &size, p + 1 - data);
+            if (i < 0)
+                goto oom;
+            stack[depth++] = i;
+            in_value = 0;
+            p++;
+            continue;
+        case '}': case ']':
+            if (depth)
+                index->shapes[stack[--depth]].end = p + 1 - data;
+            in_value = 0;
+            p++;
+            continue;
+        case '"':
+            if (!in_value && depth)
+                index->shapes[stack[depth - 1]].values++;
+            in_value = 0;
+            p = ckv_skip_string(p + 1, syntax);
+            continue;
+        case '/':
+            if (syntax & CKV_LEX_SLASH_COMMENTS) {
+                p = ckv_scan_eol(p + 1);
+                in_value = 0;
+                continue;
+            }
+            break;
+        case '<':
+            if ((syntax & CKV_LEX_XML_COMMENTS) &&
+                p[1] == '!' && p[2] == '-' && p[3] == '-') {
+                p = ckv_skip_comment_block(p + 4);
+                in_value = 0;
+                continue;
+            }
+            break;
+        case '\0':
+            p = end;
+            continue;
+        }
+
+        if (!in_value && depth)
+            index->shapes[stack[depth - 1]].values++;
+
+        if ((syntax & CKV_LEX_BARE_WORDS) &&
+            (*p == '-' || ('0' <= *p && *p <= '9'))) {
+            p = ckv_skip_number(p);
+            in_value = 1;
+            continue;
+        }
+        if ((syntax & CKV_LEX_BARE_WORDS) &&
+            (*p | 0x20) >= 'a' && (*p | 0x20) <= 'z') {
+            /* Backslashes take the next character along */
+            while (*p != ' ' && *p != '\t' && *p != '\n' && *p != '\r' &&
+                   *p != '=' && *p != '\0') {
+                if (*p == '\\') {
+                    while (*p == '\\')
+                        p++;
+                    if (*p == '\0')
+                        break;
+                }
+                p++;
+            }
+            in_value = 1;
+            continue;
+        }
+
+        in_value = 1;
+        p++;
+    }
+
+    /* Unclosed containers run to the end */
+    while (depth)
+        index->shapes[stack[--depth]].end = len;
+
+    free(stack);
+
+    return 0;
+
+oom:
+    free(stack);
+    ckv_index_free(index);
+
+    return -1;
+}
+
+void ckv_index_free(ckv_index_t *index)
+{
+    free(index->shapes);
+    index->shapes = NULL;
+    index->count = 0;
+}
+
+const ckv_shape_t *ckv_index_lookup(const ckv_index_t *index, size_t offset)
+{
+    int lo = 0, hi = index->count - 1, mid;
+
+    while (lo <= hi) {
+        mid = lo + (hi - lo) / 2;
+        if (index->shapes[mid].offset == offset)
+            return &index->shapes[mid];
+        if (index->shapes[mid].offset < offset)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+
+    return NULL;
+}
+
+const char *ckv_skip_container(const char *p, int syntax)
+{
+    int depth = 1;
+
+    while (1) {
+        switch (*p) {
+        case '\0':
+            return NULL;
+        case '{': case '[':
+            depth++;
+            p++;
+            continue;
+        case '}': case ']':
+            p++;
+            if (--depth == 0)
+                return p;
+            continue;
+        case ' ': case '\t': case '\n': case '\r': case '=': case ',':
+            p++;
+            continue;
+        case '"':
+            p = ckv_skip_string(p + 1, syntax);
+            continue;
+        case '/':
+            if (syntax & CKV_LEX_SLASH_COMMENTS) {
+                p = ckv_scan_eol(p + 1);
+                continue;
+            }
+            break;
+        case '<':
+            if ((syntax & CKV_LEX_XML_COMMENTS) &&
+                p[1] == '!' && p[2] == '-' && p[3] == '-') {
+                p = ckv_skip_comment_block(p + 4);
+                continue;
+            }
+            break;
+        }
+
+        /* Numbers end where the lexer ends them, and a letter starts a
+         * word even right after a string or a number */
+        if ((syntax & CKV_LEX_BARE_WORDS) &&
+            (*p == '-' || ('0' <= *p && *p <= '9'))) {
+            p = ckv_skip_number(p);
+            continue;
+        }
+        if ((syntax & CKV_LEX_BARE_WORDS) &&
+            (*p | 0x20) >= 'a' && (*p | 0x20) <= 'z') {
+            while (*p != ' ' && *p != '\t' && *p != '\n' && *p != '\r' &&
+                   *p != '=' && *p != '\0') {
+                if (*p == '\\') {
+                    while (*p == '\\')
+                        p++;
+                    if (*p == '\0')
+                        break;
+                }
+                p++;
+            }
+            continue;
+        }
+
+        p++;
+    }
+}
+
+void ckv_key_cache_init(ckv_key_cache_t *cache)
+{
+    int i;
+
+    for (i = 0; i < CKV_KEY_CACHE_SIZE; i++) {
+        cache->slots[i].str = NULL;
+        cache->slots[i].len = 0;
+        cache->slots[i].ref = LUA_NOREF;
+    }
+}
+
+void ckv_key_cache_clear(lua_State *l, ckv_key_cache_t *cache)
+{
+    int i;
+
+    for (i = 0; i < CKV_KEY_CACHE_SIZE; i++)
+        luaL_unref(l, LUA_REGISTRYINDEX, cache->slots[i].ref);
+
+    ckv_key_cache_init(cache);
+}
+
+void ckv_key_cache_push(lua_State *l, ckv_key_cache_t *cache,
+                        const char *str, size_t len)
+{
+    ckv_key_slot_t *slot;
+    unsigned int hash = 2166136261u;
+    size_t i;
+
+    if (len > CKV_KEY_CACHE_MAXLEN) {
+        lua_pushlstring(l, str, len);
+        return;
+    }
+
+    /* FNV-1a, keys are short */
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 16777619u;
+    }
+
+    slot = &cache->slots[hash & (CKV_KEY_CACHE_SIZE - 1)];
+    if (slot->ref != LUA_NOREF && slot->len == len &&
+        !memcmp(slot->str, str, len)) {
+        lua_rawgeti(l, LUA_REGISTRYINDEX, slot->ref);
+        return;
+    }
+
+    /* Miss, the new key replaces whatever held the slot */
+    luaL_unref(l, LUA_REGISTRYINDEX, slot->ref);
+    slot->ref = LUA_NOREF;
+
+    lua_pushlstring(l, str, len);
+    lua_pushvalue(l, -1);
+    slot->str = lua_tostring(l, -1);
+    slot->len = len;
+    slot->ref = luaL_ref(l, LUA_REGISTRYINDEX);
+}
+
+/* ===== PARSER STACKS ===== */
+
+void ckv_frames_init(lua_State *l, ckv_frames_t *stack, void *frames,
+                     int size, size_t width)
+{
+    stack->frames = (char *)frames;
+    stack->width = width;
+    stack->size = size;
+    stack->count = 0;
+    stack->base = lua_gettop(l) + 1;
+    stack->owner = 0;
+}
+
+void ckv_frames_grow(lua_State *l, ckv_frames_t *stack)
+{
+    char *frames;
+
+    frames = (char *)lua_newuserdata(l, stack->width * stack->size * 2);
+    memcpy(frames, stack->frames, stack->width * stack->count);
+
+    /* Below the open tables, the indices the parser uses are relative */
+    if (stack->owner) {
+        lua_replace(l, stack->owner);
+    } else {
+        lua_insert(l, stack->base);
+        stack->owner = stack->base;
+    }
+    stack->frames = frames;
+    stack->size *= 2;
+}
+
+void ckv_frames_free(lua_State *l, ckv_frames_t *stack)
+{
+    if (stack->owner)
+        lua_remove(l, stack->owner);
+    stack->owner = 0;
+}
+
+/* ===== SOURCE BUFFERS ===== */
+
+const char *ckv_check_source(lua_State *l, size_t *len)
+{
+    const char *data;
+    lua_Integer size;
+    char *copy;
+
+    switch (lua_type(l, 1)) {
+    case LUA_TLIGHTUSERDATA:
+        luaL_argcheck(l, lua_gettop(l) <= 2, 3, "found too many arguments");
+        data = (const char *)lua_touserdata(l, 1);
+        size = luaL_checkinteger(l, 2);
+        luaL_argcheck(l, size >= 0 && (data || !size), 2, "invalid size");
+        break;
+    case LUA_TUSERDATA:
+        luaL_argcheck(l, lua_gettop(l) <= 2, 3, "found too many arguments");
+        data = (const char *)lua_touserdata(l, 1);
+        size = luaL_optinteger(l, 2, (lua_Integer)lua_rawlen(l, 1));
+        luaL_argcheck(l, size >= 0 && (size_t)size <= lua_rawlen(l, 1), 2,
+                      "size exceeds the userdata");
+        break;
+    default:
+        luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+        return luaL_checklstring(l, 1, len);
+    }
+    lua_settop(l, 1);
+
+    if (size > 0 && !data[size - 1]) {
+        *len = (size_t)size - 1;
+        return data;
+    }
+
+    copy = (char *)lua_newuserdata(l, (size_t)size + 1);
+    if (size)
+        memcpy(copy, data, (size_t)size);
+    copy[size] = '\0';
+    lua_replace(l, 1);
+    *len = (size_t)size;
+
+    return copy;
+}
+
+/* ===== QUERIES ===== */
+
+int ckv_query_path(lua_State *l, int idx)
+{
+    const char *path, *dot;
+    size_t len;
+    int count = 0;
+
+    if (lua_type(l, idx) == LUA_TTABLE) {
+        count = (int)lua_rawlen(l, idx);
+        luaL_argcheck(l, count > 0, idx, "empty path");
+        lua_pushvalue(l, idx);
+        return count;
+    }
+
+    path = luaL_checklstring(l, idx, &len);
+    lua_newtable(l);
+    while ((dot = (const char *)memchr(path, '.', len)) != NULL) {
+        lua_pushlstring(l, path, dot - path);
+        lua_rawseti(l, -2, ++count);
+        len -= dot + 1 - path;
+        path = dot + 1;
+    }
+    lua_pushlstring(l, path, len);
+    lua_rawseti(l, -2, ++count);
+
+    return count;
+}
+
+const char *ckv_query_key(lua_State *l, int path, int k, size_t *len)
+{
+    const char *key = NULL;
+
+    lua_rawgeti(l, path, k);
+    if (lua_type(l, -1) == LUA_TSTRING)
+        key = lua_tolstring(l, -1, len);
+    lua_pop(l, 1);
+
+    return key;
+}
+
+void ckv_query_tail(lua_State *l, int path, int from, int count)
+{
+    const char *key;
+    char *end;
+    long n;
+
+    for (; from <= count; from++) {
+        if (!lua_istable(l, -1)) {
+            lua_pop(l, 1);
+            lua_pushnil(l);
+            return;
+        }
+
+        lua_rawgeti(l, path, from);
+        lua_pushvalue(l, -1);
+        lua_rawget(l, -3);
+        if (lua_isnil(l, -1) && lua_type(l, -2) == LUA_TSTRING) {
+            key = lua_tostring(l, -2);
+            n = strtol(key, &end, 10);
+            if (end != key && *end == '\0') {
+                lua_pop(l, 1);
+                lua_rawgeti(l, -2, (lua_Integer)n);
+            }
+        }
+        /* table, key, value */
+        lua_replace(l, -3);
+        lua_pop(l, 1);
+    }
+}
+
+/* ===== ARENA ===== */
+
+#define CKV_ARENA_BLOCK 65536
+
+struct ckv_arena_block {
+    ckv_arena_block_t *next;
+};
+
+void ckv_arena_init(ckv_arena_t *arena)
+{
+    arena->head = NULL;
+    arena->ptr = NULL;
+    arena->left = 0;
+}
+
+void *ckv_arena_alloc(ckv_arena_t *arena, size_t size)
+{
+    ckv_arena_block_t *block;
+    size_t block_size;
+    void *p;
+
+    /* Keep every allocation aligned for doubles and pointers */
+    size = (size + 7) & ~(size_t)7;
+
+    if (size > arena->left) {
+        block_size = size > CKV_ARENA_BLOCK / 2 ? size : CKV_ARENA_BLOCK;
+        block = (ckv_arena_block_t *)malloc(sizeof(ckv_arena_block_t) + 8 + block_size);
+        if (!block)
+            return NULL;
+        block->next = arena->head;
+        arena->head = block;
+        arena->ptr = (char *)block + ((sizeof(ckv_arena_block_t) + 7) & ~(size_t)7);
+        arena->left = block_size;
+    }
+
+    p = arena->ptr;
+    arena->ptr += size;
+    arena->left -= size;
+
+    return p;
+}
+
+void ckv_arena_free(ckv_arena_t *arena)
+{
+    ckv_arena_block_t *block = arena->head, *next;
+
+    while (block) {
+        next = block->next;
+        free(block);
+        block = next;
+    }
+
+    ckv_arena_init(arena);
+}
+
+/* ===== SCRATCH ===== */
+
+void ckv_scratch_init(ckv_scratch_t *scratch)
+{
+    /* strbuf_free() is a no-op on a zeroed, non dynamic strbuf */
+    memset(scratch, 0, sizeof(*scratch));
+}
+
+strbuf_t *ckv_scratch_get(ckv_scratch_t *scratch, size_t len)
+{
+    strbuf_t *buf;
+    int i;
+
+    for (i = 0; i < CKV_SCRATCH_BUFFERS && scratch->used[i]; i++)
+        ;
+    if (i == CKV_SCRATCH_BUFFERS || len >= INT_MAX)
+        return strbuf_new((int)(len < INT_MAX ? len : INT_MAX - 1));
+
+    buf = &scratch->bufs[i];
+    if (buf->buf && (size_t)buf->size <= len)
+        strbuf_free(buf);
+    if (!buf->buf)
+        strbuf_init(buf, (int)len);
+    strbuf_reset(buf);
+    scratch->used[i] = 1;
+
+    return buf;
+}
+
+void ckv_scratch_put(ckv_scratch_t *scratch, strbuf_t *buf, int keep)
+{
+    int i;
+
+    if (buf->dynamic) {
+        strbuf_free(buf);
+        return;
+    }
+
+    i = (int)(buf - scratch->bufs);
+    scratch->used[i] = 0;
+    if (buf->size > keep)
+        strbuf_free(buf);
+}
+
+void ckv_scratch_free(ckv_scratch_t *scratch)
+{
+    int i;
+
+    for (i = 0; i < CKV_SCRATCH_BUFFERS; i++) {
+        strbuf_free(&scratch->bufs[i]);
+        scratch->used[i] = 0;
+    }
+}
+
+/* ===== THREADS ===== */
+
+#ifdef _WIN32
+typedef HANDLE ckv_thread_t;
+typedef CRITICAL_SECTION ckv_mutex_t;
+#define ckv_mutex_init(m)       InitializeCriticalSection(m)
+#define ckv_mutex_lock(m)       EnterCriticalSection(m)
+#define ckv_mutex_unlock(m)     LeaveCriticalSection(m)
+#define ckv_mutex_destroy(m)    DeleteCriticalSection(m)
+#else
+#include <pthread.h>
+typedef pthread_t ckv_thread_t;
+typedef pthread_mutex_t ckv_mutex_t;
+#define ckv_mutex_init(m)       pthread_mutex_init(m, NULL)
+#define ckv_mutex_lock(m)       pthread_mutex_lock(m)
+#define ckv_mutex_unlock(m)     pthread_mutex_unlock(m)
+#define ckv_mutex_destroy(m)    pthread_mutex_destroy(m)
+#endif
+
+int ckv_cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+typedef struct {
+    ckv_mutex_t lock;
+    int next;
+    int jobs;
+    void (*job)(void *ctx, int i);
+    void *ctx;
+} ckv_parallel_t;
+
+/* Workers claim job indices one at a time until none are left */
+#ifdef _WIN32
+static DWORD WINAPI ckv_parallel_worker(void *arg)
+#else
+static void *ckv_parallel_worker(void *arg)
+#endif
+{
+    ckv_parallel_t *p = (ckv_parallel_t *)arg;
+    int i;
+
+    while (1) {
+        ckv_mutex_lock(&p->lock);
+        i = p->next++;
+        ckv_mutex_unlock(&p->lock);
+
+        if (i >= p->jobs)
+            break;
+        p->job(p->ctx, i);
+    }
+
+    return 0;
+}
+
+void ckv_parallel_for(int jobs, int threads, void (*job)(void *ctx, int i),
+                      void *ctx)
+{
+    ckv_parallel_t p;
+    ckv_thread_t *handles = NULL;
+    int started = 0, i;
+
+    if (threads > jobs)
+        threads = jobs;
+
+    p.next = 0;
+    p.jobs = jobs;
+    p.job = job;
+    p.ctx = ctx;
+    ckv_mutex_init(&p.lock);
+
+    /* Threads that fail to start just leave more work for the others */
+    if (threads > 1)
+        handles = (ckv_thread_t *)malloc((threads - 1) * sizeof(*handles));
+    for (i = 0; handles && i < threads - 1; i++) {
+#ifdef _WIN32
+        handles[started] = CreateThread(NULL, 0, ckv_parallel_worker, &p, 0, NULL);
+        if (handles[started] == NULL)
+            break;
+#else
+        if (pthread_create(&handles[started], NULL, ckv_parallel_worker, &p) != 0)
+            break;
+#endif
+        started++;
+    }
+
+    ckv_parallel_worker(&p);
+
+    for (i = 0; i < started; i++) {
+#ifdef _WIN32
+        WaitForSingleObject(handles[i], INFINITE);
+        CloseHandle(handles[i]);
+#else
+        pthread_join(handles[i], NULL);
+#endif
+    }
+
+    free(handles);
+    ckv_mutex_destroy(&p.lock);
+}
+
+int ckv_threads_option(lua_State *l, int arg)
+{
+    int threads = ckv_cpu_count();
+
+    if (lua_isnoneornil(l, arg))
+        return threads;
+
+    luaL_checktype(l, arg, LUA_TTABLE);
+    lua_getfield(l, arg, "threads");
+    if (!lua_isnil(l, -1)) {
+        threads = (int)luaL_checkinteger(l, -1);
+        luaL_argcheck(l, threads >= 1, arg, "threads must be at least 1");
+    }
+    lua_pop(l, 1);
+
+    return threads;
+}
+
+/* ===== BINARY CACHE ===== */
+
+enum {
+    CKV_B_FALSE,
+    CKV_B_TRUE,
+    CKV_B_NULL,
+    CKV_B_INTEGER,      /* Zigzag varint */
+    CKV_B_NUMBER,       /* IEEE 754 double, little endian */
+    CKV_B_STRING,       /* Length, bytes */
+    CKV_B_REF,          /* String table position */
+    CKV_B_TABLE,        /* Array count, record count, values */
+    CKV_B_HOLE          /* nil inside the array part */
+};
+
+#define CKV_CACHE_VERSION 1
+
+#ifdef _WIN32
+#define ckv_rename(from, to) \
+    (MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) ? 0 : -1)
+#else
+#define ckv_rename(from, to)        rename(from, to)
+#endif
+
+typedef struct {
+    strbuf_t body;
+    strbuf_t strings;
+    int count;          /* Strings in the string table */
+    int table;          /* Stack index of string -> position */
+    int max_depth;
+} ckv_binary_writer_t;
+
+typedef struct {
+    const unsigned char *p;
+    const unsigned char *end;
+    int strings;        /* Stack index of the string table */
+    size_t count;
+    int max_depth;
+} ckv_binary_reader_t;
+
+/* Writes v into p (at least 10 bytes), returns the byte count */
+static int ckv_varint_put(char *p, unsigned long long v)
+{
+    int n = 0;
+
+    while (v >= 0x80) {
+        p[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (char)v;
+
+    return n;
+}
+
+static void ckv_binary_varint(strbuf_t *s, unsigned long long v)
+{
+    strbuf_ensure_empty_length(s, 10);
+    strbuf_extend_length(s, ckv_varint_put(strbuf_empty_ptr(s), v));
+}
+
+static unsigned long long ckv_zigzag(long long v)
+{
+    unsigned long long u = (unsigned long long)v;
+
+    return (u << 1) ^ (0 - (u >> 63));
+}
+
+static long long ckv_unzigzag(unsigned long long u)
+{
+    return (long long)((u >> 1) ^ (0 - (u & 1)));
+}
+
+static void ckv_binary_error(lua_State *l, ckv_binary_writer_t *w,
+                             const char *msg)
+{
+    strbuf_free(&w->body);
+    strbuf_free(&w->strings);
+    luaL_error(l, "%s", msg);
+}
+
+static void ckv_binary_string(lua_State *l, ckv_binary_writer_t *w, int idx)
+{
+    const char *str;
+    size_t len;
+
+    str = lua_tolstring(l, idx, &len);
+    if (len > CKV_KEY_CACHE_MAXLEN) {
+        strbuf_append_char(&w->body, CKV_B_STRING);
+        ckv_binary_varint(&w->body, len);
+        strbuf_append_mem(&w->body, str, (int)len);
+        return;
+    }
+
+    lua_pushvalue(l, idx);
+    lua_rawget(l, w->table);
+    if (lua_isnil(l, -1)) {
+        lua_pop(l, 1);
+        lua_pushvalue(l, idx);
+        lua_pushinteger(l, w->count);
+        lua_rawset(l, w->table);
+        ckv_binary_varint(&w->strings, len);
+        strbuf_append_mem(&w->strings, str, (int)len);
+        lua_pushinteger(l, w->count++);
+    }
+    strbuf_append_char(&w->body, CKV_B_REF);
+    ckv_binary_varint(&w->body, (unsigned long long)lua_tointeger(l, -1));
+    lua_pop(l, 1);
+}
+
+static void ckv_binary_number(lua_State *l, ckv_binary_writer_t *w, int idx)
 {
-    if (tabCache[0] != NULL)
-    {
+    unsigned long long bits;
+    double number;
+    char bytes[8];
+    int i;
+
+#if LUA_VERSION_NUM >= 503
+    if (lua_isinteger(l, idx)) {
+        strbuf_append_char(&w->body, CKV_B_INTEGER);
+        ckv_binary_varint(&w->body, ckv_zigzag((long long)lua_tointeger(l, idx)));
         return;
     }
-    int i,j;
-    for(i = 0; i < MAX_TAB; i++)
-    {
-        char* buf = malloc(i + 1);
-        for(j = 0; j < i; j++)
-        {
-            buf[j] = '\t';
+#endif
+
+    number = (double)lua_tonumber(l, idx);
+    memcpy(&bits, &number, sizeof(bits));
+    for (i = 0; i < 8; i++)
+        bytes[i] = (char)(bits >> (i * 8));
+    strbuf_append_char(&w->body, CKV_B_NUMBER);
+    strbuf_append_mem(&w->body, bytes, 8);
+}
+
+/* Integer keys 1..narr are written in the array part */
+static int ckv_binary_in_array(lua_State *l, int idx, size_t narr)
+{
+    lua_Number n;
+
+    if (lua_type(l, idx) != LUA_TNUMBER)
+        return 0;
+    n = lua_tonumber(l, idx);
+
+    return n >= 1 && n <= (lua_Number)narr && n == floor(n);
+}
+
+static void ckv_binary_value(lua_State *l, ckv_binary_writer_t *w, int idx,
+                             int depth);
+
+static void ckv_binary_table(lua_State *l, ckv_binary_writer_t *w, int idx,
+                             int depth)
+{
+    size_t narr, nrec = 0, i;
+
+    if (depth > w->max_depth || !lua_checkstack(l, 4))
+        ckv_binary_error(l, w, "Cannot serialise, excessive nesting");
+
+    narr = (size_t)lua_rawlen(l, idx);
+    lua_pushnil(l);
+    while (lua_next(l, idx)) {
+        lua_pop(l, 1);
+        if (!ckv_binary_in_array(l, -1, narr))
+            nrec++;
+    }
+
+    strbuf_append_char(&w->body, CKV_B_TABLE);
+    ckv_binary_varint(&w->body, narr);
+    ckv_binary_varint(&w->body, nrec);
+
+    for (i = 1; i <= narr; i++) {
+        lua_rawgeti(l, idx, (lua_Integer)i);
+        if (lua_isnil(l, -1))
+            strbuf_append_char(&w->body, CKV_B_HOLE);
+        else
+            ckv_binary_value(l, w, lua_gettop(l), depth + 1);
+        lua_pop(l, 1);
+    }
+
+    lua_pushnil(l);
+    while (lua_next(l, idx)) {
+        if (!ckv_binary_in_array(l, -2, narr)) {
+            ckv_binary_value(l, w, lua_gettop(l) - 1, depth + 1);
+            ckv_binary_value(l, w, lua_gettop(l), depth + 1);
+        }
+        lua_pop(l, 1);
+    }
+}
+
+static void ckv_binary_value(lua_State *l, ckv_binary_writer_t *w, int idx,
+                             int depth)
+{
+    char msg[64];
+
+    switch (lua_type(l, idx)) {
+    case LUA_TSTRING:
+        ckv_binary_string(l, w, idx);
+        break;
+    case LUA_TNUMBER:
+        ckv_binary_number(l, w, idx);
+        break;
+    case LUA_TBOOLEAN:
+        strbuf_append_char(&w->body,
+                           lua_toboolean(l, idx) ? CKV_B_TRUE : CKV_B_FALSE);
+        break;
+    case LUA_TTABLE:
+        ckv_binary_table(l, w, idx, depth);
+        break;
+    case LUA_TLIGHTUSERDATA:
+        if (lua_touserdata(l, idx) == NULL) {
+            strbuf_append_char(&w->body, CKV_B_NULL);
+            break;
+        }
+        /* Fall through */
+    default:
+        snprintf(msg, sizeof(msg), "Cannot serialise %s to binary KV",
+                 lua_typename(l, lua_type(l, idx)));
+        ckv_binary_error(l, w, msg);
+    }
+}
+
+void ckv_binary_encode(lua_State *l, int idx, int max_depth)
+{
+    ckv_binary_writer_t w;
+    char header[5 + 10];
+
+    idx = lua_absindex(l, idx);
+    strbuf_init(&w.body, 0);
+    strbuf_init(&w.strings, 0);
+    w.count = 0;
+    w.max_depth = max_depth;
+    lua_newtable(l);
+    w.table = lua_gettop(l);
+
+    ckv_binary_value(l, &w, idx, 1);
+
+    memcpy(header, "CKVB", 4);
+    header[4] = CKV_BINARY_VERSION;
+
+    lua_pushlstring(l, header, 5 + ckv_varint_put(header + 5, w.count));
+    lua_pushlstring(l, w.strings.buf, w.strings.length);
+    lua_pushlstring(l, w.body.buf, w.body.length);
+    lua_concat(l, 3);
+    lua_remove(l, w.table);
+
+    strbuf_free(&w.body);
+    strbuf_free(&w.strings);
+}
+
+static int ckv_binary_read_varint(ckv_binary_reader_t *r,
+                                  unsigned long long *v)
+{
+    int shift = 0;
+
+    *v = 0;
+    while (r->p < r->end && shift < 64) {
+        *v |= (unsigned long long)(*r->p & 0x7F) << shift;
+        if (!(*r->p++ & 0x80))
+            return 0;
+        shift += 7;
+    }
+
+    return -1;
+}
+
+/* Counts that can't fit in what is left of the data are corrupt, every
+ * value takes at least a byte */
+static int ckv_binary_read_count(ckv_binary_reader_t *r, size_t *count)
+{
+    unsigned long long v;
+
+    if (ckv_binary_read_varint(r, &v) != 0 ||
+        v > (unsigned long long)(r->end - r->p))
+        return -1;
+    *count = (size_t)v;
+
+    return 0;
+}
+
+static int ckv_binary_read_value(lua_State *l, ckv_binary_reader_t *r,
+                                 int depth)
+{
+    unsigned long long v, bits = 0;
+    size_t narr, nrec, i;
+    double number;
+
+    if (r->p >= r->end)
+        return -1;
+
+    switch (*r->p++) {
+    case CKV_B_FALSE:
+        lua_pushboolean(l, 0);
+        return 0;
+    case CKV_B_TRUE:
+        lua_pushboolean(l, 1);
+        return 0;
+    case CKV_B_NULL:
+        lua_pushlightuserdata(l, NULL);
+        return 0;
+    case CKV_B_INTEGER:
+        if (ckv_binary_read_varint(r, &v) != 0)
+            return -1;
+        lua_pushinteger(l, (lua_Integer)ckv_unzigzag(v));
+        return 0;
+    case CKV_B_NUMBER:
+        if (r->end - r->p < 8)
+            return -1;
+        for (i = 0; i < 8; i++)
+            bits |= (unsigned long long)r->p[i] << (i * 8);
+        r->p += 8;
+        memcpy(&number, &bits, sizeof(number));
+        lua_pushnumber(l, (lua_Number)number);
+        return 0;
+    case CKV_B_STRING:
+        if (ckv_binary_read_count(r, &i) != 0)
+            return -1;
+        lua_pushlstring(l, (const char *)r->p, i);
+        r->p += i;
+        return 0;
+    case CKV_B_REF:
+        if (ckv_binary_read_varint(r, &v) != 0 || v >= r->count)
+            return -1;
+        lua_rawgeti(l, r->strings, (lua_Integer)v + 1);
+        return 0;
+    case CKV_B_TABLE:
+        if (depth > r->max_depth || !lua_checkstack(l, 3) ||
+            ckv_binary_read_count(r, &narr) != 0 ||
+            ckv_binary_read_count(r, &nrec) != 0 ||
+            narr > INT_MAX || nrec > INT_MAX)
+            return -1;
+
+        lua_createtable(l, (int)narr, (int)nrec);
+        for (i = 1; i <= narr; i++) {
+            if (r->p < r->end && *r->p == CKV_B_HOLE) {
+                r->p++;
+                continue;
+            }
+            if (ckv_binary_read_value(l, r, depth + 1) != 0)
+                return -1;
+            lua_rawseti(l, -2, (lua_Integer)i);
+        }
+        for (i = 0; i < nrec; i++) {
+            if (ckv_binary_read_value(l, r, depth + 1) != 0)
+                return -1;
+            /* nil can't be read, NaN would make lua_rawset() throw */
+            if (lua_type(l, -1) == LUA_TNUMBER &&
+                lua_tonumber(l, -1) != lua_tonumber(l, -1))
+                return -1;
+            if (ckv_binary_read_value(l, r, depth + 1) != 0)
+                return -1;
+            lua_rawset(l, -3);
+        }
+        return 0;
+    }
+
+    return -1;
+}
+
+int ckv_binary_decode(lua_State *l, const char *data, size_t len,
+                      int max_depth)
+{
+    ckv_binary_reader_t r;
+    int top = lua_gettop(l);
+    size_t i, slen;
+
+    if (len < 5 || memcmp(data, "CKVB", 4) != 0 ||
+        data[4] != CKV_BINARY_VERSION)
+        return -1;
+
+    r.p = (const unsigned char *)data + 5;
+    r.end = (const unsigned char *)data + len;
+    r.max_depth = max_depth;
+    if (ckv_binary_read_count(&r, &r.count) != 0 || r.count > INT_MAX)
+        goto invalid;
+
+    lua_createtable(l, (int)r.count, 0);
+    r.strings = lua_gettop(l);
+    for (i = 0; i < r.count; i++) {
+        if (ckv_binary_read_count(&r, &slen) != 0)
+            goto invalid;
+        lua_pushlstring(l, (const char *)r.p, slen);
+        lua_rawseti(l, r.strings, (lua_Integer)i + 1);
+        r.p += slen;
+    }
+
+    if (ckv_binary_read_value(l, &r, 1) != 0 || r.p != r.end)
+        goto invalid;
+    lua_remove(l, r.strings);
+
+    return 0;
+
+invalid:
+    lua_settop(l, top);
+
+    return -1;
+}
+
+/* Cache file layout:
+ *      "CKVC" version dialect
+ *      count, count x (path length, path, zigzag mtime, size)
+ *      binary KV */
+int ckv_cache_load(lua_State *l, const char *path, int dialect,
+                   int max_depth)
+{
+    char cache[CKV_PATH_MAX + sizeof(CKV_CACHE_SUFFIX)];
+    char source[CKV_PATH_MAX];
+    ckv_binary_reader_t r;
+    ckv_stamp_t stamp;
+    ckv_file_t file;
+    unsigned long long mtime, size;
+    size_t sources, len;
+    int ok = 0;
+
+    snprintf(cache, sizeof(cache), "%s" CKV_CACHE_SUFFIX, path);
+    if (ckv_file_open(&file, cache) != 0)
+        return 0;
+
+    r.p = (const unsigned char *)file.data;
+    r.end = r.p + file.len;
+    if (file.len < 6 || memcmp(r.p, "CKVC", 4) != 0 ||
+        r.p[4] != CKV_CACHE_VERSION || r.p[5] != dialect)
+        goto done;
+    r.p += 6;
+
+    if (ckv_binary_read_count(&r, &sources) != 0 || !sources)
+        goto done;
+    while (sources--) {
+        if (ckv_binary_read_count(&r, &len) != 0 || len >= sizeof(source))
+            goto done;
+        memcpy(source, r.p, len);
+        source[len] = '\0';
+        r.p += len;
+        if (ckv_binary_read_varint(&r, &mtime) != 0 ||
+            ckv_binary_read_varint(&r, &size) != 0 ||
+            ckv_file_stamp(source, &stamp) != 0 ||
+            stamp.mtime != ckv_unzigzag(mtime) ||
+            stamp.size != (long long)size)
+            goto done;
+    }
+
+    ok = ckv_binary_decode(l, (const char *)r.p, r.end - r.p, max_depth) == 0;
+
+done:
+    ckv_file_close(&file);
+
+    return ok;
+}
+
+static int ckv_cache_source(strbuf_t *s, const char *path)
+{
+    char resolved[CKV_PATH_MAX];
+    ckv_stamp_t stamp;
+
+    ckv_resolve_path(path, resolved, sizeof(resolved));
+    if (ckv_file_stamp(resolved, &stamp) != 0)
+        return -1;
+
+    ckv_binary_varint(s, strlen(resolved));
+    strbuf_append_mem(s, resolved, (int)strlen(resolved));
+    ckv_binary_varint(s, ckv_zigzag(stamp.mtime));
+    ckv_binary_varint(s, (unsigned long long)stamp.size);
+
+    return 0;
+}
+
+void ckv_cache_store(lua_State *l, const char *path, int idx, int sources,
+                     int dialect, int max_depth)
+{
+    char cache[CKV_PATH_MAX + sizeof(CKV_CACHE_SUFFIX)];
+    char tmp[CKV_PATH_MAX + sizeof(CKV_CACHE_SUFFIX) + 4];
+    const char *data;
+    strbuf_t header;
+    size_t count, i, len;
+    FILE *f;
+    int ok;
+
+    idx = lua_absindex(l, idx);
+    count = sources ? (size_t)lua_rawlen(l, sources) : 0;
+
+    /* The only step that can throw, before anything needs freeing */
+    ckv_binary_encode(l, idx, max_depth);
+    data = lua_tolstring(l, -1, &len);
+
+    strbuf_init(&header, 0);
+    strbuf_append_mem(&header, "CKVC", 4);
+    strbuf_append_char(&header, CKV_CACHE_VERSION);
+    strbuf_append_char(&header, (char)dialect);
+    ckv_binary_varint(&header, count + 1);
+    ok = ckv_cache_source(&header, path) == 0;
+    for (i = 1; ok && i <= count; i++) {
+        lua_rawgeti(l, sources, (lua_Integer)i);
+        ok = lua_isstring(l, -1) &&
+             ckv_cache_source(&header, lua_tostring(l, -1)) == 0;
+        lua_pop(l, 1);
+    }
+
+    /* Written aside and renamed so readers never see half a cache */
+    snprintf(cache, sizeof(cache), "%s" CKV_CACHE_SUFFIX, path);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", cache);
+    if (ok && (f = fopen(tmp, "wb")) != NULL) {
+        ok = fwrite(header.buf, 1, header.length, f) == (size_t)header.length &&
+             fwrite(data, 1, len, f) == len;
+        ok = fclose(f) == 0 && ok;
+        if (!ok || ckv_rename(tmp, cache) != 0)
+            remove(tmp);
+    }
+
+    strbuf_free(&header);
+    lua_pop(l, 1);
+}
+
+/* ===== STREAMED ENCODING ===== */
+
+static int ckv_sink_gc(lua_State *l)
+{
+    ckv_sink_t *sink = (ckv_sink_t *)lua_touserdata(l, 1);
+
+    strbuf_free(&sink->buf);
+    if (sink->file) {
+        fclose(sink->file);
+        sink->file = NULL;
+        remove(sink->tmp);
+    }
+
+    return 0;
+}
+
+static ckv_sink_t *ckv_sink_new(lua_State *l)
+{
+    ckv_sink_t *sink;
+
+    sink = (ckv_sink_t *)lua_newuserdata(l, sizeof(*sink));
+    sink->writer = 0;
+    sink->file = NULL;
+    sink->written = 0;
+    strbuf_init(&sink->buf, CKV_SINK_CHUNK * 2);
+
+    lua_newtable(l);
+    lua_pushcfunction(l, ckv_sink_gc);
+    lua_setfield(l, -2, "__gc");
+    lua_setmetatable(l, -2);
+
+    return sink;
+}
+
+ckv_sink_t *ckv_sink_writer(lua_State *l, int writer)
+{
+    ckv_sink_t *sink;
+
+    writer = lua_absindex(l, writer);
+    luaL_checktype(l, writer, LUA_TFUNCTION);
+    sink = ckv_sink_new(l);
+    sink->writer = writer;
+
+    return sink;
+}
+
+ckv_sink_t *ckv_sink_file(lua_State *l, const char *path)
+{
+    ckv_sink_t *sink;
+
+    if (strlen(path) >= CKV_PATH_MAX)
+        luaL_error(l, "path too long: %s", path);
+
+    sink = ckv_sink_new(l);
+    strcpy(sink->path, path);
+    snprintf(sink->tmp, sizeof(sink->tmp), "%s.tmp", path);
+    sink->file = fopen(sink->tmp, "wb");
+    if (!sink->file)
+        luaL_error(l, "cannot open %s: %s", sink->tmp, strerror(errno));
+
+    return sink;
+}
+
+void ckv_sink_flush(lua_State *l, ckv_sink_t *sink)
+{
+    size_t len = (size_t)strbuf_length(&sink->buf);
+
+    if (len == 0)
+        return;
+
+    if (sink->file) {
+        if (fwrite(sink->buf.buf, 1, len, sink->file) != len) {
+            fclose(sink->file);
+            sink->file = NULL;
+            remove(sink->tmp);
+            luaL_error(l, "cannot write %s: %s", sink->tmp, strerror(errno));
+        }
+    } else {
+        luaL_checkstack(l, 2, NULL);
+        lua_pushvalue(l, sink->writer);
+        lua_pushlstring(l, sink->buf.buf, len);
+        lua_call(l, 1, 0);
+    }
+
+    sink->written += len;
+    strbuf_reset(&sink->buf);
+}
+
+size_t ckv_sink_close(lua_State *l, ckv_sink_t *sink)
+{
+    FILE *file;
+
+    ckv_sink_flush(l, sink);
+
+    if (sink->file) {
+        file = sink->file;
+        sink->file = NULL;
+        if (fclose(file) != 0 || ckv_rename(sink->tmp, sink->path) != 0) {
+            remove(sink->tmp);
+            luaL_error(l, "cannot write %s: %s", sink->path, strerror(errno));
+        }
+    }
+
+    return sink->written;
+}
+
+/* ===== PARALLEL ENCODING ===== */
+
+static int ckv_snap_gc(lua_State *l)
+{
+    ckv_snap_free((ckv_snap_t *)lua_touserdata(l, 1));
+
+    return 0;
+}
+
+ckv_snap_t *ckv_snap_new(lua_State *l, ckv_snap_format_t format,
+                         const void *cfg)
+{
+    ckv_snap_t *snap;
+
+    snap = (ckv_snap_t *)lua_newuserdata(l, sizeof(*snap));
+    ckv_arena_init(&snap->arena);
+    snap->format = format;
+    snap->cfg = cfg;
+    snap->anchor_count = 0;
+    snap->jobs = NULL;
+    snap->job_count = 0;
+    snap->job_size = 0;
+    snap->skeleton = 0;
+
+    lua_newtable(l);
+    lua_pushcfunction(l, ckv_snap_gc);
+    lua_setfield(l, -2, "__gc");
+    lua_setmetatable(l, -2);
+
+    lua_newtable(l);
+    snap->anchors = lua_gettop(l);
+
+    return snap;
+}
+
+void ckv_snap_free(ckv_snap_t *snap)
+{
+    ckv_arena_free(&snap->arena);
+    free(snap->jobs);
+    snap->jobs = NULL;
+    snap->job_size = 0;
+}
+
+ckv_snap_node_t *ckv_snap_node(lua_State *l, ckv_snap_t *snap,
+                               ckv_snap_type_t type)
+{
+    ckv_snap_node_t *node;
+
+    node = (ckv_snap_node_t *)ckv_arena_alloc(&snap->arena, sizeof(*node));
+    if (!node) {
+        luaL_error(l, "not enough memory");
+        return NULL;
+    }
+
+    memset(node, 0, sizeof(*node));
+    node->type = type;
+    node->weight = 1;
+
+    return node;
+}
+
+const char *ckv_snap_tostring(lua_State *l, ckv_snap_t *snap, int idx,
+                              size_t *len)
+{
+    const char *str;
+
+    if (lua_type(l, idx) == LUA_TSTRING)
+        return lua_tolstring(l, idx, len);
+
+    lua_pushvalue(l, idx);
+    str = lua_tolstring(l, -1, len);
+    if (!str) {
+        lua_pop(l, 1);
+        *len = 0;
+        return "";
+    }
+    lua_rawseti(l, snap->anchors, ++snap->anchor_count);
+
+    return str;
+}
+
+/* Makes the run of count items from first a job when it is worth one */
+static int ckv_snap_cut(ckv_snap_node_t *first, size_t count, size_t weight)
+{
+    if (!first || weight < CKV_SNAP_MIN_JOB)
+        return 0;
+
+    first->run = count;
+    return 1;
+}
+
+/* Cuts the items of table into runs weighing about limit, going into the
+ * items heavier than that. Returns the number of runs */
+static int ckv_snap_split(ckv_snap_node_t *table, size_t limit)
+{
+    ckv_snap_node_t *item, *first = NULL;
+    size_t count = 0, weight = 0;
+    int cuts = 0;
+
+    for (item = table->child; item; item = item->next) {
+        if (item->weight > limit && item->type == CKV_SNAP_TABLE &&
+            item->count) {
+            cuts += ckv_snap_cut(first, count, weight);
+            first = NULL;
+            count = weight = 0;
+            cuts += ckv_snap_split(item, limit);
+            continue;
+        }
+
+        if (!first)
+            first = item;
+        count++;
+        weight += item->weight;
+        if (weight >= limit) {
+            cuts += ckv_snap_cut(first, count, weight);
+            first = NULL;
+            count = weight = 0;
+        }
+    }
+
+    return cuts + ckv_snap_cut(first, count, weight);
+}
+
+int ckv_snap_defer_job(ckv_snap_t *snap, strbuf_t *buf,
+                       const ckv_snap_node_t **item, int depth, int flags)
+{
+    ckv_snap_job_t *job;
+    size_t i;
+
+    /* Every run is reached once, this only guards against a formatter
+     * reaching one twice */
+    if (snap->job_count == snap->job_size)
+        return 0;
+
+    job = &snap->jobs[snap->job_count++];
+    job->item = *item;
+    job->count = (*item)->run;
+    job->depth = depth;
+    job->flags = flags;
+    job->offset = strbuf_length(buf);
+
+    for (i = 1; i < job->count; i++)
+        *item = (*item)->next;
+
+    return 1;
+}
+
+static void ckv_snap_job(void *ctx, int i)
+{
+    ckv_snap_t *snap = (ckv_snap_t *)ctx;
+    ckv_snap_job_t *job = &snap->jobs[i];
+    const ckv_snap_node_t *item = job->item;
+    size_t weight = 0, n;
+
+    for (n = 0; n < job->count; n++, item = item->next)
+        weight += item->weight;
+    strbuf_init(&job->buf, (int)(weight + weight / 8));
+
+    for (n = 0, item = job->item; n < job->count; n++, item = item->next)
+        snap->format(snap, &job->buf, item, job->depth, job->flags);
+}
+
+/* The items of root through the skeleton */
+static void ckv_snap_format_root(ckv_snap_t *snap, strbuf_t *buf,
+                                 const ckv_snap_node_t *root, int depth,
+                                 int flags)
+{
+    const ckv_snap_node_t *item;
+
+    for (item = root->child; item; item = item->next)
+        if (!ckv_snap_defer(snap, buf, &item, depth, flags))
+            snap->format(snap, buf, item, depth, flags);
+}
+
+void ckv_snap_encode(ckv_snap_t *snap, ckv_snap_node_t *root, int depth,
+                     int flags, int threads, strbuf_t *buf)
+{
+    strbuf_t skeleton;
+    size_t limit, total, from = 0;
+    int cuts = 0, i;
+
+    if (threads > 1) {
+        limit = root->weight / ((size_t)threads * CKV_SNAP_JOBS_PER_THREAD);
+        if (limit < CKV_SNAP_MIN_JOB)
+            limit = CKV_SNAP_MIN_JOB;
+        cuts = ckv_snap_split(root, limit);
+    }
+    if (cuts)
+        snap->jobs = (ckv_snap_job_t *)malloc(cuts * sizeof(*snap->jobs));
+
+    /* Without jobs (or the memory for them) it all goes in the skeleton */
+    if (!snap->jobs) {
+        ckv_snap_format_root(snap, buf, root, depth, flags);
+        return;
+    }
+
+    snap->job_size = cuts;
+    strbuf_init(&skeleton, 0);
+    snap->skeleton = 1;
+    ckv_snap_format_root(snap, &skeleton, root, depth, flags);
+    snap->skeleton = 0;
+
+    ckv_parallel_for(snap->job_count, threads, ckv_snap_job, snap);
+
+    total = strbuf_length(&skeleton);
+    for (i = 0; i < snap->job_count; i++)
+        total += strbuf_length(&snap->jobs[i].buf);
+    strbuf_ensure_empty_length(buf, (int)total);
+
+    for (i = 0; i < snap->job_count; i++) {
+        strbuf_append_mem(buf, skeleton.buf + from,
+                          (int)(snap->jobs[i].offset - from));
+        strbuf_append_mem(buf, snap->jobs[i].buf.buf,
+                          strbuf_length(&snap->jobs[i].buf));
+        strbuf_free(&snap->jobs[i].buf);
+        from = snap->jobs[i].offset;
+    }
+    strbuf_append_mem(buf, skeleton.buf + from,
+                      (int)(strbuf_length(&skeleton) - from));
+    strbuf_free(&skeleton);
+}
+
+/* ===== KEY ORDER ===== */
+
+typedef struct {
+    int rank;           /* 0 number, 1 string, 2 anything else */
+    lua_Number number;
+    const char *str;
+    size_t len;
+    int index;          /* Position in the unsorted key array */
+} ckv_sort_key_t;
+
+static int ckv_sort_key_cmp(const void *a, const void *b)
+{
+    const ckv_sort_key_t *x = (const ckv_sort_key_t *)a;
+    const ckv_sort_key_t *y = (const ckv_sort_key_t *)b;
+    size_t len;
+    int cmp;
+
+    if (x->rank != y->rank)
+        return x->rank - y->rank;
+
+    switch (x->rank) {
+    case 0:
+        if (x->number != y->number)
+            return x->number < y->number ? -1 : 1;
+        break;
+    case 1:
+        len = x->len < y->len ? x->len : y->len;
+        cmp = memcmp(x->str, y->str, len);
+        if (cmp)
+            return cmp;
+        if (x->len != y->len)
+            return x->len < y->len ? -1 : 1;
+        break;
+    }
+
+    /* Keeps qsort() deterministic for keys that can't be ordered */
+    return x->index - y->index;
+}
+
+void ckv_iter_begin(lua_State *l, ckv_iter_t *it, int sorted)
+{
+    ckv_sort_key_t *entries;
+    int count = 0, i;
+
+    it->table = lua_absindex(l, -1);
+    it->keys = 0;
+    it->count = 0;
+    it->next = 0;
+
+    if (!sorted) {
+        lua_pushnil(l);
+        return;
+    }
+
+    luaL_checkstack(l, 4, NULL);
+
+    /* The key array keeps the strings alive while entries point at them */
+    lua_newtable(l);
+    lua_pushnil(l);
+    while (lua_next(l, it->table)) {
+        lua_pop(l, 1);
+        lua_pushvalue(l, -1);
+        lua_rawseti(l, -3, ++count);
+    }
+
+    /* A userdata, so an error while sorting frees it as well */
+    entries = (ckv_sort_key_t *)lua_newuserdata(l, sizeof(*entries) *
+                                                   (count ? count : 1));
+    for (i = 0; i < count; i++) {
+        entries[i].index = i + 1;
+        lua_rawgeti(l, -2, i + 1);
+        switch (lua_type(l, -1)) {
+        case LUA_TNUMBER:
+            entries[i].rank = 0;
+            entries[i].number = lua_tonumber(l, -1);
+            break;
+        case LUA_TSTRING:
+            entries[i].rank = 1;
+            entries[i].str = lua_tolstring(l, -1, &entries[i].len);
+            break;
+        default:
+            entries[i].rank = 2;
+            break;
         }
-        buf[j] = '\0';
-        tabCache[i] = buf;
+        lua_pop(l, 1);
+    }
+    qsort(entries, count, sizeof(*entries), ckv_sort_key_cmp);
+
+    /* keys, entries -> sorted keys */
+    lua_createtable(l, count, 0);
+    for (i = 0; i < count; i++) {
+        lua_rawgeti(l, -3, entries[i].index);
+        lua_rawseti(l, -2, i + 1);
+    }
+    lua_replace(l, -3);
+    lua_pop(l, 1);
+
+    it->keys = lua_absindex(l, -1);
+    it->count = count;
+}
+
+/* ===== STATS ===== */
+
+double ckv_stats_clock(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER count, freq;
+
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+void ckv_stats_merge(ckv_stats_t *to, const ckv_stats_t *from)
+{
+    int i;
+
+    to->decodes += from->decodes;
+    to->bytes += from->bytes;
+    for (i = 0; i < CKV_STATS_TOKENS; i++)
+        to->tokens[i] += from->tokens[i];
+    to->tables += from->tables;
+    to->strings += from->strings;
+    if (from->max_depth > to->max_depth)
+        to->max_depth = from->max_depth;
+    to->reallocs += from->reallocs;
+    to->files += from->files;
+    to->read_time += from->read_time;
+    to->parse_time += from->parse_time;
+    to->includes += from->includes;
+    to->include_hits += from->include_hits;
+}
+
+void ckv_stats_push(lua_State *l, const ckv_stats_t *stats)
+{
+    int i;
+
+    lua_createtable(l, 0, 13);
+
+    lua_createtable(l, 0, CKV_STATS_TOKENS);
+    for (i = 0; i < CKV_STATS_TOKENS; i++) {
+        lua_pushnumber(l, stats->tokens[i]);
+        lua_setfield(l, -2, ckv_token_type_name[i]);
     }
-}
\ No newline at end of file
+    lua_setfield(l, -2, "tokens");
+
+#define CKV_STATS_FIELD(name) \
+    lua_pushnumber(l, (lua_Number)stats->name); \
+    lua_setfield(l, -2, #name)
+
+    CKV_STATS_FIELD(decodes);
+    CKV_STATS_FIELD(bytes);
+    CKV_STATS_FIELD(tables);
+    CKV_STATS_FIELD(strings);
+    CKV_STATS_FIELD(max_depth);
+    CKV_STATS_FIELD(reallocs);
+    CKV_STATS_FIELD(files);
+    CKV_STATS_FIELD(read_time);
+    CKV_STATS_FIELD(parse_time);
+    CKV_STATS_FIELD(includes);
+    CKV_STATS_FIELD(include_hits);
+
+#undef CKV_STATS_FIELD
+}
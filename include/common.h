@@ -2,9 +2,13 @@
 #define COMMON_H
 
 #include <assert.h>
+#include <errno.h>
 #include <string.h>
 #include <math.h>
 #include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
 #include "strbuf.h"
 #include "fpconv.h"
@@ -20,6 +24,15 @@
 #include <lauxlib.h>
 #endif
 
+/* For the few functions which must be specialised at every call site */
+#if defined(__GNUC__)
+#define CKV_FORCE_INLINE static inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define CKV_FORCE_INLINE static __forceinline
+#else
+#define CKV_FORCE_INLINE static inline
+#endif
+
 /* Workaround for Solaris platforms missing isinf() */
 #if !defined(isinf) && (defined(USE_INTERNAL_ISINF) || defined(MISSING_ISINF))
 #define isinf(x) (!isnan(x) && isnan((x) - (x)))
@@ -35,6 +48,14 @@
 #define DEFAULT_ENCODE_KEEP_BUFFER 1
 #define DEFAULT_ENCODE_NUMBER_PRECISION 14
 #define DEFAULT_ENCODE_KEEPLN 1
+#define DEFAULT_ENCODE_COMPACT 0
+#define DEFAULT_ENCODE_SORT_KEYS 0
+#define DEFAULT_DECODE_PRESIZE 0
+#define DEFAULT_DECODE_KEY_CACHE 0
+#define DEFAULT_DECODE_BASE_CACHE 1
+#define DEFAULT_DECODE_BASE_CACHE_LIMIT 256
+#define DEFAULT_DECODE_SCRATCH_LIMIT (16 * 1024 * 1024)
+#define DEFAULT_DECODE_PACKED_ARRAYS 0
 
 #ifdef DISABLE_INVALID_NUMBERS
 #undef DEFAULT_DECODE_INVALID_NUMBERS
@@ -82,6 +103,1362 @@ static const char *char2escape[256] = {
 
 void printLuaStack(lua_State* l);
 
+/* ===== INDENTATION ===== */
+
+#define CKV_TAB_RUN 64
+
+static const char ckv_tabs[CKV_TAB_RUN + 1] =
+    "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t"
+    "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t";
+
+/* Appends depth tabs, nothing when depth <= 0 */
+static inline void ckv_append_tabs(strbuf_t *buf, int depth)
+{
+    int run;
+
+    if (depth <= 0)
+        return;
+
+    strbuf_ensure_empty_length(buf, depth);
+    while (depth > 0) {
+        run = depth < CKV_TAB_RUN ? depth : CKV_TAB_RUN;
+        memcpy(strbuf_empty_ptr(buf), ckv_tabs, run);
+        strbuf_extend_length(buf, run);
+        depth -= run;
+    }
+}
+
+/* ===== KEY ORDER =====
+ *
+ * lua_next() visits keys in hash order, which differs between runs.
+ * With encode_sort_keys the encoders walk objects through ckv_iter_next()
+ * instead, in the order numbers (by value), strings (bytewise), then any
+ * other key. */
+
+typedef struct {
+    int table;          /* Stack index of the table */
+    int keys;           /* Stack index of the sorted key array, or 0 */
+    int count;
+    int next;
+} ckv_iter_t;
+
+/* Starts iterating the table on top of the stack. Pushes one slot that
+ * ckv_iter_next() uses, like the nil before a lua_next() loop */
+void ckv_iter_begin(lua_State *l, ckv_iter_t *it, int sorted);
+
+/* Same contract as lua_next(): pops the previous key, pushes the next key
+ * and value and returns 1, or returns 0 with the slot popped */
+static inline int ckv_iter_next(lua_State *l, ckv_iter_t *it)
+{
+    if (!it->keys)
+        return lua_next(l, it->table);
+
+    if (it->next > 0)
+        lua_pop(l, 1);
+    if (it->next == it->count) {
+        lua_pop(l, 1);
+        return 0;
+    }
+
+    lua_rawgeti(l, it->keys, ++it->next);
+    lua_pushvalue(l, -1);
+    lua_rawget(l, it->table);
+
+    return 1;
+}
+
+/* ===== SCANNERS =====
+ *
+ * Whitespace runs, comments and strings are scanned 16 bytes at a time
+ * with SSE2 or NEON where available. Blocks are loaded from 16 byte
+ * aligned addresses, so a load never crosses into the next page and may
+ * safely read past the NULL terminator. Define CKV_NO_SIMD to force the
+ * scalar versions, AddressSanitizer builds do so since it can't tell
+ * those reads apart from real overflows. */
+
+#if defined(__SANITIZE_ADDRESS__)
+#define CKV_NO_SIMD
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define CKV_NO_SIMD
+#endif
+#endif
+
+#if !defined(CKV_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define CKV_USE_SSE2 1
+#include <emmintrin.h>
+#elif !defined(CKV_NO_SIMD) && (defined(__ARM_NEON) || defined(_M_ARM64))
+#define CKV_USE_NEON 1
+#include <arm_neon.h>
+#endif
+
+#if defined(CKV_USE_SSE2) || defined(CKV_USE_NEON)
+#include <stdint.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifdef CKV_USE_SSE2
+/* One mask bit per byte */
+typedef unsigned int ckv_mask_t;
+typedef __m128i ckv_block_t;
+#define CKV_MASK_BITS 1
+#define ckv_block_load(p)       _mm_load_si128((const __m128i *)(p))
+#define ckv_block_eq(v, c)      _mm_cmpeq_epi8(v, _mm_set1_epi8(c))
+#define ckv_block_le(v, c)      _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(c)), v)
+#define ckv_block_or(a, b)      _mm_or_si128(a, b)
+#define ckv_block_mask(v)       ((ckv_mask_t)_mm_movemask_epi8(v))
+#define CKV_MASK_ALL            0xFFFFu
+#else
+/* Four mask bits per byte, narrowed with vshrn */
+typedef uint64_t ckv_mask_t;
+typedef uint8x16_t ckv_block_t;
+#define CKV_MASK_BITS 4
+#define ckv_block_load(p)       vld1q_u8((const uint8_t *)(p))
+#define ckv_block_eq(v, c)      vceqq_u8(v, vdupq_n_u8(c))
+#define ckv_block_le(v, c)      vcleq_u8(v, vdupq_n_u8(c))
+#define ckv_block_or(a, b)      vorrq_u8(a, b)
+#define ckv_block_mask(v)       vget_lane_u64(vreinterpret_u64_u8( \
+                                    vshrn_n_u16(vreinterpretq_u16_u8(v), 4)), 0)
+#define CKV_MASK_ALL            (~(uint64_t)0)
+#endif
+
+static inline int ckv_mask_first(ckv_mask_t mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+#ifdef CKV_USE_SSE2
+    _BitScanForward(&index, mask);
+#else
+    _BitScanForward64(&index, mask);
+#endif
+    return (int)index / CKV_MASK_BITS;
+#else
+    return __builtin_ctzll(mask) / CKV_MASK_BITS;
+#endif
+}
+
+/* Bytes which are not ' ', '\t', '\n' or '\r' */
+static inline ckv_mask_t ckv_block_not_whitespace(ckv_block_t v)
+{
+    ckv_block_t ws = ckv_block_or(
+        ckv_block_or(ckv_block_eq(v, ' '), ckv_block_eq(v, '\t')),
+        ckv_block_or(ckv_block_eq(v, '\n'), ckv_block_eq(v, '\r')));
+    return ~ckv_block_mask(ws) & CKV_MASK_ALL;
+}
+
+static inline ckv_mask_t ckv_block_eol(ckv_block_t v)
+{
+    return ckv_block_mask(ckv_block_or(
+        ckv_block_or(ckv_block_eq(v, '\n'), ckv_block_eq(v, '\r')),
+        ckv_block_eq(v, '\0')));
+}
+
+static inline ckv_mask_t ckv_block_gt(ckv_block_t v)
+{
+    return ckv_block_mask(ckv_block_or(ckv_block_eq(v, '>'),
+                                       ckv_block_eq(v, '\0')));
+}
+
+static inline ckv_mask_t ckv_block_quoted(ckv_block_t v)
+{
+    return ckv_block_mask(ckv_block_or(
+        ckv_block_or(ckv_block_eq(v, '"'), ckv_block_eq(v, '\\')),
+        ckv_block_eq(v, '\0')));
+}
+
+/* Bytes char2escape has an escape for: controls, '"', '\\' and DEL */
+static inline ckv_mask_t ckv_block_escaped(ckv_block_t v)
+{
+    return ckv_block_mask(ckv_block_or(
+        ckv_block_or(ckv_block_le(v, 0x1f), ckv_block_eq(v, '"')),
+        ckv_block_or(ckv_block_eq(v, '\\'), ckv_block_eq(v, 0x7f))));
+}
+
+/* Returns the first byte at or after p selected by match() */
+static inline const char *ckv_simd_scan(const char *p,
+                                        ckv_mask_t (*match)(ckv_block_t))
+{
+    const char *block = (const char *)((uintptr_t)p & ~(uintptr_t)15);
+    ckv_mask_t mask = match(ckv_block_load(block)) &
+                      (CKV_MASK_ALL << ((p - block) * CKV_MASK_BITS));
+
+    while (!mask) {
+        block += 16;
+        mask = match(ckv_block_load(block));
+    }
+
+    return block + ckv_mask_first(mask);
+}
+#endif
+
+static inline int ckv_is_whitespace(char ch)
+{
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
+}
+
+/* Returns the first character at or after p which is not whitespace */
+static inline const char *ckv_skip_whitespace(const char *p)
+{
+    /* Most runs are a newline and a few tabs, or nothing at all */
+    if (!ckv_is_whitespace(*p))
+        return p;
+    if (!ckv_is_whitespace(*++p))
+        return p;
+
+#if defined(CKV_USE_SSE2) || defined(CKV_USE_NEON)
+    return ckv_simd_scan(p, ckv_block_not_whitespace);
+#else
+    while (ckv_is_whitespace(*p))
+        p++;
+
+    return p;
+#endif
+}
+
+/* Returns the first '\r', '\n' or '\0' at or after p */
+static inline const char *ckv_scan_eol(const char *p)
+{
+#if defined(CKV_USE_SSE2) || defined(CKV_USE_NEON)
+    return ckv_simd_scan(p, ckv_block_eol);
+#else
+    while (*p != '\n' && *p != '\r' && *p != '\0')
+        p++;
+
+    return p;
+#endif
+}
+
+/* p points just after "<!--". Returns the character following the
+ * closing "-->", or the NULL terminator of an unterminated comment */
+static inline const char *ckv_skip_comment_block(const char *p)
+{
+    const char *start = p;
+
+    while (1) {
+#if defined(CKV_USE_SSE2) || defined(CKV_USE_NEON)
+        p = ckv_simd_scan(p, ckv_block_gt);
+#else
+        while (*p != '>' && *p != '\0')
+            p++;
+#endif
+        if (*p == '\0')
+            return p;
+        if (p - start >= 2 && p[-1] == '-' && p[-2] == '-')
+            return p + 1;
+        p++;
+    }
+}
+
+/* Returns the first '"', '\\' or '\0' at or after p. Quoted strings
+ * which reach their closing quote without an escape can be handed to
+ * lua_pushlstring() straight from the source buffer. */
+static inline const char *ckv_scan_quoted(const char *p)
+{
+#if defined(CKV_USE_SSE2) || defined(CKV_USE_NEON)
+    return ckv_simd_scan(p, ckv_block_quoted);
+#else
+    while (*p != '"' && *p != '\\' && *p != '\0')
+        p++;
+
+    return p;
+#endif
+}
+
+/* Returns the first byte at or after p which char2escape escapes. The
+ * '\0' terminating a Lua string is one of them, so the scan stops there
+ * at the latest */
+static inline const char *ckv_scan_escaped(const char *p)
+{
+#if defined(CKV_USE_SSE2) || defined(CKV_USE_NEON)
+    return ckv_simd_scan(p, ckv_block_escaped);
+#else
+    while (!char2escape[(unsigned char)*p])
+        p++;
+
+    return p;
+#endif
+}
+
+/* Read only view of a whole file.
+ * data is always NULL terminated so the tokenizers can keep treating '\0'
+ * as T_END. When possible the file is mapped instead of copied; a mapped
+ * file truncated by another process before ckv_file_close() raises
+ * SIGBUS on the next read past its new end. */
+typedef struct {
+    const char *data;
+    size_t len;
+    void *map;          /* Mapping base, NULL when data is a heap copy */
+    size_t map_len;
+} ckv_file_t;
+
+/* Returns 0 on success, -1 on failure with errno set */
+int ckv_file_open(ckv_file_t *file, const char *path);
+void ckv_file_close(ckv_file_t *file);
+
+/* Identifies one version of a file on disk. mtime has a one second
+ * resolution, the size catches most edits within the same second */
+typedef struct {
+    long long mtime;
+    long long size;
+} ckv_stamp_t;
+
+/* Returns 0 on success, -1 on failure with errno set */
+int ckv_file_stamp(const char *path, ckv_stamp_t *stamp);
+
+#define CKV_PATH_MAX 512
+
+/* Writes the absolute path of path (with "." and ".." folded) into
+ * resolved, or a copy of path when it can't be resolved */
+void ckv_resolve_path(const char *path, char *resolved, size_t size);
+
+/* Upper bound for the decoded length of any quoted string in data */
+size_t ckv_longest_quoted(const char *data, size_t len);
+
+/* ===== ESCAPING ===== */
+
+/* Appends len bytes of str escaped through char2escape, between double
+ * quotes when quote is set. str must be '\0' terminated, as Lua strings
+ * are. The runs between escapes are copied whole, and a string without
+ * any only reserves its own length */
+static inline void ckv_append_escaped(strbuf_t *buf, const char *str,
+                                      size_t len, int quote)
+{
+    const char *end, *p, *escstr;
+
+    /* lua_tolstring() returns NULL (and a length of 0) for values it
+     * cannot convert, such as the missing key of an empty table */
+    if (!str)
+        str = "";
+    end = str + len;
+    p = ckv_scan_escaped(str);
+    if (p >= end) {
+        strbuf_ensure_empty_length(buf, len + 2);
+        if (quote)
+            strbuf_append_char_unsafe(buf, '\"');
+        strbuf_append_mem_unsafe(buf, str, len);
+        if (quote)
+            strbuf_append_char_unsafe(buf, '\"');
+        return;
+    }
+
+    /* Worst case is len * 6 (all unicode escapes) */
+    strbuf_ensure_empty_length(buf, len * 6 + 2);
+
+    if (quote)
+        strbuf_append_char_unsafe(buf, '\"');
+    while (1) {
+        strbuf_append_mem_unsafe(buf, str, p - str);
+        if (p >= end)
+            break;
+
+        escstr = char2escape[(unsigned char)*p];
+        if (escstr)
+            strbuf_append_string(buf, escstr);
+        else
+            strbuf_append_char_unsafe(buf, *p);
+        str = p + 1;
+        p = ckv_scan_escaped(str);
+    }
+    if (quote)
+        strbuf_append_char_unsafe(buf, '\"');
+}
+
+/* ===== NUMBERS =====
+ *
+ * Nearly every number in a KV file is a small integer or a short
+ * decimal. ckv_scan_number() handles those without fpconv_strtod() and
+ * its locale buffer, and keeps integers as Lua integers. */
+
+#if LUA_VERSION_NUM >= 503
+#define CKV_INTEGER_MAX LUA_MAXINTEGER
+#else
+/* lua_Integer is only a ptrdiff_t before Lua 5.3 */
+#define CKV_INTEGER_MAX PTRDIFF_MAX
+#endif
+
+/* Exact powers of ten, decimals with at most 15 digits divided by one of
+ * these round correctly */
+static const double ckv_pow10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+    1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+};
+
+/* Parses -?[0-9]+ into *integer (returns 1) or -?[0-9]+.[0-9]+ into
+ * *number (returns 0) and sets *endptr after the number. A negative zero
+ * has no integer form and stays the number -0.0. Returns -1
+ * without touching the outputs for anything else (exponents, hex, a
+ * trailing '.', inf/nan, too many digits), fpconv_strtod() decides
+ * those. */
+static inline int ckv_scan_number(const char *p, const char **endptr,
+                                  lua_Integer *integer, double *number)
+{
+    const char *start;
+    unsigned long long mantissa = 0;
+    int negative = 0, digits, fraction = 0;
+
+    if (*p == '-') {
+        negative = 1;
+        p++;
+    }
+
+    start = p;
+    while ('0' <= *p && *p <= '9')
+        mantissa = mantissa * 10 + (*p++ - '0');
+    digits = p - start;
+
+    if (digits == 0 || digits > 18)
+        return -1;
+
+    if (*p == '.') {
+        start = ++p;
+        while ('0' <= *p && *p <= '9')
+            mantissa = mantissa * 10 + (*p++ - '0');
+        fraction = p - start;
+        digits += fraction;
+        if (fraction == 0 || digits > 15)
+            return -1;
+    }
+
+    if ((*p | 0x20) == 'e' || (*p | 0x20) == 'x')
+        return -1;
+
+    *endptr = p;
+
+    if (fraction) {
+        *number = (double)mantissa / ckv_pow10[fraction];
+        if (negative)
+            *number = -*number;
+        return 0;
+    }
+
+    if (mantissa > (unsigned long long)CKV_INTEGER_MAX)
+        return -1;
+
+    if (negative && mantissa == 0) {
+        *number = -0.0;
+        return 0;
+    }
+
+    *integer = negative ? -(lua_Integer)mantissa : (lua_Integer)mantissa;
+
+    return 1;
+}
+
+/* ===== TOKENIZER =====
+ *
+ * The tokenizer of all three dialects. ckv_lex_token() takes the syntax
+ * as a constant mask of CKV_LEX_* flags, so each module's X_scan_token()
+ * inlines its own copy without the branches of the other dialects. */
+
+typedef enum {
+    T_OBJ_BEGIN,
+    T_OBJ_END,
+    T_ARR_BEGIN,
+    T_ARR_END,
+    T_STRING,
+    T_NUMBER,
+    T_INTEGER,
+    T_BOOLEAN,
+    T_NULL,
+    T_COLON,
+    T_COMMA,
+    T_REF,
+    T_COMMENT,
+    T_END,
+    T_WHITESPACE,
+    T_ERROR,
+    T_UNKNOWN,
+    CKV_TOKEN_TYPES
+} ckv_token_type_t;
+
+/* "T_OBJ_BEGIN", .. indexed by ckv_token_type_t */
+extern const char *ckv_token_type_name[];
+
+typedef struct {
+    ckv_token_type_t type;
+    int index;
+    union {
+        const char *string;
+        double number;
+        lua_Integer integer;
+        int boolean;
+    } value;
+    int string_len;
+} ckv_token_t;
+
+#define CKV_LEX_ESCAPES         0x01    /* JSON escapes, otherwise a run of
+                                         * backslashes reads as '/' */
+#define CKV_LEX_SLASH_COMMENTS  0x02    /* '/' comments run to the line end */
+#define CKV_LEX_XML_COMMENTS    0x04    /* <!-- --> comments */
+#define CKV_LEX_BARE_WORDS      0x08    /* Unquoted strings */
+#define CKV_LEX_NUMBERS         0x10
+#define CKV_LEX_REFS            0x20    /* '#' of #base lines */
+#define CKV_LEX_ARRAYS          0x40    /* '[', ']' and '=' */
+
+/* Set per call by the modules */
+#define CKV_LEX_INVALID_NUMBERS 0x100   /* decode_invalid_numbers */
+#define CKV_LEX_KEY             0x200   /* Bare words may start with a digit */
+
+#define CKV_LEX_KV  (CKV_LEX_ESCAPES | CKV_LEX_SLASH_COMMENTS | \
+                     CKV_LEX_NUMBERS | CKV_LEX_REFS)
+#define CKV_LEX_KV1 (CKV_LEX_XML_COMMENTS | CKV_LEX_BARE_WORDS | \
+                     CKV_LEX_NUMBERS | CKV_LEX_ARRAYS)
+#define CKV_LEX_KV3 (CKV_LEX_XML_COMMENTS | CKV_LEX_ARRAYS)
+
+/* Lookup tables of one dialect, kept in the module config */
+typedef struct {
+    ckv_token_type_t ch2token[256];
+    char escape2char[256];
+} ckv_lexer_t;
+
+void ckv_lexer_init(ckv_lexer_t *lexer, int syntax);
+
+/* Called with *ptr at a \u escape, appends its UTF-8 to tmp and moves
+ * *ptr past it (and past the low half of a surrogate pair). Returns 0,
+ * or -1 for an invalid escape with *ptr untouched */
+int ckv_append_unicode_escape(strbuf_t *tmp, const char **ptr);
+
+static inline void ckv_lex_error(ckv_token_t *token, const char *data,
+                                 const char *p, const char *errtype)
+{
+    token->type = T_ERROR;
+    token->index = p - data;
+    token->value.string = errtype;
+}
+
+/* What an error message says was found instead of the expected token */
+static inline const char *ckv_token_found(const ckv_token_t *token)
+{
+    if (token->type == T_ERROR)
+        return token->value.string;
+
+    return ckv_token_type_name[token->type];
+}
+
+/* Raises "Expected exp but found .." for token, offset is added to its
+ * position. Never returns, release the parser state first */
+void ckv_token_error(lua_State *l, const char *exp, const ckv_token_t *token,
+                     size_t offset);
+
+/* p is just after the opening quote. Strings without a backslash stay in
+ * the source, the others are decoded into tmp, which is sized to hold
+ * the whole source. Returns the position after the closing quote, or the
+ * error position */
+CKV_FORCE_INLINE const char *ckv_lex_string(const ckv_lexer_t *lexer,
+                                            const int syntax, const char *data,
+                                            const char *p, strbuf_t *tmp,
+                                            ckv_token_t *token)
+{
+    const char *start = p;
+    char ch;
+
+    p = ckv_scan_quoted(start);
+    if (*p == '"') {
+        token->type = T_STRING;
+        token->value.string = start;
+        token->string_len = p - start;
+        return p + 1;
+    }
+
+    /* Start with the backslash free prefix */
+    strbuf_reset(tmp);
+    strbuf_append_mem_unsafe(tmp, start, p - start);
+
+    while ((ch = *p) != '"') {
+        if (!ch) {
+            ckv_lex_error(token, data, p, "unexpected end of string");
+            return p;
+        }
+
+        if (ch == '\\' && (syntax & CKV_LEX_ESCAPES)) {
+            ch = lexer->escape2char[(unsigned char)p[1]];
+            if (ch == 'u') {
+                if (ckv_append_unicode_escape(tmp, &p) == 0)
+                    continue;
+                ckv_lex_error(token, data, p, "invalid unicode escape code");
+                return p;
+            }
+            if (!ch) {
+                ckv_lex_error(token, data, p, "invalid escape code");
+                return p;
+            }
+            p++;    /* Skip '\' */
+        } else if (ch == '\\') {
+            /* The character after the run is kept as it is */
+            while (*p == '\\')
+                p++;
+            ch = *p;
+            if (!ch) {
+                ckv_lex_error(token, data, p, "unexpected end of string");
+                return p;
+            }
+            strbuf_append_char_unsafe(tmp, '/');
+        }
+
+        strbuf_append_char_unsafe(tmp, ch);
+        p++;
+    }
+
+    strbuf_ensure_null(tmp);
+    token->type = T_STRING;
+    token->value.string = strbuf_string(tmp, &token->string_len);
+
+    return p + 1;
+}
+
+/* p is just after the opening quote. Returns the position after the
+ * closing quote, reading backslashes the way ckv_lex_string() does for
+ * syntax, or the NULL terminator of an unterminated string */
+static inline const char *ckv_skip_string(const char *p, const int syntax)
+{
+    while (1) {
+        p = ckv_scan_quoted(p);
+        if (*p == '"')
+            return p + 1;
+        if (*p == '\0')
+            return p;
+
+        if (syntax & CKV_LEX_ESCAPES) {
+            /* '\' and the character it escapes */
+            if (*++p == '\0')
+                return p;
+        } else {
+            /* A run of backslashes takes the next character, even a
+             * quote */
+            while (*p == '\\')
+                p++;
+            if (*p == '\0')
+                return p;
+        }
+        p++;
+    }
+}
+
+/* Returns the first character which ends (or escapes within) a bare
+ * word */
+static inline const char *ckv_scan_bare_word(const char *p)
+{
+    while (1) {
+        switch (*p) {
+        case ' ':
+        case '\t':
+        case '\r':
+        case '\n':
+        case '=':
+        case '\\':
+        case '\0':
+            return p;
+        }
+        p++;
+    }
+}
+
+/* Same decoding as the quoted strings of a dialect without escapes. A
+ * word has to end before the end of the source */
+static inline const char *ckv_lex_bare_word(const char *data, const char *p,
+                                            strbuf_t *tmp, ckv_token_t *token)
+{
+    const char *start = p;
+    char ch;
+
+    p = ckv_scan_bare_word(start);
+    ch = *p;
+    if (ch && ch != '\\') {
+        token->type = T_STRING;
+        token->value.string = start;
+        token->string_len = p - start;
+        return p;
+    }
+
+    strbuf_reset(tmp);
+    strbuf_append_mem_unsafe(tmp, start, p - start);
+
+    while (ch != ' ' && ch != '\t' && ch != '\r' && ch != '\n' && ch != '=') {
+        if (ch == '\\') {
+            while (*p == '\\')
+                p++;
+            ch = *p;
+            if (ch)
+                strbuf_append_char_unsafe(tmp, '/');
+        }
+        if (!ch) {
+            ckv_lex_error(token, data, p, "unexpected end of string");
+            return p;
+        }
+
+        strbuf_append_char_unsafe(tmp, ch);
+        ch = *++p;
+    }
+
+    strbuf_ensure_null(tmp);
+    token->type = T_STRING;
+    token->value.string = strbuf_string(tmp, &token->string_len);
+
+    return p;
+}
+
+/* KV numbers should take the following form:
+ *      -?(0|[1-9]|[1-9][0-9]+)(.[0-9]+)?([eE][-+]?[0-9]+)?
+ *
+ * ckv_lex_number() falls back to strtod() which allows other forms:
+ * - numbers starting with '+'
+ * - NaN, -NaN, infinity, -infinity
+ * - hexadecimal numbers
+ * - numbers with leading zeros
+ *
+ * ckv_is_invalid_number() detects "numbers" which may pass strtod()'s
+ * error checking, but should not be allowed with strict KV. It may pass
+ * numbers which cause strtod() to generate an error. */
+static inline int ckv_is_invalid_number(const char *p)
+{
+    /* Reject numbers starting with + */
+    if (*p == '+')
+        return 1;
+
+    /* Skip minus sign if it exists */
+    if (*p == '-')
+        p++;
+
+    /* Reject numbers starting with 0x, or leading zeros */
+    if (*p == '0') {
+        int ch2 = *(p + 1);
+
+        if ((ch2 | 0x20) == 'x' ||          /* Hex */
+            ('0' <= ch2 && ch2 <= '9'))     /* Leading zero */
+            return 1;
+
+        return 0;
+    } else if (*p <= '9') {
+        return 0;                           /* Ordinary number */
+    }
+
+    /* Reject inf/nan */
+    if (!strncasecmp(p, "inf", 3))
+        return 1;
+    if (!strncasecmp(p, "nan", 3))
+        return 1;
+
+    /* Pass all other numbers which may still be invalid, but
+     * strtod() will catch them. */
+    return 0;
+}
+
+static inline const char *ckv_lex_number(const char *data, const char *p,
+                                         ckv_token_t *token)
+{
+    const char *end;
+    char *endptr;
+
+    switch (ckv_scan_number(p, &end, &token->value.integer,
+                            &token->value.number)) {
+    case 1:
+        token->type = T_INTEGER;
+        return end;
+    case 0:
+        token->type = T_NUMBER;
+        return end;
+    }
+
+    token->type = T_NUMBER;
+    token->value.number = fpconv_strtod(p, &endptr);
+    if (endptr == p) {
+        ckv_lex_error(token, data, p, "invalid number");
+        return p;
+    }
+
+    return endptr;
+}
+
+/* Fills in the token at *ptr and moves *ptr past it. T_STRING may point
+ * into tmp, T_ERROR and T_END leave *ptr at the token. data is the start
+ * of the source, token->index is relative to it */
+CKV_FORCE_INLINE void ckv_lex_token(const ckv_lexer_t *lexer, const int syntax,
+                                    const char *data, const char **ptr,
+                                    strbuf_t *tmp, ckv_token_t *token)
+{
+    const char *p = *ptr;
+    int ch;
+
+    /* Eat whitespace and comments */
+    while (1) {
+        p = ckv_skip_whitespace(p);
+        ch = (unsigned char)*p;
+        token->type = lexer->ch2token[ch];
+
+        if ((syntax & CKV_LEX_SLASH_COMMENTS) && token->type == T_COMMENT) {
+            /* Stop at the line break, the next pass eats it */
+            p = ckv_scan_eol(p + 1);
+            continue;
+        }
+        if ((syntax & CKV_LEX_XML_COMMENTS) && ch == '<' &&
+            p[1] == '!' && p[2] == '-' && p[3] == '-') {
+            p = ckv_skip_comment_block(p + 4);
+            continue;
+        }
+        break;
+    }
+
+    /* Store location of new token. Required when throwing errors
+     * for unexpected tokens (syntax errors). */
+    token->index = p - data;
+    *ptr = p;
+
+    /* Don't advance the pointer for an error or the end */
+    if (token->type == T_ERROR) {
+        ckv_lex_error(token, data, p, "invalid token");
+        return;
+    }
+    if (token->type == T_END)
+        return;
+
+    if ((syntax & CKV_LEX_BARE_WORDS) &&
+        (((ch | 0x20) >= 'a' && (ch | 0x20) <= 'z') ||
+         ((syntax & CKV_LEX_KEY) && (ch == '-' || ('0' <= ch && ch <= '9'))))) {
+        *ptr = ckv_lex_bare_word(data, p, tmp, token);
+        return;
+    }
+
+    /* Found a known single character token */
+    if (token->type != T_UNKNOWN) {
+        *ptr = p + 1;
+        return;
+    }
+
+    if (ch == '"') {
+        *ptr = ckv_lex_string(lexer, syntax, data, p + 1, tmp, token);
+        return;
+    }
+
+    if (syntax & CKV_LEX_NUMBERS) {
+        if (ch == '-' || ('0' <= ch && ch <= '9')) {
+            if (!(syntax & CKV_LEX_INVALID_NUMBERS) && ckv_is_invalid_number(p))
+                ckv_lex_error(token, data, p, "invalid number");
+            else
+                *ptr = ckv_lex_number(data, p, token);
+            return;
+        }
+
+        /* With decode_invalid_numbers, only attempt numbers we know are
+         * invalid (Inf, NaN, hex) so other bad tokens still register as
+         * "invalid token" */
+        if ((syntax & CKV_LEX_INVALID_NUMBERS) && ckv_is_invalid_number(p)) {
+            *ptr = ckv_lex_number(data, p, token);
+            return;
+        }
+    }
+
+    ckv_lex_error(token, data, p, "invalid token");
+}
+
+/* ===== PARSER STACKS =====
+ *
+ * The decoders parse nested tables in a loop instead of recursing. The
+ * open tables stay on the Lua stack and each one has a frame holding the
+ * rest of its state. Frames start out in an array of the caller. Deeper
+ * documents move them to a userdata below the open tables, which
+ * luaL_error() releases along with the rest of the stack. */
+
+#define CKV_FRAMES_INLINE   32
+
+typedef struct {
+    char *frames;
+    size_t width;       /* Bytes per frame */
+    int size;           /* Frames that fit */
+    int count;          /* Frames in use */
+    int base;           /* Stack index the userdata goes to, below the
+                         * open tables */
+    int owner;          /* Stack index of the userdata holding the frames,
+                         * 0 while they are in the caller's array */
+} ckv_frames_t;
+
+/* size frames of width bytes at frames, for tables pushed from now on */
+void ckv_frames_init(lua_State *l, ckv_frames_t *stack, void *frames,
+                     int size, size_t width);
+
+/* Moves the frames to a userdata twice the size, needs a free stack slot */
+void ckv_frames_grow(lua_State *l, ckv_frames_t *stack);
+
+/* Removes the userdata (if any) from below the values left on the stack */
+void ckv_frames_free(lua_State *l, ckv_frames_t *stack);
+
+static inline void *ckv_frames_push(lua_State *l, ckv_frames_t *stack)
+{
+    if (stack->count == stack->size)
+        ckv_frames_grow(l, stack);
+
+    return stack->frames + stack->width * stack->count++;
+}
+
+/* The innermost frame */
+static inline void *ckv_frames_top(ckv_frames_t *stack)
+{
+    return stack->frames + stack->width * (stack->count - 1);
+}
+
+/* Drops the innermost frame, returns the one below it or NULL */
+static inline void *ckv_frames_pop(ckv_frames_t *stack)
+{
+    if (--stack->count == 0)
+        return NULL;
+
+    return stack->frames + stack->width * (stack->count - 1);
+}
+
+/* ===== TABLE PRE-SIZING =====
+ *
+ * With decode_presize on, a structural pass over the source records the
+ * shape of every '{' and '[' so the parse contexts can lua_createtable()
+ * with the final sizes instead of rehashing as keys are added. The
+ * shapes are only hints: containers the parser handles differently just
+ * get a wrong (or no) size. */
+
+typedef struct {
+    size_t offset;  /* Offset just past the opening '{' or '[' */
+    int values;     /* Keys, values and containers directly inside */
+    int commas;     /* Commas directly inside */
+    size_t end;     /* Offset just past the closing bracket (or the end) */
+} ckv_shape_t;
+
+typedef struct {
+    ckv_shape_t *shapes;    /* Sorted by offset */
+    int count;
+    int next;               /* Lookup cursor, the parser moves forward */
+} ckv_index_t;
+
+/* syntax is the lexer syntax of the dialect (CKV_LEX_KV, ...). Returns 0
+ * on success, -1 when out of memory */
+int ckv_index_build(ckv_index_t *index, const char *data, size_t len,
+                    int syntax);
+void ckv_index_free(ckv_index_t *index);
+
+/* Appends the shape of the container opened just before offset, with its
+ * end at offset. size is the room in index->shapes, which grows. Returns
+ * the position of the shape, or -1 when out of memory */
+int ckv_index_push(ckv_index_t *index, int *size, size_t offset);
+
+/* Binary search for the shape of the container opened just before
+ * offset, in any order. Returns NULL when there is none */
+const ckv_shape_t *ckv_index_lookup(const ckv_index_t *index, size_t offset);
+
+/* Returns the end of the container opened just before p (past its
+ * closing bracket), reading comments, strings and bare words the way the
+ * lexer does for syntax (CKV_LEX_KV, ...). Returns NULL when the NUL
+ * ending the source comes first */
+const char *ckv_skip_container(const char *p, int syntax);
+
+/* Returns the shape of the container opened just before offset, or NULL
+ * when there is no index (or no matching entry) */
+static inline const ckv_shape_t *ckv_index_find(ckv_index_t *index,
+                                                size_t offset)
+{
+    if (!index)
+        return NULL;
+
+    while (index->next < index->count &&
+           index->shapes[index->next].offset < offset)
+        index->next++;
+
+    if (index->next < index->count &&
+        index->shapes[index->next].offset == offset)
+        return &index->shapes[index->next++];
+
+    return NULL;
+}
+
+/* ===== KEY CACHE =====
+ *
+ * With decode_key_cache on, object keys are looked up in a direct mapped
+ * cache held in the module config before reaching lua_pushlstring().
+ * Each slot keeps its Lua string alive through a registry reference, so
+ * the bytes it points at stay valid and a hit is a memcmp() and a
+ * lua_rawgeti() instead of hashing and interning the key again. */
+
+#define CKV_KEY_CACHE_SIZE 512      /* Power of 2 */
+#define CKV_KEY_CACHE_MAXLEN 40     /* Lua's short string limit */
+
+typedef struct {
+    const char *str;    /* Bytes of the cached Lua string */
+    size_t len;
+    int ref;            /* Registry reference, LUA_NOREF when empty */
+} ckv_key_slot_t;
+
+typedef struct {
+    ckv_key_slot_t slots[CKV_KEY_CACHE_SIZE];
+} ckv_key_cache_t;
+
+void ckv_key_cache_init(ckv_key_cache_t *cache);
+void ckv_key_cache_clear(lua_State *l, ckv_key_cache_t *cache);
+
+/* Pushes the string str, reusing the cached copy when there is one */
+void ckv_key_cache_push(lua_State *l, ckv_key_cache_t *cache,
+                        const char *str, size_t len);
+
+/* ===== SOURCE BUFFERS =====
+ *
+ * decode() takes its text as a string, as a lightuserdata and a size, or
+ * as a full userdata with an optional size (its whole block by default).
+ * The parsers stop at a NUL byte, so a buffer whose last byte is one
+ * (counted in the size) is parsed in place. Any other buffer is copied
+ * once into a NUL terminated userdata, which is still cheaper than
+ * interning it as a Lua string. */
+
+/* Checks the arguments and leaves the stack holding only the value that
+ * owns the returned bytes, so it stays alive through the decode */
+const char *ckv_check_source(lua_State *l, size_t *len);
+
+/* ===== QUERIES =====
+ *
+ * query(data, path) walks the source without building tables for what
+ * it skips. A path is a "a.b.c" string or an array of keys. */
+
+/* Pushes the keys of the path at idx as an array, returns their count */
+int ckv_query_path(lua_State *l, int idx);
+
+/* Key k of the path array at path, NULL when it isn't a string. The
+ * bytes stay valid while the path is on the stack */
+const char *ckv_query_key(lua_State *l, int path, int k, size_t *len);
+
+/* Replaces the value on top of the stack with value[k1][k2].. for keys
+ * from..count of the path array at path, or nil once a step isn't a
+ * table. A string key made of digits also finds the array item. */
+void ckv_query_tail(lua_State *l, int path, int from, int count);
+
+/* ===== ARENA =====
+ *
+ * Bump allocator for data freed all at once, such as the parse trees
+ * built off the Lua thread. */
+
+typedef struct ckv_arena_block ckv_arena_block_t;
+
+typedef struct {
+    ckv_arena_block_t *head;
+    char *ptr;          /* Free space in the head block */
+    size_t left;
+} ckv_arena_t;
+
+void ckv_arena_init(ckv_arena_t *arena);
+/* Returns NULL when out of memory */
+void *ckv_arena_alloc(ckv_arena_t *arena, size_t size);
+void ckv_arena_free(ckv_arena_t *arena);
+
+/* ===== SCRATCH =====
+ *
+ * The temporary string buffer of a decode comes from its config and goes
+ * back there afterwards, so repeated decodes reuse one allocation instead
+ * of a malloc() sized from the input each time. A #base chain takes one
+ * buffer per file; once every buffer is taken (or from a worker thread)
+ * ckv_scratch_get() falls back to a private strbuf_new(). */
+
+#define CKV_SCRATCH_BUFFERS 8
+
+typedef struct {
+    strbuf_t bufs[CKV_SCRATCH_BUFFERS];
+    char used[CKV_SCRATCH_BUFFERS];
+} ckv_scratch_t;
+
+void ckv_scratch_init(ckv_scratch_t *scratch);
+
+/* Returns an empty buffer holding at least len bytes */
+strbuf_t *ckv_scratch_get(ckv_scratch_t *scratch, size_t len);
+
+/* Hands buf back. Buffers larger than keep bytes are freed rather than
+ * kept for the next decode */
+void ckv_scratch_put(ckv_scratch_t *scratch, strbuf_t *buf, int keep);
+
+void ckv_scratch_free(ckv_scratch_t *scratch);
+
+/* ===== THREADS ===== */
+
+/* Online CPUs, at least 1 */
+int ckv_cpu_count(void);
+
+/* Calls job(ctx, i) for every i in [0, jobs) on up to threads threads,
+ * the calling thread included. Returns once all jobs are done. Jobs must
+ * not touch a lua_State. */
+void ckv_parallel_for(int jobs, int threads, void (*job)(void *ctx, int i),
+                      void *ctx);
+
+/* Thread count of the { threads = N } option table at arg, defaulting to
+ * ckv_cpu_count() when arg is none or nil or has no threads field */
+int ckv_threads_option(lua_State *l, int arg);
+
+/* ===== BINARY CACHE =====
+ *
+ * encode_binary() serialises a decoded tree so it loads again without
+ * tokenising the text. Integers are LEB128 varints:
+ *
+ *      "CKVB" version
+ *      count, count x (length, bytes)          string table
+ *      value
+ *
+ * A value is a tag byte and its payload. Tables carry their array and
+ * record counts for lua_createtable(), then the array values and the
+ * record key/value pairs. Strings up to CKV_KEY_CACHE_MAXLEN bytes, keys
+ * and values alike, are stored once in the string table. */
+
+#define CKV_BINARY_VERSION 1
+
+/* Pushes the binary form of the value at idx. Tables nested deeper than
+ * max_depth (or cyclic), and values other than tables, strings, numbers,
+ * booleans and the NULL lightuserdata raise an error */
+void ckv_binary_encode(lua_State *l, int idx, int max_depth);
+
+/* Pushes the value held in data. Returns 0, or -1 with nothing pushed
+ * when data isn't valid binary KV */
+int ckv_binary_decode(lua_State *l, const char *data, size_t len,
+                      int max_depth);
+
+/* decode_file_cached() keeps binary KV next to the text in path.ckvb,
+ * headed by the stamps of every file it was decoded from. dialect keeps
+ * the modules from reading each other's caches. */
+#define CKV_CACHE_SUFFIX ".ckvb"
+#define CKV_DIALECT_KV      0
+#define CKV_DIALECT_KV1     1
+#define CKV_DIALECT_KV3     3
+
+/* Pushes the cached value and returns 1 while every stamp still matches,
+ * otherwise returns 0 with nothing pushed */
+int ckv_cache_load(lua_State *l, const char *path, int dialect,
+                   int max_depth);
+
+/* Caches the value at idx for path. sources is the stack index of an
+ * array of other files the value was read from, or 0. Failures are
+ * ignored, the text stays the source of truth */
+void ckv_cache_store(lua_State *l, const char *path, int idx, int sources,
+                     int dialect, int max_depth);
+
+/* ===== STREAMED ENCODING =====
+ *
+ * encode_to() and encode_to_file() hand the text on in chunks of about
+ * CKV_SINK_CHUNK bytes while the encoder runs, instead of returning it as
+ * one string. The sink is a userdata on the Lua stack, so its buffer and
+ * file are released by __gc when an error unwinds the encode. */
+
+#define CKV_SINK_CHUNK (64 * 1024)
+
+typedef struct {
+    strbuf_t buf;
+    int writer;         /* Stack index of the writer function, or 0 */
+    FILE *file;         /* Open on tmp until ckv_sink_close() */
+    char tmp[CKV_PATH_MAX + 8];
+    char path[CKV_PATH_MAX];
+    size_t written;
+} ckv_sink_t;
+
+/* Pushes a sink calling the function at stack index writer with each
+ * chunk */
+ckv_sink_t *ckv_sink_writer(lua_State *l, int writer);
+
+/* Pushes a sink writing to path. The text goes to path.tmp first and
+ * replaces path only once the encode has finished */
+ckv_sink_t *ckv_sink_file(lua_State *l, const char *path);
+
+/* Passes the buffered text on and empties the buffer */
+void ckv_sink_flush(lua_State *l, ckv_sink_t *sink);
+
+/* Flushes the rest and moves the file in place. Returns the bytes
+ * written in total */
+size_t ckv_sink_close(lua_State *l, ckv_sink_t *sink);
+
+/* Called by the encoders between values. *sink is the sink of the
+ * running encode, NULL for a plain encode; it is put back after the
+ * flush as the writer may have encoded something else meanwhile */
+static inline void ckv_sink_check(lua_State *l, ckv_sink_t **sink,
+                                  strbuf_t *buf)
+{
+    ckv_sink_t *current = *sink;
+
+    if (current && strbuf_length(buf) >= CKV_SINK_CHUNK) {
+        ckv_sink_flush(l, current);
+        *sink = current;
+    }
+}
+
+/* ===== PARALLEL ENCODING =====
+ *
+ * Given { threads = N }, ckv1.encode_array() and ckv3.encode() first copy
+ * the table into a tree of ckv_snap_node_t on the Lua thread, raising
+ * every error the plain encode would. ckv_snap_encode() then formats the
+ * tree without the lua_State: it cuts the tree into runs of sibling items
+ * of about even size, formats the rest of the tree (the skeleton) leaving
+ * a hole where each run goes, formats the runs into buffers of their own
+ * on ckv_parallel_for() and joins the pieces in order. Strings point into
+ * the Lua strings, which the table keeps alive until the encode returns. */
+
+#define CKV_SNAP_JOBS_PER_THREAD 8
+
+/* Smaller runs stay in the skeleton. FuzzKV lowers it so that small
+ * inputs are cut into jobs too */
+#ifndef CKV_SNAP_MIN_JOB
+#define CKV_SNAP_MIN_JOB 4096
+#endif
+
+typedef enum {
+    CKV_SNAP_NULL,
+    CKV_SNAP_BOOLEAN,
+    CKV_SNAP_NUMBER,
+    CKV_SNAP_STRING,
+    CKV_SNAP_TABLE,
+    CKV_SNAP_PACKED         /* ckv3 packed array */
+} ckv_snap_type_t;
+
+typedef struct ckv_snap_node ckv_snap_node_t;
+
+/* Tables hold a list of items. An item is a value, with the key it is
+ * written after when the table has any */
+struct ckv_snap_node {
+    ckv_snap_type_t type;
+    int flags;              /* Left to the module */
+    size_t count;           /* Tables: number of items */
+    size_t weight;          /* Rough length of the text, key included */
+    size_t run;             /* Items of the job starting here, or 0 */
+    ckv_snap_node_t *child; /* Tables: first item */
+    ckv_snap_node_t *next;  /* Next item */
+    ckv_snap_node_t *key;
+    size_t string_len;
+    union {
+        const char *string;
+        double number;
+        int boolean;
+        const void *packed;
+    } value;
+};
+
+typedef struct ckv_snap ckv_snap_t;
+
+/* Formats one item of a table depth levels deep, flags tells the module
+ * what kind of table. Runs on the worker threads too, so it must not
+ * touch a lua_State */
+typedef void (*ckv_snap_format_t)(ckv_snap_t *snap, strbuf_t *buf,
+                                  const ckv_snap_node_t *item, int depth,
+                                  int flags);
+
+typedef struct {
+    const ckv_snap_node_t *item;   /* First item of the run */
+    size_t count;
+    int depth;
+    int flags;
+    size_t offset;          /* Where the text goes in the skeleton */
+    strbuf_t buf;
+} ckv_snap_job_t;
+
+struct ckv_snap {
+    ckv_arena_t arena;
+    ckv_snap_format_t format;
+    const void *cfg;        /* Module config, only read while formatting */
+    int anchors;            /* Stack index of the converted strings */
+    int anchor_count;
+    ckv_snap_job_t *jobs;   /* In the order of the text */
+    int job_count;
+    int job_size;
+    int skeleton;           /* Set while the skeleton is formatted */
+};
+
+/* Pushes an empty snapshot, released by __gc when the encode fails, and
+ * the table anchoring the strings converted by ckv_snap_tostring() */
+ckv_snap_t *ckv_snap_new(lua_State *l, ckv_snap_format_t format,
+                         const void *cfg);
+
+/* Frees the tree, the snapshot can't be used afterwards */
+void ckv_snap_free(ckv_snap_t *snap);
+
+/* Returns a zeroed node weighing 1, raises an error when out of memory */
+ckv_snap_node_t *ckv_snap_node(lua_State *l, ckv_snap_t *snap,
+                               ckv_snap_type_t type);
+
+/* lua_tolstring() of the value at idx without converting it in place.
+ * Numbers are converted to strings kept alive by the snapshot, values
+ * without a string form give "" */
+const char *ckv_snap_tostring(lua_State *l, ckv_snap_t *snap, int idx,
+                              size_t *len);
+
+/* Appends item (and its key, or NULL) to table after last (NULL for the
+ * first item) and returns it for the next call. Items are added once
+ * complete, so their weight counts towards the table */
+static inline ckv_snap_node_t *ckv_snap_add(ckv_snap_node_t *table,
+                                            ckv_snap_node_t *last,
+                                            ckv_snap_node_t *key,
+                                            ckv_snap_node_t *item)
+{
+    if (last)
+        last->next = item;
+    else
+        table->child = item;
+    if (key) {
+        item->key = key;
+        item->weight += key->weight;
+    }
+    table->count++;
+    table->weight += item->weight;
+
+    return item;
+}
+
+/* Formats the items of root into buf on up to threads threads */
+void ckv_snap_encode(ckv_snap_t *snap, ckv_snap_node_t *root, int depth,
+                     int flags, int threads, strbuf_t *buf);
+
+int ckv_snap_defer_job(ckv_snap_t *snap, strbuf_t *buf,
+                       const ckv_snap_node_t **item, int depth, int flags);
+
+/* Called by the formatter before each item of a table. Returns 1 when a
+ * job formats the run of items starting at *item, whose text goes where
+ * buf ends now, and moves *item to the last item of the run */
+static inline int ckv_snap_defer(ckv_snap_t *snap, strbuf_t *buf,
+                                 const ckv_snap_node_t **item, int depth,
+                                 int flags)
+{
+    return (*item)->run && snap->skeleton &&
+           ckv_snap_defer_job(snap, buf, item, depth, flags);
+}
+
+/* ===== STATS =====
+ *
+ * Counters behind X.stats(), collected by the decoders when the modules
+ * are built with -DCKV_STATS. Otherwise CKV_STAT() expands to nothing,
+ * the decoders never touch the counters and stats() returns nil. */
+
+#ifdef CKV_STATS
+#define CKV_STAT(stmt) do { stmt; } while (0)
+#else
+#define CKV_STAT(stmt) ((void)0)
+#endif
+
+#define CKV_STATS_TOKENS CKV_TOKEN_TYPES
+
+typedef struct {
+    double decodes;         /* Decoded strings and files, #base included */
+    double bytes;           /* Source bytes handed to the tokeniser */
+    double tokens[CKV_STATS_TOKENS];
+    double tables;
+    double strings;         /* Keys and string values pushed */
+    int max_depth;
+    double reallocs;        /* Of the temporary string buffer */
+    double files;           /* Files opened by ckv_decode_file() */
+    double read_time;       /* Seconds spent opening (mapping) them */
+    double parse_time;      /* Seconds spent parsing them */
+    double includes;        /* #base lines followed */
+    double include_hits;    /* Of those, served by decode_base_cache */
+} ckv_stats_t;
+
+/* Seconds from an arbitrary start, for differences only */
+double ckv_stats_clock(void);
+
+/* Counts a table entered at depth */
+static inline void ckv_stats_table(ckv_stats_t *stats, int depth)
+{
+    stats->tables++;
+    if (depth > stats->max_depth)
+        stats->max_depth = depth;
+}
+
+void ckv_stats_merge(ckv_stats_t *to, const ckv_stats_t *from);
+
+/* Pushes the counters as a table, tokens keyed by ckv_token_type_name */
+void ckv_stats_push(lua_State *l, const ckv_stats_t *stats);
+
 #ifdef __DEBUG_KV__
 #define Print_Stack printLuaStack(l)
 #define LuaPrint(format, ...) printf(format, ##__VA_ARGS__); fflush(stdout);
@@ -91,10 +1468,3 @@ void printLuaStack(lua_State* l);
 #endif
 
 #endif
-
-#define MAX_TAB 64
-char* tabCache[MAX_TAB];
-
-void InitTabCache();
-
-#define APPEND_TAB_UNSAFE(buf, cnt) for(int tabx = 0; tabx < cnt; tabx++) strbuf_append_char_unsafe(buf, '\t');
\ No newline at end of file
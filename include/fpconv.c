@@ -62,7 +62,10 @@ static void fpconv_update_locale()
         abort();
     }
 
-    locale_decimal_point = buf[1];
+    /* Every lua_State opening a module gets here, only write when the
+     * locale really changed so concurrent opens just read it */
+    if (locale_decimal_point != buf[1])
+        locale_decimal_point = buf[1];
 }
 
 /* Check for a valid number character: [-+0-9a-yA-Y.]
@@ -8,44 +8,8 @@
 #define CKV_VERSION   "1.0.0"
 #endif
 
-typedef enum {
-    T_OBJ_BEGIN,
-    T_OBJ_END,
-    T_STRING,
-    T_NUMBER,
-    T_BOOLEAN,
-    T_NULL,
-    T_COLON,
-    T_COMMA,
-    T_REF,
-    T_COMMENT,
-    T_END,
-    T_WHITESPACE,
-    T_ERROR,
-    T_UNKNOWN
-} ckv_token_type_t;
-
-static const char *ckv_token_type_name[] = {
-    "T_OBJ_BEGIN",
-    "T_OBJ_END",
-    "T_STRING",
-    "T_NUMBER",
-    "T_BOOLEAN",
-    "T_NULL",
-    "T_COLON",
-    "T_COMMA",
-    "T_REF",
-    "T_COMMENT",
-    "T_END",
-    "T_WHITESPACE",
-    "T_ERROR",
-    "T_UNKNOWN",
-    NULL
-};
-
 typedef struct {
-    ckv_token_type_t ch2token[256];
-    char escape2char[256];  /* Decoding */
+    ckv_lexer_t lexer;      /* Decoding */
 
     /* encode_buf is only allocated and used when
      * encode_keep_buffer is set */
@@ -58,30 +22,55 @@ typedef struct {
     int encode_invalid_numbers;     /* 2 => Encode as "null" */
     int encode_number_precision;
     int encode_keep_buffer;
+    int encode_compact;     /* No indentation */
+    int encode_sort_keys;
+    size_t encode_size_hint;    /* Output length of the last encode */
+    int encode_reallocs;    /* Buffer growths over every encode */
+    ckv_sink_t *encode_sink;    /* Sink of the running encode_to, or NULL */
 
     int decode_invalid_numbers;
     int decode_max_depth;
+    int decode_presize;
+    int decode_key_cache;
+    ckv_key_cache_t key_cache;  /* Only used when decode_key_cache is set */
+    ckv_scratch_t scratch;      /* Temporary strings of the decoders */
+    int decode_scratch_limit;   /* Largest scratch buffer kept */
+    ckv_stats_t stats;          /* Only counted with CKV_STATS */
+    int decode_base_cache;
+    int decode_base_cache_limit;    /* Most #base files kept */
+    int base_cache;     /* Registry ref of { path = { table, mtime, size, deps } } */
+    int base_cache_count;
+    int reload_hashes;  /* Registry ref of { table = content hash }, weak keys */
+    int doc_meta;       /* Registry ref of the document metatable */
     int keepln;
 } ckv_config_t;
 
+typedef struct ckv_include ckv_include_t;
+
 typedef struct {
     const char *data;
     const char *ptr;
     strbuf_t *tmp;    /* Temporary storage for strings */
+    ckv_file_t *file; /* Source file of ckv_decode_file, NULL otherwise */
+    ckv_index_t *index; /* Table shapes when decode_presize is on */
+    ckv_include_t *include; /* #base chain of ckv_decode_file, NULL otherwise */
     ckv_config_t *cfg;
+    ckv_stats_t *stats; /* Set under CKV_STATS only */
     int current_depth;
 } ckv_parse_t;
 
-typedef struct {
-    ckv_token_type_t type;
-    int index;
-    union {
-        const char *string;
-        double number;
-        int boolean;
-    } value;
-    int string_len;
-} ckv_token_t;
+/* One file of a #base chain, linked up to the file given to
+ * decode_file_array */
+struct ckv_include {
+    char path[CKV_PATH_MAX];    /* Resolved path */
+    ckv_parse_t *ckv;           /* NULL until the file is being parsed */
+    ckv_include_t *parent;      /* File with the #base line */
+    int sources;                /* Stack index of the array collecting
+                                 * every #base path, or 0 */
+    int deps;                   /* Stack index of the path, mtime, size
+                                 * list of every #base below a file going
+                                 * into the base cache, or 0 */
+};
 
 
 /* ===== CONFIGURATION ===== */
@@ -238,13 +227,137 @@ static int ckv_cfg_decode_invalid_numbers(lua_State *l)
     return 1;
 }
 
+/* Configures whether encoders indent nested tables */
+static int ckv_cfg_encode_compact(lua_State *l)
+{
+    ckv_config_t *cfg = ckv_arg_init(l, 1);
+
+    return ckv_enum_option(l, 1, &cfg->encode_compact, NULL, 1);
+}
+
+/* Configures whether objects are encoded in sorted key order */
+static int ckv_cfg_encode_sort_keys(lua_State *l)
+{
+    ckv_config_t *cfg = ckv_arg_init(l, 1);
+
+    return ckv_enum_option(l, 1, &cfg->encode_sort_keys, NULL, 1);
+}
+
+/* Returns { reallocs, length, size }: how often the encode buffer had to
+ * grow over every encode so far, the output length of the last encode and
+ * the size of the kept buffer (0 when encode_keep_buffer is off) */
+static int ckv_encode_buffer_stats(lua_State *l)
+{
+    ckv_config_t *cfg = ckv_arg_init(l, 0);
+
+    lua_createtable(l, 0, 3);
+    lua_pushinteger(l, cfg->encode_reallocs);
+    lua_setfield(l, -2, "reallocs");
+    lua_pushinteger(l, (lua_Integer)cfg->encode_size_hint);
+    lua_setfield(l, -2, "length");
+    lua_pushinteger(l, cfg->encode_keep_buffer ? cfg->encode_buf.size : 0);
+    lua_setfield(l, -2, "size");
+
+    return 1;
+}
+
+/* Returns the parser counters (see ckv_stats_t), nil unless built with
+ * CKV_STATS. stats(true) also resets them */
+static int ckv_stats(lua_State *l)
+{
+    ckv_config_t *cfg = ckv_arg_init(l, 1);
+
+#ifdef CKV_STATS
+    ckv_stats_push(l, &cfg->stats);
+    if (lua_toboolean(l, 1))
+        memset(&cfg->stats, 0, sizeof(cfg->stats));
+#else
+    (void)cfg;
+    lua_pushnil(l);
+#endif
+
+    return 1;
+}
+
+/* Configures the structural pass used to pre-size decoded tables */
+static int ckv_cfg_decode_presize(lua_State *l)
+{
+    ckv_config_t *cfg = ckv_arg_init(l, 1);
+
+    return ckv_enum_option(l, 1, &cfg->decode_presize, NULL, 1);
+}
+
+/* Configures the largest temporary decode buffer kept between calls */
+static int ckv_cfg_decode_scratch_limit(lua_State *l)
+{
+    ckv_config_t *cfg = ckv_arg_init(l, 1);
+
+    return ckv_integer_option(l, 1, &cfg->decode_scratch_limit, 0, INT_MAX);
+}
+
+/* Configures reuse of object key strings across decode calls */
+static int ckv_cfg_decode_key_cache(lua_State *l)
+{
+    ckv_config_t *cfg = ckv_arg_init(l, 1);
+
+    ckv_enum_option(l, 1, &cfg->decode_key_cache, NULL, 1);
+
+    /* Drop the cached strings once the cache is switched off */
+    if (!cfg->decode_key_cache)
+        ckv_key_cache_clear(l, &cfg->key_cache);
+
+    return 1;
+}
+
+/* Configures reuse of #base tables while their file is unchanged */
+static int ckv_cfg_decode_base_cache(lua_State *l)
+{
+    ckv_config_t *cfg = ckv_arg_init(l, 1);
+
+    ckv_enum_option(l, 1, &cfg->decode_base_cache, NULL, 1);
+
+    /* Drop the cached tables once the cache is switched off */
+    if (!cfg->decode_base_cache) {
+        luaL_unref(l, LUA_REGISTRYINDEX, cfg->base_cache);
+        cfg->base_cache = LUA_NOREF;
+        cfg->base_cache_count = 0;
+    }
+
+    return 1;
+}
+
+/* Configures the number of #base files the base cache holds before it
+ * starts over empty */
+static int ckv_cfg_decode_base_cache_limit(lua_State *l)
+{
+    ckv_config_t *cfg = ckv_arg_init(l, 1);
+    int ret = ckv_integer_option(l, 1, &cfg->decode_base_cache_limit, 0, INT_MAX);
+
+    if (cfg->base_cache_count > cfg->decode_base_cache_limit) {
+        luaL_unref(l, LUA_REGISTRYINDEX, cfg->base_cache);
+        cfg->base_cache = LUA_NOREF;
+        cfg->base_cache_count = 0;
+    }
+
+    return ret;
+}
+
 static int ckv_destroy_config(lua_State *l)
 {
     ckv_config_t *cfg;
 
     cfg = (ckv_config_t *)lua_touserdata(l, 1);
-    if (cfg)
+    if (cfg) {
         strbuf_free(&cfg->encode_buf);
+        ckv_key_cache_clear(l, &cfg->key_cache);
+        ckv_scratch_free(&cfg->scratch);
+        luaL_unref(l, LUA_REGISTRYINDEX, cfg->base_cache);
+        cfg->base_cache = LUA_NOREF;
+        luaL_unref(l, LUA_REGISTRYINDEX, cfg->reload_hashes);
+        cfg->reload_hashes = LUA_NOREF;
+        luaL_unref(l, LUA_REGISTRYINDEX, cfg->doc_meta);
+        cfg->doc_meta = LUA_NOREF;
+    }
     cfg = NULL;
 
     return 0;
@@ -253,7 +366,6 @@ static int ckv_destroy_config(lua_State *l)
 static void ckv_create_config(lua_State *l)
 {
     ckv_config_t *cfg;
-    int i;
 
     cfg = (ckv_config_t *)lua_newuserdata(l, sizeof(*cfg));
 
@@ -270,7 +382,24 @@ static void ckv_create_config(lua_State *l)
     cfg->decode_max_depth = DEFAULT_DECODE_MAX_DEPTH;
     cfg->encode_invalid_numbers = DEFAULT_ENCODE_INVALID_NUMBERS;
     cfg->decode_invalid_numbers = DEFAULT_DECODE_INVALID_NUMBERS;
+    cfg->decode_presize = DEFAULT_DECODE_PRESIZE;
+    cfg->decode_key_cache = DEFAULT_DECODE_KEY_CACHE;
+    ckv_key_cache_init(&cfg->key_cache);
+    ckv_scratch_init(&cfg->scratch);
+    memset(&cfg->stats, 0, sizeof(cfg->stats));
+    cfg->decode_scratch_limit = DEFAULT_DECODE_SCRATCH_LIMIT;
+    cfg->decode_base_cache = DEFAULT_DECODE_BASE_CACHE;
+    cfg->decode_base_cache_limit = DEFAULT_DECODE_BASE_CACHE_LIMIT;
+    cfg->base_cache = LUA_NOREF;
+    cfg->base_cache_count = 0;
+    cfg->reload_hashes = LUA_NOREF;
+    cfg->doc_meta = LUA_NOREF;
     cfg->encode_keep_buffer = DEFAULT_ENCODE_KEEP_BUFFER;
+    cfg->encode_compact = DEFAULT_ENCODE_COMPACT;
+    cfg->encode_sort_keys = DEFAULT_ENCODE_SORT_KEYS;
+    cfg->encode_size_hint = 0;
+    cfg->encode_reallocs = 0;
+    cfg->encode_sink = NULL;
     cfg->encode_number_precision = DEFAULT_ENCODE_NUMBER_PRECISION;
     cfg->keepln = DEFAULT_ENCODE_KEEPLN;
 
@@ -280,47 +409,7 @@ static void ckv_create_config(lua_State *l)
 
     /* Decoding init */
 
-    /* Tag all characters as an error */
-    for (i = 0; i < 256; i++)
-        cfg->ch2token[i] = T_ERROR;
-
-    /* Set tokens that require no further processing */
-    cfg->ch2token['{'] = T_OBJ_BEGIN;
-    cfg->ch2token['}'] = T_OBJ_END;
-    cfg->ch2token[','] = T_COMMA;
-    //cfg->ch2token[':'] = T_COLON;
-    cfg->ch2token['\0'] = T_END;
-    cfg->ch2token['#'] = T_REF;
-    cfg->ch2token[' '] = T_WHITESPACE;
-    cfg->ch2token['\t'] = T_WHITESPACE;
-    cfg->ch2token['\n'] = T_WHITESPACE;
-    cfg->ch2token['\r'] = T_WHITESPACE;
-    cfg->ch2token['/'] = T_COMMENT;
-    /* Update characters that require further processing */
-    cfg->ch2token['f'] = T_UNKNOWN;     /* false? */
-    cfg->ch2token['i'] = T_UNKNOWN;     /* inf, ininity? */
-    cfg->ch2token['I'] = T_UNKNOWN;
-    cfg->ch2token['n'] = T_UNKNOWN;     /* null, nan? */
-    cfg->ch2token['N'] = T_UNKNOWN;
-    cfg->ch2token['t'] = T_UNKNOWN;     /* true? */
-    cfg->ch2token['"'] = T_UNKNOWN;     /* string? */
-    cfg->ch2token['+'] = T_UNKNOWN;     /* number? */
-    cfg->ch2token['-'] = T_UNKNOWN;
-    for (i = 0; i < 10; i++)
-        cfg->ch2token['0' + i] = T_UNKNOWN;
-
-    /* Lookup table for parsing escape characters */
-    for (i = 0; i < 256; i++)
-        cfg->escape2char[i] = 0;          /* String error */
-    cfg->escape2char['"'] = '"';
-    cfg->escape2char['\\'] = '\\';
-    cfg->escape2char['/'] = '/';
-    cfg->escape2char['b'] = '\b';
-    cfg->escape2char['t'] = '\t';
-    cfg->escape2char['n'] = '\n';
-    cfg->escape2char['f'] = '\f';
-    cfg->escape2char['r'] = '\r';
-    cfg->escape2char['u'] = 'u';          /* Unicode parsing required */
+    ckv_lexer_init(&cfg->lexer, CKV_LEX_KV);
 }
 
 /* ===== ENCODING ===== */
@@ -334,6 +423,50 @@ static void ckv_encode_exception(lua_State *l, ckv_config_t *cfg, strbuf_t *ckv,
                   lua_typename(l, lua_type(l, lindex)), reason);
 }
 
+/* Returns the buffer an encode call writes to. A private buffer starts at
+ * the length of the previous output, so encoding documents of a similar
+ * size does not grow it step by step */
+static strbuf_t *ckv_encode_buffer(ckv_config_t *cfg, strbuf_t *local)
+{
+    size_t size;
+
+    cfg->encode_sink = NULL;
+
+    if (!cfg->encode_keep_buffer) {
+        /* Headroom for the worst case reservations of the appenders, as
+         * far as a strbuf can hold */
+        size = cfg->encode_size_hint + cfg->encode_size_hint / 8 +
+               STRBUF_DEFAULT_SIZE;
+        strbuf_init(local, size < INT_MAX ? (int)size : INT_MAX);
+        return local;
+    }
+
+    /* Reuse existing buffer */
+    strbuf_reset(&cfg->encode_buf);
+    cfg->encode_buf.reallocs = 0;
+
+    return &cfg->encode_buf;
+}
+
+/* Records the size and growth of a finished encode and frees a private
+ * buffer */
+static void ckv_encode_buffer_done(ckv_config_t *cfg, strbuf_t *encode_buf)
+{
+    cfg->encode_size_hint = strbuf_length(encode_buf);
+    cfg->encode_reallocs += encode_buf->reallocs;
+
+    if (!cfg->encode_keep_buffer)
+        strbuf_free(encode_buf);
+}
+
+/* Appends the indentation of a line depth levels deep */
+static inline void ckv_append_indent(ckv_config_t *cfg, strbuf_t *buf,
+                                     int depth)
+{
+    if (!cfg->encode_compact)
+        ckv_append_tabs(buf, depth);
+}
+
 /* ckv_append_string args:
  * - lua_State
  * - ckv strbuf
@@ -342,27 +475,11 @@ static void ckv_encode_exception(lua_State *l, ckv_config_t *cfg, strbuf_t *ckv,
  * Returns nothing. Doesn't remove string from Lua stack */
 static void ckv_append_string(lua_State *l, strbuf_t *ckv, int lindex)
 {
-    const char *escstr;
     const char *str;
     size_t len;
-    size_t i;
 
     str = lua_tolstring(l, lindex, &len);
-    /* Worst case is len * 6 (all unicode escapes).
-     * This buffer is reused constantly for small strings
-     * If there are any excess pages, they won't be hit anyway.
-     * This gains ~5% speedup. */
-    strbuf_ensure_empty_length(ckv, len * 6 + 2);
-
-    strbuf_append_char_unsafe(ckv, '\"');
-    for (i = 0; i < len; i++) {
-        escstr = char2escape[(unsigned char)str[i]];
-        if (escstr)
-            strbuf_append_string(ckv, escstr);
-        else
-            strbuf_append_char_unsafe(ckv, str[i]);
-    }
-    strbuf_append_char_unsafe(ckv, '\"');
+    ckv_append_escaped(ckv, str, len, 1);
 }
 
 
@@ -478,13 +595,11 @@ static void ckv_append_data2(lua_State *l, ckv_config_t *cfg,
 static void ckv_append_object(lua_State *l, ckv_config_t *cfg,
                                int current_depth, strbuf_t *ckv)
 {
+    ckv_iter_t it;
     if (cfg->keepln)
     {
         strbuf_append_char(ckv, '\n');
-        for (int i = 0; i < current_depth - 1; i++)
-        {
-            strbuf_append_char(ckv, '\t');
-        }
+        ckv_append_indent(cfg, ckv, current_depth - 1);
     }
 
     strbuf_append_char(ckv, '{');
@@ -493,15 +608,12 @@ static void ckv_append_object(lua_State *l, ckv_config_t *cfg,
         strbuf_append_char(ckv, '\n');
     }
 
-    lua_pushnil(l);
-    while (lua_next(l, -2) != 0) 
+    ckv_iter_begin(l, &it, cfg->encode_sort_keys);
+    while (ckv_iter_next(l, &it)) 
     {
         if (cfg->keepln)
         {
-            for (int i = 0; i < current_depth; i++)
-            {
-                strbuf_append_char(ckv, '\t');
-            }
+            ckv_append_indent(cfg, ckv, current_depth);
         }
         
         ckv_append_string(l, ckv, -2);
@@ -519,10 +631,7 @@ static void ckv_append_object(lua_State *l, ckv_config_t *cfg,
 
     if (cfg->keepln)
     {
-        for (int i = 0; i < current_depth - 1; i++)
-        {
-            strbuf_append_char(ckv, '\t');
-        }
+        ckv_append_indent(cfg, ckv, current_depth - 1);
     }
     strbuf_append_char(ckv, '}');
 }
@@ -533,10 +642,7 @@ static void ckv_append_array(lua_State *l, ckv_config_t *cfg, int current_depth,
     if (cfg->keepln)
     {
         strbuf_append_char(ckv, '\n');
-        for (int i = 0; i < current_depth - 1; i++)
-        {
-            strbuf_append_char(ckv, '\t');
-        }
+        ckv_append_indent(cfg, ckv, current_depth - 1);
     }
 
     strbuf_append_char(ckv, '{');
@@ -549,10 +655,7 @@ static void ckv_append_array(lua_State *l, ckv_config_t *cfg, int current_depth,
     for (int i = 1; i <= array_length; i+=2) {
         if (cfg->keepln)
         {
-            for (int i = 0; i < current_depth; i++)
-            {
-                strbuf_append_char(ckv, '\t');
-            }
+            ckv_append_indent(cfg, ckv, current_depth);
         }
         lua_rawgeti(l, -1, i);
         ckv_append_data2(l, cfg, current_depth, ckv);
@@ -572,10 +675,7 @@ static void ckv_append_array(lua_State *l, ckv_config_t *cfg, int current_depth,
 
     if (cfg->keepln)
     {
-        for (int i = 0; i < current_depth - 1; i++)
-        {
-            strbuf_append_char(ckv, '\t');
-        }
+        ckv_append_indent(cfg, ckv, current_depth - 1);
     }
     strbuf_append_char(ckv, '}');
 }
@@ -584,6 +684,8 @@ static void ckv_append_array(lua_State *l, ckv_config_t *cfg, int current_depth,
 static void ckv_append_data(lua_State *l, ckv_config_t *cfg,
                              int current_depth, strbuf_t *ckv)
 {
+    ckv_sink_check(l, &cfg->encode_sink, ckv);
+
     switch (lua_type(l, -1)) 
     {
         case LUA_TSTRING:
@@ -658,6 +760,25 @@ static void ckv_append_data2(lua_State *l, ckv_config_t *cfg,
 }
 
 
+/* Appends the root key and value of the table on top of the stack */
+static void ckv_encode_root(lua_State *l, ckv_config_t *cfg,
+                            strbuf_t *encode_buf)
+{
+    int top = lua_gettop(l);
+
+    lua_pushnil(l);
+    lua_next(l, -2);
+
+    //key
+    ckv_append_string(l, encode_buf, -2);
+    strbuf_append_char(encode_buf, '\t');
+
+    //value
+    ckv_append_data(l, cfg, 0, encode_buf);
+
+    lua_settop(l, top);
+}
+
 static int ckv_encode(lua_State *l)
 {
     ckv_config_t *cfg = ckv_fetch_config(l);
@@ -668,36 +789,52 @@ static int ckv_encode(lua_State *l)
 
     luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
 
-    if (!cfg->encode_keep_buffer) {
-        /* Use private buffer */
-        encode_buf = &local_encode_buf;
-        strbuf_init(encode_buf, 0);
-    } else {
-        /* Reuse existing buffer */
-        encode_buf = &cfg->encode_buf;
-        strbuf_reset(encode_buf);
-    }
+    encode_buf = ckv_encode_buffer(cfg, &local_encode_buf);
+    ckv_encode_root(l, cfg, encode_buf);
 
+    ckv = strbuf_string(encode_buf, &len);
 
-    lua_pushnil(l);
-    lua_next(l, -2);
+    lua_pushlstring(l, ckv, len);
 
-    //key
-    ckv_append_string(l, encode_buf, -2);
-    strbuf_append_char(encode_buf, '\t');
+    ckv_encode_buffer_done(cfg, encode_buf);
 
-    //value
-    ckv_append_data(l, cfg, 0, encode_buf);
-    ckv = strbuf_string(encode_buf, &len);
+    return 1;
+}
 
-    lua_pushlstring(l, ckv, len);
+/* Shared by encode_to and encode_to_file, the sink is on top of the
+ * stack above the table and the target */
+static int ckv_encode_sink(lua_State *l, ckv_sink_t *sink)
+{
+    ckv_config_t *cfg = ckv_fetch_config(l);
 
-    if (!cfg->encode_keep_buffer)
-        strbuf_free(encode_buf);
+    lua_pushvalue(l, 1);
+    cfg->encode_sink = sink;
+    ckv_encode_root(l, cfg, &sink->buf);
+    cfg->encode_sink = NULL;
+
+    lua_pushinteger(l, (lua_Integer)ckv_sink_close(l, sink));
 
     return 1;
 }
 
+/* Calls writer(chunk) with the text as it is encoded, returns the
+ * number of bytes written */
+static int ckv_encode_to(lua_State *l)
+{
+    luaL_argcheck(l, lua_gettop(l) == 2, 2, "expected 2 arguments");
+
+    return ckv_encode_sink(l, ckv_sink_writer(l, 2));
+}
+
+/* Writes the text to path as it is encoded, returns the number of bytes
+ * written */
+static int ckv_encode_to_file(lua_State *l)
+{
+    luaL_argcheck(l, lua_gettop(l) == 2, 2, "expected 2 arguments");
+
+    return ckv_encode_sink(l, ckv_sink_file(l, luaL_checkstring(l, 2)));
+}
+
 static int ckv_encode2(lua_State *l)
 {
     ckv_config_t *cfg = ckv_fetch_config(l);
@@ -708,15 +845,7 @@ static int ckv_encode2(lua_State *l)
 
     luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
 
-    if (!cfg->encode_keep_buffer) {
-        /* Use private buffer */
-        encode_buf = &local_encode_buf;
-        strbuf_init(encode_buf, 0);
-    } else {
-        /* Reuse existing buffer */
-        encode_buf = &cfg->encode_buf;
-        strbuf_reset(encode_buf);
-    }
+    encode_buf = ckv_encode_buffer(cfg, &local_encode_buf);
 
 
     lua_pushnil(l);
@@ -732,565 +861,248 @@ static int ckv_encode2(lua_State *l)
 
     lua_pushlstring(l, ckv, len);
 
-    if (!cfg->encode_keep_buffer)
-        strbuf_free(encode_buf);
+    ckv_encode_buffer_done(cfg, encode_buf);
 
     return 1;
 }
 
 /* ===== DECODING ===== */
 
-static void ckv_process_value(lua_State *l, ckv_parse_t *ckv,
-                               ckv_token_t *token);
-static void ckv_process_value2(lua_State *l, ckv_parse_t *ckv,
-                               ckv_token_t *token);
-
-static int hexdigit2int(char hex)
+/* Fills in the token struct.
+ * T_STRING will return a pointer to the ckv_parse_t temporary string
+ * T_ERROR will leave the ckv->ptr pointer at the error.
+ */
+static void ckv_scan_token(ckv_parse_t *ckv, ckv_token_t *token)
 {
-    if ('0' <= hex  && hex <= '9')
-        return hex - '0';
-
-    /* Force lowercase */
-    hex |= 0x20;
-    if ('a' <= hex && hex <= 'f')
-        return 10 + hex - 'a';
-
-    return -1;
+    ckv_lex_token(&ckv->cfg->lexer, CKV_LEX_KV |
+                  (ckv->cfg->decode_invalid_numbers ? CKV_LEX_INVALID_NUMBERS : 0),
+                  ckv->data, &ckv->ptr, ckv->tmp, token);
 }
 
-static int decode_hex4(const char *hex)
+/* Every token of the decoders goes through here */
+static inline void ckv_next_token(ckv_parse_t *ckv, ckv_token_t *token)
 {
-    int digit[4];
-    int i;
-
-    /* Convert ASCII hex digit to numeric digit
-     * Note: this returns an error for invalid hex digits, including
-     *       NULL */
-    for (i = 0; i < 4; i++) {
-        digit[i] = hexdigit2int(hex[i]);
-        if (digit[i] < 0) {
-            return -1;
-        }
-    }
-
-    return (digit[0] << 12) +
-           (digit[1] << 8) +
-           (digit[2] << 4) +
-            digit[3];
+    ckv_scan_token(ckv, token);
+    CKV_STAT(ckv->stats->tokens[token->type]++);
 }
 
-/* Converts a Unicode codepoint to UTF-8.
- * Returns UTF-8 string length, and up to 4 bytes in *utf8 */
-static int codepoint_to_utf8(char *utf8, int codepoint)
+/* Build the structural index of the source when decode_presize is on */
+static void ckv_parse_index(ckv_parse_t *ckv, ckv_index_t *index, size_t len)
 {
-    /* 0xxxxxxx */
-    if (codepoint <= 0x7F) {
-        utf8[0] = codepoint;
-        return 1;
-    }
-
-    /* 110xxxxx 10xxxxxx */
-    if (codepoint <= 0x7FF) {
-        utf8[0] = (codepoint >> 6) | 0xC0;
-        utf8[1] = (codepoint & 0x3F) | 0x80;
-        return 2;
-    }
+    ckv->index = NULL;
+    if (ckv->cfg->decode_presize &&
+        ckv_index_build(index, ckv->data, len, CKV_LEX_KV) == 0)
+        ckv->index = index;
+}
 
-    /* 1110xxxx 10xxxxxx 10xxxxxx */
-    if (codepoint <= 0xFFFF) {
-        utf8[0] = (codepoint >> 12) | 0xE0;
-        utf8[1] = ((codepoint >> 6) & 0x3F) | 0x80;
-        utf8[2] = (codepoint & 0x3F) | 0x80;
-        return 3;
-    }
+/* Release the temporary parser string, the table index and the source
+ * file (if any). Also called before luaL_error() unwinds the C stack */
+static void ckv_parse_release(ckv_parse_t *ckv)
+{
+    CKV_STAT(ckv->stats->decodes++;
+             ckv->stats->bytes += ckv->ptr - ckv->data;
+             ckv->stats->reallocs += ckv->tmp->reallocs);
+    ckv_scratch_put(&ckv->cfg->scratch, ckv->tmp,
+                    ckv->cfg->decode_scratch_limit);
+    if (ckv->index)
+        ckv_index_free(ckv->index);
+    if (ckv->file)
+        ckv_file_close(ckv->file);
+}
 
-    /* 11110xxx 10xxxxxx 10xxxxxx 10xxxxxx */
-    if (codepoint <= 0x1FFFFF) {
-        utf8[0] = (codepoint >> 18) | 0xF0;
-        utf8[1] = ((codepoint >> 12) & 0x3F) | 0x80;
-        utf8[2] = ((codepoint >> 6) & 0x3F) | 0x80;
-        utf8[3] = (codepoint & 0x3F) | 0x80;
-        return 4;
+/* Release every file of a #base chain, starting at include. The files
+ * up the chain are all blocked in ckv_checkref() on the one below */
+static void ckv_include_abort(ckv_include_t *include)
+{
+    for (; include; include = include->parent) {
+        if (include->ckv)
+            ckv_parse_release(include->ckv);
     }
-
-    return 0;
 }
 
-
-/* Called when index pointing to beginning of UTF-16 code escape: \uXXXX
- * \u is guaranteed to exist, but the remaining hex characters may be
- * missing.
- * Translate to UTF-8 and append to temporary token string.
- * Must advance index to the next character to be processed.
- * Returns: 0   success
- *          -1  error
- */
-static int ckv_append_unicode_escape(ckv_parse_t *ckv)
+/* Release ckv and the files including it ahead of luaL_error() */
+static void ckv_parse_abort(ckv_parse_t *ckv)
 {
-    char utf8[4];       /* Surrogate pairs require 4 UTF-8 bytes */
-    int codepoint;
-    int surrogate_low;
-    int len;
-    int escape_len = 6;
+    ckv_parse_release(ckv);
+    if (ckv->include)
+        ckv_include_abort(ckv->include->parent);
+}
 
-    /* Fetch UTF-16 code unit */
-    codepoint = decode_hex4(ckv->ptr + 2);
-    if (codepoint < 0)
-        return -1;
+/* This function does not return.
+ * DO NOT CALL WITH DYNAMIC MEMORY ALLOCATED.
+ * The only supported exceptions are the temporary parser string
+ * ckv->tmp struct, the ckv->index shapes, the ckv->file source and
+ * those of the files including it.
+ * ckv and token should exist on the stack somewhere.
+ * luaL_error() will long_jmp and release the stack */
+static void ckv_throw_parse_error(lua_State *l, ckv_parse_t *ckv,
+                                   const char *exp, ckv_token_t *token)
+{
+    ckv_parse_abort(ckv);
+    ckv_token_error(l, exp, token, 0);
+}
 
-    /* UTF-16 surrogate pairs take the following 2 byte form:
-     *      11011 x yyyyyyyyyy
-     * When x = 0: y is the high 10 bits of the codepoint
-     *      x = 1: y is the low 10 bits of the codepoint
-     *
-     * Check for a surrogate pair (high or low) */
-    if ((codepoint & 0xF800) == 0xD800) {
-        /* Error if the 1st surrogate is not high */
-        if (codepoint & 0x400)
-            return -1;
-
-        /* Ensure the next code is a unicode escape */
-        if (*(ckv->ptr + escape_len) != '\\' ||
-            *(ckv->ptr + escape_len + 1) != 'u') {
-            return -1;
-        }
+/* Push an object key, through the key cache when decode_key_cache is on */
+static inline void ckv_push_key(lua_State *l, ckv_parse_t *ckv,
+                               const ckv_token_t *token)
+{
+    CKV_STAT(ckv->stats->strings++);
+    if (ckv->cfg->decode_key_cache)
+        ckv_key_cache_push(l, &ckv->cfg->key_cache, token->value.string,
+                           token->string_len);
+    else
+        lua_pushlstring(l, token->value.string, token->string_len);
+}
 
-        /* Fetch the next codepoint */
-        surrogate_low = decode_hex4(ckv->ptr + 2 + escape_len);
-        if (surrogate_low < 0)
-            return -1;
+static inline void ckv_decode_ascend(ckv_parse_t *ckv)
+{
+    ckv->current_depth--;
+}
 
-        /* Error if the 2nd code is not a low surrogate */
-        if ((surrogate_low & 0xFC00) != 0xDC00)
-            return -1;
+static void ckv_decode_descend(lua_State *l, ckv_parse_t *ckv, int slots)
+{
+    ckv->current_depth++;
+    CKV_STAT(ckv_stats_table(ckv->stats, ckv->current_depth));
 
-        /* Calculate Unicode codepoint */
-        codepoint = (codepoint & 0x3FF) << 10;
-        surrogate_low &= 0x3FF;
-        codepoint = (codepoint | surrogate_low) + 0x10000;
-        escape_len = 12;
+    if (ckv->current_depth <= ckv->cfg->decode_max_depth &&
+        lua_checkstack(l, slots)) {
+        return;
     }
 
-    /* Convert codepoint to UTF-8 */
-    len = codepoint_to_utf8(utf8, codepoint);
-    if (!len)
-        return -1;
-
-    /* Append bytes and advance parse index */
-    strbuf_append_mem_unsafe(ckv->tmp, utf8, len);
-    ckv->ptr += escape_len;
-
-    return 0;
+    ckv_parse_abort(ckv);
+    luaL_error(l, "Found too many nested data structures (%d) at character %d",
+        ckv->current_depth, ckv->ptr - ckv->data);
 }
 
-static void ckv_set_token_error(ckv_token_t *token, ckv_parse_t *ckv,
-                                 const char *errtype)
+/* Push the value of any token but T_OBJ_BEGIN */
+static inline void ckv_push_scalar(lua_State *l, ckv_parse_t *ckv,
+                                   ckv_token_t *token)
 {
-    token->type = T_ERROR;
-    token->index = ckv->ptr - ckv->data;
-    token->value.string = errtype;
-#if __DEBUG_KV__
-    printf("token error : %s", errtype);
-#endif
+    switch (token->type) {
+        case T_STRING:
+            CKV_STAT(ckv->stats->strings++);
+            lua_pushlstring(l, token->value.string, token->string_len);
+            break;;
+        case T_NUMBER:
+            lua_pushnumber(l, token->value.number);
+            break;;
+        case T_INTEGER:
+            lua_pushinteger(l, token->value.integer);
+            break;;
+        case T_BOOLEAN:
+            lua_pushboolean(l, token->value.boolean);
+            break;;
+        case T_NULL:
+            /* In Lua, setting "t[k] = nil" will delete k from the table.
+             * Hence a NULL pointer lightuserdata object is used instead */
+            lua_pushlightuserdata(l, NULL);
+            break;;
+        default:
+            ckv_throw_parse_error(l, ckv, "value", token);
+    }
 }
 
-static void ckv_next_string_token(ckv_parse_t *ckv, ckv_token_t *token)
+/* Push the table of a T_OBJ_BEGIN value, returns its frame */
+static inline int *ckv_open_table(lua_State *l, ckv_parse_t *ckv,
+                                  ckv_frames_t *stack, int object)
 {
-    char *escape2char = ckv->cfg->escape2char;
-    char ch;
+    const ckv_shape_t *shape;
+    int *next;
 
-    /* Caller must ensure a string is next */
-    assert(*ckv->ptr == '"');
+    /* Slots required: .., table, [key,] value and one to grow the frames */
+    ckv_decode_descend(l, ckv, object ? 4 : 3);
+    next = (int *)ckv_frames_push(l, stack);
+    *next = 1;
 
-    /* Skip " */
-    ckv->ptr++;
-    /* ckv->tmp is the temporary strbuf used to accumulate the
-     * decoded string value.
-     * ckv->tmp is sized to handle ckv containing only a string value.
-     */
-    strbuf_reset(ckv->tmp);
+    shape = ckv_index_find(ckv->index, ckv->ptr - ckv->data);
+    if (object)
+        lua_createtable(l, 0, shape ? shape->values / 2 : 0);
+    else
+        lua_createtable(l, shape ? shape->values : 0, 0);
 
-    while ((ch = *ckv->ptr) != '"') {
-        if (!ch) {
-            /* Premature end of the string */
-            ckv_set_token_error(token, ckv, "unexpected end of string");
-            return;
-        }
+    return next;
+}
 
-        /* Handle escapes */
-        if (ch == '\\') {
-            /* Fetch escape character */
-            ch = *(ckv->ptr + 1);
+/* Parse the table of a T_OBJ_BEGIN value with every table nested in it,
+ * in the layout of decode() (object) or decode2(). A frame is the next
+ * array index of its table */
+static void ckv_parse_table(lua_State *l, ckv_parse_t *ckv, int object)
+{
+    int frames[CKV_FRAMES_INLINE];
+    ckv_frames_t stack;
+    ckv_token_t token;
+    int *next;
 
-            /* Translate escape code and append to tmp string */
-            ch = escape2char[(unsigned char)ch];
-            if (ch == 'u') {
-                if (ckv_append_unicode_escape(ckv) == 0)
-                    continue;
+    ckv_frames_init(l, &stack, frames, CKV_FRAMES_INLINE, sizeof(*frames));
+    next = ckv_open_table(l, ckv, &stack, object);
+    ckv_next_token(ckv, &token);
 
-                ckv_set_token_error(token, ckv,
-                                     "invalid unicode escape code");
-                return;
+    while (1) {
+        if (token.type == T_OBJ_END) {
+            /* The table is the value of the one below */
+            ckv_decode_ascend(ckv);
+            next = (int *)ckv_frames_pop(&stack);
+            if (!next)
+                break;
+        } else {
+            if (object) {
+                if (token.type != T_STRING)
+                    ckv_throw_parse_error(l, ckv, "object key string", &token);
+                ckv_push_key(l, ckv, &token);
+                ckv_next_token(ckv, &token);
             }
-            if (!ch) {
-                ckv_set_token_error(token, ckv, "invalid escape code");
-                return;
+            if (token.type == T_OBJ_BEGIN) {
+                next = ckv_open_table(l, ckv, &stack, object);
+                ckv_next_token(ckv, &token);
+                continue;
             }
-
-            /* Skip '\' */
-            ckv->ptr++;
+            ckv_push_scalar(l, ckv, &token);
         }
 
-        /* Append normal character or translated single character
-         * Unicode escapes are handled above */
-        strbuf_append_char_unsafe(ckv->tmp, ch);
-        ckv->ptr++;
-    }
-    ckv->ptr++;    /* Eat final quote (") */
+        /* Set key = value, arr[i] = value */
+        if (object)
+            lua_rawset(l, -3);
+        else
+            lua_rawseti(l, -2, (*next)++);
 
-    strbuf_ensure_null(ckv->tmp);
+        ckv_next_token(ckv, &token);
+    }
 
-    token->type = T_STRING;
-    token->value.string = strbuf_string(ckv->tmp, &token->string_len);
+    ckv_frames_free(l, &stack);
 }
 
-
-/* ckv numbers should take the following form:
- *      -?(0|[1-9]|[1-9][0-9]+)(.[0-9]+)?([eE][-+]?[0-9]+)?
- *
- * ckv_next_number_token() uses strtod() which allows other forms:
- * - numbers starting with '+'
- * - NaN, -NaN, infinity, -infinity
- * - hexadecimal numbers
- * - numbers with leading zeros
- *
- * ckv_is_invalid_number() detects "numbers" which may pass strtod()'s
- * error checking, but should not be allowed with strict ckv.
- *
- * ckv_is_invalid_number() may pass numbers which cause strtod()
- * to generate an error.
- */
-static int ckv_is_invalid_number(ckv_parse_t *ckv)
-{
-    const char *p = ckv->ptr;
-
-    /* Reject numbers starting with + */
-    if (*p == '+')
-        return 1;
-
-    /* Skip minus sign if it exists */
-    if (*p == '-')
-        p++;
-
-    /* Reject numbers starting with 0x, or leading zeros */
-    if (*p == '0') {
-        int ch2 = *(p + 1);
-
-        if ((ch2 | 0x20) == 'x' ||          /* Hex */
-            ('0' <= ch2 && ch2 <= '9'))     /* Leading zero */
-            return 1;
-
-        return 0;
-    } else if (*p <= '9') {
-        return 0;                           /* Ordinary number */
-    }
-
-    /* Reject inf/nan */
-    if (!strncasecmp(p, "inf", 3))
-        return 1;
-    if (!strncasecmp(p, "nan", 3))
-        return 1;
-
-    /* Pass all other numbers which may still be invalid, but
-     * strtod() will catch them. */
-    return 0;
-}
-
-static void ckv_next_number_token(ckv_parse_t *ckv, ckv_token_t *token)
-{
-    char *endptr;
-
-    token->type = T_NUMBER;
-    token->value.number = fpconv_strtod(ckv->ptr, &endptr);
-    if (ckv->ptr == endptr)
-        ckv_set_token_error(token, ckv, "invalid number");
-    else
-        ckv->ptr = endptr;     /* Skip the processed number */
-}
-
-
-/* Fills in the token struct.
- * T_STRING will return a pointer to the ckv_parse_t temporary string
- * T_ERROR will leave the ckv->ptr pointer at the error.
- */
-static void ckv_next_token(ckv_parse_t *ckv, ckv_token_t *token)
-{
-    const ckv_token_type_t *ch2token = ckv->cfg->ch2token;
-    int ch;
-
-    /* Eat whitespace. */
-    while (1) {
-        ch = (unsigned char)*(ckv->ptr);
-        token->type = ch2token[ch];
-        if (token->type != T_WHITESPACE)
-        {
-            if (token->type == T_COMMENT)
-            {
-                while (1)
-                {
-                    ckv->ptr++;
-                    ch = (unsigned char)*(ckv->ptr);
-                    if (ch == '\r' || ch == '\n')
-                    {
-                        break;
-                    }
-                }
-            }
-#if __DEBUG_KV__
-            else if (token->type == T_ERROR)
-            {
-                printf("error token: %c = %d in %s \n", ch, ch, (ckv->ptr));
-            }
-#endif
-            else
-            {
-                break;
-            }
-        }
-        ckv->ptr++;
-    }
-
-    /* Store location of new token. Required when throwing errors
-     * for unexpected tokens (syntax errors). */
-    token->index = ckv->ptr - ckv->data;
-
-    /* Don't advance the pointer for an error or the end */
-    if (token->type == T_ERROR) {
-        ckv_set_token_error(token, ckv, "invalid token 1057");
-        return;
-    }
-
-    if (token->type == T_END) {
-        return;
-    }
-
-    /* Found a known single character token, advance index and return */
-    if (token->type != T_UNKNOWN) {
-        ckv->ptr++;
-        return;
-    }
-
-    if (ch == '"') {
-        ckv_next_string_token(ckv, token);
-        return;
-    }
-    else if (ch == '-' || ('0' <= ch && ch <= '9')) {
-        if (!ckv->cfg->decode_invalid_numbers && ckv_is_invalid_number(ckv)) {
-            ckv_set_token_error(token, ckv, "invalid number");
-            return;
-        }
-        ckv_next_number_token(ckv, token);
-        return;
-    } 
-    else if (ckv->cfg->decode_invalid_numbers &&
-               ckv_is_invalid_number(ckv)) {
-        /* When decode_invalid_numbers is enabled, only attempt to process
-         * numbers we know are invalid ckv (Inf, NaN, hex)
-         * This is required to generate an appropriate token error,
-         * otherwise all bad tokens will register as "invalid number"
-         */
-        ckv_next_number_token(ckv, token);
-        return;
-    }
-
-    /* Token starts with t/f/n but isn't recognised above. */
-    ckv_set_token_error(token, ckv, "invalid token 1");
-}
-
-/* This function does not return.
- * DO NOT CALL WITH DYNAMIC MEMORY ALLOCATED.
- * The only supported exception is the temporary parser string
- * ckv->tmp struct.
- * ckv and token should exist on the stack somewhere.
- * luaL_error() will long_jmp and release the stack */
-static void ckv_throw_parse_error(lua_State *l, ckv_parse_t *ckv,
-                                   const char *exp, ckv_token_t *token)
-{
-    const char *found;
-
-    strbuf_free(ckv->tmp);
-
-    if (token->type == T_ERROR)
-        found = token->value.string;
-    else
-        found = ckv_token_type_name[token->type];
-
-    /* Note: token->index is 0 based, display starting from 1 */
-    luaL_error(l, "Expected %s but found %s at character %d",
-               exp, found, token->index + 1);
-
-#if __DEBUG_KV__
-    printf("Expected %s but found %s at character %d",
-               exp, found, token->index + 1);
-#endif
-}
-
-static inline void ckv_decode_ascend(ckv_parse_t *ckv)
-{
-    ckv->current_depth--;
-}
-
-static void ckv_decode_descend(lua_State *l, ckv_parse_t *ckv, int slots)
-{
-    ckv->current_depth++;
-
-    if (ckv->current_depth <= ckv->cfg->decode_max_depth &&
-        lua_checkstack(l, slots)) {
-        return;
-    }
-
-    strbuf_free(ckv->tmp);
-    luaL_error(l, "Found too many nested data structures (%d) at character %d",
-        ckv->current_depth, ckv->ptr - ckv->data);
-}
-
-static void ckv_parse_object_context(lua_State *l, ckv_parse_t *ckv)
-{
-    ckv_token_t token;
-
-    ckv_decode_descend(l, ckv, 3);
-
-    lua_newtable(l);
-
-    ckv_next_token(ckv, &token);
-
-    /* Handle empty objects */
-    if (token.type == T_OBJ_END) {
-        ckv_decode_ascend(ckv);
-        return;
-    }
-
-    while (1) {
-        if (token.type != T_STRING)
-            ckv_throw_parse_error(l, ckv, "object key string", &token);
-
-        /* Push key */
-        lua_pushlstring(l, token.value.string, token.string_len);
-
-        /* Fetch value */
-        ckv_next_token(ckv, &token);
-        ckv_process_value(l, ckv, &token);
-
-        /* Set key = value */
-        lua_rawset(l, -3);
-
-        ckv_next_token(ckv, &token);
-
-        if (token.type == T_OBJ_END) {
-            ckv_decode_ascend(ckv);
-            return;
-        }
-    }
-}
-
-
 /* Handle the "value" context */
 static void ckv_process_value(lua_State *l, ckv_parse_t *ckv,
                                ckv_token_t *token)
 {
-    switch (token->type) {
-        case T_STRING:
-            lua_pushlstring(l, token->value.string, token->string_len);
-            break;;
-        case T_OBJ_BEGIN:
-            ckv_parse_object_context(l, ckv);
-            break;;
-        case T_NUMBER:
-            lua_pushnumber(l, token->value.number);
-            break;;
-        case T_BOOLEAN:
-            lua_pushboolean(l, token->value.boolean);
-        case T_NULL:
-            /* In Lua, setting "t[k] = nil" will delete k from the table.
-             * Hence a NULL pointer lightuserdata object is used instead */
-            lua_pushlightuserdata(l, NULL);
-            break;;
-        default:
-            ckv_throw_parse_error(l, ckv, "value", token);
-    }
-}
-
-/* Handle the array context */
-static void ckv_parse_array_context(lua_State *l, ckv_parse_t *ckv)
-{
-    ckv_token_t token;
-    int i;
-
-    /* 2 slots required:
-     * .., table, value */
-    ckv_decode_descend(l, ckv, 2);
-
-    lua_newtable(l);
-
-    ckv_next_token(ckv, &token);
-
-    /* Handle empty arrays */
-    if (token.type == T_OBJ_END) {
-        ckv_decode_ascend(ckv);
-        return;
-    }
-
-    for (i = 1; ; i++) {
-        ckv_process_value2(l, ckv, &token);
-        lua_rawseti(l, -2, i);            /* arr[i] = value */
-
-        ckv_next_token(ckv, &token);
-
-        if (token.type == T_OBJ_END) {
-            ckv_decode_ascend(ckv);
-            return;
-        }
-    }
+    if (token->type == T_OBJ_BEGIN)
+        ckv_parse_table(l, ckv, 1);
+    else
+        ckv_push_scalar(l, ckv, token);
 }
 
-/* Handle the "value" context */
+/* Handle the "value" context of the array layout */
 static void ckv_process_value2(lua_State *l, ckv_parse_t *ckv,
                                ckv_token_t *token)
 {
-    switch (token->type) {
-        case T_STRING:
-            lua_pushlstring(l, token->value.string, token->string_len);
-            break;;
-        case T_OBJ_BEGIN:
-            ckv_parse_array_context(l, ckv);
-            break;;
-        case T_NUMBER:
-            lua_pushnumber(l, token->value.number);
-            break;;
-        case T_BOOLEAN:
-            lua_pushboolean(l, token->value.boolean);
-            break;;
-        case T_NULL:
-            /* In Lua, setting "t[k] = nil" will delete k from the table.
-             * Hence a NULL pointer lightuserdata object is used instead */
-            lua_pushlightuserdata(l, NULL);
-            break;;
-        default:
-            ckv_throw_parse_error(l, ckv, "value", token);
-    }
+    if (token->type == T_OBJ_BEGIN)
+        ckv_parse_table(l, ckv, 0);
+    else
+        ckv_push_scalar(l, ckv, token);
 }
 
 static int ckv_decode(lua_State *l)
 {
     ckv_parse_t ckv;
     ckv_token_t token;
+    ckv_index_t index;
     size_t ckv_len;
 
-    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
-
     ckv.cfg = ckv_fetch_config(l);
-    ckv.data = luaL_checklstring(l, 1, &ckv_len);
-    lua_pop(l, 1);
+    CKV_STAT(ckv.stats = &ckv.cfg->stats);
+    ckv.data = ckv_check_source(l, &ckv_len);
+    ckv.file = NULL;
+    ckv.include = NULL;
     ckv.current_depth = 0;
     ckv.ptr = ckv.data;
     
@@ -1305,7 +1117,8 @@ static int ckv_decode(lua_State *l)
     /* Ensure the temporary buffer can hold the entire string.
      * This means we no longer need to do length checks since the decoded
      * string must be smaller than the entire ckv string */
-    ckv.tmp = strbuf_new(ckv_len);
+    ckv.tmp = ckv_scratch_get(&ckv.cfg->scratch, ckv_len);
+    ckv_parse_index(&ckv, &index, ckv_len);
 
     lua_newtable(l);
         
@@ -1322,70 +1135,58 @@ static int ckv_decode(lua_State *l)
         lua_rawset(l, -3);
     }
     
-    strbuf_free(ckv.tmp);
+    ckv_parse_release(&ckv);
 
     return 1;
 }
 
-static void ckv_checkref(ckv_parse_t *ckv, ckv_token_t *token, lua_State* l, const char* filename);
+static void ckv_checkref(ckv_parse_t *ckv, lua_State* l, const char* filename);
 
-static const char* ckv_get_filename(const char* fullpath, char filename[128])
+/* Returns the part of fullpath after its last separator */
+static const char* ckv_get_filename(const char* fullpath)
 {
-    const int len = strlen(fullpath);
-    int i = len - 1;
-    int start = 0;
-    for(;i >= 0; i--)
-    {
-        if (fullpath[i] == '\\' || fullpath[i] == '/')
-        {
-            start = i + 1;
-            break;
-        }
-    }
+    const char *filename = fullpath;
+    const char *p;
 
-    i = start;
-    start = 0;
-    for(; i < len; i++)
+    for (p = fullpath; *p; p++)
     {
-        filename[start++] = fullpath[i];
+        if (*p == '\\' || *p == '/')
+            filename = p + 1;
     }
-    filename[start] = '\0';
     return filename;
 }
 
-static void ckv_decode_file(lua_State* l, const char* fullpath)
+static void ckv_decode_file(lua_State* l, const char* fullpath,
+                            ckv_include_t *include)
 {
     ckv_parse_t ckv;
     ckv_token_t token;
-    FILE* fp = NULL;
-    fopen_s(&fp, fullpath, "rb");
-    if (fp == NULL)
+    ckv_index_t index;
+    ckv_file_t file;
+#ifdef CKV_STATS
+    /* Parse time excludes the reads of this file and of its #base files */
+    ckv_stats_t *stats = &ckv_fetch_config(l)->stats;
+    double started = ckv_stats_clock(), read_time = stats->read_time;
+#endif
+
+    /* Map the file (or read it once into a buffer sized from stat) and
+     * parse straight from those bytes */
+    if (ckv_file_open(&file, fullpath) != 0)
     {
         luaL_fileresult(l, 0, fullpath);
         return;
     }
-    
-    size_t nr;
-    strbuf_t* filebuffer = strbuf_new(LUAL_BUFFERSIZE);
-    
-    do
-    {
-        char tempbuffer[LUAL_BUFFERSIZE];
-        nr = fread(tempbuffer, sizeof(char), LUAL_BUFFERSIZE, fp);
-        strbuf_append_mem(filebuffer, tempbuffer, nr);
-    } while (nr == LUAL_BUFFERSIZE);
+    CKV_STAT(stats->files++;
+             stats->read_time += ckv_stats_clock() - started);
 
-    const int res = fclose(fp);
-    if (res != 0)
-    {
-        luaL_fileresult(l, 0, "fclose failed");
-    }
-    
     ckv.cfg = ckv_fetch_config(l);
-    ckv.data = filebuffer->buf;
+    CKV_STAT(ckv.stats = &ckv.cfg->stats);
+    ckv.data = file.data;
+    ckv.file = &file;
+    ckv.include = include;
     ckv.current_depth = 0;
     ckv.ptr = ckv.data;
-    const size_t ckv_len = filebuffer->size;
+    const size_t ckv_len = file.len;
 
     /* Detect Unicode other than UTF-8 (see RFC 4627, Sec 3)
      *
@@ -1412,26 +1213,28 @@ static void ckv_decode_file(lua_State* l, const char* fullpath)
     }
     if (checkUTF8 == 0)
     {
-        const char ch = (unsigned char)*(ckv.ptr);
-        if (ckv.cfg->ch2token[ch] == T_ERROR)
+        const unsigned char ch = (unsigned char)*(ckv.ptr);
+        if (ckv.cfg->lexer.ch2token[ch] == T_ERROR)
         {
+            ckv_file_close(&file);
+            ckv_include_abort(include->parent);
             luaL_error(l, "ckv parser just support UTF-8");
             return;
         }
     }
-    /* Ensure the temporary buffer can hold the entire string.
-     * This means we no longer need to do length checks since the decoded
-     * string must be smaller than the entire ckv string */
-    ckv.tmp = strbuf_new(ckv_len);
+    /* Every decoded string (and the #base path) fits in the widest gap
+     * between two quotes, so there is no need to size the temporary
+     * buffer from the entire file */
+    ckv.tmp = ckv_scratch_get(&ckv.cfg->scratch, ckv_longest_quoted(ckv.data, ckv_len) + 1);
+    ckv_parse_index(&ckv, &index, ckv_len);
+    include->ckv = &ckv;
 
     //引入了其他kv文件
-    ckv_checkref(&ckv, &token, l, fullpath);
+    ckv_checkref(&ckv, l, fullpath);
     //在外面包一层
     lua_newtable(l);
 
-    char filename[128];
-    ckv_get_filename(fullpath, filename);
-    lua_pushlstring(l, filename, strlen(filename));
+    lua_pushstring(l, ckv_get_filename(fullpath));
 
     {
         lua_newtable(l);
@@ -1450,122 +1253,278 @@ static void ckv_decode_file(lua_State* l, const char* fullpath)
     }
     
     lua_rawset(l, -3);
-    strbuf_free(ckv.tmp);
-    strbuf_free(filebuffer);
+    include->ckv = NULL;
+    ckv_parse_release(&ckv);
+#ifdef CKV_STATS
+    if (!include->parent)
+        stats->parse_time += ckv_stats_clock() - started -
+                             (stats->read_time - read_time);
+#endif
 }
 
-static void ckv_checkref(ckv_parse_t *ckv, ckv_token_t *token, lua_State* l, const char* fullpath)
+/* Record that path, in the state stamp (-1, -1 when it could not be
+ * read), is a #base of every file from include up which goes into the
+ * base cache */
+static void ckv_base_depend(lua_State *l, ckv_include_t *include,
+                            const char *path, lua_Number mtime,
+                            lua_Number size)
 {
-    const ckv_token_type_t *ch2token = ckv->cfg->ch2token;
-    int ch = 0, i = 0;
-    const int len = strlen(fullpath);
-    
-    while (1) {
-        ch = (unsigned char)*(ckv->ptr);
-        token->type = ch2token[ch];
-        if (token->type != T_WHITESPACE)
-        {
-            if (token->type == T_COMMENT)
-            {
-                while (1)
-                {
-                    ckv->ptr++;
-                    ch = (unsigned char)*(ckv->ptr);
-                    if (ch == '\r' || ch == '\n')
-                    {
-                        break;
-                    }
-                }
-            }
-            else if (token->type == T_REF)
-            {
-                while (1)
-                {
-                    ckv->ptr++;
-                    ch = (unsigned char)*(ckv->ptr);
-                    if (ch == '\"')
-                    {
-                        strbuf_reset(ckv->tmp);
-                        while (1)
-                        {
-                            ckv->ptr++;
-                            ch = (unsigned char)*(ckv->ptr);
-                            if (ch == '\"')
-                            {
-                                strbuf_append_char_unsafe(ckv->tmp, '\0');
-                                char* buf = strbuf_string(ckv->tmp, &token->string_len);
-                                char dir[256];
-
-                                int dindex = -1;
-                                for(i = len - 1; i >= 0; i--)
-                                {
-                                    if ((fullpath[i] == '\\' || fullpath[i] == '/') && dindex < 0)
-                                    {
-                                        dindex = i;
-                                        dir[i + 1] = '\0';
-                                    }
-                                    
-                                    if (dindex >= 0)
-                                    {
-                                        dir[i] = fullpath[i];
-                                    }
-                                }
-                                
-                                char newfilepath[256];
-                                sprintf_s(newfilepath, 256, "%s/%s", dir, buf);
-                                ckv_decode_file(l, newfilepath);
-                                
-                                break;
-                            }
-                            else
-                            {
-                                strbuf_append_char_unsafe(ckv->tmp, ch);
-                            }
-                        }
-                        break;
-                    }
-                }
-            }
-            else
-            {
-                break;
-            }
-        }
-        ckv->ptr++;
+    int n;
+
+    for (; include; include = include->parent) {
+        if (!include->deps)
+            continue;
+        n = (int)lua_rawlen(l, include->deps);
+        lua_pushstring(l, path);
+        lua_rawseti(l, include->deps, n + 1);
+        lua_pushnumber(l, mtime);
+        lua_rawseti(l, include->deps, n + 2);
+        lua_pushnumber(l, size);
+        lua_rawseti(l, include->deps, n + 3);
     }
 }
 
-static int ckv_decode2(lua_State *l)
+/* Returns 1 when every file of the path, mtime, size list at deps is
+ * still in the state it was in when the list was built */
+static int ckv_base_fresh(lua_State *l, int deps)
 {
-    ckv_parse_t ckv;
-    ckv_token_t token;
-    size_t ckv_len;
+    const int n = (int)lua_rawlen(l, deps);
+    ckv_stamp_t stamp;
+    int i, fresh = 1;
+
+    for (i = 1; fresh && i + 2 <= n; i += 3) {
+        lua_rawgeti(l, deps, i);
+        lua_rawgeti(l, deps, i + 1);
+        lua_rawgeti(l, deps, i + 2);
+        if (ckv_file_stamp(lua_tostring(l, -3), &stamp) != 0)
+            stamp.mtime = stamp.size = -1;
+        fresh = lua_tonumber(l, -2) == (lua_Number)stamp.mtime &&
+                lua_tonumber(l, -1) == (lua_Number)stamp.size;
+        lua_pop(l, 3);
+    }
 
-    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+    return fresh;
+}
 
-    ckv.cfg = ckv_fetch_config(l);
-    ckv.data = luaL_checklstring(l, 1, &ckv_len);
-    lua_pop(l, 1);
-    ckv.current_depth = 0;
-    ckv.ptr = ckv.data;
+/* A base served from the cache adds the #base files below it to the
+ * lists of the files including it, as reading it would have */
+static void ckv_base_replay(lua_State *l, ckv_include_t *include, int deps)
+{
+    const int n = (int)lua_rawlen(l, deps);
+    int i;
 
-    /* Detect Unicode other than UTF-8 (see RFC 4627, Sec 3)
-     *
-     * CKV can support any simple data type, hence only the first
-     * character is guaranteed to be ASCII (at worst: '"'). This is
-     * still enough to detect whether the wrong encoding is in use. */
-    if (ckv_len >= 2 && (!ckv.data[0] || !ckv.data[1]))
-        luaL_error(l, "ckv parser does not support UTF-16 or UTF-32");
+    for (i = 1; i + 2 <= n; i += 3) {
+        lua_rawgeti(l, deps, i);
+        lua_rawgeti(l, deps, i + 1);
+        lua_rawgeti(l, deps, i + 2);
+        if (include->sources) {
+            lua_pushvalue(l, -3);
+            lua_rawseti(l, include->sources,
+                        (lua_Integer)lua_rawlen(l, include->sources) + 1);
+        }
+        ckv_base_depend(l, include, lua_tostring(l, -3), lua_tonumber(l, -2),
+                        lua_tonumber(l, -1));
+        lua_pop(l, 3);
+    }
+}
 
-    /* Ensure the temporary buffer can hold the entire string.
-     * This means we no longer need to do length checks since the decoded
-     * string must be smaller than the entire ckv string */
-    ckv.tmp = strbuf_new(ckv_len);
+/* Push the table of a #base file like ckv_decode_file(), reusing the one
+ * from an earlier include while neither the file nor any #base below it
+ * changed */
+static void ckv_decode_base(lua_State* l, ckv_parse_t *ckv, const char* path)
+{
+    ckv_config_t *cfg = ckv->cfg;
+    ckv_include_t include, *parent;
+    ckv_stamp_t stamp;
+    int top, cached, deps;
+
+    ckv_resolve_path(path, include.path, sizeof(include.path));
+    include.ckv = NULL;
+    include.parent = ckv->include;
+    include.sources = ckv->include->sources;
+    include.deps = 0;
+
+    for (parent = ckv->include; parent; parent = parent->parent) {
+        if (!strcmp(parent->path, include.path)) {
+            ckv_include_abort(ckv->include);
+            luaL_error(l, "#base cycle: %s is included by itself", path);
+        }
+    }
 
-    lua_newtable(l);
-        
-    //第一个永远是表的名字
-    ckv_next_token(&ckv, &token);
+    CKV_STAT(cfg->stats.includes++);
+    if (include.sources) {
+        lua_pushstring(l, include.path);
+        lua_rawseti(l, include.sources, (lua_Integer)lua_rawlen(l, include.sources) + 1);
+    }
+
+    if (!cfg->decode_base_cache || ckv_file_stamp(include.path, &stamp) != 0) {
+        ckv_base_depend(l, ckv->include, include.path, -1, -1);
+        ckv_decode_file(l, path, &include);
+        return;
+    }
+    ckv_base_depend(l, ckv->include, include.path, (lua_Number)stamp.mtime,
+                    (lua_Number)stamp.size);
+
+    if (cfg->base_cache == LUA_NOREF) {
+        lua_newtable(l);
+        cfg->base_cache = luaL_ref(l, LUA_REGISTRYINDEX);
+        cfg->base_cache_count = 0;
+    }
+    lua_rawgeti(l, LUA_REGISTRYINDEX, cfg->base_cache);
+    cached = lua_gettop(l);
+
+    /* { table, mtime, size, deps } */
+    lua_getfield(l, cached, include.path);
+    if (lua_istable(l, -1)) {
+        lua_rawgeti(l, -1, 2);
+        lua_rawgeti(l, -2, 3);
+        lua_rawgeti(l, -3, 4);
+        if (lua_tonumber(l, -3) == (lua_Number)stamp.mtime &&
+            lua_tonumber(l, -2) == (lua_Number)stamp.size &&
+            lua_istable(l, -1) && ckv_base_fresh(l, lua_gettop(l))) {
+            ckv_base_replay(l, &include, lua_gettop(l));
+            lua_pop(l, 3);
+            lua_rawgeti(l, -1, 1);
+            lua_replace(l, cached);
+            lua_pop(l, 1);
+            CKV_STAT(cfg->stats.include_hits++);
+            return;
+        }
+        lua_pop(l, 3);
+    }
+    lua_pop(l, 1);
+
+    lua_newtable(l);
+    deps = include.deps = lua_gettop(l);
+    top = lua_gettop(l);
+    ckv_decode_file(l, path, &include);
+
+    /* Files that could not be read push nil, message, errno. The tables of
+     * the #base files below sit under the file's own one, which is all a
+     * hit pushes again */
+    if (lua_gettop(l) > top && lua_istable(l, -1) &&
+        cfg->decode_base_cache_limit > 0) {
+        /* Start over rather than grow without bound */
+        if (cfg->base_cache_count >= cfg->decode_base_cache_limit) {
+            lua_newtable(l);
+            lua_pushvalue(l, -1);
+            lua_rawseti(l, LUA_REGISTRYINDEX, cfg->base_cache);
+            lua_replace(l, cached);
+            cfg->base_cache_count = 0;
+        }
+        lua_createtable(l, 4, 0);
+        lua_pushvalue(l, -2);
+        lua_rawseti(l, -2, 1);
+        lua_pushnumber(l, (lua_Number)stamp.mtime);
+        lua_rawseti(l, -2, 2);
+        lua_pushnumber(l, (lua_Number)stamp.size);
+        lua_rawseti(l, -2, 3);
+        lua_pushvalue(l, deps);
+        lua_rawseti(l, -2, 4);
+        lua_setfield(l, cached, include.path);
+        cfg->base_cache_count++;
+    }
+    lua_remove(l, deps);
+    lua_remove(l, cached);
+}
+
+/* Skip whitespace and comments ahead of the root key. Returns 1 with the
+ * path of the next #base "path" line in ckv->tmp, 0 once ckv->ptr is at
+ * the first token of the file. Never touches the lua_State */
+static int ckv_next_ref(ckv_parse_t *ckv)
+{
+    const ckv_token_type_t *ch2token = ckv->cfg->lexer.ch2token;
+    const char *start;
+
+    while (1) {
+        ckv->ptr = ckv_skip_whitespace(ckv->ptr);
+        switch (ch2token[(unsigned char)*ckv->ptr]) {
+        case T_COMMENT:
+            ckv->ptr = ckv_scan_eol(ckv->ptr + 1);
+            break;
+        case T_REF:
+            /* An unterminated path ends the scan at the NUL (T_END) */
+            while (*ckv->ptr && *ckv->ptr != '"')
+                ckv->ptr++;
+            if (!*ckv->ptr)
+                return 0;
+            start = ++ckv->ptr;
+            while (*ckv->ptr && *ckv->ptr != '"')
+                ckv->ptr++;
+            if (!*ckv->ptr)
+                return 0;
+
+            strbuf_reset(ckv->tmp);
+            strbuf_append_mem_unsafe(ckv->tmp, start, ckv->ptr - start);
+            strbuf_ensure_null(ckv->tmp);
+            ckv->ptr++;    /* Eat final quote (") */
+            return 1;
+        default:
+            return 0;
+        }
+    }
+}
+
+static void ckv_checkref(ckv_parse_t *ckv, lua_State* l, const char* fullpath)
+{
+    /* #base paths are relative to the directory of fullpath, which keeps
+     * its separator. A bare file name has none and refers to the current
+     * directory */
+    const size_t dir_len = ckv_get_filename(fullpath) - fullpath;
+    char newfilepath[CKV_PATH_MAX];
+    const char *ref;
+    size_t prefix;
+    int len;
+
+    while (ckv_next_ref(ckv)) {
+        ref = strbuf_string(ckv->tmp, &len);
+        prefix = dir_len ? dir_len + 1 : 0;
+        if (prefix + len >= sizeof(newfilepath)) {
+            ckv_include_abort(ckv->include);
+            luaL_error(l, "#base path too long in %s", fullpath);
+        }
+
+        memcpy(newfilepath, fullpath, dir_len);
+        if (dir_len)
+            newfilepath[dir_len] = '/';
+        memcpy(newfilepath + prefix, ref, len + 1);
+        ckv_decode_base(l, ckv, newfilepath);
+    }
+}
+
+static int ckv_decode2(lua_State *l)
+{
+    ckv_parse_t ckv;
+    ckv_token_t token;
+    ckv_index_t index;
+    size_t ckv_len;
+
+    ckv.cfg = ckv_fetch_config(l);
+    CKV_STAT(ckv.stats = &ckv.cfg->stats);
+    ckv.data = ckv_check_source(l, &ckv_len);
+    ckv.file = NULL;
+    ckv.include = NULL;
+    ckv.current_depth = 0;
+    ckv.ptr = ckv.data;
+
+    /* Detect Unicode other than UTF-8 (see RFC 4627, Sec 3)
+     *
+     * CKV can support any simple data type, hence only the first
+     * character is guaranteed to be ASCII (at worst: '"'). This is
+     * still enough to detect whether the wrong encoding is in use. */
+    if (ckv_len >= 2 && (!ckv.data[0] || !ckv.data[1]))
+        luaL_error(l, "ckv parser does not support UTF-16 or UTF-32");
+
+    /* Ensure the temporary buffer can hold the entire string.
+     * This means we no longer need to do length checks since the decoded
+     * string must be smaller than the entire ckv string */
+    ckv.tmp = ckv_scratch_get(&ckv.cfg->scratch, ckv_len);
+    ckv_parse_index(&ckv, &index, ckv_len);
+
+    lua_newtable(l);
+        
+    //第一个永远是表的名字
+    ckv_next_token(&ckv, &token);
 
     if (token.type != T_END)
     {
@@ -1578,7 +1537,7 @@ static int ckv_decode2(lua_State *l)
         lua_rawset(l, -3);
     }
     
-    strbuf_free(ckv.tmp);
+    ckv_parse_release(&ckv);
 
     return 1;
 }
@@ -1589,9 +1548,1117 @@ static int ckv_decode_file_array(lua_State *l)
     
     size_t filepath_len;
     const char *filepath = luaL_checklstring(l, 1, &filepath_len);
+    ckv_include_t include;
+
+    lua_pop(l, 1);
+    lua_newtable(l);
+    ckv_resolve_path(filepath, include.path, sizeof(include.path));
+    include.ckv = NULL;
+    include.parent = NULL;
+    include.sources = 0;
+    include.deps = 0;
+    ckv_decode_file(l, filepath, &include);
+
+    return 1;
+}
+
+/* ===== PARALLEL DECODING =====
+ *
+ * decode_files() parses every file on a worker thread into a tree kept in
+ * a per file arena, then builds the Lua tables on the calling thread. The
+ * workers only share the (read only) config, so they never touch the
+ * lua_State. */
+
+typedef struct ckv_node ckv_node_t;
+
+struct ckv_node {
+    ckv_token_type_t type;  /* T_STRING, T_NUMBER, T_INTEGER or T_OBJ_BEGIN */
+    int object;             /* Tables: children alternate key and value */
+    int count;              /* Tables: number of children */
+    ckv_node_t *child;      /* Tables: first child */
+    ckv_node_t *next;       /* Next sibling */
+    size_t string_len;
+    union {
+        const char *string;
+        double number;
+        lua_Integer integer;
+        ckv_node_t **keys;  /* Objects: key index of ckv.open() lookups */
+    } value;
+};
+
+typedef struct {
+    const char *path;
+    ckv_arena_t arena;
+    ckv_node_t *key;        /* Root key, NULL for an empty file */
+    ckv_node_t *value;
+    int file_errno;         /* Set when the file could not be read */
+    char error[256];        /* Set when the file failed to decode */
+    ckv_stats_t stats;      /* Merged into the config after the batch */
+} ckv_file_job_t;
+
+typedef struct {
+    ckv_config_t *cfg;
+    ckv_file_job_t *jobs;
+} ckv_file_batch_t;
+
+static ckv_node_t *ckv_tree_value(ckv_parse_t *ckv, ckv_file_job_t *job,
+                                  ckv_token_t *token, int object);
+
+static ckv_node_t *ckv_tree_error(ckv_file_job_t *job, const char *exp,
+                                  const ckv_token_t *token)
+{
+    if (job->error[0])
+        return NULL;
+
+    /* Note: token->index is 0 based, display starting from 1 */
+    snprintf(job->error, sizeof(job->error),
+             "Expected %s but found %s at character %d",
+             exp, ckv_token_found(token), token->index + 1);
+
+    return NULL;
+}
+
+static ckv_node_t *ckv_tree_node(ckv_file_job_t *job, ckv_token_type_t type)
+{
+    ckv_node_t *node;
+
+    node = (ckv_node_t *)ckv_arena_alloc(&job->arena, sizeof(*node));
+    if (!node) {
+        snprintf(job->error, sizeof(job->error), "not enough memory");
+        return NULL;
+    }
+
+    memset(node, 0, sizeof(*node));
+    node->type = type;
+
+    return node;
+}
+
+/* Tree version of ckv_parse_table() */
+static ckv_node_t *ckv_tree_table(ckv_parse_t *ckv, ckv_file_job_t *job,
+                                  int object)
+{
+    ckv_token_t token;
+    ckv_node_t *node, *child, **tail;
+
+    CKV_STAT(ckv_stats_table(ckv->stats, ckv->current_depth + 1));
+    if (++ckv->current_depth > ckv->cfg->decode_max_depth) {
+        snprintf(job->error, sizeof(job->error),
+                 "Found too many nested data structures (%d) at character %d",
+                 ckv->current_depth, (int)(ckv->ptr - ckv->data));
+        return NULL;
+    }
+
+    node = ckv_tree_node(job, T_OBJ_BEGIN);
+    if (!node)
+        return NULL;
+    node->object = object;
+    tail = &node->child;
+
+    ckv_next_token(ckv, &token);
+
+    while (token.type != T_OBJ_END) {
+        if (object) {
+            if (token.type != T_STRING)
+                return ckv_tree_error(job, "object key string", &token);
+
+            child = ckv_tree_value(ckv, job, &token, object);
+            if (!child)
+                return NULL;
+            *tail = child;
+            tail = &child->next;
+            node->count++;
+
+            ckv_next_token(ckv, &token);
+        }
+
+        child = ckv_tree_value(ckv, job, &token, object);
+        if (!child)
+            return NULL;
+        *tail = child;
+        tail = &child->next;
+        node->count++;
+
+        ckv_next_token(ckv, &token);
+    }
+
+    ckv->current_depth--;
+
+    return node;
+}
+
+/* Tree version of ckv_process_value() (object) / ckv_process_value2() */
+static ckv_node_t *ckv_tree_value(ckv_parse_t *ckv, ckv_file_job_t *job,
+                                  ckv_token_t *token, int object)
+{
+    ckv_node_t *node;
+    char *string;
+
+    switch (token->type) {
+        case T_STRING:
+            node = ckv_tree_node(job, T_STRING);
+            if (!node)
+                return NULL;
+            /* Copy out, the token may point into ckv->tmp */
+            string = (char *)ckv_arena_alloc(&job->arena, token->string_len);
+            if (!string && token->string_len) {
+                snprintf(job->error, sizeof(job->error), "not enough memory");
+                return NULL;
+            }
+            memcpy(string, token->value.string, token->string_len);
+            node->value.string = string;
+            node->string_len = token->string_len;
+            return node;
+        case T_OBJ_BEGIN:
+            return ckv_tree_table(ckv, job, object);
+        case T_NUMBER:
+            node = ckv_tree_node(job, T_NUMBER);
+            if (node)
+                node->value.number = token->value.number;
+            return node;
+        case T_INTEGER:
+            node = ckv_tree_node(job, T_INTEGER);
+            if (node)
+                node->value.integer = token->value.integer;
+            return node;
+        default:
+            return ckv_tree_error(job, "value", token);
+    }
+}
+
+/* Worker side of ckv_decode_file(). #base files are skipped, their tables
+ * never reach the result of decode_file_array either */
+static void ckv_decode_file_job(void *ctx, int i)
+{
+    ckv_file_batch_t *batch = (ckv_file_batch_t *)ctx;
+    ckv_file_job_t *job = &batch->jobs[i];
+    ckv_parse_t ckv;
+    ckv_token_t token;
+    ckv_file_t file;
+    const unsigned char *bom;
+#ifdef CKV_STATS
+    double started = ckv_stats_clock();
+#endif
+
+    if (ckv_file_open(&file, job->path) != 0) {
+        job->file_errno = errno ? errno : EIO;
+        return;
+    }
+    CKV_STAT(job->stats.files++;
+             job->stats.read_time += ckv_stats_clock() - started);
+
+    ckv.cfg = batch->cfg;
+    CKV_STAT(ckv.stats = &job->stats);
+    ckv.data = file.data;
+    ckv.file = &file;
+    ckv.index = NULL;
+    ckv.include = NULL;
+    ckv.current_depth = 0;
+    ckv.ptr = ckv.data;
+
+    /* Same UTF-8 check as ckv_decode_file() */
+    bom = (const unsigned char *)ckv.data;
+    if (file.len > 2 && bom[0] == 239 && bom[1] == 187 && bom[2] == 191) {
+        ckv.ptr += 3;
+    } else if (ckv.cfg->lexer.ch2token[(unsigned char)*ckv.ptr] == T_ERROR) {
+        snprintf(job->error, sizeof(job->error), "ckv parser just support UTF-8");
+        ckv_file_close(&file);
+        return;
+    }
+
+    /* Workers share the config, so keep the pool to the Lua thread */
+    ckv.tmp = strbuf_new(ckv_longest_quoted(ckv.data, file.len) + 1);
+
+    while (ckv_next_ref(&ckv))
+        ;
+
+    ckv_next_token(&ckv, &token);
+    if (token.type != T_END) {
+        job->key = ckv_tree_value(&ckv, job, &token, 1);
+        if (job->key) {
+            ckv_next_token(&ckv, &token);
+            job->value = ckv_tree_value(&ckv, job, &token, 0);
+        }
+    }
+
+    ckv_parse_release(&ckv);
+    CKV_STAT(job->stats.parse_time += ckv_stats_clock() - started -
+                                      job->stats.read_time);
+}
+
+/* Push the Lua value of node, returns 0 when the Lua stack can't grow */
+static int ckv_push_node(lua_State *l, ckv_config_t *cfg, const ckv_node_t *node)
+{
+    const ckv_node_t *child;
+    int i;
+
+    switch (node->type) {
+        case T_STRING:
+            CKV_STAT(cfg->stats.strings++);
+            lua_pushlstring(l, node->value.string, node->string_len);
+            return 1;
+        case T_NUMBER:
+            lua_pushnumber(l, node->value.number);
+            return 1;
+        case T_INTEGER:
+            lua_pushinteger(l, node->value.integer);
+            return 1;
+        default:
+            break;
+    }
+
+    if (!lua_checkstack(l, 3))
+        return 0;
+
+    if (node->object) {
+        lua_createtable(l, 0, node->count / 2);
+        for (child = node->child; child; child = child->next->next) {
+            CKV_STAT(cfg->stats.strings++);
+            if (cfg->decode_key_cache)
+                ckv_key_cache_push(l, &cfg->key_cache, child->value.string,
+                                   child->string_len);
+            else
+                lua_pushlstring(l, child->value.string, child->string_len);
+            if (!ckv_push_node(l, cfg, child->next))
+                return 0;
+            lua_rawset(l, -3);
+        }
+    } else {
+        lua_createtable(l, node->count, 0);
+        for (child = node->child, i = 1; child; child = child->next, i++) {
+            if (!ckv_push_node(l, cfg, child))
+                return 0;
+            lua_rawseti(l, -2, i);
+        }
+    }
+
+    return 1;
+}
+
+static void ckv_free_file_jobs(ckv_file_job_t *jobs, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+        ckv_arena_free(&jobs[i].arena);
+    free(jobs);
+}
+
+/* ckv.decode_files({ path, ... } [, { threads = N }])
+ *
+ * Returns a table with the decode_file_array() result of every path, or
+ * false when that file failed. A second table maps the index of every
+ * failed file to its error message, it is nil when no file failed. */
+static int ckv_decode_files(lua_State *l)
+{
+    ckv_file_batch_t batch;
+    ckv_file_job_t *jobs;
+    size_t paths;
+    int count, threads, failed = 0, i;
+
+    luaL_argcheck(l, lua_gettop(l) >= 1 && lua_gettop(l) <= 2, 1,
+                  "expected 1 or 2 arguments");
+    luaL_checktype(l, 1, LUA_TTABLE);
+
+    threads = ckv_threads_option(l, 2);
+
+    batch.cfg = ckv_fetch_config(l);
+
+    /* The job array size must not overflow */
+    paths = lua_rawlen(l, 1);
+    luaL_argcheck(l, paths <= (size_t)INT_MAX / sizeof(*jobs), 1, "too many paths");
+    count = (int)paths;
+    for (i = 1; i <= count; i++) {
+        lua_rawgeti(l, 1, i);
+        if (lua_type(l, -1) != LUA_TSTRING)
+            luaL_error(l, "path %d is not a string", i);
+        lua_pop(l, 1);
+    }
+
+    lua_createtable(l, count, 0);
+    if (count == 0)
+        return 1;
+
+    jobs = (ckv_file_job_t *)malloc(paths * sizeof(*jobs));
+    if (!jobs)
+        luaL_error(l, "not enough memory");
+
+    /* The path strings stay referenced by the argument table */
+    for (i = 0; i < count; i++) {
+        lua_rawgeti(l, 1, i + 1);
+        jobs[i].path = lua_tostring(l, -1);
+        lua_pop(l, 1);
+        ckv_arena_init(&jobs[i].arena);
+        jobs[i].key = NULL;
+        jobs[i].value = NULL;
+        jobs[i].file_errno = 0;
+        jobs[i].error[0] = '\0';
+        memset(&jobs[i].stats, 0, sizeof(jobs[i].stats));
+    }
+
+    batch.jobs = jobs;
+    ckv_parallel_for(count, threads, ckv_decode_file_job, &batch);
+#ifdef CKV_STATS
+    for (i = 0; i < count; i++)
+        ckv_stats_merge(&batch.cfg->stats, &jobs[i].stats);
+#endif
+
+    /* Same shape as decode_file_array(): { filename = { key = value } } */
+    for (i = 0; i < count; i++) {
+        if (jobs[i].file_errno || jobs[i].error[0]) {
+            lua_pushboolean(l, 0);
+            lua_rawseti(l, -2, i + 1);
+            failed++;
+            continue;
+        }
+
+        lua_createtable(l, 0, 1);
+        lua_pushstring(l, ckv_get_filename(jobs[i].path));
+        lua_createtable(l, 0, jobs[i].key ? 1 : 0);
+        if (jobs[i].key) {
+            if (!ckv_push_node(l, batch.cfg, jobs[i].key) ||
+                !ckv_push_node(l, batch.cfg, jobs[i].value)) {
+                ckv_free_file_jobs(jobs, count);
+                luaL_error(l, "Found too many nested data structures");
+            }
+            lua_rawset(l, -3);
+        }
+        lua_rawset(l, -3);
+        lua_rawseti(l, -2, i + 1);
+
+        /* Release each tree as soon as it is in Lua */
+        ckv_arena_free(&jobs[i].arena);
+    }
+
+    if (!failed) {
+        ckv_free_file_jobs(jobs, count);
+        return 1;
+    }
+
+    lua_createtable(l, 0, failed);
+    for (i = 0; i < count; i++) {
+        if (jobs[i].file_errno)
+            lua_pushfstring(l, "%s: %s", jobs[i].path,
+                            strerror(jobs[i].file_errno));
+        else if (jobs[i].error[0])
+            lua_pushfstring(l, "%s: %s", jobs[i].path, jobs[i].error);
+        else
+            continue;
+        lua_rawseti(l, -2, i + 1);
+    }
+
+    ckv_free_file_jobs(jobs, count);
+
+    return 2;
+}
+
+/* ===== DOCUMENTS =====
+ *
+ * ckv.open(data) parses once into the arena tree of decode_files(), in
+ * the object layout of decode(), and returns it as a document:
+ *
+ *     local doc = ckv.open(str)
+ *     doc:get("DOTAHeroes.npc_dota_hero_axe.AttackRate")
+ *     for k, v in doc:children("DOTAHeroes") do ... end
+ *     doc:totable("DOTAHeroes.npc_dota_hero_axe")
+ *
+ * Paths are those of query(). A lookup costs one step per key: objects
+ * with at least CKV_DOC_INDEX_MIN keys get a hash index of their keys on
+ * the first lookup, smaller ones are scanned. Like decode(), the last of
+ * duplicate keys wins. */
+
+#define CKV_DOC_INDEX_MIN   16
+
+typedef struct {
+    ckv_file_job_t job;     /* Arena and error of the tree builder */
+    ckv_node_t *root;       /* Object holding the root key and value */
+} ckv_doc_t;
+
+static ckv_doc_t *ckv_check_doc(lua_State *l)
+{
+    ckv_doc_t *doc = (ckv_doc_t *)lua_touserdata(l, 1);
+
+    if (!doc || !lua_getmetatable(l, 1) ||
+        !lua_rawequal(l, -1, lua_upvalueindex(2)))
+        luaL_argerror(l, 1, "ckv document expected");
+    lua_pop(l, 1);
+
+    return doc;
+}
+
+static unsigned int ckv_doc_hash(const char *key, size_t len)
+{
+    unsigned int hash = 2166136261u;
+    size_t i;
+
+    /* FNV-1a */
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/* Slots of the key index of an object with pairs keys, a power of 2 */
+static size_t ckv_doc_slots(int pairs)
+{
+    size_t slots = CKV_DOC_INDEX_MIN;
+
+    while (slots < (size_t)pairs * 2)
+        slots *= 2;
+
+    return slots;
+}
+
+/* Build the key index of node, returns -1 when out of memory */
+static int ckv_doc_index(ckv_doc_t *doc, ckv_node_t *node)
+{
+    const size_t mask = ckv_doc_slots(node->count / 2) - 1;
+    ckv_node_t **keys, *child;
+    size_t i;
+
+    keys = (ckv_node_t **)ckv_arena_alloc(&doc->job.arena,
+                                          (mask + 1) * sizeof(*keys));
+    if (!keys)
+        return -1;
+    memset(keys, 0, (mask + 1) * sizeof(*keys));
+
+    for (child = node->child; child; child = child->next->next) {
+        i = ckv_doc_hash(child->value.string, child->string_len) & mask;
+        while (keys[i] && (keys[i]->string_len != child->string_len ||
+                           memcmp(keys[i]->value.string, child->value.string,
+                                  child->string_len)))
+            i = (i + 1) & mask;
+        keys[i] = child;
+    }
+    node->value.keys = keys;
+
+    return 0;
+}
+
+/* Value of key in the object node, or NULL */
+static ckv_node_t *ckv_doc_child(ckv_doc_t *doc, ckv_node_t *node,
+                                 const char *key, size_t len)
+{
+    ckv_node_t *child, *match = NULL;
+    size_t i, mask;
+
+    if (node->type != T_OBJ_BEGIN)
+        return NULL;
+
+    if (node->count / 2 >= CKV_DOC_INDEX_MIN &&
+        (node->value.keys || ckv_doc_index(doc, node) == 0)) {
+        mask = ckv_doc_slots(node->count / 2) - 1;
+        for (i = ckv_doc_hash(key, len) & mask; (child = node->value.keys[i]);
+             i = (i + 1) & mask) {
+            if (child->string_len == len &&
+                !memcmp(child->value.string, key, len))
+                return child->next;
+        }
+        return NULL;
+    }
+
+    for (child = node->child; child; child = child->next->next) {
+        if (child->string_len == len && !memcmp(child->value.string, key, len))
+            match = child->next;
+    }
+
+    return match;
+}
+
+/* Node at the path argument 2, the root object without one */
+static ckv_node_t *ckv_doc_find(lua_State *l, ckv_doc_t *doc)
+{
+    ckv_node_t *node = doc->root;
+    const char *key;
+    size_t len;
+    int path, count, k;
+
+    if (lua_isnoneornil(l, 2))
+        return node;
+
+    count = ckv_query_path(l, 2);
+    path = lua_gettop(l);
+    for (k = 1; k <= count && node; k++) {
+        key = ckv_query_key(l, path, k, &len);
+        node = key ? ckv_doc_child(doc, node, key, len) : NULL;
+    }
     lua_pop(l, 1);
+
+    return node;
+}
+
+/* Push a leaf value, or true for a table */
+static void ckv_doc_push_value(lua_State *l, const ckv_node_t *node)
+{
+    switch (node->type) {
+        case T_STRING:
+            lua_pushlstring(l, node->value.string, node->string_len);
+            break;
+        case T_NUMBER:
+            lua_pushnumber(l, node->value.number);
+            break;
+        case T_INTEGER:
+            lua_pushinteger(l, node->value.integer);
+            break;
+        default:
+            lua_pushboolean(l, 1);
+    }
+}
+
+/* doc:get(path): the value at path, true for a table, nil when missing */
+static int ckv_doc_get(lua_State *l)
+{
+    ckv_node_t *node = ckv_doc_find(l, ckv_check_doc(l));
+
+    if (node)
+        ckv_doc_push_value(l, node);
+    else
+        lua_pushnil(l);
+
+    return 1;
+}
+
+/* Iterator of doc:children(), upvalues are the document and the next key */
+static int ckv_doc_next(lua_State *l)
+{
+    const ckv_node_t *key;
+
+    key = (const ckv_node_t *)lua_touserdata(l, lua_upvalueindex(2));
+    if (!key)
+        return 0;
+
+    lua_pushlightuserdata(l, key->next->next);
+    lua_replace(l, lua_upvalueindex(2));
+    lua_pushlstring(l, key->value.string, key->string_len);
+    ckv_doc_push_value(l, key->next);
+
+    return 2;
+}
+
+/* doc:children(path): iterates the keys and values of the table at path
+ * like doc:get(), nothing for a leaf or a missing path */
+static int ckv_doc_children(lua_State *l)
+{
+    ckv_node_t *node = ckv_doc_find(l, ckv_check_doc(l));
+
+    lua_pushvalue(l, 1);
+    lua_pushlightuserdata(l, node && node->type == T_OBJ_BEGIN ?
+                             node->child : NULL);
+    lua_pushcclosure(l, ckv_doc_next, 2);
+
+    return 1;
+}
+
+/* doc:totable(path): Lua tables of the value at path, the whole document
+ * as decode() returns it without a path */
+static int ckv_doc_totable(lua_State *l)
+{
+    ckv_node_t *node = ckv_doc_find(l, ckv_check_doc(l));
+
+    if (!node)
+        lua_pushnil(l);
+    else if (!ckv_push_node(l, ckv_fetch_config(l), node))
+        luaL_error(l, "Found too many nested data structures");
+
+    return 1;
+}
+
+static int ckv_doc_gc(lua_State *l)
+{
+    ckv_doc_t *doc = ckv_check_doc(l);
+
+    ckv_arena_free(&doc->job.arena);
+    doc->root = NULL;
+
+    return 0;
+}
+
+/* ckv.open(data): the document of data, taken like decode() takes it */
+static int ckv_open(lua_State *l)
+{
+    ckv_parse_t ckv;
+    ckv_token_t token;
+    ckv_node_t *key = NULL, *value = NULL;
+    ckv_doc_t *doc;
+    size_t ckv_len;
+
+    ckv.cfg = ckv_fetch_config(l);
+    CKV_STAT(ckv.stats = &ckv.cfg->stats);
+    ckv.data = ckv_check_source(l, &ckv_len);
+    ckv.file = NULL;
+    ckv.include = NULL;
+    ckv.index = NULL;
+    ckv.current_depth = 0;
+    ckv.ptr = ckv.data;
+
+    if (ckv_len >= 2 && (!ckv.data[0] || !ckv.data[1]))
+        luaL_error(l, "ckv parser does not support UTF-16 or UTF-32");
+
+    /* Set up for __gc first, which frees the arena if the parse fails */
+    doc = (ckv_doc_t *)lua_newuserdata(l, sizeof(*doc));
+    memset(doc, 0, sizeof(*doc));
+    ckv_arena_init(&doc->job.arena);
+    lua_rawgeti(l, LUA_REGISTRYINDEX, ckv.cfg->doc_meta);
+    lua_setmetatable(l, -2);
+
+    ckv.tmp = ckv_scratch_get(&ckv.cfg->scratch, ckv_len);
+
+    doc->root = ckv_tree_node(&doc->job, T_OBJ_BEGIN);
+    ckv_next_token(&ckv, &token);
+    if (doc->root && token.type != T_END) {
+        doc->root->object = 1;
+        if (token.type != T_STRING)
+            ckv_tree_error(&doc->job, "object key string", &token);
+        else if ((key = ckv_tree_value(&ckv, &doc->job, &token, 1)) != NULL) {
+            ckv_next_token(&ckv, &token);
+            value = ckv_tree_value(&ckv, &doc->job, &token, 1);
+        }
+        if (value) {
+            key->next = value;
+            doc->root->child = key;
+            doc->root->count = 2;
+        }
+    }
+
+    ckv_parse_release(&ckv);
+    if (doc->job.error[0])
+        luaL_error(l, "%s", doc->job.error);
+
+    return 1;
+}
+
+/* Create the document metatable, the config userdata is on top of the
+ * stack */
+static void ckv_doc_register(lua_State *l)
+{
+    ckv_config_t *cfg = (ckv_config_t *)lua_touserdata(l, -1);
+    luaL_Reg methods[] = {
+        { "get", ckv_doc_get },
+        { "children", ckv_doc_children },
+        { "totable", ckv_doc_totable },
+        { "__gc", ckv_doc_gc },
+        { NULL, NULL }
+    };
+
+    /* Methods take the config and check their argument against their
+     * own metatable */
     lua_newtable(l);
-    ckv_decode_file(l, filepath);
+    lua_pushvalue(l, -2);
+    lua_pushvalue(l, -2);
+    luaL_setfuncs(l, methods, 2);
+    lua_pushvalue(l, -1);
+    lua_setfield(l, -2, "__index");
+    cfg->doc_meta = luaL_ref(l, LUA_REGISTRYINDEX);
+}
+
+/* ===== QUERIES ===== */
+
+/* Validate a value the query doesn't want, skipping objects whole */
+static void ckv_query_skip(lua_State *l, ckv_parse_t *ckv, ckv_token_t *token)
+{
+    switch (token->type) {
+    case T_STRING:
+    case T_NUMBER:
+    case T_INTEGER:
+    case T_BOOLEAN:
+    case T_NULL:
+        return;
+    case T_OBJ_BEGIN:
+        ckv->ptr = ckv_skip_container(ckv->ptr, CKV_LEX_KV);
+        if (ckv->ptr)
+            return;
+        token->type = T_END;
+        token->index = (int)strlen(ckv->data);
+        ckv_throw_parse_error(l, ckv, "object end", token);
+        break;
+    default:
+        ckv_throw_parse_error(l, ckv, "value", token);
+    }
+}
+
+/* Scan the object opened just before ckv->ptr up to its end. Returns the
+ * start of the value of the last key equal to key (decode() keeps the
+ * last duplicate), or NULL */
+static const char *ckv_query_object(lua_State *l, ckv_parse_t *ckv,
+                                    const char *key, size_t key_len)
+{
+    ckv_token_t token;
+    const char *match = NULL, *value;
+    int hit;
+
+    ckv_next_token(ckv, &token);
+    while (token.type != T_OBJ_END) {
+        if (token.type != T_STRING)
+            ckv_throw_parse_error(l, ckv, "object key string", &token);
+
+        hit = key && (size_t)token.string_len == key_len &&
+              !memcmp(token.value.string, key, key_len);
+
+        value = ckv->ptr;
+        ckv_next_token(ckv, &token);
+        ckv_query_skip(l, ckv, &token);
+        if (hit)
+            match = value;
+
+        ckv_next_token(ckv, &token);
+    }
+
+    return match;
+}
+
+/* query(data, path): the value decode(data)[k1][k2].. or nil. Objects off
+ * the path are skipped by bracket counting, so they are not validated */
+static int ckv_query(lua_State *l)
+{
+    ckv_parse_t ckv;
+    ckv_token_t token;
+    const char *key;
+    size_t ckv_len, key_len;
+    int path, count, k;
+
+    luaL_argcheck(l, lua_gettop(l) == 2, 2, "expected 2 arguments");
+
+    ckv.cfg = ckv_fetch_config(l);
+    CKV_STAT(ckv.stats = &ckv.cfg->stats);
+    ckv.data = luaL_checklstring(l, 1, &ckv_len);
+    count = ckv_query_path(l, 2);
+    path = lua_gettop(l);
+    ckv.file = NULL;
+    ckv.include = NULL;
+    ckv.index = NULL;
+    ckv.current_depth = 0;
+    ckv.ptr = ckv.data;
+
+    if (ckv_len >= 2 && (!ckv.data[0] || !ckv.data[1]))
+        luaL_error(l, "ckv parser does not support UTF-16 or UTF-32");
+
+    ckv.tmp = ckv_scratch_get(&ckv.cfg->scratch, ckv_len);
+
+    /* The root is a single key and value */
+    key = ckv_query_key(l, path, 1, &key_len);
+    ckv_next_token(&ckv, &token);
+    if (token.type != T_STRING || !key || (size_t)token.string_len != key_len ||
+        memcmp(token.value.string, key, key_len)) {
+        ckv_parse_release(&ckv);
+        lua_pushnil(l);
+        return 1;
+    }
+
+    for (k = 2; k <= count; k++) {
+        ckv_next_token(&ckv, &token);
+        if (token.type != T_OBJ_BEGIN) {
+            ckv_parse_release(&ckv);
+            lua_pushnil(l);
+            return 1;
+        }
+
+        key = ckv_query_key(l, path, k, &key_len);
+        ckv.ptr = ckv_query_object(l, &ckv, key, key_len);
+        if (!ckv.ptr) {
+            ckv_parse_release(&ckv);
+            lua_pushnil(l);
+            return 1;
+        }
+    }
+
+    ckv_next_token(&ckv, &token);
+    ckv_process_value(l, &ckv, &token);
+    ckv_parse_release(&ckv);
+
+    return 1;
+}
+
+/* ===== BINARY CACHE ===== */
+
+static int ckv_encode_binary(lua_State *l)
+{
+    ckv_config_t *cfg = ckv_arg_init(l, 1);
+
+    ckv_binary_encode(l, 1, cfg->encode_max_depth);
+
+    return 1;
+}
+
+static int ckv_decode_binary(lua_State *l)
+{
+    ckv_config_t *cfg;
+    const char *data;
+    size_t len;
+
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+
+    cfg = ckv_fetch_config(l);
+    data = luaL_checklstring(l, 1, &len);
+    if (ckv_binary_decode(l, data, len, cfg->decode_max_depth) != 0)
+        luaL_error(l, "Invalid binary KV data");
+
+    return 1;
+}
+
+/* decode_file_array() through a binary cache of the file. The cache also
+ * holds the stamps of every #base file below it */
+static int ckv_decode_file_cached(lua_State *l)
+{
+    ckv_config_t *cfg;
+    const char *filepath;
+    ckv_include_t include;
+    int sources;
+
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+
+    cfg = ckv_fetch_config(l);
+    filepath = luaL_checkstring(l, 1);
+    luaL_argcheck(l, strlen(filepath) < CKV_PATH_MAX, 1, "path too long");
+
+    if (ckv_cache_load(l, filepath, CKV_DIALECT_KV, cfg->decode_max_depth))
+        return 1;
+
+    lua_newtable(l);
+    sources = lua_gettop(l);
+
+    lua_newtable(l);
+    ckv_resolve_path(filepath, include.path, sizeof(include.path));
+    include.ckv = NULL;
+    include.parent = NULL;
+    include.sources = sources;
+    include.deps = 0;
+    ckv_decode_file(l, filepath, &include);
+
+    if (lua_istable(l, -1))
+        ckv_cache_store(l, filepath, -1, sources, CKV_DIALECT_KV,
+                        cfg->encode_max_depth);
+
+    return 1;
+}
+
+/* ===== HOT RELOAD =====
+ *
+ * reload() decodes the file again and patches the old table in place.
+ * Every table of the new tree is hashed bottom up, and the hash stays
+ * recorded for the old table it is merged into: a subtree whose hash
+ * matches the one left by the previous reload is skipped without reading
+ * the old table. The hashes don't depend on the lua_next() order. A table
+ * changed from Lua is only patched back once the file changes under it. */
+
+typedef struct {
+    int hashes;     /* Stack index of { table = content hash }, weak keys */
+    int changed;    /* Stack index of the array of changed paths */
+    int path;       /* Stack index of the keys down to the current table */
+    int depth;      /* Keys of path in use */
+} ckv_reload_t;
+
+static uint64_t ckv_reload_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+static uint64_t ckv_reload_hash_table(lua_State *l, int idx, ckv_reload_t *r);
+
+static uint64_t ckv_reload_hash_value(lua_State *l, int idx, ckv_reload_t *r)
+{
+    uint64_t h = 14695981039346656037ULL;
+    const char *str;
+    lua_Number num;
+    size_t len, i;
+
+    switch (lua_type(l, idx)) {
+    case LUA_TSTRING:
+        /* FNV-1a */
+        str = lua_tolstring(l, idx, &len);
+        for (i = 0; i < len; i++) {
+            h ^= (unsigned char)str[i];
+            h *= 1099511628211ULL;
+        }
+        return ckv_reload_mix(h ^ LUA_TSTRING);
+    case LUA_TNUMBER:
+        /* 1 and 1.0 are equal, so are 0.0 and -0.0 */
+        num = lua_tonumber(l, idx);
+        if (num == 0)
+            num = 0;
+        h = 0;
+        memcpy(&h, &num, sizeof(num) < sizeof(h) ? sizeof(num) : sizeof(h));
+        return ckv_reload_mix(h ^ LUA_TNUMBER);
+    case LUA_TBOOLEAN:
+        return ckv_reload_mix((uint64_t)lua_toboolean(l, idx) << 8 ^ LUA_TBOOLEAN);
+    case LUA_TTABLE:
+        return ckv_reload_hash_table(l, idx, r);
+    default:
+        return ckv_reload_mix((uint64_t)(size_t)lua_topointer(l, idx) ^
+                              (uint64_t)lua_type(l, idx));
+    }
+}
+
+/* Hash of the decoded table at idx, recorded in hashes for it and for
+ * every table below it */
+static uint64_t ckv_reload_hash_table(lua_State *l, int idx, ckv_reload_t *r)
+{
+    uint64_t h = 0;
+    size_t count = 0;
+    int top;
+
+    luaL_checkstack(l, 4, "reload: table too deep");
+    lua_pushnil(l);
+    while (lua_next(l, idx) != 0) {
+        top = lua_gettop(l);
+        h += ckv_reload_mix(ckv_reload_hash_value(l, top - 1, r) * 31 +
+                            ckv_reload_hash_value(l, top, r));
+        count++;
+        lua_pop(l, 1);
+    }
+    h = ckv_reload_mix(h + count) ^ LUA_TTABLE;
+
+    lua_pushvalue(l, idx);
+    lua_pushinteger(l, (lua_Integer)h);
+    lua_rawset(l, r->hashes);
+
+    return h;
+}
+
+/* Append path..key to the changed paths, key is on the top */
+static void ckv_reload_changed(lua_State *l, ckv_reload_t *r)
+{
+    int i;
+
+    lua_createtable(l, r->depth + 1, 0);
+    for (i = 1; i <= r->depth; i++) {
+        lua_rawgeti(l, r->path, i);
+        lua_rawseti(l, -2, i);
+    }
+    lua_pushvalue(l, -2);
+    lua_rawseti(l, -2, r->depth + 1);
+    lua_rawseti(l, r->changed, (lua_Integer)lua_rawlen(l, r->changed) + 1);
+}
+
+/* Make the table at old hold the same as the decoded table at fresh */
+static void ckv_reload_patch(lua_State *l, int old, int fresh, ckv_reload_t *r)
+{
+    int removed, count = 0, i;
+
+    luaL_checkstack(l, 8, "reload: table too deep");
+
+    lua_pushvalue(l, fresh);
+    lua_rawget(l, r->hashes);
+    lua_pushvalue(l, old);
+    lua_rawget(l, r->hashes);
+    if (!lua_isnil(l, -1) && lua_rawequal(l, -1, -2)) {
+        lua_pop(l, 2);
+        return;
+    }
+    lua_pop(l, 1);
+
+    /* New and changed values */
+    lua_pushnil(l);
+    while (lua_next(l, fresh) != 0) {
+        lua_pushvalue(l, -2);
+        lua_rawget(l, old);
+        if (lua_istable(l, -1) && lua_istable(l, -2)) {
+            lua_pushvalue(l, -3);
+            lua_rawseti(l, r->path, ++r->depth);
+            ckv_reload_patch(l, lua_gettop(l), lua_gettop(l) - 1, r);
+            r->depth--;
+        } else if (!lua_rawequal(l, -1, -2)) {
+            lua_pushvalue(l, -3);
+            lua_pushvalue(l, -3);
+            lua_rawset(l, old);
+            lua_pushvalue(l, -3);
+            ckv_reload_changed(l, r);
+            lua_pop(l, 1);
+        }
+        lua_pop(l, 2);
+    }
+
+    /* Keys that are gone, cleared once the traversal is over */
+    lua_pushnil(l);
+    removed = lua_gettop(l);
+    lua_pushnil(l);
+    while (lua_next(l, old) != 0) {
+        lua_pushvalue(l, -2);
+        lua_rawget(l, fresh);
+        if (lua_isnil(l, -1)) {
+            if (!count) {
+                lua_newtable(l);
+                lua_replace(l, removed);
+            }
+            lua_pushvalue(l, -3);
+            lua_rawseti(l, removed, ++count);
+        }
+        lua_pop(l, 2);
+    }
+    for (i = 1; i <= count; i++) {
+        lua_rawgeti(l, removed, i);
+        lua_pushvalue(l, -1);
+        lua_pushnil(l);
+        lua_rawset(l, old);
+        ckv_reload_changed(l, r);
+        lua_pop(l, 1);
+    }
+    lua_pop(l, 1);
+
+    /* The hash of fresh is on the top, old has the same content now */
+    lua_pushvalue(l, old);
+    lua_insert(l, -2);
+    lua_rawset(l, r->hashes);
+}
+
+/* reload(path, old): decode the file like decode_file_array() and patch
+ * old to match it, returning the changed paths as arrays of keys from the
+ * root of old (the form query() takes). Only changed keys are written */
+static int ckv_reload(lua_State *l)
+{
+    ckv_config_t *cfg;
+    const char *filepath;
+    ckv_include_t include;
+    ckv_reload_t r;
+    int top, fresh;
+
+    luaL_argcheck(l, lua_gettop(l) == 2, 2, "expected 2 arguments");
+
+    cfg = ckv_fetch_config(l);
+    filepath = luaL_checkstring(l, 1);
+    luaL_argcheck(l, strlen(filepath) < CKV_PATH_MAX, 1, "path too long");
+    luaL_checktype(l, 2, LUA_TTABLE);
+
+    top = lua_gettop(l);
+    lua_newtable(l);
+    ckv_resolve_path(filepath, include.path, sizeof(include.path));
+    include.ckv = NULL;
+    include.parent = NULL;
+    include.sources = 0;
+    include.deps = 0;
+    ckv_decode_file(l, filepath, &include);
+
+    /* Files that could not be read push nil, message, errno */
+    if (!lua_istable(l, -1))
+        return lua_gettop(l) - top - 1;
+    fresh = lua_gettop(l);
+
+    if (cfg->reload_hashes == LUA_NOREF) {
+        lua_newtable(l);
+        lua_newtable(l);
+        lua_pushliteral(l, "k");
+        lua_setfield(l, -2, "__mode");
+        lua_setmetatable(l, -2);
+        cfg->reload_hashes = luaL_ref(l, LUA_REGISTRYINDEX);
+    }
+    lua_rawgeti(l, LUA_REGISTRYINDEX, cfg->reload_hashes);
+    r.hashes = lua_gettop(l);
+    lua_newtable(l);
+    r.changed = lua_gettop(l);
+    lua_newtable(l);
+    r.path = lua_gettop(l);
+    r.depth = 0;
+
+    ckv_reload_hash_table(l, fresh, &r);
+    ckv_reload_patch(l, 2, fresh, &r);
+    lua_pushvalue(l, r.changed);
 
     return 1;
 }
@@ -1605,8 +2672,27 @@ static int lua_ckv_new(lua_State *l)
         { "encode", ckv_encode },
         { "decode", ckv_decode },
         { "encode2", ckv_encode2 },
+        { "encode_to", ckv_encode_to },
+        { "encode_to_file", ckv_encode_to_file },
         { "decode2", ckv_decode2 },
         { "decode_file_array", ckv_decode_file_array },
+        { "decode_files", ckv_decode_files },
+        { "query", ckv_query },
+        { "open", ckv_open },
+        { "encode_binary", ckv_encode_binary },
+        { "decode_binary", ckv_decode_binary },
+        { "decode_file_cached", ckv_decode_file_cached },
+        { "reload", ckv_reload },
+        { "encode_keep_buffer", ckv_cfg_encode_keep_buffer },
+        { "encode_compact", ckv_cfg_encode_compact },
+        { "encode_sort_keys", ckv_cfg_encode_sort_keys },
+        { "encode_buffer_stats", ckv_encode_buffer_stats },
+        { "stats", ckv_stats },
+        { "decode_presize", ckv_cfg_decode_presize },
+        { "decode_key_cache", ckv_cfg_decode_key_cache },
+        { "decode_scratch_limit", ckv_cfg_decode_scratch_limit },
+        { "decode_base_cache", ckv_cfg_decode_base_cache },
+        { "decode_base_cache_limit", ckv_cfg_decode_base_cache_limit },
         { NULL, NULL }
     };
 
@@ -1615,6 +2701,7 @@ static int lua_ckv_new(lua_State *l)
     lua_newtable(l);
 
     ckv_create_config(l);
+    ckv_doc_register(l);
     luaL_setfuncs(l, reg, 1);
     
     return 1;
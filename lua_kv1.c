@@ -6,46 +6,8 @@ typedef enum
     LoadType_Array
 }LoadType;
 
-static LoadType loadType;
-
-typedef enum {
-    T_OBJ_BEGIN,
-    T_OBJ_END,
-    T_ARR_BEGIN,
-    T_ARR_END,
-    T_STRING,
-    T_NUMBER,
-    T_BOOLEAN,
-    T_NULL,
-    T_COLON,
-    T_COMMA,
-    T_END,
-    T_WHITESPACE,
-    T_ERROR,
-    T_UNKNOWN
-} ckv1_token_type_t;
-
-static const char *ckv1_token_type_name[] = {
-    "T_OBJ_BEGIN",
-    "T_OBJ_END",
-    "T_ARR_BEGIN",
-    "T_ARR_END",
-    "T_STRING",
-    "T_NUMBER",
-    "T_BOOLEAN",
-    "T_NULL",
-    "T_COLON",
-    "T_COMMA",
-    "T_END",
-    "T_WHITESPACE",
-    "T_ERROR",
-    "T_UNKNOWN",
-    NULL
-};
-
 typedef struct {
-    ckv1_token_type_t ch2token[256];
-    char escape2char[256];  /* Decoding */
+    ckv_lexer_t lexer;      /* Decoding */
 
     /* encode_buf is only allocated and used when
      * encode_keep_buffer is set */
@@ -58,30 +20,46 @@ typedef struct {
     int encode_invalid_numbers;     /* 2 => Encode as "null" */
     int encode_number_precision;
     int encode_keep_buffer;
+    int encode_compact;     /* No indentation */
+    int encode_sort_keys;
+    size_t encode_size_hint;    /* Output length of the last encode */
+    int encode_reallocs;    /* Buffer growths over every encode */
+    ckv_sink_t *encode_sink;    /* Sink of the running encode_to, or NULL */
 
     int decode_invalid_numbers;
     int decode_max_depth;
+    int decode_presize;
+    int decode_key_cache;
+    ckv_key_cache_t key_cache;  /* Only used when decode_key_cache is set */
+    ckv_scratch_t scratch;      /* Temporary strings of the decoders */
+    int decode_scratch_limit;   /* Largest scratch buffer kept */
+    ckv_stats_t stats;          /* Only counted with CKV_STATS */
 } ckv1_config_t;
 
+/* A decode_lazy document. meta and proxies are the stack (or upvalue)
+ * indexes of the proxy metatable and the proxy -> offset table, only
+ * valid during the current call */
+typedef struct {
+    ckv_index_t index;
+    const char *data;
+    size_t len;
+    int meta;
+    int proxies;
+} ckv1_lazy_t;
+
 typedef struct {
     const char *data;
     const char *ptr;
     strbuf_t *tmp;    /* Temporary storage for strings */
+    ckv_index_t *index; /* Table shapes when decode_presize is on */
     ckv1_config_t *cfg;
+    ckv_stats_t *stats; /* Set under CKV_STATS only */
     int current_depth;
+    LoadType loadType;  /* decode or decode_array */
+    ckv1_lazy_t *lazy;  /* decode_lazy: nested containers become proxies */
+    int target;         /* Stack index of the proxy the next table fills */
 } ckv1_parse_t;
 
-typedef struct {
-    ckv1_token_type_t type;
-    int index;
-    union {
-        const char *string;
-        double number;
-        int boolean;
-    } value;
-    int string_len;
-} ckv1_token_t;
-
 
 
 /* ===== CONFIGURATION ===== */
@@ -156,6 +134,109 @@ static int ckv1_enum_option(lua_State *l, int optindex, int *setting,
     return 1;
 }
 
+/* Configures ckv1 encoding buffer persistence */
+static int ckv1_cfg_encode_keep_buffer(lua_State *l)
+{
+    ckv1_config_t *cfg = ckv1_arg_init(l, 1);
+    int old_value;
+
+    old_value = cfg->encode_keep_buffer;
+
+    ckv1_enum_option(l, 1, &cfg->encode_keep_buffer, NULL, 1);
+
+    /* Init / free the buffer if the setting has changed */
+    if (old_value ^ cfg->encode_keep_buffer) {
+        if (cfg->encode_keep_buffer)
+            strbuf_init(&cfg->encode_buf, 0);
+        else
+            strbuf_free(&cfg->encode_buf);
+    }
+
+    return 1;
+}
+
+/* Configures whether encoders indent nested tables */
+static int ckv1_cfg_encode_compact(lua_State *l)
+{
+    ckv1_config_t *cfg = ckv1_arg_init(l, 1);
+
+    return ckv1_enum_option(l, 1, &cfg->encode_compact, NULL, 1);
+}
+
+/* Configures whether objects are encoded in sorted key order */
+static int ckv1_cfg_encode_sort_keys(lua_State *l)
+{
+    ckv1_config_t *cfg = ckv1_arg_init(l, 1);
+
+    return ckv1_enum_option(l, 1, &cfg->encode_sort_keys, NULL, 1);
+}
+
+/* Returns { reallocs, length, size }: how often the encode buffer had to
+ * grow over every encode so far, the output length of the last encode and
+ * the size of the kept buffer (0 when encode_keep_buffer is off) */
+static int ckv1_encode_buffer_stats(lua_State *l)
+{
+    ckv1_config_t *cfg = ckv1_arg_init(l, 0);
+
+    lua_createtable(l, 0, 3);
+    lua_pushinteger(l, cfg->encode_reallocs);
+    lua_setfield(l, -2, "reallocs");
+    lua_pushinteger(l, (lua_Integer)cfg->encode_size_hint);
+    lua_setfield(l, -2, "length");
+    lua_pushinteger(l, cfg->encode_keep_buffer ? cfg->encode_buf.size : 0);
+    lua_setfield(l, -2, "size");
+
+    return 1;
+}
+
+/* Returns the parser counters (see ckv_stats_t), nil unless built with
+ * CKV_STATS. stats(true) also resets them */
+static int ckv1_stats(lua_State *l)
+{
+    ckv1_config_t *cfg = ckv1_arg_init(l, 1);
+
+#ifdef CKV_STATS
+    ckv_stats_push(l, &cfg->stats);
+    if (lua_toboolean(l, 1))
+        memset(&cfg->stats, 0, sizeof(cfg->stats));
+#else
+    (void)cfg;
+    lua_pushnil(l);
+#endif
+
+    return 1;
+}
+
+/* Configures the structural pass used to pre-size decoded tables */
+static int ckv1_cfg_decode_presize(lua_State *l)
+{
+    ckv1_config_t *cfg = ckv1_arg_init(l, 1);
+
+    return ckv1_enum_option(l, 1, &cfg->decode_presize, NULL, 1);
+}
+
+/* Configures the largest temporary decode buffer kept between calls */
+static int ckv1_cfg_decode_scratch_limit(lua_State *l)
+{
+    ckv1_config_t *cfg = ckv1_arg_init(l, 1);
+
+    return ckv1_integer_option(l, 1, &cfg->decode_scratch_limit, 0, INT_MAX);
+}
+
+/* Configures reuse of object key strings across decode calls */
+static int ckv1_cfg_decode_key_cache(lua_State *l)
+{
+    ckv1_config_t *cfg = ckv1_arg_init(l, 1);
+
+    ckv1_enum_option(l, 1, &cfg->decode_key_cache, NULL, 1);
+
+    /* Drop the cached strings once the cache is switched off */
+    if (!cfg->decode_key_cache)
+        ckv_key_cache_clear(l, &cfg->key_cache);
+
+    return 1;
+}
+
 #if defined(DISABLE_INVALID_NUMBERS) && !defined(USE_INTERNAL_FPCONV)
 void ckv1_verify_invalid_number_setting(lua_State *l, int *setting)
 {
@@ -173,8 +254,11 @@ static int ckv1_destroy_config(lua_State *l)
     ckv1_config_t *cfg;
 
     cfg = (ckv1_config_t *)lua_touserdata(l, 1);
-    if (cfg)
+    if (cfg) {
         strbuf_free(&cfg->encode_buf);
+        ckv_key_cache_clear(l, &cfg->key_cache);
+        ckv_scratch_free(&cfg->scratch);
+    }
     cfg = NULL;
 
     return 0;
@@ -183,7 +267,6 @@ static int ckv1_destroy_config(lua_State *l)
 static void ckv1_create_config(lua_State *l)
 {
     ckv1_config_t *cfg;
-    int i;
 
     cfg = (ckv1_config_t *)lua_newuserdata(l, sizeof(*cfg));
 
@@ -200,7 +283,18 @@ static void ckv1_create_config(lua_State *l)
     cfg->decode_max_depth = DEFAULT_DECODE_MAX_DEPTH;
     cfg->encode_invalid_numbers = DEFAULT_ENCODE_INVALID_NUMBERS;
     cfg->decode_invalid_numbers = DEFAULT_DECODE_INVALID_NUMBERS;
+    cfg->decode_presize = DEFAULT_DECODE_PRESIZE;
+    cfg->decode_key_cache = DEFAULT_DECODE_KEY_CACHE;
+    ckv_key_cache_init(&cfg->key_cache);
+    ckv_scratch_init(&cfg->scratch);
+    memset(&cfg->stats, 0, sizeof(cfg->stats));
+    cfg->decode_scratch_limit = DEFAULT_DECODE_SCRATCH_LIMIT;
     cfg->encode_keep_buffer = DEFAULT_ENCODE_KEEP_BUFFER;
+    cfg->encode_compact = DEFAULT_ENCODE_COMPACT;
+    cfg->encode_sort_keys = DEFAULT_ENCODE_SORT_KEYS;
+    cfg->encode_size_hint = 0;
+    cfg->encode_reallocs = 0;
+    cfg->encode_sink = NULL;
     cfg->encode_number_precision = DEFAULT_ENCODE_NUMBER_PRECISION;
 
 #if DEFAULT_ENCODE_KEEP_BUFFER > 0
@@ -209,62 +303,65 @@ static void ckv1_create_config(lua_State *l)
 
     /* Decoding init */
 
-    /* Tag all characters as an error */
-    for (i = 0; i < 256; i++)
-        cfg->ch2token[i] = T_ERROR;
-
-    /* Set tokens that require no further processing */
-    cfg->ch2token['{'] = T_OBJ_BEGIN;
-    cfg->ch2token['}'] = T_OBJ_END;
-    cfg->ch2token['['] = T_ARR_BEGIN;
-    cfg->ch2token[']'] = T_ARR_END;
-    cfg->ch2token[','] = T_COMMA;
-    cfg->ch2token['='] = T_COLON;
-    cfg->ch2token['\0'] = T_END;
-    cfg->ch2token[' '] = T_WHITESPACE;
-    cfg->ch2token['\t'] = T_WHITESPACE;
-    cfg->ch2token['\n'] = T_WHITESPACE;
-    cfg->ch2token['\r'] = T_WHITESPACE;
-
-    /* Update characters that require further processing */
-    cfg->ch2token['"'] = T_UNKNOWN;     /* string? */
-    cfg->ch2token['+'] = T_UNKNOWN;     /* number? */
-    cfg->ch2token['-'] = T_UNKNOWN;
-    cfg->ch2token['<'] = T_UNKNOWN;
-    for (i = 0; i < 10; i++)
-        cfg->ch2token['0' + i] = T_UNKNOWN;
-
-    for (i = 0; i < 26; ++i)
-    {
-        cfg->ch2token['a' + i] = T_UNKNOWN;
-        cfg->ch2token['A' + i] = T_UNKNOWN;
-    }
-
-    /* Lookup table for parsing escape characters */
-    for (i = 0; i < 256; i++)
-        cfg->escape2char[i] = 0;          /* String error */
-    cfg->escape2char['"'] = '"';
-    cfg->escape2char['\\'] = '\\';
-    cfg->escape2char['/'] = '/';
-    cfg->escape2char['b'] = '\b';
-    cfg->escape2char['t'] = '\t';
-    cfg->escape2char['n'] = '\n';
-    cfg->escape2char['f'] = '\f';
-    cfg->escape2char['r'] = '\r';
-    cfg->escape2char['u'] = 'u';          /* Unicode parsing required */
+    ckv_lexer_init(&cfg->lexer, CKV_LEX_KV1);
 }
 
 /* ===== ENCODING ===== */
 
+/* ckv1 is NULL when nothing was buffered yet */
 static void ckv1_encode_exception(lua_State *l, ckv1_config_t *cfg, strbuf_t *ckv1, int lindex,
                                   const char *reason)
 {
-    if (!cfg->encode_keep_buffer)
+    if (ckv1 && !cfg->encode_keep_buffer)
         strbuf_free(ckv1);
     luaL_error(l, "Cannot serialise %s: %s",
                   lua_typename(l, lua_type(l, lindex)), reason);
 }
 
+/* Returns the buffer an encode call writes to. A private buffer starts at
+ * the length of the previous output, so encoding documents of a similar
+ * size does not grow it step by step */
+static strbuf_t *ckv1_encode_buffer(ckv1_config_t *cfg, strbuf_t *local)
+{
+    size_t size;
+
+    cfg->encode_sink = NULL;
+
+    if (!cfg->encode_keep_buffer) {
+        /* Headroom for the worst case reservations of the appenders, as
+         * far as a strbuf can hold */
+        size = cfg->encode_size_hint + cfg->encode_size_hint / 8 +
+               STRBUF_DEFAULT_SIZE;
+        strbuf_init(local, size < INT_MAX ? (int)size : INT_MAX);
+        return local;
+    }
+
+    /* Reuse existing buffer */
+    strbuf_reset(&cfg->encode_buf);
+    cfg->encode_buf.reallocs = 0;
+
+    return &cfg->encode_buf;
+}
+
+/* Records the size and growth of a finished encode and frees a private
+ * buffer */
+static void ckv1_encode_buffer_done(ckv1_config_t *cfg, strbuf_t *encode_buf)
+{
+    cfg->encode_size_hint = strbuf_length(encode_buf);
+    cfg->encode_reallocs += encode_buf->reallocs;
+
+    if (!cfg->encode_keep_buffer)
+        strbuf_free(encode_buf);
+}
+
+/* Appends the indentation of a line depth levels deep */
+static inline void ckv1_append_indent(ckv1_config_t *cfg, strbuf_t *buf,
+                                      int depth)
+{
+    if (!cfg->encode_compact)
+        ckv_append_tabs(buf, depth);
+}
+
 /* ckv1_append_string args:
  * - lua_State
  * - KV strbuf
@@ -273,31 +370,11 @@ static void ckv1_encode_exception(lua_State *l, ckv1_config_t *cfg, strbuf_t *ck
  * Returns nothing. Doesn't remove string from Lua stack */
 static void ckv1_append_string(lua_State *l, strbuf_t *ckv1, int lindex, int needQuote)
 {
-    const char *escstr;
     const char *str;
     size_t len;
-    size_t i;
 
     str = lua_tolstring(l, lindex, &len);
-
-    /* Worst case is len * 6 (all unicode escapes).
-     * This buffer is reused constantly for small strings
-     * If there are any excess pages, they won't be hit anyway.
-     * This gains ~5% speedup. */
-    strbuf_ensure_empty_length(ckv1, len * 6 + 2);
-
-    if (needQuote == 1)
-        strbuf_append_char_unsafe(ckv1, '\"');
-    
-    for (i = 0; i < len; i++) {
-        escstr = char2escape[(unsigned char)str[i]];
-        if (escstr)
-            strbuf_append_string(ckv1, escstr);
-        else
-            strbuf_append_char_unsafe(ckv1, str[i]);
-    }
-    if (needQuote == 1)
-        strbuf_append_char_unsafe(ckv1, '\"');
+    ckv_append_escaped(ckv1, str, len, needQuote == 1);
 }
 
 static void ckv1_check_encode_depth(lua_State *l, ckv1_config_t *cfg,
@@ -316,7 +393,7 @@ static void ckv1_check_encode_depth(lua_State *l, ckv1_config_t *cfg,
     if (current_depth <= cfg->encode_max_depth && lua_checkstack(l, 3))
         return;
 
-    if (!cfg->encode_keep_buffer)
+    if (ckv1 && !cfg->encode_keep_buffer)
         strbuf_free(ckv1);
 
     luaL_error(l, "Cannot serialise, excessive nesting (%d)",
@@ -324,7 +401,8 @@ static void ckv1_check_encode_depth(lua_State *l, ckv1_config_t *cfg,
 }
 
 static void ckv1_append_data(lua_State *l, ckv1_config_t *cfg,
-                             int current_depth, strbuf_t *ckv1, int quot);
+                             int current_depth, strbuf_t *ckv1, int quot,
+                             LoadType loadType);
 
 /* ckv1_append_array args:
  * - lua_State
@@ -339,21 +417,15 @@ static void ckv1_append_array(lua_State *l, ckv1_config_t *cfg, int current_dept
         strbuf_append_char(ckv1, '\n');
         lua_rawgeti(l, -1, i);
         
-        for (int j = 0; j < current_depth; j++)
-        {
-            strbuf_append_char(ckv1, '\t');
-        }
+        ckv1_append_indent(cfg, ckv1, current_depth);
         
-        ckv1_append_data(l, cfg, current_depth, ckv1, 1);
+        ckv1_append_data(l, cfg, current_depth, ckv1, 1, LoadType_Map);
         strbuf_append_char(ckv1, ',');
         lua_pop(l, 1);
     }
 
     strbuf_append_char(ckv1, '\n');
-    for (int j = 1; j < current_depth; j++)
-    {
-        strbuf_append_char(ckv1, '\t');
-    }
+    ckv1_append_indent(cfg, ckv1, current_depth - 1);
     strbuf_append_char(ckv1, ']');
 }
 
@@ -361,36 +433,29 @@ static void ckv1_append_object_array(lua_State *l, ckv1_config_t *cfg, int curre
                               strbuf_t *ckv1, int array_length)
 {
     strbuf_append_char(ckv1, '\n');
-    int w;
-    for (w = 1; w < current_depth; w++)
-    {
-        strbuf_append_char(ckv1, '\t');
-    }
+    ckv1_append_indent(cfg, ckv1, current_depth - 1);
 
     lua_rawgeti(l, -1, 1);
     size_t len;
     const char *str = lua_tolstring(l, -1, &len);
     lua_pop(l, 1);
     int isArray = 0;
-    if (strcmp(str, "__IsArray__") != 0) 
+    if (!str || strcmp(str, "__IsArray__") != 0) 
     {
         strbuf_append_char(ckv1, '{');
         strbuf_append_char(ckv1, '\n');
         for (int i = 1; i <= array_length; i+=2) {
 
-            for (w = 0; w < current_depth; w++)
-            {
-                strbuf_append_char(ckv1, '\t');
-            }
+            ckv1_append_indent(cfg, ckv1, current_depth);
 
             lua_rawgeti(l, -1, i);
-            ckv1_append_data(l, cfg, current_depth, ckv1, 0);
+            ckv1_append_data(l, cfg, current_depth, ckv1, 0, LoadType_Array);
             strbuf_append_char(ckv1, '=');
             lua_pop(l, 1);
         
 
             lua_rawgeti(l, -1, i + 1);
-            ckv1_append_data(l, cfg, current_depth, ckv1, 1);
+            ckv1_append_data(l, cfg, current_depth, ckv1, 1, LoadType_Array);
             lua_pop(l, 1);
             
             strbuf_append_char(ckv1, '\n');
@@ -403,14 +468,11 @@ static void ckv1_append_object_array(lua_State *l, ckv1_config_t *cfg, int curre
         strbuf_append_char(ckv1, '\n');
         for (int i = 2; i <= array_length; i++) {
 
-            for (w = 0; w < current_depth; w++)
-            {
-                strbuf_append_char(ckv1, '\t');
-            }
+            ckv1_append_indent(cfg, ckv1, current_depth);
             strbuf_append_char(ckv1, '\"');
             
             lua_rawgeti(l, -1, i);
-            ckv1_append_data(l, cfg, current_depth, ckv1, 0);
+            ckv1_append_data(l, cfg, current_depth, ckv1, 0, LoadType_Array);
             lua_pop(l, 1);
             strbuf_append_char(ckv1, '\"');
             
@@ -419,10 +481,7 @@ static void ckv1_append_object_array(lua_State *l, ckv1_config_t *cfg, int curre
         }
     }
     
-    for (w = 1; w < current_depth; w++)
-    {
-        strbuf_append_char(ckv1, '\t');
-    }
+    ckv1_append_indent(cfg, ckv1, current_depth - 1);
 
     if (!isArray)
     {
@@ -434,18 +493,12 @@ static void ckv1_append_object_array(lua_State *l, ckv1_config_t *cfg, int curre
     }
 }
 
-static void ckv1_append_number(lua_State *l, ckv1_config_t *cfg,
-                               strbuf_t *ckv1, int lindex)
+/* Appends num, which is finite unless encode_invalid_numbers allows it */
+static void ckv1_append_double(ckv1_config_t *cfg, strbuf_t *ckv1, double num)
 {
-    double num = lua_tonumber(l, lindex);
     int len;
 
-    if (cfg->encode_invalid_numbers == 0) {
-        /* Prevent encoding invalid numbers */
-        if (isinf(num) || isnan(num))
-            ckv1_encode_exception(l, cfg, ckv1, lindex,
-                                  "must not be NaN or Infinity");
-    } else if (cfg->encode_invalid_numbers == 1) {
+    if (cfg->encode_invalid_numbers == 1) {
         /* Encode NaN/Infinity separately to ensure Javascript compatible
          * values are used. */
         if (isnan(num)) {
@@ -472,23 +525,34 @@ static void ckv1_append_number(lua_State *l, ckv1_config_t *cfg,
     strbuf_extend_length(ckv1, len);
 }
 
+static void ckv1_append_number(lua_State *l, ckv1_config_t *cfg,
+                               strbuf_t *ckv1, int lindex)
+{
+    double num = lua_tonumber(l, lindex);
+
+    /* Prevent encoding invalid numbers */
+    if (cfg->encode_invalid_numbers == 0 && (isinf(num) || isnan(num)))
+        ckv1_encode_exception(l, cfg, ckv1, lindex,
+                              "must not be NaN or Infinity");
+
+    ckv1_append_double(cfg, ckv1, num);
+}
+
 static void ckv1_append_object(lua_State *l, ckv1_config_t *cfg,
                                int current_depth, strbuf_t *ckv1)
 {
-    int keytype, w = 0;
+    ckv_iter_t it;
+    int keytype;
 
     /* Object */
     strbuf_append_char(ckv1, '{');
     current_depth++;
-    lua_pushnil(l);
+    ckv_iter_begin(l, &it, cfg->encode_sort_keys);
     /* table, startkey */
-    while (lua_next(l, -2) != 0) {
+    while (ckv_iter_next(l, &it)) {
         strbuf_append_char(ckv1, '\n');
         
-        for (w = 2; w < current_depth; w++)
-        {
-            strbuf_append_char(ckv1, '\t');
-        }
+        ckv1_append_indent(cfg, ckv1, current_depth - 2);
         /* table, key, value */
         keytype = lua_type(l, -2);
         if (keytype == LUA_TNUMBER) {
@@ -504,22 +568,22 @@ static void ckv1_append_object(lua_State *l, ckv1_config_t *cfg,
         }
 
         /* table, key, value */
-        ckv1_append_data(l, cfg, current_depth, ckv1, 1);
+        ckv1_append_data(l, cfg, current_depth, ckv1, 1, LoadType_Map);
         lua_pop(l, 1);
         /* table, key */
     }
     strbuf_append_char(ckv1, '\n');
-    for (w = 3; w < current_depth; w++)
-    {
-        strbuf_append_char(ckv1, '\t');
-    }
+    ckv1_append_indent(cfg, ckv1, current_depth - 3);
     strbuf_append_char(ckv1, '}');
 }
 
 /* Serialise Lua data into KV string. */
 static void ckv1_append_data(lua_State *l, ckv1_config_t *cfg,
-                             int current_depth, strbuf_t *ckv1, int needQuot)
+                             int current_depth, strbuf_t *ckv1, int needQuot,
+                             LoadType loadType)
 {
+    ckv_sink_check(l, &cfg->encode_sink, ckv1);
+
     switch (lua_type(l, -1)) {
     case LUA_TSTRING:
         ckv1_append_string(l, ckv1, -1, needQuot);
@@ -570,31 +634,17 @@ static void ckv1_append_data(lua_State *l, ckv1_config_t *cfg,
     }
 }
 
-static int ckv1_encode(lua_State *l)
+/* Appends every key and value of the table on top of the stack */
+static void ckv1_encode_map(lua_State *l, ckv1_config_t *cfg,
+                            strbuf_t *encode_buf)
 {
-    loadType = LoadType_Map;
-    ckv1_config_t *cfg = ckv1_fetch_config(l);
-    strbuf_t local_encode_buf;
-    strbuf_t *encode_buf;
-    char *ckv1;
-    int len;
-
-    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
-
-    if (!cfg->encode_keep_buffer) {
-        /* Use private buffer */
-        encode_buf = &local_encode_buf;
-        strbuf_init(encode_buf, 0);
-    } else {
-        /* Reuse existing buffer */
-        encode_buf = &cfg->encode_buf;
-        strbuf_reset(encode_buf);
-    }
+    ckv_iter_t it;
+    int top = lua_gettop(l);
 
-    lua_pushnil(l);
+    ckv_iter_begin(l, &it, cfg->encode_sort_keys);
     
     int keytype, ln = 0;
-    while (lua_next(l, -2) != 0) {
+    while (ckv_iter_next(l, &it)) {
         if (ln == 1)
         {
             strbuf_append_char(encode_buf, '\n');
@@ -619,23 +669,16 @@ static int ckv1_encode(lua_State *l)
         }
 
         /* table, key, value */
-        ckv1_append_data(l, cfg, 0, encode_buf, 1);
+        ckv1_append_data(l, cfg, 0, encode_buf, 1, LoadType_Map);
         lua_pop(l, 1);
         /* table, key */
     }
 
-    ckv1 = strbuf_string(encode_buf, &len);
-    lua_pushlstring(l, ckv1, len);
-
-    if (!cfg->encode_keep_buffer)
-        strbuf_free(encode_buf);
-
-    return 1;
+    lua_settop(l, top);
 }
 
-static int ckv1_encode_array(lua_State *l)
+static int ckv1_encode(lua_State *l)
 {
-    loadType = LoadType_Array;
     ckv1_config_t *cfg = ckv1_fetch_config(l);
     strbuf_t local_encode_buf;
     strbuf_t *encode_buf;
@@ -644,15 +687,22 @@ static int ckv1_encode_array(lua_State *l)
 
     luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
 
-    if (!cfg->encode_keep_buffer) {
-        /* Use private buffer */
-        encode_buf = &local_encode_buf;
-        strbuf_init(encode_buf, 0);
-    } else {
-        /* Reuse existing buffer */
-        encode_buf = &cfg->encode_buf;
-        strbuf_reset(encode_buf);
-    }
+    encode_buf = ckv1_encode_buffer(cfg, &local_encode_buf);
+    ckv1_encode_map(l, cfg, encode_buf);
+
+    ckv1 = strbuf_string(encode_buf, &len);
+    lua_pushlstring(l, ckv1, len);
+
+    ckv1_encode_buffer_done(cfg, encode_buf);
+
+    return 1;
+}
+
+/* Appends the decode_array form held by the table on top of the stack */
+static void ckv1_encode_list(lua_State *l, ckv1_config_t *cfg,
+                             strbuf_t *encode_buf)
+{
+    int top = lua_gettop(l);
 
     lua_pushnil(l);
     
@@ -664,7 +714,7 @@ static int ckv1_encode_array(lua_State *l)
             strbuf_append_char_unsafe(encode_buf, '\n');
         }
         lua_rawgeti(l, -2, n++); // [table, element]
-        ckv1_append_data(l, cfg, 0, encode_buf, 1);
+        ckv1_append_data(l, cfg, 0, encode_buf, 1, LoadType_Array);
         if (lua_type(l, -1) != LUA_TTABLE)
         {
             lua_pop(l, 1); // [table]
@@ -672,473 +722,394 @@ static int ckv1_encode_array(lua_State *l)
             // strbuf_append_char_unsafe(encode_buf, '=');
 
             lua_rawgeti(l, -2, n++); // [table, element]
-            ckv1_append_data(l, cfg, 0, encode_buf, 1);
+            ckv1_append_data(l, cfg, 0, encode_buf, 1, LoadType_Array);
         }
         lua_pop(l, 1); // [table]
     }
 
-    ckv1 = strbuf_string(encode_buf, &len);
-    lua_pushlstring(l, ckv1, len);
-
-    if (!cfg->encode_keep_buffer)
-        strbuf_free(encode_buf);
-
-    return 1;
+    lua_settop(l, top);
 }
 
-/* ===== DECODING ===== */
+/* Snapshot flag of a table starting with "__IsArray__" */
+#define CKV1_SNAP_LIST 1
 
-static void ckv1_process_value(lua_State *l, ckv1_parse_t *ckv1,
-                               ckv1_token_t *token);
+/* Format flags: the kind of table an item is in */
+#define CKV1_FORMAT_TOP 0
+#define CKV1_FORMAT_PAIR 1      /* ckv1_append_object_array() object */
+#define CKV1_FORMAT_LIST 2      /* ckv1_append_object_array() list */
 
-static int hexdigit2int(char hex)
+static ckv_snap_node_t *ckv1_snap_value(lua_State *l, ckv1_config_t *cfg,
+                                        ckv_snap_t *snap, int current_depth);
+
+/* Copies element i of the table on top of the stack */
+static ckv_snap_node_t *ckv1_snap_element(lua_State *l, ckv1_config_t *cfg,
+                                          ckv_snap_t *snap, int current_depth,
+                                          int i)
 {
-    if ('0' <= hex  && hex <= '9')
-        return hex - '0';
+    ckv_snap_node_t *node;
 
-    /* Force lowercase */
-    hex |= 0x20;
-    if ('a' <= hex && hex <= 'f')
-        return 10 + hex - 'a';
+    lua_rawgeti(l, -1, i);
+    node = ckv1_snap_value(l, cfg, snap, current_depth);
+    lua_pop(l, 1);
 
-    return -1;
+    return node;
 }
 
-static int decode_hex4(const char *hex)
+/* Same walk and errors as ckv1_append_data() with LoadType_Array */
+static ckv_snap_node_t *ckv1_snap_value(lua_State *l, ckv1_config_t *cfg,
+                                        ckv_snap_t *snap, int current_depth)
 {
-    int digit[4];
-    int i;
+    ckv_snap_node_t *node, *key, *last = NULL;
+    const char *str;
+    int array_length, i;
+
+    switch (lua_type(l, -1)) {
+    case LUA_TSTRING:
+        node = ckv_snap_node(l, snap, CKV_SNAP_STRING);
+        node->value.string = lua_tolstring(l, -1, &node->string_len);
+        node->weight += node->string_len;
+        return node;
+    case LUA_TNUMBER:
+        node = ckv_snap_node(l, snap, CKV_SNAP_NUMBER);
+        node->value.number = lua_tonumber(l, -1);
+        if (cfg->encode_invalid_numbers == 0 &&
+            (isinf(node->value.number) || isnan(node->value.number)))
+            ckv1_encode_exception(l, cfg, NULL, -1,
+                                  "must not be NaN or Infinity");
+        node->weight += 8;
+        return node;
+    case LUA_TBOOLEAN:
+        node = ckv_snap_node(l, snap, CKV_SNAP_BOOLEAN);
+        node->value.boolean = lua_toboolean(l, -1);
+        return node;
+    case LUA_TTABLE:
+        current_depth++;
+        ckv1_check_encode_depth(l, cfg, current_depth, NULL);
 
-    /* Convert ASCII hex digit to numeric digit
-     * Note: this returns an error for invalid hex digits, including
-     *       NULL */
-    for (i = 0; i < 4; i++) {
-        digit[i] = hexdigit2int(hex[i]);
-        if (digit[i] < 0) {
-            return -1;
+        node = ckv_snap_node(l, snap, CKV_SNAP_TABLE);
+        node->weight += current_depth * 2;
+        array_length = (int)lua_rawlen(l, -1);
+
+        lua_rawgeti(l, -1, 1);
+        str = lua_tostring(l, -1);
+        if (str && strcmp(str, "__IsArray__") == 0)
+            node->flags = CKV1_SNAP_LIST;
+        lua_pop(l, 1);
+
+        if (node->flags & CKV1_SNAP_LIST) {
+            for (i = 2; i <= array_length; i++)
+                last = ckv_snap_add(node, last, NULL,
+                                    ckv1_snap_element(l, cfg, snap,
+                                                      current_depth, i));
+        } else {
+            /* An odd length pairs the last key with nil */
+            for (i = 1; i <= array_length; i += 2) {
+                key = ckv1_snap_element(l, cfg, snap, current_depth, i);
+                last = ckv_snap_add(node, last, key,
+                                    ckv1_snap_element(l, cfg, snap,
+                                                      current_depth, i + 1));
+            }
         }
+        return node;
+    case LUA_TNIL:
+        return ckv_snap_node(l, snap, CKV_SNAP_NULL);
+    case LUA_TLIGHTUSERDATA:
+        if (lua_touserdata(l, -1) == NULL)
+            return ckv_snap_node(l, snap, CKV_SNAP_NULL);
+        /* fall through */
+    default:
+        ckv1_encode_exception(l, cfg, NULL, -1, "type not supported");
+        /* never returns */
     }
 
-    return (digit[0] << 12) +
-           (digit[1] << 8) +
-           (digit[2] << 4) +
-            digit[3];
+    return NULL;
 }
 
-/* Converts a Unicode codepoint to UTF-8.
- * Returns UTF-8 string length, and up to 4 bytes in *utf8 */
-static int codepoint_to_utf8(char *utf8, int codepoint)
+/* Copies the decode_array form held by the table on top of the stack,
+ * same walk as ckv1_encode_list(). A value other than a table is the key
+ * of the element after it */
+static ckv_snap_node_t *ckv1_snap_list(lua_State *l, ckv1_config_t *cfg,
+                                       ckv_snap_t *snap)
 {
-    /* 0xxxxxxx */
-    if (codepoint <= 0x7F) {
-        utf8[0] = codepoint;
-        return 1;
+    ckv_snap_node_t *root, *key, *value, *last = NULL;
+    int MAX = (int)lua_rawlen(l, -1);
+    int n;
+
+    root = ckv_snap_node(l, snap, CKV_SNAP_TABLE);
+    for (n = 1; n <= MAX;) {
+        key = NULL;
+        value = ckv1_snap_element(l, cfg, snap, 0, n++);
+        if (value->type != CKV_SNAP_TABLE) {
+            key = value;
+            value = ckv1_snap_element(l, cfg, snap, 0, n++);
+        }
+        last = ckv_snap_add(root, last, key, value);
     }
 
-    /* 110xxxxx 10xxxxxx */
-    if (codepoint <= 0x7FF) {
-        utf8[0] = (codepoint >> 6) | 0xC0;
-        utf8[1] = (codepoint & 0x3F) | 0x80;
-        return 2;
-    }
+    return root;
+}
 
-    /* 1110xxxx 10xxxxxx 10xxxxxx */
-    if (codepoint <= 0xFFFF) {
-        utf8[0] = (codepoint >> 12) | 0xE0;
-        utf8[1] = ((codepoint >> 6) & 0x3F) | 0x80;
-        utf8[2] = (codepoint & 0x3F) | 0x80;
-        return 3;
-    }
+static void ckv1_format_item(ckv_snap_t *snap, strbuf_t *ckv1,
+                             const ckv_snap_node_t *item, int current_depth,
+                             int flags);
 
-    /* 11110xxx 10xxxxxx 10xxxxxx 10xxxxxx */
-    if (codepoint <= 0x1FFFFF) {
-        utf8[0] = (codepoint >> 18) | 0xF0;
-        utf8[1] = ((codepoint >> 12) & 0x3F) | 0x80;
-        utf8[2] = ((codepoint >> 6) & 0x3F) | 0x80;
-        utf8[3] = (codepoint & 0x3F) | 0x80;
-        return 4;
-    }
+/* ckv1_append_data() with LoadType_Array off the Lua thread */
+static void ckv1_format_value(ckv_snap_t *snap, strbuf_t *ckv1,
+                              const ckv_snap_node_t *node, int current_depth,
+                              int needQuot)
+{
+    ckv1_config_t *cfg = (ckv1_config_t *)snap->cfg;
+    const ckv_snap_node_t *item;
+    int list, kind;
+
+    switch (node->type) {
+    case CKV_SNAP_STRING:
+        ckv_append_escaped(ckv1, node->value.string, node->string_len,
+                           needQuot);
+        break;
+    case CKV_SNAP_NUMBER:
+        ckv1_append_double(cfg, ckv1, node->value.number);
+        break;
+    case CKV_SNAP_BOOLEAN:
+        if (node->value.boolean)
+            strbuf_append_mem(ckv1, "true", 4);
+        else
+            strbuf_append_mem(ckv1, "false", 5);
+        break;
+    case CKV_SNAP_TABLE:
+        current_depth++;
+        list = node->flags & CKV1_SNAP_LIST;
+        kind = list ? CKV1_FORMAT_LIST : CKV1_FORMAT_PAIR;
 
-    return 0;
+        strbuf_append_char(ckv1, '\n');
+        ckv1_append_indent(cfg, ckv1, current_depth - 1);
+        strbuf_append_char(ckv1, list ? '[' : '{');
+        strbuf_append_char(ckv1, '\n');
+        for (item = node->child; item; item = item->next)
+            if (!ckv_snap_defer(snap, ckv1, &item, current_depth, kind))
+                ckv1_format_item(snap, ckv1, item, current_depth, kind);
+        ckv1_append_indent(cfg, ckv1, current_depth - 1);
+        strbuf_append_char(ckv1, list ? ']' : '}');
+        break;
+    default:
+        strbuf_append_mem(ckv1, "null", 4);
+    }
 }
 
+/* Formats an item the way ckv1_encode_list() (CKV1_FORMAT_TOP) or
+ * ckv1_append_object_array() writes the elements it came from */
+static void ckv1_format_item(ckv_snap_t *snap, strbuf_t *ckv1,
+                             const ckv_snap_node_t *item, int current_depth,
+                             int flags)
+{
+    ckv1_config_t *cfg = (ckv1_config_t *)snap->cfg;
+
+    switch (flags) {
+    case CKV1_FORMAT_TOP:
+        if (item->key)
+            ckv1_format_value(snap, ckv1, item->key, 0, 1);
+        ckv1_format_value(snap, ckv1, item, 0, 1);
+        if (item->next)
+            strbuf_append_char(ckv1, '\n');
+        break;
+    case CKV1_FORMAT_PAIR:
+        ckv1_append_indent(cfg, ckv1, current_depth);
+        ckv1_format_value(snap, ckv1, item->key, current_depth, 0);
+        strbuf_append_char(ckv1, '=');
+        ckv1_format_value(snap, ckv1, item, current_depth, 1);
+        strbuf_append_char(ckv1, '\n');
+        break;
+    default:
+        ckv1_append_indent(cfg, ckv1, current_depth);
+        strbuf_append_char(ckv1, '\"');
+        ckv1_format_value(snap, ckv1, item, current_depth, 0);
+        strbuf_append_char(ckv1, '\"');
+        strbuf_append_char(ckv1, ',');
+        strbuf_append_char(ckv1, '\n');
+    }
+}
 
-/* Called when index pointing to beginning of UTF-16 code escape: \uXXXX
- * \u is guaranteed to exist, but the remaining hex characters may be
- * missing.
- * Translate to UTF-8 and append to temporary token string.
- * Must advance index to the next character to be processed.
- * Returns: 0   success
- *          -1  error
- */
-static int ckv1_append_unicode_escape(ckv1_parse_t *ckv1)
+/* ckv1.encode_array(tb [, { threads = N }])
+ *
+ * With the option table the text is formatted on up to threads threads,
+ * see PARALLEL ENCODING in common.h */
+static int ckv1_encode_array(lua_State *l)
 {
-    char utf8[4];       /* Surrogate pairs require 4 UTF-8 bytes */
-    int codepoint;
-    int surrogate_low;
-    int len;
-    int escape_len = 6;
+    ckv1_config_t *cfg = ckv1_fetch_config(l);
+    strbuf_t local_encode_buf;
+    strbuf_t *encode_buf;
+    ckv_snap_t *snap = NULL;
+    ckv_snap_node_t *root = NULL;
+    char *ckv1;
+    int threads = 1, len;
+
+    luaL_argcheck(l, lua_gettop(l) >= 1 && lua_gettop(l) <= 2, 1,
+                  "expected 1 or 2 arguments");
+    if (!lua_isnoneornil(l, 2))
+        threads = ckv_threads_option(l, 2);
+    lua_settop(l, 1);
+
+    /* The copy raises any error before there is a buffer to free */
+    if (threads > 1) {
+        snap = ckv_snap_new(l, ckv1_format_item, cfg);
+        lua_pushvalue(l, 1);
+        root = ckv1_snap_list(l, cfg, snap);
+        lua_pop(l, 1);
+    }
 
-    /* Fetch UTF-16 code unit */
-    codepoint = decode_hex4(ckv1->ptr + 2);
-    if (codepoint < 0)
-        return -1;
+    encode_buf = ckv1_encode_buffer(cfg, &local_encode_buf);
+    if (snap) {
+        ckv_snap_encode(snap, root, 0, CKV1_FORMAT_TOP, threads, encode_buf);
+        ckv_snap_free(snap);
+    } else {
+        ckv1_encode_list(l, cfg, encode_buf);
+    }
 
-    /* UTF-16 surrogate pairs take the following 2 byte form:
-     *      11011 x yyyyyyyyyy
-     * When x = 0: y is the high 10 bits of the codepoint
-     *      x = 1: y is the low 10 bits of the codepoint
-     *
-     * Check for a surrogate pair (high or low) */
-    if ((codepoint & 0xF800) == 0xD800) {
-        /* Error if the 1st surrogate is not high */
-        if (codepoint & 0x400)
-            return -1;
-
-        /* Ensure the next code is a unicode escape */
-        if (*(ckv1->ptr + escape_len) != '\\' ||
-            *(ckv1->ptr + escape_len + 1) != 'u') {
-            return -1;
-        }
+    ckv1 = strbuf_string(encode_buf, &len);
+    lua_pushlstring(l, ckv1, len);
 
-        /* Fetch the next codepoint */
-        surrogate_low = decode_hex4(ckv1->ptr + 2 + escape_len);
-        if (surrogate_low < 0)
-            return -1;
+    ckv1_encode_buffer_done(cfg, encode_buf);
 
-        /* Error if the 2nd code is not a low surrogate */
-        if ((surrogate_low & 0xFC00) != 0xDC00)
-            return -1;
+    return 1;
+}
 
-        /* Calculate Unicode codepoint */
-        codepoint = (codepoint & 0x3FF) << 10;
-        surrogate_low &= 0x3FF;
-        codepoint = (codepoint | surrogate_low) + 0x10000;
-        escape_len = 12;
-    }
+/* Shared by the encode_to variants, the sink is on top of the stack above
+ * the table and the target */
+static int ckv1_encode_sink(lua_State *l, ckv_sink_t *sink,
+                            void (*encode)(lua_State *, ckv1_config_t *,
+                                           strbuf_t *))
+{
+    ckv1_config_t *cfg = ckv1_fetch_config(l);
 
-    /* Convert codepoint to UTF-8 */
-    len = codepoint_to_utf8(utf8, codepoint);
-    if (!len)
-        return -1;
+    lua_pushvalue(l, 1);
+    cfg->encode_sink = sink;
+    encode(l, cfg, &sink->buf);
+    cfg->encode_sink = NULL;
 
-    /* Append bytes and advance parse index */
-    strbuf_append_mem_unsafe(ckv1->tmp, utf8, len);
-    ckv1->ptr += escape_len;
+    lua_pushinteger(l, (lua_Integer)ckv_sink_close(l, sink));
 
-    return 0;
+    return 1;
 }
 
-static void ckv1_set_token_error(ckv1_token_t *token, ckv1_parse_t *ckv1,
-                                 const char *errtype)
+/* Calls writer(chunk) with the text of encode(tb) as it is encoded,
+ * returns the number of bytes written */
+static int ckv1_encode_to(lua_State *l)
 {
-    token->type = T_ERROR;
-    token->index = ckv1->ptr - ckv1->data;
-    token->value.string = errtype;
+    luaL_argcheck(l, lua_gettop(l) == 2, 2, "expected 2 arguments");
+
+    return ckv1_encode_sink(l, ckv_sink_writer(l, 2), ckv1_encode_map);
 }
 
-static void ckv1_next_string_token(ckv1_parse_t *ckv1, ckv1_token_t *token)
+/* Writes the text of encode(tb) to path as it is encoded, returns the
+ * number of bytes written */
+static int ckv1_encode_to_file(lua_State *l)
 {
-    char *escape2char = ckv1->cfg->escape2char;
-    char ch;
-
-    /* Caller must ensure a string is next */
-    assert(*ckv1->ptr == '"');
-
-    /* Skip " */
-    ckv1->ptr++;
-
-    /* ckv1->tmp is the temporary strbuf used to accumulate the
-     * decoded string value.
-     * ckv1->tmp is sized to handle KV containing only a string value.
-     */
-    strbuf_reset(ckv1->tmp);
+    luaL_argcheck(l, lua_gettop(l) == 2, 2, "expected 2 arguments");
 
-    while ((ch = *ckv1->ptr) != '"') {
-        if (!ch) {
-            /* Premature end of the string */
-            ckv1_set_token_error(token, ckv1, "unexpected end of string");
-            return;
-        }
-
-        int hasBackSlash = 0;
-        while (ch == '\\')
-        {
-            ckv1->ptr++;
-            ch = *ckv1->ptr;
-            hasBackSlash = 1;
-        }
-        if (hasBackSlash)
-        {
-            strbuf_append_char_unsafe(ckv1->tmp, '/');
-        }
-        strbuf_append_char_unsafe(ckv1->tmp, ch);
+    return ckv1_encode_sink(l, ckv_sink_file(l, luaL_checkstring(l, 2)),
+                            ckv1_encode_map);
+}
 
-        ckv1->ptr++;
-    }
+/* encode_to for the decode_array form */
+static int ckv1_encode_array_to(lua_State *l)
+{
+    luaL_argcheck(l, lua_gettop(l) == 2, 2, "expected 2 arguments");
 
-    ckv1->ptr++;    /* Eat final quote (") */
+    return ckv1_encode_sink(l, ckv_sink_writer(l, 2), ckv1_encode_list);
+}
 
-    strbuf_ensure_null(ckv1->tmp);
+/* encode_to_file for the decode_array form */
+static int ckv1_encode_array_to_file(lua_State *l)
+{
+    luaL_argcheck(l, lua_gettop(l) == 2, 2, "expected 2 arguments");
 
-    token->type = T_STRING;
-    token->value.string = strbuf_string(ckv1->tmp, &token->string_len);
+    return ckv1_encode_sink(l, ckv_sink_file(l, luaL_checkstring(l, 2)),
+                            ckv1_encode_list);
 }
 
-static void ckv1_next_string_token_noquote(ckv1_parse_t *ckv1, ckv1_token_t *token)
-{
-    /* ckv1->tmp is the temporary strbuf used to accumulate the
-     * decoded string value.
-     * ckv1->tmp is sized to handle KV containing only a string value.
-     */
-    strbuf_reset(ckv1->tmp);
-    char ch = *ckv1->ptr;
-    while (ch != ' ' && ch != '\t' && ch != '\r' && ch != '\n' && ch != '=') {
-        if (!ch) {
-            /* Premature end of the string */
-            ckv1_set_token_error(token, ckv1, "unexpected end of string");
-            return;
-        }
+/* ===== DECODING ===== */
 
-        int hasBackSlash = 0;
-        while (ch == '\\')
-        {
-            ckv1->ptr++;
-            ch = *ckv1->ptr;
-            hasBackSlash = 1;
-        }
-        if (hasBackSlash)
-        {
-            strbuf_append_char_unsafe(ckv1->tmp, '/');
-        }
-
-        strbuf_append_char_unsafe(ckv1->tmp, ch);
-
-        ckv1->ptr++;
-        ch = *(ckv1->ptr);
-    }
-
-    strbuf_ensure_null(ckv1->tmp);
-
-    token->type = T_STRING;
-    token->value.string = strbuf_string(ckv1->tmp, &token->string_len);
-}
-
-/* KV numbers should take the following form:
- *      -?(0|[1-9]|[1-9][0-9]+)(.[0-9]+)?([eE][-+]?[0-9]+)?
- *
- * ckv1_next_number_token() uses strtod() which allows other forms:
- * - numbers starting with '+'
- * - NaN, -NaN, infinity, -infinity
- * - hexadecimal numbers
- * - numbers with leading zeros
- *
- * ckv1_is_invalid_number() detects "numbers" which may pass strtod()'s
- * error checking, but should not be allowed with strict KV.
- *
- * ckv1_is_invalid_number() may pass numbers which cause strtod()
- * to generate an error.
+/* Fills in the token struct.
+ * T_STRING will return a pointer to the ckv1_parse_t temporary string
+ * T_ERROR will leave the ckv1->ptr pointer at the error.
+ * Keys may be bare words starting with a digit.
  */
-static int ckv1_is_invalid_number(ckv1_parse_t *ckv1)
+static void ckv1_scan_token(ckv1_parse_t *ckv1, ckv_token_t *token, int isKey)
 {
-    const char *p = ckv1->ptr;
-
-    /* Reject numbers starting with + */
-    if (*p == '+')
-        return 1;
-
-    /* Skip minus sign if it exists */
-    if (*p == '-')
-        p++;
-
-    /* Reject numbers starting with 0x, or leading zeros */
-    if (*p == '0') {
-        int ch2 = *(p + 1);
-
-        if ((ch2 | 0x20) == 'x' ||          /* Hex */
-            ('0' <= ch2 && ch2 <= '9'))     /* Leading zero */
-            return 1;
-
-        return 0;
-    } else if (*p <= '9') {
-        return 0;                           /* Ordinary number */
-    }
-
-    /* Reject inf/nan */
-    if (!strncasecmp(p, "inf", 3))
-        return 1;
-    if (!strncasecmp(p, "nan", 3))
-        return 1;
-
-    /* Pass all other numbers which may still be invalid, but
-     * strtod() will catch them. */
-    return 0;
+    ckv_lex_token(&ckv1->cfg->lexer, CKV_LEX_KV1 |
+                  (ckv1->cfg->decode_invalid_numbers ? CKV_LEX_INVALID_NUMBERS : 0) |
+                  (isKey == 1 ? CKV_LEX_KEY : 0),
+                  ckv1->data, &ckv1->ptr, ckv1->tmp, token);
 }
 
-static void ckv1_next_number_token(ckv1_parse_t *ckv1, ckv1_token_t *token)
+/* Every token of the decoders goes through here */
+static inline void ckv1_next_token(ckv1_parse_t *ckv1, ckv_token_t *token,
+                                   int isKey)
 {
-    char *endptr;
-
-    token->type = T_NUMBER;
-    token->value.number = fpconv_strtod(ckv1->ptr, &endptr);
-    if (ckv1->ptr == endptr)
-        ckv1_set_token_error(token, ckv1, "invalid number");
-    else
-        ckv1->ptr = endptr;     /* Skip the processed number */
+    ckv1_scan_token(ckv1, token, isKey);
+    CKV_STAT(ckv1->stats->tokens[token->type]++);
 }
 
-/* Fills in the token struct.
- * T_STRING will return a pointer to the ckv1_parse_t temporary string
- * T_ERROR will leave the ckv1->ptr pointer at the error.
- */
-static void ckv1_next_token(ckv1_parse_t *ckv1, ckv1_token_t *token, int isKey)
+/* Build the structural index of the source when decode_presize is on */
+static void ckv1_parse_index(ckv1_parse_t *ckv1, ckv_index_t *index, size_t len)
 {
-    const ckv1_token_type_t *ch2token = ckv1->cfg->ch2token;
-    int ch;
-
-    /* Eat whitespace. */
-    while (1) {
-        ch = (unsigned char)*(ckv1->ptr);
-        token->type = ch2token[ch];
-        if (token->type != T_WHITESPACE)
-            break;
-        ckv1->ptr++;
-    }
-
-    if (ch == '<')
-    {
-        char skips[] = {'!', '-', '-'};
-        int isMark = 1;
-        //skip mark
-        for (int i = 0; i < 3; i++)
-        {
-            ch = (unsigned char)*(ckv1->ptr + i + 1);
-            if (ch != skips[i])
-            {
-                isMark = 0;
-                break;
-            }
-        }
-
-        if (isMark)
-        {
-            ckv1->ptr += 4;
-            char skips2[] = {'-','-','>'};
-            int offset = 0;
-            while (1)
-            {
-                ch = (unsigned char)*(ckv1->ptr);
-                ckv1->ptr++;
-                if (ch == skips2[offset++])
-                {
-                    if (offset == 3)
-                    {
-                        break;
-                    }
-                }
-                else
-                {
-                    offset = 0;
-                }
-            }
-
-            while (1) {
-                ch = (unsigned char)*(ckv1->ptr);
-                token->type = ch2token[ch];
-                if (token->type != T_WHITESPACE)
-                    break;
-                ckv1->ptr++;
-            }
-        }
-    }
-
-    /* Store location of new token. Required when throwing errors
-     * for unexpected tokens (syntax errors). */
-    token->index = ckv1->ptr - ckv1->data;
-
-    /* Don't advance the pointer for an error or the end */
-    if (token->type == T_ERROR) {
-        ckv1_set_token_error(token, ckv1, "invalid token");
-        return;
-    }
-
-    if (token->type == T_END) {
-        return;
-    }
-
-    if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z'))
-    {
-        ckv1_next_string_token_noquote(ckv1, token);
-        return;
-    }
-
-    if ((ch >= '0' && ch <= '9') || ch == '-')
-    {
-        if (isKey == 1)
-        {
-            ckv1_next_string_token_noquote(ckv1, token);
-            return;
-        }
-    }
-    
-    /* Found a known single character token, advance index and return */
-    if (token->type != T_UNKNOWN) {
-        ckv1->ptr++;
-        return;
-    }
-
-    /* Process characters which triggered T_UNKNOWN
-     *
-     * Must use strncmp() to match the front of the KV string.
-     * KV identifier must be lowercase.
-     * When strict_numbers if disabled, either case is allowed for
-     * Infinity/NaN (since we are no longer following the spec..) */
-    if (ch == '"') {
-        ckv1_next_string_token(ckv1, token);
-        return;
-    } else if (ch == '-' || ('0' <= ch && ch <= '9')) {
-        if (!ckv1->cfg->decode_invalid_numbers && ckv1_is_invalid_number(ckv1)) {
-            ckv1_set_token_error(token, ckv1, "invalid number");
-            return;
-        }
-        ckv1_next_number_token(ckv1, token);
-        return;
-    } else if (ckv1->cfg->decode_invalid_numbers &&
-               ckv1_is_invalid_number(ckv1)) {
-        /* When decode_invalid_numbers is enabled, only attempt to process
-         * numbers we know are invalid KV (Inf, NaN, hex)
-         * This is required to generate an appropriate token error,
-         * otherwise all bad tokens will register as "invalid number"
-         */
-        ckv1_next_number_token(ckv1, token);
-        return;
-    }
+    ckv1->index = NULL;
+    if (ckv1->cfg->decode_presize &&
+        ckv_index_build(index, ckv1->data, len, CKV_LEX_KV1) == 0)
+        ckv1->index = index;
+}
 
-    /* Token starts with t/f/n but isn't recognised above. */
-    ckv1_set_token_error(token, ckv1, "invalid token");
+/* Release the temporary parser string and the table index. Also called
+ * before luaL_error() unwinds the C stack */
+static void ckv1_parse_release(ckv1_parse_t *ckv1)
+{
+    CKV_STAT(ckv1->stats->decodes++;
+             ckv1->stats->bytes += ckv1->ptr - ckv1->data;
+             ckv1->stats->reallocs += ckv1->tmp->reallocs);
+    ckv_scratch_put(&ckv1->cfg->scratch, ckv1->tmp,
+                    ckv1->cfg->decode_scratch_limit);
+    ckv1->tmp = NULL;
+    /* A decode_lazy index lives as long as the document */
+    if (ckv1->index && !ckv1->lazy)
+        ckv_index_free(ckv1->index);
 }
 
 /* This function does not return.
  * DO NOT CALL WITH DYNAMIC MEMORY ALLOCATED.
- * The only supported exception is the temporary parser string
- * ckv1->tmp struct.
+ * The only supported exceptions are the temporary parser string
+ * ckv1->tmp struct and the ckv1->index shapes.
  * ckv1 and token should exist on the stack somewhere.
  * luaL_error() will long_jmp and release the stack */
 static void ckv1_throw_parse_error(lua_State *l, ckv1_parse_t *ckv1,
-                                   const char *exp, ckv1_token_t *token)
+                                   const char *exp, ckv_token_t *token)
 {
-    const char *found;
-
-    strbuf_free(ckv1->tmp);
+    ckv1_parse_release(ckv1);
+    ckv_token_error(l, exp, token, 0);
+}
 
-    if (token->type == T_ERROR)
-        found = token->value.string;
+/* Push an object key, through the key cache when decode_key_cache is on */
+static inline void ckv1_push_key(lua_State *l, ckv1_parse_t *ckv1,
+                               const ckv_token_t *token)
+{
+    CKV_STAT(ckv1->stats->strings++);
+    if (ckv1->cfg->decode_key_cache)
+        ckv_key_cache_push(l, &ckv1->cfg->key_cache, token->value.string,
+                           token->string_len);
     else
-        found = ckv1_token_type_name[token->type];
+        lua_pushlstring(l, token->value.string, token->string_len);
+}
 
-    /* Note: token->index is 0 based, display starting from 1 */
-    luaL_error(l, "Expected %s but found %s at character %d",
-               exp, found, token->index + 1);
+/* Push the table for the container being parsed. When a decode_lazy
+ * proxy is being materialised that is the proxy itself */
+static inline void ckv1_new_table(lua_State *l, ckv1_parse_t *ckv1,
+                                  int narr, int nrec)
+{
+    if (ckv1->target) {
+        lua_pushvalue(l, ckv1->target);
+        ckv1->target = 0;
+    } else {
+        lua_createtable(l, narr, nrec);
+    }
 }
 
 static inline void ckv1_decode_ascend(ckv1_parse_t *ckv1)
@@ -1149,220 +1120,103 @@ static inline void ckv1_decode_ascend(ckv1_parse_t *ckv1)
 static void ckv1_decode_descend(lua_State *l, ckv1_parse_t *ckv1, int slots)
 {
     ckv1->current_depth++;
+    CKV_STAT(ckv_stats_table(ckv1->stats, ckv1->current_depth));
 
     if (ckv1->current_depth <= ckv1->cfg->decode_max_depth &&
         lua_checkstack(l, slots)) {
         return;
     }
 
-    strbuf_free(ckv1->tmp);
+    ckv1_parse_release(ckv1);
     luaL_error(l, "Found too many nested data structures (%d) at character %d",
         ckv1->current_depth, ckv1->ptr - ckv1->data);
 }
 
-static void ckv1_parse_object_context(lua_State *l, ckv1_parse_t *ckv1)
-{
-    ckv1_token_t token;
-
-    /* 3 slots required:
-     * .., table, key, value */
-    ckv1_decode_descend(l, ckv1, 3);
-
-    lua_newtable(l);
-
-    ckv1_next_token(ckv1, &token, 1);
-
-    int HasNestKV3 = 0;
-    /* Handle empty objects */
-    if (token.type == T_OBJ_END) {
-        ckv1_decode_ascend(ckv1);
-        return;
-    }
-
-    if (token.type == T_OBJ_BEGIN)
-    {
-        //可能是kv1里面嵌套了kv3 傻逼v蛇
-        ckv1_next_token(ckv1, &token, 1);
-
-        ckv1_next_token(ckv1, &token, 1);
-        HasNestKV3 = 1;
-    }
-
-    while (1) {
-        if (token.type != T_STRING)
-            ckv1_throw_parse_error(l, ckv1, "object key string", &token);
-
-        /* Push key */
-        lua_pushlstring(l, token.value.string, token.string_len);
-
-        ckv1_next_token(ckv1, &token, 0);
-        if (token.type != T_COLON)
-        {
-            ckv1_process_value(l, ckv1, &token);
-        }
-        else
-        {
-            /* Fetch value */
-            ckv1_next_token(ckv1, &token, 0);
-            ckv1_process_value(l, ckv1, &token);
-        }
-        
-        /* Set key = value */
-        lua_rawset(l, -3);
-
-
-        //key or T_OBJ_END?
-        ckv1_next_token(ckv1, &token, 1);
-
-        if (token.type == T_OBJ_END) {
-            // compatible
-            if (HasNestKV3 == 1)
-            {
-                ckv1_next_token(ckv1, &token, 1);
-            }
-            ckv1_decode_ascend(ckv1);
-            return;
-        }
-    }
-}
 const char* ArrayFlag = "__IsArray__";
 const int ArrayFlagLen = 11;
-/* Handle the array context */
-static void ckv1_parse_array_context(lua_State *l, ckv1_parse_t *ckv1, int isObject)
-{
-    ckv1_token_t token;
-    int i;
-
-    /* 2 slots required:
-     * .., table, value */
-    const int slot = (isObject == 1 ? 3 : 2);
-    ckv1_decode_descend(l, ckv1, slot);
-
-    lua_newtable(l);
-
-    ckv1_next_token(ckv1, &token, isObject);
-
-    /* Handle empty arrays */
-    if (token.type == T_ARR_END || (isObject == 1 && token.type == T_OBJ_END)) {
-        ckv1_decode_ascend(ckv1);
-        return;
-    }
 
-    int HasNestKV3 = 0;
-    if (token.type == T_OBJ_BEGIN)
-    {
-        //可能是kv1里面嵌套了kv3 傻逼v蛇
-        ckv1_next_token(ckv1, &token, 1);
+/* Containers are parsed in a loop, the frame of each open table says
+ * what the value just parsed in it was */
+typedef enum {
+    S1_MAP,             /* Object: the value of a key */
+    S1_ARRAY,           /* Array: an element */
+    S1_LIST_VALUE,      /* decode_array: an element, maybe the key of a pair */
+    S1_LIST_PAIR,       /* decode_array: the value after a ':' */
+    S1_ROOT,            /* Caller: the value of a top level "key" */
+    S1_DOCUMENT,        /* Caller: a top level container, then the end */
+    S1_VALUE            /* Caller: a value left on the stack */
+} ckv1_parse_state_t;
 
-        ckv1_next_token(ckv1, &token, 1);
-        HasNestKV3 = 1;
+typedef struct {
+    ckv1_parse_state_t state;
+    int is_object;      /* decode_array: the array was opened by '{' */
+    int nest_kv3;       /* Opened by two braces, skip an extra one at the end */
+    int i;              /* Next element index */
+    int v;              /* decode_array: next pair number */
+} ckv1_frame_t;
+
+/* Where ckv1_parse_run() is in the source. decode_async keeps it between
+ * slices, the open tables stay on the Lua stack */
+typedef struct {
+    ckv_frames_t stack;     /* The caller's frame at the bottom */
+    ckv_token_t token;      /* The next value while more is set */
+    int more;
+    size_t pause;           /* Stop before a value starting past it */
+} ckv1_run_t;
+
+#define CKV1_RUN_NO_PAUSE ((size_t)-1)
+
+/* Push an empty proxy for the container opened just before ckv1->ptr
+ * and skip over it. The proxy metatable materialises it on first use */
+static void ckv1_lazy_proxy(lua_State *l, ckv1_parse_t *ckv1,
+                            ckv_token_t *token)
+{
+    ckv1_lazy_t *lazy = ckv1->lazy;
+    size_t offset = ckv1->ptr - ckv1->data;
+    const ckv_shape_t *shape;
+
+    shape = ckv_index_find(&lazy->index, offset);
+    if (!shape)
+        ckv1_throw_parse_error(l, ckv1, "indexed container", token);
+
+    if (!lua_checkstack(l, 3)) {
+        ckv1_parse_release(ckv1);
+        luaL_error(l, "Found too many nested data structures (%d) at character %d",
+            ckv1->current_depth, (int)offset);
     }
-    
-    if (loadType == LoadType_Array)
-    {
-        i = 1;
-
-        if (isObject == 0)
-        {
-            lua_pushlstring(l, ArrayFlag, ArrayFlagLen);
-            lua_rawseti(l, -2, i++);
-        }
-        
-        int v = 1;
-        while(1)
-        {
-            ckv1_process_value(l, ckv1, &token);
-            lua_rawseti(l, -2, i++);            /* arr[i] = value */
-            
-            //= or , 
-            ckv1_next_token(ckv1, &token, 0);
-
-            //,
-            if (token.type == T_COMMA)
-            {
-                ckv1_next_token(ckv1, &token, 1);
-            }
 
-            if (token.type == T_COLON)
-            {
-                if (isObject == 0)
-                {
-                    lua_pushinteger(l, v++);
-                    lua_rawseti(l, -2, i++);
-                }
-                
-                ckv1_next_token(ckv1, &token, 0);
-                ckv1_process_value(l, ckv1, &token);
-                lua_rawseti(l, -2, i++);
-
-                ckv1_next_token(ckv1, &token, 1);
-            }
-
-
-            if (token.type == T_ARR_END || (isObject == 1 && token.type == T_OBJ_END))
-            {
-                // compatible
-                if (HasNestKV3 == 1)
-                {
-                    ckv1_next_token(ckv1, &token, 1);
-                }
-                ckv1_decode_ascend(ckv1);
-                return;
-            }
-        }
-    }
-    else
-    {
-        for (i = 1; ; i++)
-        {
-            //,
-            ckv1_process_value(l, ckv1, &token);
-            lua_rawseti(l, -2, i);
-            
-            //,
-            ckv1_next_token(ckv1, &token, 0);
-            if (token.type == T_ARR_END) {
-                ckv1_decode_ascend(ckv1);
-                return;
-            }
+    lua_newtable(l);
+    lua_pushvalue(l, lazy->meta);
+    lua_setmetatable(l, -2);
+    lua_pushvalue(l, -1);
+    lua_pushinteger(l, (lua_Integer)offset);
+    lua_rawset(l, lazy->proxies);
 
-            //value or ]
-            ckv1_next_token(ckv1, &token, 0);
-            if (token.type == T_ARR_END) {
-                ckv1_decode_ascend(ckv1);
-                return;
-            }
-        }
-    }
+    ckv1->ptr = ckv1->data + shape->end;
 }
 
-/* Handle the "value" context */
-static void ckv1_process_value(lua_State *l, ckv1_parse_t *ckv1,
-                               ckv1_token_t *token)
+/* Push the value of a token, containers become decode_lazy proxies */
+static void ckv1_push_value(lua_State *l, ckv1_parse_t *ckv1,
+                            ckv_token_t *token)
 {
     switch (token->type) {
     case T_STRING:
+        CKV_STAT(ckv1->stats->strings++);
         lua_pushlstring(l, token->value.string, token->string_len);
         break;;
     case T_NUMBER:
         lua_pushnumber(l, token->value.number);
         break;;
+    case T_INTEGER:
+        lua_pushinteger(l, token->value.integer);
+        break;;
     case T_BOOLEAN:
         lua_pushboolean(l, token->value.boolean);
         break;;
     case T_OBJ_BEGIN:
-        if (loadType == LoadType_Array)
-        {
-            ckv1_parse_array_context(l, ckv1, 1);
-        }
-        else
-        {
-            ckv1_parse_object_context(l, ckv1);
-        }
-        
-        break;;
     case T_ARR_BEGIN:
-        ckv1_parse_array_context(l, ckv1, 0);
+        /* Only reached under decode_lazy */
+        ckv1_lazy_proxy(l, ckv1, token);
         break;;
     case T_NULL:
         /* In Lua, setting "t[k] = nil" will delete k from the table.
@@ -1374,94 +1228,338 @@ static void ckv1_process_value(lua_State *l, ckv1_parse_t *ckv1,
     }
 }
 
-static int ckv1_decode(lua_State *l)
+/* Push an object key, leaving token at its value */
+static void ckv1_parse_key(lua_State *l, ckv1_parse_t *ckv1,
+                           ckv_token_t *token)
 {
-    loadType = LoadType_Map;
-    ckv1_parse_t ckv1;
-    ckv1_token_t token;
-    size_t ckv1_len;
+    if (token->type != T_STRING)
+        ckv1_throw_parse_error(l, ckv1, "object key string", token);
 
-    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+    /* Push key */
+    ckv1_push_key(l, ckv1, token);
 
-    ckv1.cfg = ckv1_fetch_config(l);
-    ckv1.data = luaL_checklstring(l, 1, &ckv1_len);
-    lua_pop(l, 1);
-    ckv1.current_depth = 0;
-    ckv1.ptr = ckv1.data;
+    /* Fetch value */
+    ckv1_next_token(ckv1, token, 0);
+    if (token->type == T_COLON)
+        ckv1_next_token(ckv1, token, 0);
+}
 
-    /* Detect Unicode other than UTF-8 (see RFC 4627, Sec 3)
-     *
-     * CKV1 can support any simple data type, hence only the first
-     * character is guaranteed to be ASCII (at worst: '"'). This is
-     * still enough to detect whether the wrong encoding is in use. */
-    if (ckv1_len >= 2 && (!ckv1.data[0] || !ckv1.data[1]))
-        luaL_error(l, "KV parser does not support UTF-16 or UTF-32");
+/* Push the table of the container opened by token along with its frame.
+ * Returns 0 when it is empty, otherwise token is its first value */
+static int ckv1_open_table(lua_State *l, ckv1_parse_t *ckv1,
+                           ckv_frames_t *stack, ckv_token_t *token)
+{
+    const int is_object = token->type == T_OBJ_BEGIN;
+    const int list = ckv1->loadType == LoadType_Array;
+    const ckv_shape_t *shape;
+    ckv1_frame_t *frame;
+    int n;
+
+    /* Slots required: .., table, [key or pair number,] value and one to
+     * grow the frames */
+    ckv1_decode_descend(l, ckv1, is_object ? 4 : 3);
+    frame = (ckv1_frame_t *)ckv_frames_push(l, stack);
+    frame->is_object = is_object;
+    frame->nest_kv3 = 0;
+    frame->i = 1;
+    frame->v = 1;
+
+    shape = ckv_index_find(ckv1->index, ckv1->ptr - ckv1->data);
+    if (is_object && !list) {
+        frame->state = S1_MAP;
+        ckv1_new_table(l, ckv1, 0, shape ? shape->values / 2 : 0);
+
+        ckv1_next_token(ckv1, token, 1);
+
+        /* Handle empty objects */
+        if (token->type == T_OBJ_END)
+            return 0;
+    } else {
+        frame->state = list ? S1_LIST_VALUE : S1_ARRAY;
 
-    /* Ensure the temporary buffer can hold the entire string.
-     * This means we no longer need to do length checks since the decoded
-     * string must be smaller than the entire ckv1 string */
-    ckv1.tmp = strbuf_new(ckv1_len);
+        /* Arrays loaded with decode_array also hold the ArrayFlag */
+        n = shape ? shape->values : 0;
+        if (shape && list && !is_object)
+            n++;
+        ckv1_new_table(l, ckv1, n, 0);
 
-    lua_newtable(l);
-    
-    ckv1_next_token(&ckv1, &token, 1);
-    if (token.type == T_STRING)
-    {
-        while (1) {
-            /* Push key */
-            lua_pushlstring(l, token.value.string, token.string_len);
+        ckv1_next_token(ckv1, token, is_object);
 
-            ckv1_next_token(&ckv1, &token, 0);
-            if (token.type == T_COLON)
-            {
-                /* Fetch value */
-                ckv1_next_token(&ckv1, &token, 0);
-                ckv1_process_value(l, &ckv1, &token);
-            }
-            else
-            {
-                //兼容
-                ckv1_process_value(l, &ckv1, &token);
-            }
-            
-            /* Set key = value */
-            lua_rawset(l, -3);
-            
-            ckv1_next_token(&ckv1, &token, 1);
+        /* Handle empty arrays */
+        if (token->type == T_ARR_END || (is_object && token->type == T_OBJ_END))
+            return 0;
+    }
 
-            if (token.type == T_END) {
-                break;
+    if (token->type == T_OBJ_BEGIN)
+    {
+        //可能是kv1里面嵌套了kv3 傻逼v蛇
+        ckv1_next_token(ckv1, token, 1);
+
+        ckv1_next_token(ckv1, token, 1);
+        frame->nest_kv3 = 1;
+    }
+
+    if (frame->state == S1_MAP) {
+        ckv1_parse_key(l, ckv1, token);
+    } else if (list && !is_object) {
+        lua_pushlstring(l, ArrayFlag, ArrayFlagLen);
+        lua_rawseti(l, -2, frame->i++);
+    }
+
+    return 1;
+}
+
+static inline int ckv1_list_end(const ckv1_frame_t *frame,
+                                const ckv_token_t *token)
+{
+    return token->type == T_ARR_END ||
+           (frame->is_object && token->type == T_OBJ_END);
+}
+
+/* Store the value on top of the stack in the table of frame. Returns 0
+ * when that completes the table, otherwise token is its next value */
+static int ckv1_store_value(lua_State *l, ckv1_parse_t *ckv1,
+                            ckv1_frame_t *frame, ckv_token_t *token)
+{
+    switch (frame->state) {
+    case S1_MAP:
+    case S1_ROOT:
+        /* Set key = value */
+        lua_rawset(l, -3);
+
+        //key or T_OBJ_END?
+        ckv1_next_token(ckv1, token, 1);
+        if (token->type != (frame->state == S1_ROOT ? T_END : T_OBJ_END)) {
+            ckv1_parse_key(l, ckv1, token);
+            return 1;
+        }
+        break;;
+    case S1_ARRAY:
+        lua_rawseti(l, -2, frame->i);
+
+        //,
+        ckv1_next_token(ckv1, token, 0);
+        if (token->type == T_ARR_END)
+            return 0;
+
+        //value or ]
+        ckv1_next_token(ckv1, token, 0);
+        if (token->type == T_ARR_END)
+            return 0;
+
+        frame->i++;
+        return 1;
+    case S1_LIST_VALUE:
+        lua_rawseti(l, -2, frame->i++);            /* arr[i] = value */
+
+        //= or ,
+        ckv1_next_token(ckv1, token, 0);
+
+        //,
+        if (token->type == T_COMMA)
+            ckv1_next_token(ckv1, token, 1);
+
+        if (token->type == T_COLON) {
+            if (!frame->is_object) {
+                lua_pushinteger(l, frame->v++);
+                lua_rawseti(l, -2, frame->i++);
             }
+
+            ckv1_next_token(ckv1, token, 0);
+            frame->state = S1_LIST_PAIR;
+            return 1;
         }
+
+        if (!ckv1_list_end(frame, token))
+            return 1;
+        break;;
+    case S1_LIST_PAIR:
+        lua_rawseti(l, -2, frame->i++);
+
+        ckv1_next_token(ckv1, token, 1);
+        frame->state = S1_LIST_VALUE;
+
+        if (!ckv1_list_end(frame, token))
+            return 1;
+        break;;
+    case S1_DOCUMENT:
+        ckv1_next_token(ckv1, token, 0);
+        if (token->type != T_END)
+            ckv1_throw_parse_error(l, ckv1, "the end", token);
+        return 0;
+    case S1_VALUE:
+        return 0;
     }
-    else if (token.type == T_OBJ_BEGIN)
-    {
-        ckv1_process_value(l, &ckv1, &token);
-        
-        ckv1_next_token(&ckv1, &token, 0);
-        if (token.type != T_END)
-            ckv1_throw_parse_error(l, &ckv1, "the end", &token);
+
+    // compatible
+    if (frame->nest_kv3)
+        ckv1_next_token(ckv1, token, 1);
+
+    return 0;
+}
+
+/* Start run with the frame of its caller, the frames userdata (if any)
+ * goes below what is on top of the stack from now on */
+static void ckv1_run_begin(lua_State *l, ckv1_run_t *run, ckv1_frame_t *frames,
+                           int size, ckv1_parse_state_t state)
+{
+    ckv1_frame_t *frame;
+
+    ckv_frames_init(l, &run->stack, frames, size, sizeof(*frames));
+    frame = (ckv1_frame_t *)ckv_frames_push(l, &run->stack);
+    frame->state = state;
+    frame->nest_kv3 = 0;
+    run->more = 1;
+    run->pause = CKV1_RUN_NO_PAUSE;
+}
+
+/* Parse on from run->token with everything nested in it. Returns 1 once
+ * the value of the caller's frame is complete, or 0 at a value starting
+ * past run->pause */
+static int ckv1_parse_run(lua_State *l, ckv1_parse_t *ckv1, ckv1_run_t *run)
+{
+    ckv_token_t *token = &run->token;
+    ckv1_frame_t *frame = (ckv1_frame_t *)ckv_frames_top(&run->stack);
+
+    while (1) {
+        if (!run->more) {
+            /* The table is a value of the one below */
+            ckv1_decode_ascend(ckv1);
+            frame = (ckv1_frame_t *)ckv_frames_pop(&run->stack);
+        } else if ((size_t)(ckv1->ptr - ckv1->data) > run->pause) {
+            return 0;
+        } else if (!ckv1->lazy &&
+                   (token->type == T_OBJ_BEGIN || token->type == T_ARR_BEGIN)) {
+            run->more = ckv1_open_table(l, ckv1, &run->stack, token);
+            frame = (ckv1_frame_t *)ckv_frames_top(&run->stack);
+            continue;
+        } else {
+            ckv1_push_value(l, ckv1, token);
+        }
+
+        run->more = ckv1_store_value(l, ckv1, frame, token);
+        if (!run->more && run->stack.count == 1)
+            return 1;
+    }
+}
+
+/* Parse the container opened by token with everything nested in it,
+ * leaving its table on top of the stack */
+static void ckv1_parse_container(lua_State *l, ckv1_parse_t *ckv1,
+                                 ckv_token_t *token)
+{
+    ckv1_frame_t frames[CKV_FRAMES_INLINE];
+    ckv1_run_t run;
+
+    ckv1_run_begin(l, &run, frames, CKV_FRAMES_INLINE, S1_VALUE);
+    run.token = *token;
+    run.more = ckv1_open_table(l, ckv1, &run.stack, &run.token);
+    ckv1_parse_run(l, ckv1, &run);
+    ckv_frames_free(l, &run.stack);
+}
+
+/* Handle the "value" context */
+static void ckv1_process_value(lua_State *l, ckv1_parse_t *ckv1,
+                               ckv_token_t *token)
+{
+    if (!ckv1->lazy &&
+        (token->type == T_OBJ_BEGIN || token->type == T_ARR_BEGIN))
+        ckv1_parse_container(l, ckv1, token);
+    else
+        ckv1_push_value(l, ckv1, token);
+}
+
+/* Push the table of a decode() source and start run on its top level.
+ * Returns 0 when there is nothing to parse */
+static int ckv1_root_begin(lua_State *l, ckv1_parse_t *ckv1, ckv1_run_t *run,
+                           ckv1_frame_t *frames, int size)
+{
+    ckv1_frame_t *frame;
+    ckv_token_t *token = &run->token;
+
+    /* Below the table, the top level keys come and go above it */
+    ckv1_run_begin(l, run, frames, size, S1_ROOT);
+    frame = (ckv1_frame_t *)ckv_frames_top(&run->stack);
+    lua_newtable(l);
+
+    ckv1_next_token(ckv1, token, 1);
+    if (token->type == T_STRING)
+        ckv1_parse_key(l, ckv1, token);
+    else if (token->type == T_OBJ_BEGIN)
+        frame->state = S1_DOCUMENT;
+    else
+        return 0;
+
+    return 1;
+}
+
+/* Parse the top level of a decode() source, leaving the result on top
+ * of the stack */
+static void ckv1_decode_root(lua_State *l, ckv1_parse_t *ckv1)
+{
+    ckv1_frame_t frames[CKV_FRAMES_INLINE];
+    ckv1_run_t run;
+
+    if (ckv1_root_begin(l, ckv1, &run, frames, CKV_FRAMES_INLINE)) {
+        ckv1_parse_run(l, ckv1, &run);
+        ckv_frames_free(l, &run.stack);
     }
+}
+
+static int ckv1_decode(lua_State *l)
+{
+    ckv1_parse_t ckv1;
+    ckv_index_t index;
+    size_t ckv1_len;
+
+    ckv1.cfg = ckv1_fetch_config(l);
+    CKV_STAT(ckv1.stats = &ckv1.cfg->stats);
+    ckv1.data = ckv_check_source(l, &ckv1_len);
+    ckv1.current_depth = 0;
+    ckv1.loadType = LoadType_Map;
+    ckv1.ptr = ckv1.data;
+    ckv1.lazy = NULL;
+    ckv1.target = 0;
+
+    /* Detect Unicode other than UTF-8 (see RFC 4627, Sec 3)
+     *
+     * CKV1 can support any simple data type, hence only the first
+     * character is guaranteed to be ASCII (at worst: '"'). This is
+     * still enough to detect whether the wrong encoding is in use. */
+    if (ckv1_len >= 2 && (!ckv1.data[0] || !ckv1.data[1]))
+        luaL_error(l, "KV parser does not support UTF-16 or UTF-32");
+
+    /* Ensure the temporary buffer can hold the entire string.
+     * This means we no longer need to do length checks since the decoded
+     * string must be smaller than the entire ckv1 string */
+    ckv1.tmp = ckv_scratch_get(&ckv1.cfg->scratch, ckv1_len);
+    ckv1_parse_index(&ckv1, &index, ckv1_len);
+
+    ckv1_decode_root(l, &ckv1);
     
-    strbuf_free(ckv1.tmp);
+    ckv1_parse_release(&ckv1);
 
     return 1;
 }
 
 static int ckv1_decode_array(lua_State *l)
 {
-    loadType = LoadType_Array;
     ckv1_parse_t ckv1;
-    ckv1_token_t token;
+    ckv_token_t token;
+    ckv_index_t index;
     size_t ckv1_len;
 
     luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
 
     ckv1.cfg = ckv1_fetch_config(l);
+    CKV_STAT(ckv1.stats = &ckv1.cfg->stats);
     ckv1.data = luaL_checklstring(l, 1, &ckv1_len);
     lua_pop(l, 1);
     ckv1.current_depth = 0;
+    ckv1.loadType = LoadType_Array;
     ckv1.ptr = ckv1.data;
+    ckv1.lazy = NULL;
+    ckv1.target = 0;
 
     /* Detect Unicode other than UTF-8 (see RFC 4627, Sec 3)
      *
@@ -1474,7 +1572,8 @@ static int ckv1_decode_array(lua_State *l)
     /* Ensure the temporary buffer can hold the entire string.
      * This means we no longer need to do length checks since the decoded
      * string must be smaller than the entire ckv1 string */
-    ckv1.tmp = strbuf_new(ckv1_len);
+    ckv1.tmp = ckv_scratch_get(&ckv1.cfg->scratch, ckv1_len);
+    ckv1_parse_index(&ckv1, &index, ckv1_len);
     
     lua_newtable(l);
     
@@ -1523,7 +1622,726 @@ static int ckv1_decode_array(lua_State *l)
         }
     }
     
-    strbuf_free(ckv1.tmp);
+    ckv1_parse_release(&ckv1);
+
+    return 1;
+}
+
+/* ===== LAZY DECODING ===== */
+
+/* decode_lazy() only builds the top level. Nested objects and arrays
+ * become empty proxy tables sharing one metatable, the proxy table maps
+ * each of them to the offset just past its opening bracket. The first
+ * access through the metatable parses that level into the proxy itself
+ * (its own children becoming proxies in turn) and drops the metatable.
+ * ckv1_lazy_scan() finds where each container starts and ends first.
+ *
+ * Metamethod upvalues:
+ *      1: config, 2: document, 3: source string, 4: proxies, 5: meta */
+
+static int ckv1_lazy_gc(lua_State *l)
+{
+    ckv1_lazy_t *lazy = (ckv1_lazy_t *)lua_touserdata(l, 1);
+
+    ckv_index_free(&lazy->index);
+
+    return 0;
+}
+
+/* Materialise the proxy at stack index 1 unless already done */
+static void ckv1_lazy_fill(lua_State *l)
+{
+    ckv1_lazy_t *lazy;
+    ckv1_parse_t ckv1;
+    ckv_token_t token;
+    const ckv_shape_t *shape;
+    size_t offset;
+
+    luaL_checktype(l, 1, LUA_TTABLE);
+    lazy = (ckv1_lazy_t *)lua_touserdata(l, lua_upvalueindex(2));
+    lazy->proxies = lua_upvalueindex(4);
+    lazy->meta = lua_upvalueindex(5);
+
+    lua_pushvalue(l, 1);
+    lua_rawget(l, lazy->proxies);
+    if (lua_isnil(l, -1)) {
+        lua_pop(l, 1);
+        return;
+    }
+    offset = (size_t)lua_tointeger(l, -1);
+    lua_pop(l, 1);
+
+    shape = ckv_index_lookup(&lazy->index, offset);
+    if (!shape)
+        luaL_error(l, "BUG: Unknown CKV1 lazy offset %d", (int)offset);
+
+    ckv1.cfg = ckv1_fetch_config(l);
+    CKV_STAT(ckv1.stats = &ckv1.cfg->stats);
+    ckv1.data = lazy->data;
+    ckv1.ptr = lazy->data + offset;
+    /* ckv1_parse_release() counts the bytes from data */
+    CKV_STAT(ckv1.stats->bytes -= offset);
+    ckv1.current_depth = 0;
+    ckv1.loadType = LoadType_Map;
+    ckv1.lazy = lazy;
+    ckv1.target = 1;
+    ckv1.index = &lazy->index;
+    lazy->index.next = (int)(shape - lazy->index.shapes);
+
+    /* Strings end before the source does */
+    ckv1.tmp = ckv_scratch_get(&ckv1.cfg->scratch, lazy->len - offset);
+
+    /* Writes are raw, the proxy keeps its metatable until the level is
+     * complete so a failed parse is retried on the next access */
+    token.type = lazy->data[offset - 1] == '{' ? T_OBJ_BEGIN : T_ARR_BEGIN;
+    ckv1_parse_container(l, &ckv1, &token);
+    lua_pop(l, 1);
+
+    ckv1_parse_release(&ckv1);
+
+    lua_pushvalue(l, 1);
+    lua_pushnil(l);
+    lua_rawset(l, lazy->proxies);
+    lua_pushnil(l);
+    lua_setmetatable(l, 1);
+}
+
+static int ckv1_lazy_index(lua_State *l)
+{
+    ckv1_lazy_fill(l);
+    lua_settop(l, 2);
+    lua_rawget(l, 1);
+
+    return 1;
+}
+
+static int ckv1_lazy_newindex(lua_State *l)
+{
+    ckv1_lazy_fill(l);
+    lua_settop(l, 3);
+    lua_rawset(l, 1);
+
+    return 0;
+}
+
+static int ckv1_lazy_len(lua_State *l)
+{
+    ckv1_lazy_fill(l);
+    lua_pushinteger(l, (lua_Integer)lua_rawlen(l, 1));
+
+    return 1;
+}
+
+static int ckv1_lazy_next(lua_State *l)
+{
+    luaL_checktype(l, 1, LUA_TTABLE);
+    lua_settop(l, 2);
+    if (lua_next(l, 1))
+        return 2;
+
+    lua_pushnil(l);
+
+    return 1;
+}
+
+static int ckv1_lazy_pairs(lua_State *l)
+{
+    ckv1_lazy_fill(l);
+    lua_pushcfunction(l, ckv1_lazy_next);
+    lua_pushvalue(l, 1);
+    lua_pushnil(l);
+
+    return 3;
+}
+
+/* A container being skipped by ckv1_skip_tokens() */
+typedef struct {
+    ckv1_parse_state_t state;   /* S1_MAP or S1_ARRAY */
+    int nest_kv3;
+    int shape;
+} ckv1_scan_frame_t;
+
+/* Skip the container opened by token (ckv1->ptr just past its bracket)
+ * with everything nested in it, taking the same tokens in the same order
+ * as ckv1_parse_run() but pushing nothing. Counting brackets the way
+ * ckv_skip_container() does can't find the end: the token
+ * ckv1_store_value() drops after an array item and the ones dropped
+ * around a nested kv3 object may be brackets. Raises the error of
+ * decode() for a container it rejects.
+ *
+ * With an index, the shape of every container is appended to it, size
+ * being the room ckv_index_push() keeps track of */
+static void ckv1_skip_tokens(lua_State *l, ckv1_parse_t *ckv1,
+                             ckv_token_t *token, ckv_index_t *index,
+                             int *size)
+{
+    ckv1_scan_frame_t frames[CKV_FRAMES_INLINE];
+    ckv1_scan_frame_t *frame = NULL;
+    ckv_frames_t stack;
+    int is_object;
+
+    ckv_frames_init(l, &stack, frames, CKV_FRAMES_INLINE, sizeof(*frames));
+
+    while (1) {
+        /* token is a value of frame, or the container itself */
+        if (token->type == T_OBJ_BEGIN || token->type == T_ARR_BEGIN) {
+            is_object = token->type == T_OBJ_BEGIN;
+            frame = (ckv1_scan_frame_t *)ckv_frames_push(l, &stack);
+            frame->state = is_object ? S1_MAP : S1_ARRAY;
+            frame->nest_kv3 = 0;
+            frame->shape = -1;
+            if (index) {
+                frame->shape = ckv_index_push(index, size,
+                                              ckv1->ptr - ckv1->data);
+                if (frame->shape < 0) {
+                    ckv1_parse_release(ckv1);
+                    luaL_error(l, "Out of memory indexing the KV source");
+                }
+            }
+
+            ckv1_scan_token(ckv1, token, is_object);
+            if (token->type == T_ARR_END ||
+                (is_object && token->type == T_OBJ_END))
+                goto close;
+            if (token->type == T_OBJ_BEGIN) {
+                ckv1_scan_token(ckv1, token, 1);
+                ckv1_scan_token(ckv1, token, 1);
+                frame->nest_kv3 = 1;
+            }
+            if (is_object)
+                goto key;
+            if (index)
+                index->shapes[frame->shape].values++;
+            continue;
+        }
+
+        switch (token->type) {
+        case T_STRING:
+        case T_NUMBER:
+        case T_INTEGER:
+        case T_BOOLEAN:
+        case T_NULL:
+            break;
+        default:
+            ckv1_throw_parse_error(l, ckv1, "value", token);
+        }
+
+next:
+        /* Past a value of frame, as in ckv1_store_value() */
+        if (frame->state == S1_MAP) {
+            ckv1_scan_token(ckv1, token, 1);
+            if (token->type != T_OBJ_END)
+                goto key;
+            if (frame->nest_kv3)
+                ckv1_scan_token(ckv1, token, 1);
+            goto close;
+        }
+        ckv1_scan_token(ckv1, token, 0);
+        if (token->type == T_ARR_END)
+            goto close;
+        ckv1_scan_token(ckv1, token, 0);
+        if (token->type == T_ARR_END)
+            goto close;
+        if (index)
+            index->shapes[frame->shape].values++;
+        continue;
+
+key:
+        /* As in ckv1_parse_key() */
+        if (token->type != T_STRING)
+            ckv1_throw_parse_error(l, ckv1, "object key string", token);
+        ckv1_scan_token(ckv1, token, 0);
+        if (token->type == T_COLON)
+            ckv1_scan_token(ckv1, token, 0);
+        if (index)
+            index->shapes[frame->shape].values += 2;
+        continue;
+
+close:
+        if (index)
+            index->shapes[frame->shape].end = ckv1->ptr - ckv1->data;
+        frame = (ckv1_scan_frame_t *)ckv_frames_pop(&stack);
+        if (!frame)
+            break;
+        goto next;
+    }
+
+    ckv_frames_free(l, &stack);
+}
+
+/* Record where each container of the source starts and where
+ * ckv1_parse_run() stops reading it, the top level read as in
+ * ckv1_root_begin(). Raises the error of decode() for a source it
+ * rejects */
+static void ckv1_lazy_scan(lua_State *l, ckv1_parse_t *ckv1,
+                           ckv_index_t *index)
+{
+    ckv_token_t token;
+    int size = 0;
+
+    ckv1_scan_token(ckv1, &token, 1);
+    if (token.type == T_OBJ_BEGIN) {
+        ckv1_skip_tokens(l, ckv1, &token, index, &size);
+        ckv1_scan_token(ckv1, &token, 0);
+        if (token.type != T_END)
+            ckv1_throw_parse_error(l, ckv1, "the end", &token);
+        return;
+    }
+
+    while (token.type == T_STRING) {
+        ckv1_scan_token(ckv1, &token, 0);
+        if (token.type == T_COLON)
+            ckv1_scan_token(ckv1, &token, 0);
+        switch (token.type) {
+        case T_OBJ_BEGIN:
+        case T_ARR_BEGIN:
+            ckv1_skip_tokens(l, ckv1, &token, index, &size);
+            break;
+        case T_STRING:
+        case T_NUMBER:
+        case T_INTEGER:
+        case T_BOOLEAN:
+        case T_NULL:
+            break;
+        default:
+            ckv1_throw_parse_error(l, ckv1, "value", &token);
+        }
+
+        ckv1_scan_token(ckv1, &token, 1);
+        if (token.type == T_END)
+            return;
+        if (token.type != T_STRING)
+            ckv1_throw_parse_error(l, ckv1, "object key string", &token);
+    }
+}
+
+static int ckv1_decode_lazy(lua_State *l)
+{
+    luaL_Reg meta[] = {
+        { "__index", ckv1_lazy_index },
+        { "__newindex", ckv1_lazy_newindex },
+        { "__len", ckv1_lazy_len },
+        { "__pairs", ckv1_lazy_pairs },
+        { NULL, NULL }
+    };
+    const luaL_Reg *reg;
+    ckv1_parse_t ckv1;
+    ckv1_lazy_t *lazy;
+    size_t ckv1_len;
+
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+
+    ckv1.cfg = ckv1_fetch_config(l);
+    CKV_STAT(ckv1.stats = &ckv1.cfg->stats);
+    ckv1.data = luaL_checklstring(l, 1, &ckv1_len);
+
+    if (ckv1_len >= 2 && (!ckv1.data[0] || !ckv1.data[1]))
+        luaL_error(l, "KV parser does not support UTF-16 or UTF-32");
+
+    /* 2: document, owns the index */
+    lazy = (ckv1_lazy_t *)lua_newuserdata(l, sizeof(*lazy));
+    lazy->index.shapes = NULL;
+    lazy->index.count = 0;
+    lazy->data = ckv1.data;
+    lazy->len = ckv1_len;
+    lua_newtable(l);
+    lua_pushcfunction(l, ckv1_lazy_gc);
+    lua_setfield(l, -2, "__gc");
+    lua_setmetatable(l, -2);
+
+    /* 3: proxies, weak keys */
+    lua_newtable(l);
+    lua_newtable(l);
+    lua_pushliteral(l, "k");
+    lua_setfield(l, -2, "__mode");
+    lua_setmetatable(l, -2);
+
+    /* 4: proxy metatable */
+    lua_newtable(l);
+    for (reg = meta; reg->name; reg++) {
+        lua_pushvalue(l, lua_upvalueindex(1));
+        lua_pushvalue(l, 2);
+        lua_pushvalue(l, 1);
+        lua_pushvalue(l, 3);
+        lua_pushvalue(l, 4);
+        lua_pushcclosure(l, reg->func, 5);
+        lua_setfield(l, 4, reg->name);
+    }
+    lazy->proxies = 3;
+    lazy->meta = 4;
+
+    ckv1.ptr = ckv1.data;
+    ckv1.current_depth = 0;
+    ckv1.loadType = LoadType_Map;
+    ckv1.lazy = lazy;
+    ckv1.target = 0;
+    ckv1.index = NULL;
+    ckv1.tmp = ckv_scratch_get(&ckv1.cfg->scratch, ckv1_len);
+
+    ckv1_lazy_scan(l, &ckv1, &lazy->index);
+    ckv1.ptr = ckv1.data;
+    ckv1.index = &lazy->index;
+    lazy->index.next = 0;
+
+    ckv1_decode_root(l, &ckv1);
+
+    ckv1_parse_release(&ckv1);
+
+    return 1;
+}
+
+/* ===== TIME-SLICED DECODING =====
+ *
+ * decode_async() decodes like decode() from inside a coroutine, yielding
+ * whenever a slice has taken its time budget. The parser state lives in
+ * a userdata at stack index 2 and the open tables stay on the coroutine
+ * stack, so the lua_yieldk() continuation parses on where it stopped.
+ * Outside a coroutine, or before Lua 5.3, it decodes in one go. */
+
+/* Source bytes parsed between two clock reads */
+#define CKV1_ASYNC_STEP 4096
+
+/* Stack index of the ckv1_async_t, after the source */
+#define CKV1_ASYNC_STATE 2
+
+#if LUA_VERSION_NUM >= 503
+#define CKV1_ASYNC_YIELDABLE(l) lua_isyieldable(l)
+#else
+#define CKV1_ASYNC_YIELDABLE(l) 0
+#endif
+
+typedef struct {
+    ckv1_parse_t ckv1;
+    ckv_index_t index;
+    ckv1_run_t run;
+    ckv1_frame_t frames[CKV_FRAMES_INLINE];
+    double budget;          /* Seconds per slice */
+    int top;                /* Stack top while suspended */
+} ckv1_async_t;
+
+static int ckv1_async_gc(lua_State *l)
+{
+    ckv1_async_t *async = (ckv1_async_t *)lua_touserdata(l, 1);
+
+    /* The coroutine was dropped before the end of the document */
+    if (async->ckv1.tmp)
+        ckv1_parse_release(&async->ckv1);
+
+    return 0;
+}
+
+/* Parse until the document is complete (1) or, inside a coroutine, the
+ * slice ran out of budget (0) */
+static int ckv1_async_slice(lua_State *l, ckv1_async_t *async)
+{
+    ckv1_parse_t *ckv1 = &async->ckv1;
+    double started;
+
+    if (!CKV1_ASYNC_YIELDABLE(l)) {
+        async->run.pause = CKV1_RUN_NO_PAUSE;
+        return ckv1_parse_run(l, ckv1, &async->run);
+    }
+
+    started = ckv_stats_clock();
+    do {
+        async->run.pause = (size_t)(ckv1->ptr - ckv1->data) + CKV1_ASYNC_STEP;
+        if (ckv1_parse_run(l, ckv1, &async->run))
+            return 1;
+    } while (ckv_stats_clock() - started < async->budget);
+
+    return 0;
+}
+
+#if LUA_VERSION_NUM >= 503
+static int ckv1_async_continue(lua_State *l, int status, lua_KContext ctx);
+#endif
+
+static int ckv1_async_run(lua_State *l, ckv1_async_t *async)
+{
+#if LUA_VERSION_NUM >= 503
+    if (!ckv1_async_slice(l, async)) {
+        /* Yield the bytes parsed so far */
+        async->top = lua_gettop(l);
+        lua_pushinteger(l, (lua_Integer)(async->ckv1.ptr - async->ckv1.data));
+        return lua_yieldk(l, 1, 0, ckv1_async_continue);
+    }
+#else
+    ckv1_async_slice(l, async);
+#endif
+
+    /* .., root table, [frames,] [top level container] */
+    ckv_frames_free(l, &async->run.stack);
+    ckv1_parse_release(&async->ckv1);
+
+    return 1;
+}
+
+#if LUA_VERSION_NUM >= 503
+static int ckv1_async_continue(lua_State *l, int status, lua_KContext ctx)
+{
+    ckv1_async_t *async;
+
+    (void)status;
+    (void)ctx;
+
+    async = (ckv1_async_t *)lua_touserdata(l, CKV1_ASYNC_STATE);
+
+    /* Drop the values resume() passed in */
+    lua_settop(l, async->top);
+
+    return ckv1_async_run(l, async);
+}
+#endif
+
+/* decode_async(data, budget_us), data as for decode() */
+static int ckv1_decode_async(lua_State *l)
+{
+    ckv1_async_t *async;
+    ckv1_parse_t *ckv1;
+    const char *data;
+    size_t ckv1_len;
+    double budget;
+    int top = lua_gettop(l);
+
+    /* The budget is the last argument */
+    budget = luaL_checknumber(l, top < 2 ? 2 : top);
+    luaL_argcheck(l, budget >= 0, top, "budget must not be negative");
+    lua_settop(l, top - 1);
+
+    data = ckv_check_source(l, &ckv1_len);
+
+    /* 2: parser state */
+    async = (ckv1_async_t *)lua_newuserdata(l, sizeof(*async));
+    async->ckv1.tmp = NULL;
+    lua_newtable(l);
+    lua_pushcfunction(l, ckv1_async_gc);
+    lua_setfield(l, -2, "__gc");
+    lua_setmetatable(l, -2);
+
+    ckv1 = &async->ckv1;
+    ckv1->cfg = ckv1_fetch_config(l);
+    CKV_STAT(ckv1->stats = &ckv1->cfg->stats);
+    ckv1->data = data;
+    ckv1->current_depth = 0;
+    ckv1->loadType = LoadType_Map;
+    ckv1->ptr = ckv1->data;
+    ckv1->lazy = NULL;
+    ckv1->target = 0;
+    async->budget = budget / 1e6;
+
+    if (ckv1_len >= 2 && (!ckv1->data[0] || !ckv1->data[1]))
+        luaL_error(l, "KV parser does not support UTF-16 or UTF-32");
+
+    ckv1->tmp = ckv_scratch_get(&ckv1->cfg->scratch, ckv1_len);
+    ckv1_parse_index(ckv1, &async->index, ckv1_len);
+
+    if (!ckv1_root_begin(l, ckv1, &async->run, async->frames,
+                         CKV_FRAMES_INLINE)) {
+        ckv1_parse_release(ckv1);
+        return 1;
+    }
+
+    return ckv1_async_run(l, async);
+}
+
+/* ===== QUERIES ===== */
+
+/* Validate a value the query doesn't want, skipping containers whole
+ * with their tokens */
+static void ckv1_query_skip(lua_State *l, ckv1_parse_t *ckv1,
+                            ckv_token_t *token)
+{
+    switch (token->type) {
+    case T_STRING:
+    case T_NUMBER:
+    case T_INTEGER:
+    case T_BOOLEAN:
+    case T_NULL:
+        return;
+    case T_OBJ_BEGIN:
+    case T_ARR_BEGIN:
+        ckv1_skip_tokens(l, ckv1, token, NULL, NULL);
+        return;
+    default:
+        ckv1_throw_parse_error(l, ckv1, "value", token);
+    }
+}
+
+/* Scan an object like ckv1_parse_container() (or the key/value
+ * list of a top level without braces when root is set) up to its end.
+ * Returns the start of the value of the last key equal to key, decode()
+ * keeps the last duplicate, or NULL */
+static const char *ckv1_query_object(lua_State *l, ckv1_parse_t *ckv1,
+                                     const char *key, size_t key_len,
+                                     int root)
+{
+    const ckv_token_type_t end = root ? T_END : T_OBJ_END;
+    ckv_token_t token;
+    const char *match = NULL, *value;
+    int hit, HasNestKV3 = 0;
+
+    ckv1_next_token(ckv1, &token, 1);
+    if (token.type == end)
+        return NULL;
+
+    if (!root && token.type == T_OBJ_BEGIN) {
+        ckv1_next_token(ckv1, &token, 1);
+        ckv1_next_token(ckv1, &token, 1);
+        HasNestKV3 = 1;
+    }
+
+    while (1) {
+        if (token.type != T_STRING)
+            ckv1_throw_parse_error(l, ckv1, "object key string", &token);
+
+        hit = key && (size_t)token.string_len == key_len &&
+              !memcmp(token.value.string, key, key_len);
+
+        value = ckv1->ptr;
+        ckv1_next_token(ckv1, &token, 0);
+        if (token.type == T_COLON) {
+            value = ckv1->ptr;
+            ckv1_next_token(ckv1, &token, 0);
+        }
+        ckv1_query_skip(l, ckv1, &token);
+        if (hit)
+            match = value;
+
+        ckv1_next_token(ckv1, &token, 1);
+        if (token.type == end) {
+            if (HasNestKV3)
+                ckv1_next_token(ckv1, &token, 1);
+            return match;
+        }
+    }
+}
+
+/* query(data, path): the value decode(data)[k1][k2].. or nil. Containers
+ * off the path are lexed but not built, so they fail where decode() does.
+ * Arrays on the path are decoded to index into them */
+static int ckv1_query(lua_State *l)
+{
+    ckv1_parse_t ckv1;
+    ckv_token_t token;
+    const char *key;
+    size_t ckv1_len, key_len;
+    int path, count, k, root;
+
+    luaL_argcheck(l, lua_gettop(l) == 2, 2, "expected 2 arguments");
+
+    ckv1.cfg = ckv1_fetch_config(l);
+    CKV_STAT(ckv1.stats = &ckv1.cfg->stats);
+    ckv1.data = luaL_checklstring(l, 1, &ckv1_len);
+    count = ckv_query_path(l, 2);
+    path = lua_gettop(l);
+    ckv1.index = NULL;
+    ckv1.current_depth = 0;
+    ckv1.loadType = LoadType_Map;
+    ckv1.lazy = NULL;
+    ckv1.target = 0;
+    ckv1.ptr = ckv1.data;
+
+    if (ckv1_len >= 2 && (!ckv1.data[0] || !ckv1.data[1]))
+        luaL_error(l, "KV parser does not support UTF-16 or UTF-32");
+
+    ckv1.tmp = ckv_scratch_get(&ckv1.cfg->scratch, ckv1_len);
+
+    /* The top level is either key/value pairs or a single object */
+    ckv1_next_token(&ckv1, &token, 1);
+    if (token.type == T_STRING) {
+        ckv1.ptr = ckv1.data;
+        root = 1;
+    } else if (token.type == T_OBJ_BEGIN) {
+        root = 0;
+    } else {
+        ckv1_parse_release(&ckv1);
+        lua_pushnil(l);
+        return 1;
+    }
+
+    for (k = 1; ; k++) {
+        key = ckv_query_key(l, path, k, &key_len);
+        ckv1.ptr = ckv1_query_object(l, &ckv1, key, key_len, root);
+        if (!ckv1.ptr)
+            break;
+
+        root = 0;
+        ckv1_next_token(&ckv1, &token, 0);
+        if (k == count) {
+            ckv1_process_value(l, &ckv1, &token);
+            ckv1_parse_release(&ckv1);
+            return 1;
+        }
+        if (token.type == T_ARR_BEGIN) {
+            ckv1_process_value(l, &ckv1, &token);
+            ckv1_parse_release(&ckv1);
+            ckv_query_tail(l, path, k + 1, count);
+            return 1;
+        }
+        if (token.type != T_OBJ_BEGIN)
+            break;
+    }
+
+    ckv1_parse_release(&ckv1);
+    lua_pushnil(l);
+
+    return 1;
+}
+
+/* ===== BINARY CACHE ===== */
+
+static int ckv1_encode_binary(lua_State *l)
+{
+    ckv1_config_t *cfg = ckv1_arg_init(l, 1);
+
+    ckv_binary_encode(l, 1, cfg->encode_max_depth);
+
+    return 1;
+}
+
+static int ckv1_decode_binary(lua_State *l)
+{
+    ckv1_config_t *cfg;
+    const char *data;
+    size_t len;
+
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+
+    cfg = ckv1_fetch_config(l);
+    data = luaL_checklstring(l, 1, &len);
+    if (ckv_binary_decode(l, data, len, cfg->decode_max_depth) != 0)
+        luaL_error(l, "Invalid binary KV data");
+
+    return 1;
+}
+
+/* decode() of a file, through a binary cache of it */
+static int ckv1_decode_file_cached(lua_State *l)
+{
+    char path[CKV_PATH_MAX];
+    ckv1_config_t *cfg;
+    ckv_file_t file;
+
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+
+    cfg = ckv1_fetch_config(l);
+    luaL_argcheck(l, strlen(luaL_checkstring(l, 1)) < sizeof(path), 1,
+                  "path too long");
+    strcpy(path, lua_tostring(l, 1));
+
+    if (ckv_cache_load(l, path, CKV_DIALECT_KV1, cfg->decode_max_depth))
+        return 1;
+
+    if (ckv_file_open(&file, path) != 0)
+        return luaL_fileresult(l, 0, path);
+
+    /* decode() takes the text as its only argument */
+    lua_settop(l, 0);
+    lua_pushlstring(l, file.data, file.len);
+    ckv_file_close(&file);
+    ckv1_decode(l);
+
+    ckv_cache_store(l, path, -1, 0, CKV_DIALECT_KV1, cfg->encode_max_depth);
 
     return 1;
 }
@@ -1585,7 +2403,25 @@ static int lua_ckv1_new(lua_State *l)
         { "encode", ckv1_encode },
         { "decode", ckv1_decode },
         { "encode_array", ckv1_encode_array },
+        { "encode_to", ckv1_encode_to },
+        { "encode_to_file", ckv1_encode_to_file },
+        { "encode_array_to", ckv1_encode_array_to },
+        { "encode_array_to_file", ckv1_encode_array_to_file },
         { "decode_array", ckv1_decode_array },
+        { "decode_lazy", ckv1_decode_lazy },
+        { "decode_async", ckv1_decode_async },
+        { "query", ckv1_query },
+        { "encode_binary", ckv1_encode_binary },
+        { "decode_binary", ckv1_decode_binary },
+        { "decode_file_cached", ckv1_decode_file_cached },
+        { "encode_keep_buffer", ckv1_cfg_encode_keep_buffer },
+        { "encode_compact", ckv1_cfg_encode_compact },
+        { "encode_sort_keys", ckv1_cfg_encode_sort_keys },
+        { "encode_buffer_stats", ckv1_encode_buffer_stats },
+        { "stats", ckv1_stats },
+        { "decode_presize", ckv1_cfg_decode_presize },
+        { "decode_key_cache", ckv1_cfg_decode_key_cache },
+        { "decode_scratch_limit", ckv1_cfg_decode_scratch_limit },
         { NULL, NULL }
     };
 
@@ -1,55 +1,32 @@
 #include "include/common.h"
-typedef enum {
-    T_OBJ_BEGIN,
-    T_OBJ_END,
-    T_ARR_BEGIN,
-    T_ARR_END,
-    T_STRING,
-    T_NUMBER,
-    T_BOOLEAN,
-    T_NULL,
-    T_COLON,
-    T_COMMA,
-    T_END,
-    T_WHITESPACE,
-    T_ERROR,
-    T_UNKNOWN
-} ckv3_token_type_t;
-
-static const char *ckv3_token_type_name[] = {
-    "T_OBJ_BEGIN",
-    "T_OBJ_END",
-    "T_ARR_BEGIN",
-    "T_ARR_END",
-    "T_STRING",
-    "T_NUMBER",
-    "T_BOOLEAN",
-    "T_NULL",
-    "T_COLON",
-    "T_COMMA",
-    "T_END",
-    "T_WHITESPACE",
-    "T_ERROR",
-    "T_UNKNOWN",
-    NULL
+/* Arrays of float tuples, decode_packed_arrays turns these into a
+ * ckv3_packed_t of width floats per element */
+static const struct {
+    const char *name;
+    int width;
+} ckv3_packed_types[] = {
+    { "time_array", 1 },
+    { "float_array", 1 },
+    { "vector2_array", 2 },
+    { "vector3_array", 3 },
+    { "qangle_array", 3 },
+    { "vector4_array", 4 },
+    { "quaternion_array", 4 },
+    { NULL, 0 }
 };
 
-static const char* ckv3_array_struct[] = {
-    "vector2",
-    "vector3",
-    "vector4",
-    "vector2_array",
-    "vector3_array",
-    "vector4_array",
-    "quaternion",
-    "quaternion_array",
-    "time_array",
-    NULL
-};
+typedef struct {
+    int type;       /* Index into ckv3_packed_types */
+    int width;      /* Floats per element */
+    size_t count;   /* Elements */
+    float data[1];
+} ckv3_packed_t;
+
+#define CKV3_PACKED_SIZE(floats) \
+    (offsetof(ckv3_packed_t, data) + (floats) * sizeof(float))
 
 typedef struct {
-    ckv3_token_type_t ch2token[256];
-    char escape2char[256];  /* Decoding */
+    ckv_lexer_t lexer;      /* Decoding */
 
     /* encode_buf is only allocated and used when
      * encode_keep_buffer is set */
@@ -62,30 +39,35 @@ typedef struct {
     int encode_invalid_numbers;     /* 2 => Encode as "null" */
     int encode_number_precision;
     int encode_keep_buffer;
+    int encode_compact;     /* No indentation */
+    int encode_sort_keys;
+    size_t encode_size_hint;    /* Output length of the last encode */
+    int encode_reallocs;    /* Buffer growths over every encode */
+    ckv_sink_t *encode_sink;    /* Sink of the running encode_to, or NULL */
 
     int decode_invalid_numbers;
     int decode_max_depth;
+    int decode_presize;
+    int decode_key_cache;
+    ckv_key_cache_t key_cache;  /* Only used when decode_key_cache is set */
+    ckv_scratch_t scratch;      /* Temporary strings of the decoders */
+    int decode_scratch_limit;   /* Largest scratch buffer kept */
+    int decode_packed_arrays;
+    int packed_meta;            /* Registry ref of the packed array metatable */
+    ckv_stats_t stats;          /* Only counted with CKV_STATS */
 } ckv3_config_t;
 
 typedef struct {
     const char *data;
     const char *ptr;
     strbuf_t *tmp;    /* Temporary storage for strings */
+    ckv_index_t *index; /* Table shapes when decode_presize is on */
     ckv3_config_t *cfg;
+    ckv_stats_t *stats; /* Set under CKV_STATS only */
     int current_depth;
+    int packed;         /* Decode float tuple arrays as ckv3_packed_t */
 } ckv3_parse_t;
 
-typedef struct {
-    ckv3_token_type_t type;
-    int index;
-    union {
-        const char *string;
-        double number;
-        int boolean;
-    } value;
-    int string_len;
-} ckv3_token_t;
-
 
 
 /* ===== CONFIGURATION ===== */
@@ -101,6 +83,175 @@ static ckv3_config_t *ckv3_fetch_config(lua_State *l)
     return cfg;
 }
 
+/* Ensure the correct number of arguments have been provided.
+ * Pad with nil to allow other functions to simply check arg[i]
+ * to find whether an argument was provided */
+static ckv3_config_t *ckv3_arg_init(lua_State *l, int args)
+{
+    luaL_argcheck(l, lua_gettop(l) <= args, args + 1,
+                  "found too many arguments");
+
+    while (lua_gettop(l) < args)
+        lua_pushnil(l);
+
+    return ckv3_fetch_config(l);
+}
+
+static int ckv3_integer_option(lua_State *l, int optindex, int *setting,
+                               int min, int max)
+{
+    char errmsg[64];
+    int value;
+
+    if (!lua_isnil(l, optindex)) {
+        value = luaL_checkinteger(l, optindex);
+        snprintf(errmsg, sizeof(errmsg), "expected integer between %d and %d", min, max);
+        luaL_argcheck(l, min <= value && value <= max, 1, errmsg);
+        *setting = value;
+    }
+
+    lua_pushinteger(l, *setting);
+
+    return 1;
+}
+
+/* Process enumerated arguments for a configuration function */
+static int ckv3_enum_option(lua_State *l, int optindex, int *setting,
+                            const char **options, int bool_true)
+{
+    static const char *bool_options[] = { "off", "on", NULL };
+
+    if (!options) {
+        options = bool_options;
+        bool_true = 1;
+    }
+
+    if (!lua_isnil(l, optindex)) {
+        if (bool_true && lua_isboolean(l, optindex))
+            *setting = lua_toboolean(l, optindex) * bool_true;
+        else
+            *setting = luaL_checkoption(l, optindex, NULL, options);
+    }
+
+    if (bool_true && (*setting == 0 || *setting == bool_true))
+        lua_pushboolean(l, *setting);
+    else
+        lua_pushstring(l, options[*setting]);
+
+    return 1;
+}
+
+/* Configures ckv3 encoding buffer persistence */
+static int ckv3_cfg_encode_keep_buffer(lua_State *l)
+{
+    ckv3_config_t *cfg = ckv3_arg_init(l, 1);
+    int old_value;
+
+    old_value = cfg->encode_keep_buffer;
+
+    ckv3_enum_option(l, 1, &cfg->encode_keep_buffer, NULL, 1);
+
+    /* Init / free the buffer if the setting has changed */
+    if (old_value ^ cfg->encode_keep_buffer) {
+        if (cfg->encode_keep_buffer)
+            strbuf_init(&cfg->encode_buf, 0);
+        else
+            strbuf_free(&cfg->encode_buf);
+    }
+
+    return 1;
+}
+
+/* Configures whether encoders indent nested tables */
+static int ckv3_cfg_encode_compact(lua_State *l)
+{
+    ckv3_config_t *cfg = ckv3_arg_init(l, 1);
+
+    return ckv3_enum_option(l, 1, &cfg->encode_compact, NULL, 1);
+}
+
+/* Configures whether objects are encoded in sorted key order */
+static int ckv3_cfg_encode_sort_keys(lua_State *l)
+{
+    ckv3_config_t *cfg = ckv3_arg_init(l, 1);
+
+    return ckv3_enum_option(l, 1, &cfg->encode_sort_keys, NULL, 1);
+}
+
+/* Returns { reallocs, length, size }: how often the encode buffer had to
+ * grow over every encode so far, the output length of the last encode and
+ * the size of the kept buffer (0 when encode_keep_buffer is off) */
+static int ckv3_encode_buffer_stats(lua_State *l)
+{
+    ckv3_config_t *cfg = ckv3_arg_init(l, 0);
+
+    lua_createtable(l, 0, 3);
+    lua_pushinteger(l, cfg->encode_reallocs);
+    lua_setfield(l, -2, "reallocs");
+    lua_pushinteger(l, (lua_Integer)cfg->encode_size_hint);
+    lua_setfield(l, -2, "length");
+    lua_pushinteger(l, cfg->encode_keep_buffer ? cfg->encode_buf.size : 0);
+    lua_setfield(l, -2, "size");
+
+    return 1;
+}
+
+/* Returns the parser counters (see ckv_stats_t), nil unless built with
+ * CKV_STATS. stats(true) also resets them */
+static int ckv3_stats(lua_State *l)
+{
+    ckv3_config_t *cfg = ckv3_arg_init(l, 1);
+
+#ifdef CKV_STATS
+    ckv_stats_push(l, &cfg->stats);
+    if (lua_toboolean(l, 1))
+        memset(&cfg->stats, 0, sizeof(cfg->stats));
+#else
+    (void)cfg;
+    lua_pushnil(l);
+#endif
+
+    return 1;
+}
+
+/* Configures the structural pass used to pre-size decoded tables */
+static int ckv3_cfg_decode_presize(lua_State *l)
+{
+    ckv3_config_t *cfg = ckv3_arg_init(l, 1);
+
+    return ckv3_enum_option(l, 1, &cfg->decode_presize, NULL, 1);
+}
+
+/* Configures the largest temporary decode buffer kept between calls */
+static int ckv3_cfg_decode_scratch_limit(lua_State *l)
+{
+    ckv3_config_t *cfg = ckv3_arg_init(l, 1);
+
+    return ckv3_integer_option(l, 1, &cfg->decode_scratch_limit, 0, INT_MAX);
+}
+
+/* Configures decoding float tuple arrays into packed userdata */
+static int ckv3_cfg_decode_packed_arrays(lua_State *l)
+{
+    ckv3_config_t *cfg = ckv3_arg_init(l, 1);
+
+    return ckv3_enum_option(l, 1, &cfg->decode_packed_arrays, NULL, 1);
+}
+
+/* Configures reuse of object key strings across decode calls */
+static int ckv3_cfg_decode_key_cache(lua_State *l)
+{
+    ckv3_config_t *cfg = ckv3_arg_init(l, 1);
+
+    ckv3_enum_option(l, 1, &cfg->decode_key_cache, NULL, 1);
+
+    /* Drop the cached strings once the cache is switched off */
+    if (!cfg->decode_key_cache)
+        ckv_key_cache_clear(l, &cfg->key_cache);
+
+    return 1;
+}
+
 #if defined(DISABLE_INVALID_NUMBERS) && !defined(USE_INTERNAL_FPCONV)
 void ckv3_verify_invalid_number_setting(lua_State *l, int *setting)
 {
@@ -118,8 +269,12 @@ static int ckv3_destroy_config(lua_State *l)
     ckv3_config_t *cfg;
 
     cfg = (ckv3_config_t *)lua_touserdata(l, 1);
-    if (cfg)
+    if (cfg) {
         strbuf_free(&cfg->encode_buf);
+        ckv_key_cache_clear(l, &cfg->key_cache);
+        ckv_scratch_free(&cfg->scratch);
+        luaL_unref(l, LUA_REGISTRYINDEX, cfg->packed_meta);
+    }
     cfg = NULL;
 
     return 0;
@@ -128,7 +283,6 @@ static int ckv3_destroy_config(lua_State *l)
 static void ckv3_create_config(lua_State *l)
 {
     ckv3_config_t *cfg;
-    int i;
 
     cfg = (ckv3_config_t *)lua_newuserdata(l, sizeof(*cfg));
 
@@ -145,7 +299,20 @@ static void ckv3_create_config(lua_State *l)
     cfg->decode_max_depth = DEFAULT_DECODE_MAX_DEPTH;
     cfg->encode_invalid_numbers = DEFAULT_ENCODE_INVALID_NUMBERS;
     cfg->decode_invalid_numbers = DEFAULT_DECODE_INVALID_NUMBERS;
+    cfg->decode_presize = DEFAULT_DECODE_PRESIZE;
+    cfg->decode_key_cache = DEFAULT_DECODE_KEY_CACHE;
+    ckv_key_cache_init(&cfg->key_cache);
+    ckv_scratch_init(&cfg->scratch);
+    memset(&cfg->stats, 0, sizeof(cfg->stats));
+    cfg->decode_scratch_limit = DEFAULT_DECODE_SCRATCH_LIMIT;
+    cfg->decode_packed_arrays = DEFAULT_DECODE_PACKED_ARRAYS;
+    cfg->packed_meta = LUA_NOREF;
     cfg->encode_keep_buffer = DEFAULT_ENCODE_KEEP_BUFFER;
+    cfg->encode_compact = DEFAULT_ENCODE_COMPACT;
+    cfg->encode_sort_keys = DEFAULT_ENCODE_SORT_KEYS;
+    cfg->encode_size_hint = 0;
+    cfg->encode_reallocs = 0;
+    cfg->encode_sink = NULL;
     cfg->encode_number_precision = DEFAULT_ENCODE_NUMBER_PRECISION;
 
 #if DEFAULT_ENCODE_KEEP_BUFFER > 0
@@ -154,62 +321,65 @@ static void ckv3_create_config(lua_State *l)
 
     /* Decoding init */
 
-    /* Tag all characters as an error */
-    for (i = 0; i < 256; i++)
-        cfg->ch2token[i] = T_ERROR;
-
-    /* Set tokens that require no further processing */
-    cfg->ch2token['{'] = T_OBJ_BEGIN;
-    cfg->ch2token['}'] = T_OBJ_END;
-    cfg->ch2token['['] = T_ARR_BEGIN;
-    cfg->ch2token[']'] = T_ARR_END;
-    cfg->ch2token[','] = T_COMMA;
-    cfg->ch2token['='] = T_COLON;
-    cfg->ch2token['\0'] = T_END;
-    cfg->ch2token[' '] = T_WHITESPACE;
-    cfg->ch2token['\t'] = T_WHITESPACE;
-    cfg->ch2token['\n'] = T_WHITESPACE;
-    cfg->ch2token['\r'] = T_WHITESPACE;
-
-    /* Update characters that require further processing */
-    cfg->ch2token['"'] = T_UNKNOWN;     /* string? */
-    cfg->ch2token['+'] = T_UNKNOWN;     /* number? */
-    cfg->ch2token['-'] = T_UNKNOWN;
-    cfg->ch2token['<'] = T_UNKNOWN;
-    for (i = 0; i < 10; i++)
-        cfg->ch2token['0' + i] = T_UNKNOWN;
-
-    for (i = 0; i < 26; ++i)
-    {
-        cfg->ch2token['a' + i] = T_UNKNOWN;
-        cfg->ch2token['A' + i] = T_UNKNOWN;
-    }
-
-    /* Lookup table for parsing escape characters */
-    for (i = 0; i < 256; i++)
-        cfg->escape2char[i] = 0;          /* String error */
-    cfg->escape2char['"'] = '"';
-    cfg->escape2char['\\'] = '\\';
-    cfg->escape2char['/'] = '/';
-    cfg->escape2char['b'] = '\b';
-    cfg->escape2char['t'] = '\t';
-    cfg->escape2char['n'] = '\n';
-    cfg->escape2char['f'] = '\f';
-    cfg->escape2char['r'] = '\r';
-    cfg->escape2char['u'] = 'u';          /* Unicode parsing required */
+    ckv_lexer_init(&cfg->lexer, CKV_LEX_KV3);
 }
 
 /* ===== ENCODING ===== */
 
+/* ckv3 is NULL when nothing was buffered yet */
 static void ckv3_encode_exception(lua_State *l, ckv3_config_t *cfg, strbuf_t *ckv3, int lindex,
                                   const char *reason)
 {
-    if (!cfg->encode_keep_buffer)
+    if (ckv3 && !cfg->encode_keep_buffer)
         strbuf_free(ckv3);
     luaL_error(l, "Cannot serialise %s: %s",
                   lua_typename(l, lua_type(l, lindex)), reason);
 }
 
+/* Returns the buffer an encode call writes to. A private buffer starts at
+ * the length of the previous output, so encoding documents of a similar
+ * size does not grow it step by step */
+static strbuf_t *ckv3_encode_buffer(ckv3_config_t *cfg, strbuf_t *local)
+{
+    size_t size;
+
+    cfg->encode_sink = NULL;
+
+    if (!cfg->encode_keep_buffer) {
+        /* Headroom for the worst case reservations of the appenders, as
+         * far as a strbuf can hold */
+        size = cfg->encode_size_hint + cfg->encode_size_hint / 8 +
+               STRBUF_DEFAULT_SIZE;
+        strbuf_init(local, size < INT_MAX ? (int)size : INT_MAX);
+        return local;
+    }
+
+    /* Reuse existing buffer */
+    strbuf_reset(&cfg->encode_buf);
+    cfg->encode_buf.reallocs = 0;
+
+    return &cfg->encode_buf;
+}
+
+/* Records the size and growth of a finished encode and frees a private
+ * buffer */
+static void ckv3_encode_buffer_done(ckv3_config_t *cfg, strbuf_t *encode_buf)
+{
+    cfg->encode_size_hint = strbuf_length(encode_buf);
+    cfg->encode_reallocs += encode_buf->reallocs;
+
+    if (!cfg->encode_keep_buffer)
+        strbuf_free(encode_buf);
+}
+
+/* Appends the indentation of a line depth levels deep */
+static inline void ckv3_append_indent(ckv3_config_t *cfg, strbuf_t *buf,
+                                      int depth)
+{
+    if (!cfg->encode_compact)
+        ckv_append_tabs(buf, depth);
+}
+
 /* ckv3_append_string args:
  * - lua_State
  * - KV strbuf
@@ -218,28 +388,11 @@ static void ckv3_encode_exception(lua_State *l, ckv3_config_t *cfg, strbuf_t *ck
  * Returns nothing. Doesn't remove string from Lua stack */
 static void ckv3_append_string(lua_State *l, strbuf_t *ckv3, int lindex)
 {
-    const char *escstr;
     const char *str;
     size_t len;
-    size_t i;
 
     str = lua_tolstring(l, lindex, &len);
-
-    /* Worst case is len * 6 (all unicode escapes).
-     * This buffer is reused constantly for small strings
-     * If there are any excess pages, they won't be hit anyway.
-     * This gains ~5% speedup. */
-    strbuf_ensure_empty_length(ckv3, len * 6 + 2);
-    strbuf_append_char_unsafe(ckv3, '\"');
-    
-    for (i = 0; i < len; i++) {
-        escstr = char2escape[(unsigned char)str[i]];
-        if (escstr)
-            strbuf_append_string(ckv3, escstr);
-        else
-            strbuf_append_char_unsafe(ckv3, str[i]);
-    }
-    strbuf_append_char_unsafe(ckv3, '\"');
+    ckv_append_escaped(ckv3, str, len, 1);
 }
 
 static void ckv3_check_encode_depth(lua_State *l, ckv3_config_t *cfg,
@@ -258,7 +411,7 @@ static void ckv3_check_encode_depth(lua_State *l, ckv3_config_t *cfg,
     if (current_depth <= cfg->encode_max_depth && lua_checkstack(l, 3))
         return;
 
-    if (!cfg->encode_keep_buffer)
+    if (ckv3 && !cfg->encode_keep_buffer)
         strbuf_free(ckv3);
 
     luaL_error(l, "Cannot serialise, excessive nesting (%d)",
@@ -268,6 +421,78 @@ static void ckv3_check_encode_depth(lua_State *l, ckv3_config_t *cfg,
 static void ckv3_append_data(lua_State *l, ckv3_config_t *cfg,
                              int current_depth, strbuf_t *ckv3, int isObject);
 
+/* Writes the shortest %g form of value that reads back as the same
+ * float, returns its length */
+static int ckv3_format_float(char *buf, float value)
+{
+    char *end;
+    int precision, len = 0;
+
+    for (precision = 6; precision <= 9; precision++) {
+        len = fpconv_g_fmt(buf, value, precision);
+        if ((float)fpconv_strtod(buf, &end) == value)
+            break;
+    }
+
+    return len;
+}
+
+/* Returns the packed array at lindex, or NULL for any other value */
+static ckv3_packed_t *ckv3_to_packed(lua_State *l, ckv3_config_t *cfg,
+                                     int lindex)
+{
+    ckv3_packed_t *packed = (ckv3_packed_t *)lua_touserdata(l, lindex);
+    int same;
+
+    if (!packed || !lua_getmetatable(l, lindex))
+        return NULL;
+    lua_rawgeti(l, LUA_REGISTRYINDEX, cfg->packed_meta);
+    same = lua_rawequal(l, -1, -2);
+    lua_pop(l, 2);
+
+    return same ? packed : NULL;
+}
+
+/* Same text as the table of "x y z" strings the array decodes to
+ * without decode_packed_arrays. Off the Lua thread l is NULL, which is
+ * fine as encode_sink is always NULL there */
+static void ckv3_append_packed(lua_State *l, ckv3_config_t *cfg,
+                               int current_depth, strbuf_t *ckv3,
+                               const ckv3_packed_t *packed)
+{
+    const float *value = packed->data;
+    size_t i;
+    int j;
+
+    strbuf_append_char(ckv3, '\n');
+    ckv3_append_indent(cfg, ckv3, current_depth);
+    strbuf_append_char(ckv3, '[');
+    strbuf_append_char(ckv3, '\n');
+    ckv3_append_indent(cfg, ckv3, current_depth + 1);
+
+    for (i = 0; i < packed->count; i++) {
+        ckv_sink_check(l, &cfg->encode_sink, ckv3);
+
+        strbuf_ensure_empty_length(ckv3,
+                                   packed->width * (FPCONV_G_FMT_BUFSIZE + 1) + 2);
+        strbuf_append_char_unsafe(ckv3, '\"');
+        for (j = 0; j < packed->width; j++) {
+            if (j)
+                strbuf_append_char_unsafe(ckv3, ' ');
+            strbuf_extend_length(ckv3,
+                                 ckv3_format_float(strbuf_empty_ptr(ckv3), *value++));
+        }
+        strbuf_append_char_unsafe(ckv3, '\"');
+
+        if (i + 1 < packed->count)
+            strbuf_append_char(ckv3, ',');
+    }
+
+    strbuf_append_char(ckv3, '\n');
+    ckv3_append_indent(cfg, ckv3, current_depth);
+    strbuf_append_char(ckv3, ']');
+}
+
 static void ckv3_append_array(lua_State *l, ckv3_config_t *cfg, int current_depth,
                               strbuf_t *ckv3, int array_length, int isObject)
 {
@@ -276,7 +501,7 @@ static void ckv3_append_array(lua_State *l, ckv3_config_t *cfg, int current_dept
     if (!isObject)
     {
         strbuf_append_char(ckv3, '\n');
-        APPEND_TAB_UNSAFE(ckv3, current_depth);
+        ckv3_append_indent(cfg, ckv3, current_depth);
         strbuf_append_char(ckv3, '[');
         strbuf_append_char(ckv3, '\n');
     }
@@ -296,7 +521,7 @@ static void ckv3_append_array(lua_State *l, ckv3_config_t *cfg, int current_dept
             if (length2 > 0)
             {
                 strbuf_append_char(ckv3, '\n');
-                APPEND_TAB_UNSAFE(ckv3, current_depth);
+                ckv3_append_indent(cfg, ckv3, current_depth);
                 strbuf_append_char(ckv3, '[');
                 strbuf_append_char(ckv3, '\n');
                 for(j = 1; j <= length2; j++)
@@ -304,7 +529,7 @@ static void ckv3_append_array(lua_State *l, ckv3_config_t *cfg, int current_dept
                     lua_rawgeti(l, -1, j);
                     if (j == 1)
                     {
-                        APPEND_TAB_UNSAFE(ckv3, current_depth + 1);
+                        ckv3_append_indent(cfg, ckv3, current_depth + 1);
                     }
                     ckv3_append_data(l, cfg, current_depth + 1, ckv3, 1);
                     if (j < length2)
@@ -314,7 +539,7 @@ static void ckv3_append_array(lua_State *l, ckv3_config_t *cfg, int current_dept
                     lua_pop(l, 1);
                 }
                 strbuf_append_char(ckv3, '\n');
-                APPEND_TAB_UNSAFE(ckv3, current_depth);
+                ckv3_append_indent(cfg, ckv3, current_depth);
                 strbuf_append_char(ckv3, ']');
             }
             else
@@ -338,7 +563,7 @@ static void ckv3_append_array(lua_State *l, ckv3_config_t *cfg, int current_dept
     if (!isObject)
     {
         strbuf_append_char(ckv3, '\n');
-        APPEND_TAB_UNSAFE(ckv3, current_depth);
+        ckv3_append_indent(cfg, ckv3, current_depth);
         strbuf_append_char(ckv3, ']');
     }
 }
@@ -346,17 +571,17 @@ static void ckv3_append_array(lua_State *l, ckv3_config_t *cfg, int current_dept
 static void ckv3_append_object(lua_State *l, ckv3_config_t *cfg,
                                int current_depth, strbuf_t *ckv3)
 {
-    int w = 0;
+    ckv_iter_t it;
     /* Object */
     strbuf_append_char(ckv3, '\n');
-    APPEND_TAB_UNSAFE(ckv3, current_depth);
+    ckv3_append_indent(cfg, ckv3, current_depth);
     strbuf_append_char(ckv3, '{');
-    lua_pushnil(l);
+    ckv_iter_begin(l, &it, cfg->encode_sort_keys);
     /* table, startkey */
-    while (lua_next(l, -2) != 0) {
+    while (ckv_iter_next(l, &it)) {
         strbuf_append_char(ckv3, '\n');
         
-        APPEND_TAB_UNSAFE(ckv3, current_depth + 1);
+        ckv3_append_indent(cfg, ckv3, current_depth + 1);
         
         ckv3_append_string(l, ckv3, -2);
         strbuf_append_char(ckv3, ' ');
@@ -367,7 +592,7 @@ static void ckv3_append_object(lua_State *l, ckv3_config_t *cfg,
         lua_pop(l, 1);
     }
     strbuf_append_char(ckv3, '\n');
-    APPEND_TAB_UNSAFE(ckv3, current_depth);
+    ckv3_append_indent(cfg, ckv3, current_depth);
     strbuf_append_char(ckv3, '}');
 }
 
@@ -375,6 +600,10 @@ static void ckv3_append_object(lua_State *l, ckv3_config_t *cfg,
 static void ckv3_append_data(lua_State *l, ckv3_config_t *cfg,
                              int current_depth, strbuf_t *ckv3, int isObject)
 {
+    ckv3_packed_t *packed;
+
+    ckv_sink_check(l, &cfg->encode_sink, ckv3);
+
     switch (lua_type(l, -1)) {
     case LUA_TSTRING:
         ckv3_append_string(l, ckv3, -1);
@@ -392,38 +621,32 @@ static void ckv3_append_data(lua_State *l, ckv3_config_t *cfg,
             ckv3_append_object(l, cfg, current_depth, ckv3);
         }
         break;
+    case LUA_TUSERDATA:
+        packed = ckv3_to_packed(l, cfg, -1);
+        if (packed) {
+            ckv3_append_packed(l, cfg, current_depth, ckv3, packed);
+            break;
+        }
+        /* fall through */
     default:
-        /* Remaining types (LUA_TFUNCTION, LUA_TUSERDATA, LUA_TTHREAD,
+        /* Remaining types (LUA_TFUNCTION, other userdata, LUA_TTHREAD,
          * and LUA_TLIGHTUSERDATA) cannot be serialised */
         ckv3_encode_exception(l, cfg, ckv3, -1, "type not supported");
         /* never returns */
     }
 }
 
-static int ckv3_encode(lua_State *l)
+/* Appends every key and value of the table on top of the stack */
+static void ckv3_encode_pairs(lua_State *l, ckv3_config_t *cfg,
+                              strbuf_t *encode_buf)
 {
-    ckv3_config_t *cfg = ckv3_fetch_config(l);
-    strbuf_t local_encode_buf;
-    strbuf_t *encode_buf;
-    char *ckv3;
-    int len;
-
-    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
-
-    if (!cfg->encode_keep_buffer) {
-        /* Use private buffer */
-        encode_buf = &local_encode_buf;
-        strbuf_init(encode_buf, 0);
-    } else {
-        /* Reuse existing buffer */
-        encode_buf = &cfg->encode_buf;
-        strbuf_reset(encode_buf);
-    }
+    ckv_iter_t it;
+    int top = lua_gettop(l);
 
-    lua_pushnil(l);
+    ckv_iter_begin(l, &it, cfg->encode_sort_keys);
     
     int keytype, ln = 0;
-    while (lua_next(l, -2) != 0) {
+    while (ckv_iter_next(l, &it)) {
         if (ln == 1)
         {
             strbuf_append_char(encode_buf, '\n');
@@ -450,406 +673,783 @@ static int ckv3_encode(lua_State *l)
         /* table, key */
     }
 
-    ckv3 = strbuf_string(encode_buf, &len);
-    lua_pushlstring(l, ckv3, len);
-
-    if (!cfg->encode_keep_buffer)
-        strbuf_free(encode_buf);
-
-    return 1;
+    lua_settop(l, top);
 }
-/* ===== DECODING ===== */
 
-static void ckv3_process_value(lua_State *l, ckv3_parse_t *ckv3,
-                               ckv3_token_t *token);
+/* Snapshot flag of a table without an array part */
+#define CKV3_SNAP_OBJECT 1
 
-static void ckv3_set_token_error(ckv3_token_t *token, ckv3_parse_t *ckv3,
-                                 const char *errtype)
-{
-    token->type = T_ERROR;
-    token->index = ckv3->ptr - ckv3->data;
-    token->value.string = errtype;
-}
+/* Format flags: the kind of table an item is in */
+#define CKV3_FORMAT_TOP 0       /* ckv3_encode_pairs() */
+#define CKV3_FORMAT_PAIR 1      /* ckv3_append_object() */
+#define CKV3_FORMAT_ELEMENT 2   /* ckv3_append_array() */
+#define CKV3_FORMAT_INNER 3     /* A table element of ckv3_append_array() */
+#define CKV3_FORMAT_KINDS 3
+#define CKV3_FORMAT_OBJECT 4    /* isObject of ckv3_append_array() */
 
-static void ckv3_next_string_token(ckv3_parse_t *ckv3, ckv3_token_t *token)
+static ckv_snap_node_t *ckv3_snap_data(lua_State *l, ckv3_config_t *cfg,
+                                       ckv_snap_t *snap, int current_depth);
+
+static ckv_snap_node_t *ckv3_snap_string(lua_State *l, ckv_snap_t *snap,
+                                         int lindex)
 {
-    char *escape2char = ckv3->cfg->escape2char;
-    char ch;
+    ckv_snap_node_t *node = ckv_snap_node(l, snap, CKV_SNAP_STRING);
 
-    /* Caller must ensure a string is next */
-    assert(*ckv3->ptr == '"');
+    node->value.string = ckv_snap_tostring(l, snap, lindex,
+                                           &node->string_len);
+    node->weight += node->string_len + 2;
 
-    /* Skip " */
-    ckv3->ptr++;
+    return node;
+}
 
-    /* ckv3->tmp is the temporary strbuf used to accumulate the
-     * decoded string value.
-     * ckv3->tmp is sized to handle KV containing only a string value.
-     */
-    strbuf_reset(ckv3->tmp);
+/* Same walk as ckv3_append_array() over the table on top of the stack */
+static ckv_snap_node_t *ckv3_snap_array(lua_State *l, ckv3_config_t *cfg,
+                                        ckv_snap_t *snap, int current_depth)
+{
+    ckv_snap_node_t *node, *last = NULL, *inner, *inner_last;
+    int array_length = (int)lua_rawlen(l, -1);
+    int i, j, length2;
 
-    while ((ch = *ckv3->ptr) != '"') {
-        if (!ch) {
-            /* Premature end of the string */
-            ckv3_set_token_error(token, ckv3, "unexpected end of string");
-            return;
-        }
+    node = ckv_snap_node(l, snap, CKV_SNAP_TABLE);
+    for (i = 1; i <= array_length; i++) {
+        lua_rawgeti(l, -1, i);
 
-        int hasBackSlash = 0;
-        while (ch == '\\')
-        {
-            ckv3->ptr++;
-            ch = *ckv3->ptr;
-            hasBackSlash = 1;
-        }
-        if (hasBackSlash)
-        {
-            strbuf_append_char_unsafe(ckv3->tmp, '/');
+        length2 = lua_type(l, -1) == LUA_TTABLE ? (int)lua_rawlen(l, -1) : 0;
+        if (length2 > 0) {
+            inner = ckv_snap_node(l, snap, CKV_SNAP_TABLE);
+            inner->weight += current_depth * 2;
+            inner_last = NULL;
+            for (j = 1; j <= length2; j++) {
+                lua_rawgeti(l, -1, j);
+                inner_last = ckv_snap_add(inner, inner_last, NULL,
+                                          ckv3_snap_data(l, cfg, snap,
+                                                         current_depth + 1));
+                lua_pop(l, 1);
+            }
+            last = ckv_snap_add(node, last, NULL, inner);
+        } else {
+            last = ckv_snap_add(node, last, NULL,
+                                ckv3_snap_data(l, cfg, snap, current_depth));
         }
-        strbuf_append_char_unsafe(ckv3->tmp, ch);
 
-        ckv3->ptr++;
+        lua_pop(l, 1);
     }
 
-    ckv3->ptr++;    /* Eat final quote (") */
-
-    strbuf_ensure_null(ckv3->tmp);
-
-    token->type = T_STRING;
-    token->value.string = strbuf_string(ckv3->tmp, &token->string_len);
+    return node;
 }
 
-char mark_begin[] = {'!', '-', '-'};
-char mark_end[] = {'-','-','>'};
-/* Fills in the token struct.
- * T_STRING will return a pointer to the ckv3_parse_t temporary string
- * T_ERROR will leave the ckv3->ptr pointer at the error.
- */
-static void ckv3_next_token(ckv3_parse_t *ckv3, ckv3_token_t *token)
+/* Same walk as ckv3_append_object() */
+static ckv_snap_node_t *ckv3_snap_object(lua_State *l, ckv3_config_t *cfg,
+                                         ckv_snap_t *snap, int current_depth)
 {
-    const ckv3_token_type_t *ch2token = ckv3->cfg->ch2token;
-    int ch;
+    ckv_snap_node_t *node, *key, *last = NULL;
+    ckv_iter_t it;
 
-    /* Eat whitespace. */
-    while (1) {
-        ch = (unsigned char)*(ckv3->ptr);
-        token->type = ch2token[ch];
-        if (token->type != T_WHITESPACE)
-            break;
-        ckv3->ptr++;
-    }
+    node = ckv_snap_node(l, snap, CKV_SNAP_TABLE);
+    node->flags = CKV3_SNAP_OBJECT;
+    node->weight += current_depth * 2;
 
-    if (ch == '<')
-    {
-        int isMark = 1;
-        //skip mark
-        for (int i = 0; i < 3; i++)
-        {
-            ch = (unsigned char)*(ckv3->ptr + i + 1);
-            if (ch != mark_begin[i])
-            {
-                isMark = 0;
-                break;
-            }
-        }
+    ckv_iter_begin(l, &it, cfg->encode_sort_keys);
+    while (ckv_iter_next(l, &it)) {
+        key = ckv3_snap_string(l, snap, -2);
+        key->weight += current_depth + 2;
 
-        if (isMark)
-        {
-            ckv3->ptr += 4;
-            
-            int offset = 0;
-            while (1)
-            {
-                ch = (unsigned char)*(ckv3->ptr);
-                ckv3->ptr++;
-                if (ch == mark_end[offset++])
-                {
-                    if (offset == 3)
-                    {
-                        break;
-                    }
-                }
-                else
-                {
-                    offset = 0;
-                }
-            }
+        /* ckv3_append_array() would index anything else with
+         * lua_rawgeti() */
+        if (lua_type(l, -1) != LUA_TTABLE)
+            ckv3_encode_exception(l, cfg, NULL, -1, "type not supported");
+        last = ckv_snap_add(node, last, key,
+                            ckv3_snap_array(l, cfg, snap, current_depth + 1));
 
-            while (1) {
-                ch = (unsigned char)*(ckv3->ptr);
-                token->type = ch2token[ch];
-                if (token->type != T_WHITESPACE)
-                    break;
-                ckv3->ptr++;
-            }
-        }
+        lua_pop(l, 1);
     }
 
-    /* Store location of new token. Required when throwing errors
-     * for unexpected tokens (syntax errors). */
-    token->index = ckv3->ptr - ckv3->data;
-
-    /* Don't advance the pointer for an error or the end */
-    if (token->type == T_ERROR) {
-        ckv3_set_token_error(token, ckv3, "invalid token");
-        return;
-    }
+    return node;
+}
 
-    if (token->type == T_END) {
-        return;
-    }
-    
-    /* Found a known single character token, advance index and return */
-    if (token->type != T_UNKNOWN) {
-        ckv3->ptr++;
-        return;
-    }
+/* Same walk and errors as ckv3_append_data() */
+static ckv_snap_node_t *ckv3_snap_data(lua_State *l, ckv3_config_t *cfg,
+                                       ckv_snap_t *snap, int current_depth)
+{
+    ckv_snap_node_t *node;
+    ckv3_packed_t *packed;
 
-    /* Process characters which triggered T_UNKNOWN
-     *
-     * Must use strncmp() to match the front of the KV string.
-     * KV identifier must be lowercase.
-     * When strict_numbers if disabled, either case is allowed for
-     * Infinity/NaN (since we are no longer following the spec..) */
-    if (ch == '"') {
-        ckv3_next_string_token(ckv3, token);
-        return;
+    switch (lua_type(l, -1)) {
+    case LUA_TSTRING:
+        return ckv3_snap_string(l, snap, -1);
+    case LUA_TTABLE:
+        ckv3_check_encode_depth(l, cfg, current_depth, NULL);
+
+        if (lua_rawlen(l, -1) > 0)
+            return ckv3_snap_array(l, cfg, snap, current_depth);
+        return ckv3_snap_object(l, cfg, snap, current_depth);
+    case LUA_TUSERDATA:
+        packed = ckv3_to_packed(l, cfg, -1);
+        if (packed) {
+            node = ckv_snap_node(l, snap, CKV_SNAP_PACKED);
+            node->value.packed = packed;
+            node->weight += packed->count * packed->width * 10;
+            return node;
+        }
+        /* fall through */
+    default:
+        ckv3_encode_exception(l, cfg, NULL, -1, "type not supported");
+        /* never returns */
     }
 
-    /* Token starts with t/f/n but isn't recognised above. */
-    ckv3_set_token_error(token, ckv3, "invalid token");
+    return NULL;
 }
 
-/* This function does not return.
- * DO NOT CALL WITH DYNAMIC MEMORY ALLOCATED.
- * The only supported exception is the temporary parser string
- * ckv3->tmp struct.
- * ckv3 and token should exist on the stack somewhere.
- * luaL_error() will long_jmp and release the stack */
-static void ckv3_throw_parse_error(lua_State *l, ckv3_parse_t *ckv3,
-                                   const char *exp, ckv3_token_t *token)
+/* Same walk and errors as ckv3_encode_pairs() */
+static ckv_snap_node_t *ckv3_snap_pairs(lua_State *l, ckv3_config_t *cfg,
+                                        ckv_snap_t *snap)
 {
-    const char *found;
-
-    strbuf_free(ckv3->tmp);
-
-    if (token->type == T_ERROR)
-        found = token->value.string;
-    else
-        found = ckv3_token_type_name[token->type];
+    ckv_snap_node_t *root, *key, *last = NULL;
+    ckv_iter_t it;
+
+    root = ckv_snap_node(l, snap, CKV_SNAP_TABLE);
+    ckv_iter_begin(l, &it, cfg->encode_sort_keys);
+    while (ckv_iter_next(l, &it)) {
+        if (lua_type(l, -2) != LUA_TSTRING)
+            ckv3_encode_exception(l, cfg, NULL, -2,
+                                  "table key must be a string");
+        key = ckv3_snap_string(l, snap, -2);
+        last = ckv_snap_add(root, last, key,
+                            ckv3_snap_data(l, cfg, snap, 0));
+        lua_pop(l, 1);
+    }
 
-    /* Note: token->index is 0 based, display starting from 1 */
-    luaL_error(l, "Expected %s but found %s at character %d",
-               exp, found, token->index + 1);
+    return root;
 }
 
-static inline void ckv3_decode_ascend(ckv3_parse_t *ckv3)
+static void ckv3_format_item(ckv_snap_t *snap, strbuf_t *ckv3,
+                             const ckv_snap_node_t *item, int current_depth,
+                             int flags);
+
+/* Formats the items of table through the skeleton */
+static inline void ckv3_format_items(ckv_snap_t *snap, strbuf_t *ckv3,
+                                     const ckv_snap_node_t *table,
+                                     int current_depth, int flags)
 {
-    ckv3->current_depth--;
+    const ckv_snap_node_t *item;
+
+    for (item = table->child; item; item = item->next)
+        if (!ckv_snap_defer(snap, ckv3, &item, current_depth, flags))
+            ckv3_format_item(snap, ckv3, item, current_depth, flags);
 }
 
-static void ckv3_decode_descend(lua_State *l, ckv3_parse_t *ckv3, int slots)
+/* ckv3_append_array() off the Lua thread */
+static void ckv3_format_array(ckv_snap_t *snap, strbuf_t *ckv3,
+                              const ckv_snap_node_t *node, int current_depth,
+                              int isObject)
 {
-    ckv3->current_depth++;
+    ckv3_config_t *cfg = (ckv3_config_t *)snap->cfg;
 
-    if (ckv3->current_depth <= ckv3->cfg->decode_max_depth &&
-        lua_checkstack(l, slots)) {
+    if (isObject) {
+        ckv3_format_items(snap, ckv3, node, current_depth,
+                          CKV3_FORMAT_ELEMENT | CKV3_FORMAT_OBJECT);
         return;
     }
 
-    strbuf_free(ckv3->tmp);
-    luaL_error(l, "Found too many nested data structures (%d) at character %d",
-        ckv3->current_depth, ckv3->ptr - ckv3->data);
+    strbuf_append_char(ckv3, '\n');
+    ckv3_append_indent(cfg, ckv3, current_depth);
+    strbuf_append_char(ckv3, '[');
+    strbuf_append_char(ckv3, '\n');
+    ckv3_format_items(snap, ckv3, node, current_depth, CKV3_FORMAT_ELEMENT);
+    strbuf_append_char(ckv3, '\n');
+    ckv3_append_indent(cfg, ckv3, current_depth);
+    strbuf_append_char(ckv3, ']');
 }
 
-static void parse_object_internal(lua_State *l, ckv3_token_t *token, ckv3_parse_t *ckv3)
+/* ckv3_append_data() off the Lua thread */
+static void ckv3_format_data(ckv_snap_t *snap, strbuf_t *ckv3,
+                             const ckv_snap_node_t *node, int current_depth,
+                             int isObject)
 {
-    //key
-    lua_pushlstring(l, token->value.string, token->string_len);
+    ckv3_config_t *cfg = (ckv3_config_t *)snap->cfg;
 
-    ckv3_next_token(ckv3, token);
-    if (token->type == T_STRING)
-    {
-        lua_newtable(l);
-        //type
-        lua_pushlstring(l, token->value.string, token->string_len);
-        // Print_Stack;
-        lua_rawseti(l, -2, 1);
+    switch (node->type) {
+    case CKV_SNAP_STRING:
+        ckv_append_escaped(ckv3, node->value.string, node->string_len, 1);
+        break;
+    case CKV_SNAP_TABLE:
+        if (!(node->flags & CKV3_SNAP_OBJECT)) {
+            ckv3_format_array(snap, ckv3, node, current_depth, isObject);
+            break;
+        }
 
-        //value
-        ckv3_next_token(ckv3, token);
-        ckv3_process_value(l, ckv3, token);
+        strbuf_append_char(ckv3, '\n');
+        ckv3_append_indent(cfg, ckv3, current_depth);
+        strbuf_append_char(ckv3, '{');
+        ckv3_format_items(snap, ckv3, node, current_depth, CKV3_FORMAT_PAIR);
+        strbuf_append_char(ckv3, '\n');
+        ckv3_append_indent(cfg, ckv3, current_depth);
+        strbuf_append_char(ckv3, '}');
+        break;
+    default:
+        ckv3_append_packed(NULL, cfg, current_depth, ckv3,
+                           (const ckv3_packed_t *)node->value.packed);
+    }
+}
 
-        // Print_Stack;
-        lua_rawseti(l, -2, 2);
+/* Formats an item the way the function named by flags writes the key and
+ * value it came from */
+static void ckv3_format_item(ckv_snap_t *snap, strbuf_t *ckv3,
+                             const ckv_snap_node_t *item, int current_depth,
+                             int flags)
+{
+    ckv3_config_t *cfg = (ckv3_config_t *)snap->cfg;
+
+    switch (flags & CKV3_FORMAT_KINDS) {
+    case CKV3_FORMAT_TOP:
+        ckv_append_escaped(ckv3, item->key->value.string,
+                           item->key->string_len, 1);
+        strbuf_append_char(ckv3, ' ');
+        ckv3_format_data(snap, ckv3, item, 0, 1);
+        if (item->next)
+            strbuf_append_char(ckv3, '\n');
+        break;
+    case CKV3_FORMAT_PAIR:
+        strbuf_append_char(ckv3, '\n');
+        ckv3_append_indent(cfg, ckv3, current_depth + 1);
+        ckv_append_escaped(ckv3, item->key->value.string,
+                           item->key->string_len, 1);
+        strbuf_append_char(ckv3, ' ');
+        ckv3_format_array(snap, ckv3, item, current_depth + 1, 1);
+        break;
+    case CKV3_FORMAT_ELEMENT:
+        if (item->type == CKV_SNAP_TABLE &&
+            !(item->flags & CKV3_SNAP_OBJECT)) {
+            strbuf_append_char(ckv3, '\n');
+            ckv3_append_indent(cfg, ckv3, current_depth);
+            strbuf_append_char(ckv3, '[');
+            strbuf_append_char(ckv3, '\n');
+            ckv3_append_indent(cfg, ckv3, current_depth + 1);
+            ckv3_format_items(snap, ckv3, item, current_depth + 1,
+                              CKV3_FORMAT_INNER);
+            strbuf_append_char(ckv3, '\n');
+            ckv3_append_indent(cfg, ckv3, current_depth);
+            strbuf_append_char(ckv3, ']');
+        } else {
+            ckv3_format_data(snap, ckv3, item, current_depth, 0);
+        }
+        if (item->next)
+            strbuf_append_char(ckv3, flags & CKV3_FORMAT_OBJECT ? ' ' : ',');
+        break;
+    default:
+        ckv3_format_data(snap, ckv3, item, current_depth, 1);
+        if (item->next)
+            strbuf_append_char(ckv3, ',');
+    }
+}
+
+/* ckv3.encode(tb [, { threads = N }])
+ *
+ * With the option table the text is formatted on up to threads threads,
+ * see PARALLEL ENCODING in common.h */
+static int ckv3_encode(lua_State *l)
+{
+    ckv3_config_t *cfg = ckv3_fetch_config(l);
+    strbuf_t local_encode_buf;
+    strbuf_t *encode_buf;
+    ckv_snap_t *snap = NULL;
+    ckv_snap_node_t *root = NULL;
+    char *ckv3;
+    int threads = 1, len;
+
+    luaL_argcheck(l, lua_gettop(l) >= 1 && lua_gettop(l) <= 2, 1,
+                  "expected 1 or 2 arguments");
+    if (!lua_isnoneornil(l, 2))
+        threads = ckv_threads_option(l, 2);
+    lua_settop(l, 1);
+
+    /* The copy raises any error before there is a buffer to free */
+    if (threads > 1) {
+        snap = ckv_snap_new(l, ckv3_format_item, cfg);
+        lua_pushvalue(l, 1);
+        root = ckv3_snap_pairs(l, cfg, snap);
+        lua_pop(l, 1);
+    }
+
+    encode_buf = ckv3_encode_buffer(cfg, &local_encode_buf);
+    if (snap) {
+        ckv_snap_encode(snap, root, 0, CKV3_FORMAT_TOP, threads, encode_buf);
+        ckv_snap_free(snap);
+    } else {
+        ckv3_encode_pairs(l, cfg, encode_buf);
+    }
+
+    ckv3 = strbuf_string(encode_buf, &len);
+    lua_pushlstring(l, ckv3, len);
+
+    ckv3_encode_buffer_done(cfg, encode_buf);
+
+    return 1;
+}
+
+/* Shared by encode_to and encode_to_file, the sink is on top of the
+ * stack above the table and the target */
+static int ckv3_encode_sink(lua_State *l, ckv_sink_t *sink)
+{
+    ckv3_config_t *cfg = ckv3_fetch_config(l);
+
+    lua_pushvalue(l, 1);
+    cfg->encode_sink = sink;
+    ckv3_encode_pairs(l, cfg, &sink->buf);
+    cfg->encode_sink = NULL;
+
+    lua_pushinteger(l, (lua_Integer)ckv_sink_close(l, sink));
+
+    return 1;
+}
+
+/* Calls writer(chunk) with the text as it is encoded, returns the
+ * number of bytes written */
+static int ckv3_encode_to(lua_State *l)
+{
+    luaL_argcheck(l, lua_gettop(l) == 2, 2, "expected 2 arguments");
+
+    return ckv3_encode_sink(l, ckv_sink_writer(l, 2));
+}
+
+/* Writes the text to path as it is encoded, returns the number of bytes
+ * written */
+static int ckv3_encode_to_file(lua_State *l)
+{
+    luaL_argcheck(l, lua_gettop(l) == 2, 2, "expected 2 arguments");
+
+    return ckv3_encode_sink(l, ckv_sink_file(l, luaL_checkstring(l, 2)));
+}
+
+/* ===== DECODING ===== */
+
+/* Fills in the token struct.
+ * T_STRING will return a pointer to the ckv3_parse_t temporary string
+ * T_ERROR will leave the ckv3->ptr pointer at the error.
+ */
+static void ckv3_scan_token(ckv3_parse_t *ckv3, ckv_token_t *token)
+{
+    ckv_lex_token(&ckv3->cfg->lexer, CKV_LEX_KV3, ckv3->data, &ckv3->ptr,
+                  ckv3->tmp, token);
+}
+
+/* Every token of the decoders goes through here */
+static inline void ckv3_next_token(ckv3_parse_t *ckv3, ckv_token_t *token)
+{
+    ckv3_scan_token(ckv3, token);
+    CKV_STAT(ckv3->stats->tokens[token->type]++);
+}
+
+/* Build the structural index of the source when decode_presize is on */
+static void ckv3_parse_index(ckv3_parse_t *ckv3, ckv_index_t *index, size_t len)
+{
+    ckv3->index = NULL;
+    if (ckv3->cfg->decode_presize &&
+        ckv_index_build(index, ckv3->data, len, CKV_LEX_KV3) == 0)
+        ckv3->index = index;
+}
+
+/* Release the temporary parser string and the table index. Also called
+ * before luaL_error() unwinds the C stack */
+static void ckv3_parse_release(ckv3_parse_t *ckv3)
+{
+    CKV_STAT(ckv3->stats->decodes++;
+             ckv3->stats->bytes += ckv3->ptr - ckv3->data;
+             ckv3->stats->reallocs += ckv3->tmp->reallocs);
+    ckv_scratch_put(&ckv3->cfg->scratch, ckv3->tmp,
+                    ckv3->cfg->decode_scratch_limit);
+    if (ckv3->index)
+        ckv_index_free(ckv3->index);
+}
+
+/* This function does not return.
+ * DO NOT CALL WITH DYNAMIC MEMORY ALLOCATED.
+ * The only supported exceptions are the temporary parser string
+ * ckv3->tmp struct and the ckv3->index shapes.
+ * ckv3 and token should exist on the stack somewhere.
+ * luaL_error() will long_jmp and release the stack */
+static void ckv3_throw_parse_error(lua_State *l, ckv3_parse_t *ckv3,
+                                   const char *exp, ckv_token_t *token)
+{
+    ckv3_parse_release(ckv3);
+    ckv_token_error(l, exp, token, 0);
+}
+
+/* Push an object key, through the key cache when decode_key_cache is on */
+static inline void ckv3_push_key(lua_State *l, ckv3_parse_t *ckv3,
+                               const ckv_token_t *token)
+{
+    CKV_STAT(ckv3->stats->strings++);
+    if (ckv3->cfg->decode_key_cache)
+        ckv_key_cache_push(l, &ckv3->cfg->key_cache, token->value.string,
+                           token->string_len);
+    else
+        lua_pushlstring(l, token->value.string, token->string_len);
+}
+
+static inline void ckv3_decode_ascend(ckv3_parse_t *ckv3)
+{
+    ckv3->current_depth--;
+}
+
+static void ckv3_decode_descend(lua_State *l, ckv3_parse_t *ckv3, int slots)
+{
+    ckv3->current_depth++;
+    CKV_STAT(ckv_stats_table(ckv3->stats, ckv3->current_depth));
+
+    if (ckv3->current_depth <= ckv3->cfg->decode_max_depth &&
+        lua_checkstack(l, slots)) {
+        return;
+    }
+
+    ckv3_parse_release(ckv3);
+    luaL_error(l, "Found too many nested data structures (%d) at character %d",
+        ckv3->current_depth, ckv3->ptr - ckv3->data);
+}
+
+/* Returns the ckv3_packed_types index of a type name, or -1 */
+static int ckv3_packed_type(const char *name, int len)
+{
+    int i;
+
+    for (i = 0; ckv3_packed_types[i].name; i++) {
+        if (!strncmp(ckv3_packed_types[i].name, name, len) &&
+            !ckv3_packed_types[i].name[len])
+            return i;
+    }
+
+    return -1;
+}
+
+/* Parses the elements of a float tuple array starting just after its '['
+ * into out (when not NULL) and sets *endptr after the ']'. Returns the
+ * element count, or -1 when an element isn't a string of exactly width
+ * numbers */
+static int ckv3_scan_packed(const char *p, int width, float *out,
+                            const char **endptr)
+{
+    const char *end;
+    lua_Integer integer;
+    double number;
+    int count = 0, i;
+
+    p = ckv_skip_whitespace(p);
+    while (*p != ']') {
+        if (*p++ != '"' || count == INT_MAX)
+            return -1;
+
+        for (i = 0; i < width; i++) {
+            if (i) {
+                if (*p != ' ')
+                    return -1;
+                while (*p == ' ')
+                    p++;
+            }
+
+            switch (ckv_scan_number(p, &end, &integer, &number)) {
+            case 1:
+                number = (double)integer;
+                break;
+            case 0:
+                break;
+            default:
+                number = fpconv_strtod(p, (char **)&end);
+                if (end == p)
+                    return -1;
+            }
+            if (out)
+                *out++ = (float)number;
+            p = end;
+        }
+
+        if (*p++ != '"')
+            return -1;
+        count++;
+
+        p = ckv_skip_whitespace(p);
+        if (*p == ',')
+            p = ckv_skip_whitespace(p + 1);
     }
-    else if (token->type == T_OBJ_BEGIN)
+
+    *endptr = p + 1;
+    return count;
+}
+
+/* Decodes the float tuple array at ckv3->ptr (just after its '[') into a
+ * ckv3_packed_t on the stack. Returns 0 with nothing consumed when it is
+ * empty or holds anything else, the table decoder takes those */
+static int ckv3_push_packed(lua_State *l, ckv3_parse_t *ckv3, int type)
+{
+    const int width = ckv3_packed_types[type].width;
+    ckv3_packed_t *packed;
+    const char *end;
+    int count;
+
+    count = ckv3_scan_packed(ckv3->ptr, width, NULL, &end);
+    if (count <= 0 || !lua_checkstack(l, 2))
+        return 0;
+
+    packed = (ckv3_packed_t *)lua_newuserdata(l,
+                 CKV3_PACKED_SIZE((size_t)count * width));
+    packed->type = type;
+    packed->width = width;
+    packed->count = count;
+    ckv3_scan_packed(ckv3->ptr, width, packed->data, &end);
+
+    lua_rawgeti(l, LUA_REGISTRYINDEX, ckv3->cfg->packed_meta);
+    lua_setmetatable(l, -2);
+    ckv3->ptr = end;
+
+    return 1;
+}
+
+/* Tables are parsed in a loop. The frame of each open table, and the one
+ * of the caller at the bottom, says where the value being parsed goes */
+typedef enum {
+    P3_VALUE,           /* Caller: a value left on the stack */
+    P3_PLAIN,           /* Object: the container after a key */
+    P3_TYPED,           /* Object: the value of a { type, value } pair */
+    P3_ELEMENT,         /* Array: an element, maybe a type name */
+    P3_TYPED_ELEMENT    /* Array: the value after a type name */
+} ckv3_parse_state_t;
+
+typedef struct {
+    ckv3_parse_state_t state;
+    int index;          /* Arrays: next element index */
+    int packed;         /* P3_TYPED: ckv3_packed_types index or -1 */
+} ckv3_parse_frame_t;
+
+/* Push the key at token and for "key" "type" value the pair holding the
+ * type, leaving token at the value */
+static void ckv3_parse_key(lua_State *l, ckv3_parse_t *ckv3,
+                           ckv3_parse_frame_t *frame, ckv_token_t *token)
+{
+    //key
+    ckv3_push_key(l, ckv3, token);
+
+    ckv3_next_token(ckv3, token);
+    if (token->type == T_STRING)
     {
-        ckv3_process_value(l, ckv3, token);
+        CKV_STAT(ckv3->stats->tables++);
+        lua_createtable(l, 2, 0);
+        frame->packed = ckv3->packed ?
+            ckv3_packed_type(token->value.string, token->string_len) : -1;
+        //type, a handful of names ("vector3", "elementid", ..) repeat everywhere
+        ckv3_push_key(l, ckv3, token);
+        lua_rawseti(l, -2, 1);
+
+        //value
+        ckv3_next_token(ckv3, token);
+        frame->state = P3_TYPED;
     }
-    else if (token->type == T_ARR_BEGIN)
+    else if (token->type == T_OBJ_BEGIN || token->type == T_ARR_BEGIN)
     {
-        ckv3_process_value(l, ckv3, token);
+        frame->state = P3_PLAIN;
     }
     else
     {
         ckv3_throw_parse_error(l, ckv3, "unexpected token", token);
     }
-            
+}
+
+/* .., table, key, [pair,] value */
+static inline void ckv3_set_attribute(lua_State *l, ckv3_parse_state_t state)
+{
+    if (state == P3_TYPED)
+        lua_rawseti(l, -2, 2);
+
     /* Set key = value */
     lua_rawset(l, -3);
 }
 
-static void ckv3_parse_object_context(lua_State *l, ckv3_parse_t *ckv3)
+/* Push the table of the container opened by token along with its frame.
+ * Returns 0 when it is empty, otherwise token is its first value */
+static int ckv3_open_table(lua_State *l, ckv3_parse_t *ckv3,
+                           ckv_frames_t *stack, ckv_token_t *token)
 {
-    ckv3_token_t token;
+    ckv3_parse_frame_t *frame;
+    const ckv_shape_t *shape;
 
-    /* 3 slots required:
-     * .., table, key, value */
-    ckv3_decode_descend(l, ckv3, 3);
+    if (token->type == T_OBJ_BEGIN) {
+        /* Slots required: .., table, key, pair, value and one to grow
+         * the frames */
+        ckv3_decode_descend(l, ckv3, 5);
+        frame = (ckv3_parse_frame_t *)ckv_frames_push(l, stack);
 
-    lua_newtable(l);
+        /* Attributes are mostly "name" "type" value triples */
+        shape = ckv_index_find(ckv3->index, ckv3->ptr - ckv3->data);
+        lua_createtable(l, 0, shape ? shape->values / 3 : 0);
 
-    ckv3_next_token(ckv3, &token);
-    
-    /* Handle empty objects */
-    if (token.type == T_OBJ_END) {
-        ckv3_decode_ascend(ckv3);
-        return;
-    }
-    
-    while (1) {
-        if (token.type != T_STRING)
-            ckv3_throw_parse_error(l, ckv3, "object key string", &token);
+        ckv3_next_token(ckv3, token);
 
-        parse_object_internal(l, &token, ckv3);
-        
-        //key or T_OBJ_END?
-        ckv3_next_token(ckv3, &token);
+        /* Handle empty objects */
+        if (token->type == T_OBJ_END)
+            return 0;
 
-        if (token.type == T_OBJ_END) {
-            ckv3_decode_ascend(ckv3);
-            return;
-        }
+        if (token->type != T_STRING)
+            ckv3_throw_parse_error(l, ckv3, "object key string", token);
+        ckv3_parse_key(l, ckv3, frame, token);
+
+        return 1;
     }
+
+    /* Slots required: .., table, pair, value and one to grow the frames */
+    ckv3_decode_descend(l, ckv3, 4);
+    frame = (ckv3_parse_frame_t *)ckv_frames_push(l, stack);
+    frame->state = P3_ELEMENT;
+    frame->index = 1;
+
+    /* Elements are comma separated, element_array entries are two values */
+    shape = ckv_index_find(ckv3->index, ckv3->ptr - ckv3->data);
+    lua_createtable(l, shape && shape->values ? shape->commas + 1 : 0, 0);
+    ckv3_next_token(ckv3, token);
+
+    /* Handle empty arrays */
+    return token->type != T_ARR_END;
 }
 
-/* Handle the array context */
-static void ckv3_parse_array_context(lua_State *l, ckv3_parse_t *ckv3)
+/* Store the value on top of the stack in the table of frame. Returns 0
+ * when that completes the table, otherwise token is its next value */
+static int ckv3_store_value(lua_State *l, ckv3_parse_t *ckv3,
+                            ckv3_parse_frame_t *frame, ckv_token_t *token)
 {
-    ckv3_token_t token;
-    int i;
+    switch (frame->state) {
+    case P3_PLAIN:
+    case P3_TYPED:
+        ckv3_set_attribute(l, frame->state);
 
-    /* 2 slots required:
-     * .., table, value */
-    const int slot = 2;
-    ckv3_decode_descend(l, ckv3, slot);
-
-    lua_newtable(l);
-    ckv3_next_token(ckv3, &token);
+        //key or T_OBJ_END?
+        ckv3_next_token(ckv3, token);
+        if (token->type == T_OBJ_END)
+            return 0;
 
-    /* Handle empty arrays */
-    if (token.type == T_ARR_END) {
-        ckv3_decode_ascend(ckv3);
-        return;
-    }
+        if (token->type != T_STRING)
+            ckv3_throw_parse_error(l, ckv3, "object key string", token);
+        ckv3_parse_key(l, ckv3, frame, token);
 
-    for (i = 1; ; i++)
-    {
-        //push string
-        ckv3_process_value(l, ckv3, &token);
-        
+        return 1;
+    case P3_ELEMENT:
         // maybe pure array, maybe element_array
-        ckv3_next_token(ckv3, &token);
-        if (token.type == T_COMMA)
+        ckv3_next_token(ckv3, token);
+        if (token->type == T_COMMA)
         {
             //是逗号 进下一个循环
-            lua_rawseti(l, -2, i);
-            ckv3_next_token(ckv3, &token);
+            lua_rawseti(l, -2, frame->index++);
+            ckv3_next_token(ckv3, token);
             //兼容一下末尾是,]的情况
-            if (token.type == T_ARR_END)
-            {
-                ckv3_decode_ascend(ckv3);
-                return;
-            }
+            return token->type != T_ARR_END;
         }
-        else if (token.type == T_ARR_END)
+        else if (token->type == T_ARR_END)
         {
             //数组的末尾
-            lua_rawseti(l, -2, i);
-            ckv3_decode_ascend(ckv3);
-            return;
+            lua_rawseti(l, -2, frame->index);
+            return 0;
         }
-        else
-        {
-            //不是逗号，那么是数据类型或者直接跟容器
-            size_t len;
-            const char * keyName = lua_tolstring(l, -1, &len);
+
+        //不是逗号，那么是数据类型或者直接跟容器
+        //a container has no type name, it becomes ""
+        if (lua_type(l, -1) != LUA_TSTRING) {
             lua_pop(l, 1);
+            lua_pushliteral(l, "");
+        }
+        lua_createtable(l, 2, 0);
+        lua_insert(l, -2);
 
-            lua_newtable(l);
-            lua_pushlstring(l, keyName, len);
+        //array[1] = type
+        lua_rawseti(l, -2, 1);
+        frame->state = P3_TYPED_ELEMENT;
 
-            //array[1] = type
-            lua_rawseti(l, -2, 1);
+        return 1;
+    case P3_TYPED_ELEMENT:
+        //array[2] = obj
+        lua_rawseti(l, -2, 2);
+        lua_rawseti(l, -2, frame->index++);
+        frame->state = P3_ELEMENT;
 
-            //array[2] = obj
-            ckv3_process_value(l, ckv3, &token);
-            lua_rawseti(l, -2, 2);
-            
-            lua_rawseti(l, -2, i);
-            ckv3_next_token(ckv3, &token);
-            if (token.type == T_COMMA)
-            {
-                //是逗号，直接进入下一个循环
-                ckv3_next_token(ckv3, &token);
-                //兼容一下末尾是,]的情况
-                if (token.type == T_ARR_END)
-                {
-                    ckv3_decode_ascend(ckv3);
-                    return;
-                }
-            }
-            else if (token.type == T_ARR_END)
-            {
-                ckv3_decode_ascend(ckv3);
-                return;
-            }
+        ckv3_next_token(ckv3, token);
+        if (token->type == T_COMMA)
+        {
+            //是逗号，直接进入下一个循环
+            ckv3_next_token(ckv3, token);
+        }
+        //兼容一下末尾是,]的情况
+        return token->type != T_ARR_END;
+    default:
+        return 0;
+    }
+}
+
+/* Parse the value at token with every table nested in it, or with
+ * attribute set the "key" [type] value at token into the table on top
+ * of the stack */
+static void ckv3_parse(lua_State *l, ckv3_parse_t *ckv3, ckv_token_t *token,
+                       int attribute)
+{
+    ckv3_parse_frame_t frames[CKV_FRAMES_INLINE];
+    ckv_frames_t stack;
+    ckv3_parse_frame_t *frame;
+    ckv3_parse_state_t state;
+    int more = 1;
+
+    ckv_frames_init(l, &stack, frames, CKV_FRAMES_INLINE, sizeof(*frames));
+    frame = (ckv3_parse_frame_t *)ckv_frames_push(l, &stack);
+    frame->state = P3_VALUE;
+    if (attribute)
+        ckv3_parse_key(l, ckv3, frame, token);
+
+    while (1) {
+        if (!more) {
+            /* The table is a value of the frame below */
+            ckv3_decode_ascend(ckv3);
+            frame = (ckv3_parse_frame_t *)ckv_frames_pop(&stack);
+        } else if (frame->state == P3_TYPED && frame->packed >= 0 &&
+                   token->type == T_ARR_BEGIN &&
+                   ckv3_push_packed(l, ckv3, frame->packed)) {
+            /* Float tuple array */
+        } else if (token->type == T_OBJ_BEGIN || token->type == T_ARR_BEGIN) {
+            more = ckv3_open_table(l, ckv3, &stack, token);
+            frame = (ckv3_parse_frame_t *)ckv_frames_top(&stack);
+            continue;
+        } else if (token->type == T_STRING) {
+            CKV_STAT(ckv3->stats->strings++);
+            lua_pushlstring(l, token->value.string, token->string_len);
+        } else {
+            ckv3_throw_parse_error(l, ckv3, "value", token);
         }
+
+        if (stack.count == 1)
+            break;
+        more = ckv3_store_value(l, ckv3, frame, token);
     }
+
+    /* The frames userdata is below the value */
+    state = frame->state;
+    ckv_frames_free(l, &stack);
+    if (state != P3_VALUE)
+        ckv3_set_attribute(l, state);
 }
 
 /* Handle the "value" context */
 static void ckv3_process_value(lua_State *l, ckv3_parse_t *ckv3,
-                               ckv3_token_t *token)
+                               ckv_token_t *token)
 {
-    switch (token->type) {
-    case T_STRING:
-        lua_pushlstring(l, token->value.string, token->string_len);
-        break;;
-    case T_OBJ_BEGIN:
-        ckv3_parse_object_context(l, ckv3);
-        break;;
-    case T_ARR_BEGIN:
-        ckv3_parse_array_context(l, ckv3);
-        break;;
-    default:
-        ckv3_throw_parse_error(l, ckv3, "value", token);
-    }
+    ckv3_parse(l, ckv3, token, 0);
 }
 
-static int ckv3_decode(lua_State *l)
+/* Decodes the text at index 1, packed selects ckv3_packed_t for float
+ * tuple arrays */
+static int ckv3_decode_text(lua_State *l, int packed)
 {
     ckv3_parse_t ckv3;
-    ckv3_token_t token;
+    ckv_token_t token;
+    ckv_index_t index;
     size_t ckv3_len;
 
-    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
-
     ckv3.cfg = ckv3_fetch_config(l);
-    ckv3.data = luaL_checklstring(l, 1, &ckv3_len);
-    lua_pop(l, 1);
+    CKV_STAT(ckv3.stats = &ckv3.cfg->stats);
+    ckv3.data = ckv_check_source(l, &ckv3_len);
     ckv3.current_depth = 0;
+    ckv3.packed = packed;
     ckv3.ptr = ckv3.data;
 
     /* Detect Unicode other than UTF-8 (see RFC 4627, Sec 3)
@@ -863,7 +1463,8 @@ static int ckv3_decode(lua_State *l)
     /* Ensure the temporary buffer can hold the entire string.
      * This means we no longer need to do length checks since the decoded
      * string must be smaller than the entire ckv3 string */
-    ckv3.tmp = strbuf_new(ckv3_len);
+    ckv3.tmp = ckv_scratch_get(&ckv3.cfg->scratch, ckv3_len);
+    ckv3_parse_index(&ckv3, &index, ckv3_len);
 
     lua_newtable(l);
     
@@ -871,13 +1472,15 @@ static int ckv3_decode(lua_State *l)
     if (token.type == T_STRING)
     {
         while (1) {
-            parse_object_internal(l, &token, &ckv3);
+            ckv3_parse(l, &ckv3, &token, 1);
             
             ckv3_next_token(&ckv3, &token);
 
             if (token.type == T_END) {
                 break;
             }
+            if (token.type != T_STRING)
+                ckv3_throw_parse_error(l, &ckv3, "object key string", &token);
         }
     }
     else
@@ -885,18 +1488,856 @@ static int ckv3_decode(lua_State *l)
         ckv3_throw_parse_error(l, &ckv3, "Must begin with string", &token);
     }
     
-    strbuf_free(ckv3.tmp);
+    ckv3_parse_release(&ckv3);
 
     return 1;
 }
 
+static int ckv3_decode(lua_State *l)
+{
+    return ckv3_decode_text(l, ckv3_fetch_config(l)->decode_packed_arrays);
+}
+
+
+/* ===== STREAMING DECODER =====
+ *
+ * ckv3.decoder() returns an object taking the document in chunks:
+ *
+ *     local dec = ckv3.decoder()
+ *     dec:feed(chunk) ...
+ *     local t = dec:finish()
+ *
+ * The parser state lives in the decoder instead of the C stack, so each
+ * feed() turns every token completed by the chunk into Lua values right
+ * away and keeps only the unfinished token for the next call. Open tables
+ * and pending keys are kept in a Lua table (the value stack). */
+
+typedef enum {
+    S3_KEY,             /* Object: key or '}' */
+    S3_AFTER_KEY,       /* Object: type name, '{' or '[' */
+    S3_PAIR_VALUE,      /* Object: value of a { type, value } pair */
+    S3_VALUE,           /* Object: container value after the key */
+    S3_FIRST,           /* Array: first element or ']' */
+    S3_ELEMENT,         /* Array: element value */
+    S3_AFTER_ELEMENT,   /* Array: ',', ']' or the element was a type name */
+    S3_TYPED_ELEMENT,   /* Array: value after a type name */
+    S3_AFTER_TYPED,     /* Array: ',' or ']' after a typed element */
+    S3_AFTER_COMMA      /* Array: element or ']' */
+} ckv3_stream_state_t;
+
+typedef struct {
+    ckv3_stream_state_t state;
+    int index;          /* Arrays: next element index */
+} ckv3_frame_t;
+
+typedef struct {
+    strbuf_t buf;       /* Unconsumed input, an unfinished token at most */
+    strbuf_t tmp;       /* Decoded strings with backslashes */
+    ckv3_frame_t *frames;   /* frames[0] is the document root */
+    int depth;
+    int frames_size;
+    int values;         /* Registry ref of the value stack */
+    int top;            /* Entries in use in the value stack */
+    int keys;           /* Root attributes decoded so far */
+    size_t offset;      /* Input bytes consumed before buf */
+    int status;         /* 0 running, 1 finished, -1 failed */
+} ckv3_decoder_t;
+
+/* Stack index of the value stack while feeding */
+#define CKV3_VALUES 3
+
+static void ckv3_stream_error(lua_State *l, ckv3_decoder_t *dec,
+                              const char *exp, const ckv_token_t *token)
+{
+    dec->status = -1;
+    ckv_token_error(l, exp, token, dec->offset);
+}
+
+/* Move the value at the top of the Lua stack onto the value stack */
+static inline void ckv3_stream_push(lua_State *l, ckv3_decoder_t *dec)
+{
+    lua_rawseti(l, CKV3_VALUES, ++dec->top);
+}
+
+/* Push value stack entry top - n onto the Lua stack */
+static inline void ckv3_stream_get(lua_State *l, ckv3_decoder_t *dec, int n)
+{
+    lua_rawgeti(l, CKV3_VALUES, dec->top - n);
+}
+
+/* Drop the top n entries of the value stack */
+static void ckv3_stream_drop(lua_State *l, ckv3_decoder_t *dec, int n)
+{
+    while (n-- > 0) {
+        lua_pushnil(l);
+        lua_rawseti(l, CKV3_VALUES, dec->top--);
+    }
+}
+
+static void ckv3_stream_open(lua_State *l, ckv3_decoder_t *dec,
+                             const ckv_token_t *token)
+{
+    ckv3_frame_t *frame;
+
+    if (dec->depth == dec->frames_size) {
+        frame = (ckv3_frame_t *)realloc(dec->frames,
+                                        2 * dec->frames_size * sizeof(*frame));
+        if (!frame) {
+            dec->status = -1;
+            luaL_error(l, "not enough memory");
+        }
+        dec->frames = frame;
+        dec->frames_size *= 2;
+    }
+
+    /* The root frame isn't a nested structure */
+    if (dec->depth > ckv3_fetch_config(l)->decode_max_depth) {
+        dec->status = -1;
+        luaL_error(l, "Found too many nested data structures (%d) at character %d",
+                   dec->depth, (int)(dec->offset + token->index + 1));
+    }
+
+    frame = &dec->frames[dec->depth++];
+    frame->state = token->type == T_OBJ_BEGIN ? S3_KEY : S3_FIRST;
+    frame->index = 1;
+
+    lua_newtable(l);
+    ckv3_stream_push(l, dec);
+}
+
+/* Store the value at the top of the Lua stack where the current frame
+ * expects it */
+static void ckv3_stream_value_done(lua_State *l, ckv3_decoder_t *dec)
+{
+    ckv3_frame_t *frame = &dec->frames[dec->depth - 1];
+
+    switch (frame->state) {
+    case S3_VALUE:
+        /* .., table, key */
+        ckv3_stream_get(l, dec, 1);
+        ckv3_stream_get(l, dec, 0);
+        lua_pushvalue(l, -3);
+        lua_rawset(l, -3);
+        lua_pop(l, 2);
+        ckv3_stream_drop(l, dec, 1);
+        frame->state = S3_KEY;
+        break;
+    case S3_PAIR_VALUE:
+        /* .., table, key, { type } */
+        ckv3_stream_get(l, dec, 0);
+        lua_insert(l, -2);
+        lua_rawseti(l, -2, 2);
+        ckv3_stream_get(l, dec, 2);
+        ckv3_stream_get(l, dec, 1);
+        lua_pushvalue(l, -3);
+        lua_rawset(l, -3);
+        lua_pop(l, 2);
+        ckv3_stream_drop(l, dec, 2);
+        frame->state = S3_KEY;
+        break;
+    case S3_TYPED_ELEMENT:
+        /* .., array, { type } */
+        ckv3_stream_get(l, dec, 0);
+        lua_insert(l, -2);
+        lua_rawseti(l, -2, 2);
+        ckv3_stream_get(l, dec, 1);
+        lua_insert(l, -2);
+        lua_rawseti(l, -2, frame->index++);
+        lua_pop(l, 1);
+        ckv3_stream_drop(l, dec, 1);
+        frame->state = S3_AFTER_TYPED;
+        break;
+    default:
+        /* S3_ELEMENT: kept until the next token tells whether the element
+         * is a value or the type name of the one after it */
+        ckv3_stream_push(l, dec);
+        frame->state = S3_AFTER_ELEMENT;
+        break;
+    }
+}
+
+/* Append the element kept by S3_AFTER_ELEMENT to the array */
+static void ckv3_stream_append(lua_State *l, ckv3_decoder_t *dec,
+                               ckv3_frame_t *frame)
+{
+    /* .., array, element */
+    ckv3_stream_get(l, dec, 1);
+    ckv3_stream_get(l, dec, 0);
+    lua_rawseti(l, -2, frame->index++);
+    lua_pop(l, 1);
+    ckv3_stream_drop(l, dec, 1);
+}
+
+static void ckv3_stream_close(lua_State *l, ckv3_decoder_t *dec)
+{
+    dec->depth--;
+    ckv3_stream_get(l, dec, 0);
+    ckv3_stream_drop(l, dec, 1);
+    ckv3_stream_value_done(l, dec);
+}
+
+static void ckv3_stream_value(lua_State *l, ckv3_decoder_t *dec,
+                              const ckv_token_t *token)
+{
+    switch (token->type) {
+    case T_STRING:
+        CKV_STAT(ckv3_fetch_config(l)->stats.strings++);
+        lua_pushlstring(l, token->value.string, token->string_len);
+        ckv3_stream_value_done(l, dec);
+        break;
+    case T_OBJ_BEGIN:
+    case T_ARR_BEGIN:
+        ckv3_stream_open(l, dec, token);
+        break;
+    default:
+        ckv3_stream_error(l, dec, "value", token);
+    }
+}
+
+/* Feed one token to the state machine. Same grammar as ckv3_decode() */
+static void ckv3_stream_token(lua_State *l, ckv3_decoder_t *dec,
+                              ckv3_parse_t *ckv3, const ckv_token_t *token)
+{
+    ckv3_frame_t *frame = &dec->frames[dec->depth - 1];
+    size_t len;
+    const char *name;
+
+    switch (frame->state) {
+    case S3_KEY:
+        if (token->type == T_STRING) {
+            ckv3_push_key(l, ckv3, token);
+            ckv3_stream_push(l, dec);
+            frame->state = S3_AFTER_KEY;
+            if (dec->depth == 1)
+                dec->keys++;
+        } else if (token->type == T_OBJ_END && dec->depth > 1) {
+            ckv3_stream_close(l, dec);
+        } else if (dec->depth == 1 && dec->keys == 0) {
+            ckv3_stream_error(l, dec, "Must begin with string", token);
+        } else if (token->type != T_END || dec->depth > 1) {
+            ckv3_stream_error(l, dec, "object key string", token);
+        }
+        break;
+    case S3_AFTER_KEY:
+        if (token->type == T_STRING) {
+            lua_createtable(l, 2, 0);
+            ckv3_push_key(l, ckv3, token);
+            lua_rawseti(l, -2, 1);
+            ckv3_stream_push(l, dec);
+            frame->state = S3_PAIR_VALUE;
+        } else if (token->type == T_OBJ_BEGIN || token->type == T_ARR_BEGIN) {
+            frame->state = S3_VALUE;
+            ckv3_stream_open(l, dec, token);
+        } else {
+            ckv3_stream_error(l, dec, "unexpected token", token);
+        }
+        break;
+    case S3_FIRST:
+    case S3_AFTER_COMMA:
+        if (token->type == T_ARR_END) {
+            ckv3_stream_close(l, dec);
+            break;
+        }
+        frame->state = S3_ELEMENT;
+        ckv3_stream_value(l, dec, token);
+        break;
+    case S3_AFTER_ELEMENT:
+        if (token->type == T_COMMA) {
+            ckv3_stream_append(l, dec, frame);
+            frame->state = S3_AFTER_COMMA;
+        } else if (token->type == T_ARR_END) {
+            ckv3_stream_append(l, dec, frame);
+            ckv3_stream_close(l, dec);
+        } else {
+            /* The element was the type name of this value */
+            ckv3_stream_get(l, dec, 0);
+            name = lua_tolstring(l, -1, &len);
+            lua_createtable(l, 2, 0);
+            lua_pushlstring(l, name, len);
+            lua_rawseti(l, -2, 1);
+            ckv3_stream_drop(l, dec, 1);
+            ckv3_stream_push(l, dec);
+            lua_pop(l, 1);
+            frame->state = S3_TYPED_ELEMENT;
+            ckv3_stream_value(l, dec, token);
+        }
+        break;
+    case S3_AFTER_TYPED:
+        if (token->type == T_COMMA) {
+            frame->state = S3_AFTER_COMMA;
+        } else if (token->type == T_ARR_END) {
+            ckv3_stream_close(l, dec);
+        } else {
+            frame->state = S3_ELEMENT;
+            ckv3_stream_value(l, dec, token);
+        }
+        break;
+    default:
+        /* S3_PAIR_VALUE and the element states */
+        ckv3_stream_value(l, dec, token);
+        break;
+    }
+}
+
+/* Returns 1 when the next token in [p, end) is complete, 0 when it may
+ * continue in the next chunk and -1 when the input ends inside a string.
+ * *end is always '\0' */
+static int ckv3_stream_complete(const char *p, const char *end)
+{
+    /* Any number of comments may come first, each one possibly cut off */
+    while (1) {
+        p = ckv_skip_whitespace(p);
+        if (p == end)
+            return 0;
+        if (*p != '<')
+            break;
+        if (end - p < 4)
+            return 0;
+        if (memcmp(p + 1, "!--", 3) != 0)
+            return 1;   /* ckv3_next_token() reports it */
+        p = ckv_skip_comment_block(p + 4);
+    }
+
+    if (*p != '"')
+        return 1;
+
+    for (p++; ; p++) {
+        p = ckv_scan_quoted(p);
+        if (*p == '"')
+            return 1;
+        if (*p == '\0' && p != end)
+            return 1;   /* ckv_lex_string() reports it */
+        /* A run of backslashes takes the next character, even a quote */
+        while (*p == '\\')
+            p++;
+        if (p == end)
+            return -1;
+    }
+}
+
+/* Decode the complete tokens of data (len bytes, NULL terminated).
+ * Returns the number of bytes consumed */
+static size_t ckv3_stream_run(lua_State *l, ckv3_decoder_t *dec,
+                              const char *data, size_t len, int final)
+{
+    ckv3_parse_t ckv3;
+    ckv_token_t token;
+    int complete;
+
+    ckv3.cfg = ckv3_fetch_config(l);
+    CKV_STAT(ckv3.stats = &ckv3.cfg->stats);
+    ckv3.data = data;
+    ckv3.ptr = data;
+    ckv3.tmp = &dec->tmp;
+    ckv3.index = NULL;
+    ckv3.current_depth = 0;
+    ckv3.packed = 0;
+
+    /* Any string decoded from data fits */
+    strbuf_reset(&dec->tmp);
+    strbuf_ensure_empty_length(&dec->tmp, (int)len + 1);
+
+    while (1) {
+        complete = ckv3_stream_complete(ckv3.ptr, data + len);
+        if (complete < 0 && final) {
+            token.type = T_ERROR;
+            token.index = (int)len;
+            token.value.string = "unexpected end of string";
+            ckv3_stream_token(l, dec, &ckv3, &token);    /* Throws */
+        }
+        if (complete <= 0 && !final)
+            break;
+
+        ckv3_next_token(&ckv3, &token);
+
+        /* A NULL inside the chunk reads as T_END too */
+        if (token.type == T_END && !final)
+            ckv3_stream_error(l, dec, "value", &token);
+
+        ckv3_stream_token(l, dec, &ckv3, &token);
+        if (token.type == T_END)
+            break;
+    }
+
+    CKV_STAT(ckv3.stats->bytes += ckv3.ptr - data);
+
+    return ckv3.ptr - data;
+}
+
+static ckv3_decoder_t *ckv3_check_decoder(lua_State *l)
+{
+    ckv3_decoder_t *dec = (ckv3_decoder_t *)lua_touserdata(l, 1);
+
+    if (!dec || !lua_getmetatable(l, 1) ||
+        !lua_rawequal(l, -1, lua_upvalueindex(2)))
+        luaL_argerror(l, 1, "ckv3 decoder expected");
+    lua_pop(l, 1);
+
+    if (dec->status > 0)
+        luaL_error(l, "ckv3 decoder already finished");
+    if (dec->status < 0)
+        luaL_error(l, "ckv3 decoder failed on an earlier error");
+
+    return dec;
+}
+
+static void ckv3_decoder_release(lua_State *l, ckv3_decoder_t *dec)
+{
+    strbuf_free(&dec->buf);
+    strbuf_free(&dec->tmp);
+    free(dec->frames);
+    dec->frames = NULL;
+    luaL_unref(l, LUA_REGISTRYINDEX, dec->values);
+    dec->values = LUA_NOREF;
+}
+
+/* dec:feed(chunk) */
+static int ckv3_decoder_feed(lua_State *l)
+{
+    ckv3_decoder_t *dec = ckv3_check_decoder(l);
+    const char *chunk, *data;
+    size_t len, consumed;
+
+    chunk = luaL_checklstring(l, 2, &len);
+    lua_settop(l, 2);
+    lua_rawgeti(l, LUA_REGISTRYINDEX, dec->values);
+
+    /* Without an unfinished token the chunk is parsed in place */
+    if (dec->buf.length) {
+        strbuf_append_mem(&dec->buf, chunk, (int)len);
+        strbuf_ensure_null(&dec->buf);
+        data = dec->buf.buf;
+        len = dec->buf.length;
+    } else {
+        data = chunk;
+    }
+
+    consumed = ckv3_stream_run(l, dec, data, len, 0);
+
+    /* Keep the unfinished token */
+    if (data == dec->buf.buf) {
+        memmove(dec->buf.buf, data + consumed, len - consumed);
+        dec->buf.length = (int)(len - consumed);
+    } else {
+        strbuf_reset(&dec->buf);
+        strbuf_append_mem(&dec->buf, data + consumed, (int)(len - consumed));
+    }
+    strbuf_ensure_null(&dec->buf);
+    dec->offset += consumed;
+
+    return 0;
+}
+
+/* dec:finish() returns the decoded table */
+static int ckv3_decoder_finish(lua_State *l)
+{
+    ckv3_decoder_t *dec = ckv3_check_decoder(l);
+
+    lua_settop(l, 1);
+    lua_pushnil(l);
+    lua_rawgeti(l, LUA_REGISTRYINDEX, dec->values);
+
+    strbuf_ensure_null(&dec->buf);
+    ckv3_stream_run(l, dec, dec->buf.buf, dec->buf.length, 1);
+
+    dec->status = 1;
+    lua_rawgeti(l, CKV3_VALUES, 1);
+    ckv3_decoder_release(l, dec);
+
+    return 1;
+}
+
+static int ckv3_decoder_gc(lua_State *l)
+{
+    ckv3_decoder_t *dec = (ckv3_decoder_t *)lua_touserdata(l, 1);
+
+    /* Safe after finish(), release() leaves everything empty */
+    if (dec)
+        ckv3_decoder_release(l, dec);
+
+    return 0;
+}
+
+/* ckv3.decoder() */
+static int ckv3_decoder_new(lua_State *l)
+{
+    ckv3_decoder_t *dec;
+
+    luaL_argcheck(l, lua_gettop(l) == 0, 1, "expected 0 arguments");
+
+    dec = (ckv3_decoder_t *)lua_newuserdata(l, sizeof(*dec));
+    strbuf_init(&dec->buf, 0);
+    strbuf_init(&dec->tmp, 0);
+    dec->frames = NULL;
+    dec->values = LUA_NOREF;
+    lua_pushvalue(l, lua_upvalueindex(2));
+    lua_setmetatable(l, -2);
+
+    dec->frames_size = 16;
+    dec->frames = (ckv3_frame_t *)malloc(dec->frames_size * sizeof(*dec->frames));
+    if (!dec->frames)
+        luaL_error(l, "not enough memory");
+    dec->depth = 1;
+    dec->frames[0].state = S3_KEY;
+    dec->frames[0].index = 1;
+    dec->keys = 0;
+    dec->offset = 0;
+    dec->status = 0;
+
+    /* The value stack starts with the root table */
+    lua_createtable(l, 16, 0);
+    lua_newtable(l);
+    lua_rawseti(l, -2, 1);
+    dec->top = 1;
+    dec->values = luaL_ref(l, LUA_REGISTRYINDEX);
+
+    return 1;
+}
+
+/* Add ckv3.decoder to the module table, which is below the config
+ * userdata on the stack */
+static void ckv3_decoder_register(lua_State *l)
+{
+    luaL_Reg methods[] = {
+        { "feed", ckv3_decoder_feed },
+        { "finish", ckv3_decoder_finish },
+        { "__gc", ckv3_decoder_gc },
+        { NULL, NULL }
+    };
+
+    /* module, config, metatable */
+    lua_newtable(l);
+    lua_pushvalue(l, -1);
+    lua_setfield(l, -2, "__index");
+
+    /* The methods get the config and their own metatable */
+    lua_pushvalue(l, -2);
+    lua_pushvalue(l, -2);
+    luaL_setfuncs(l, methods, 2);
+
+    /* module, config, config, metatable */
+    lua_pushvalue(l, -2);
+    lua_insert(l, -2);
+    lua_pushcclosure(l, ckv3_decoder_new, 2);
+    lua_setfield(l, -3, "decoder");
+}
+
+/* ===== PACKED ARRAYS ===== */
+
+static ckv3_packed_t *ckv3_check_packed(lua_State *l)
+{
+    ckv3_packed_t *packed = (ckv3_packed_t *)lua_touserdata(l, 1);
+
+    if (!packed || !lua_getmetatable(l, 1) ||
+        !lua_rawequal(l, -1, lua_upvalueindex(1)))
+        luaL_argerror(l, 1, "ckv3 packed array expected");
+    lua_pop(l, 1);
+
+    return packed;
+}
+
+/* packed[i] is the i-th float of the flat buffer, .width, .count and
+ * .type describe the elements */
+static int ckv3_packed_index(lua_State *l)
+{
+    ckv3_packed_t *packed = ckv3_check_packed(l);
+    const char *key;
+    lua_Integer i;
+
+    if (lua_type(l, 2) == LUA_TNUMBER) {
+        i = lua_tointeger(l, 2);
+        if (i >= 1 && (size_t)i <= packed->count * packed->width)
+            lua_pushnumber(l, packed->data[i - 1]);
+        else
+            lua_pushnil(l);
+        return 1;
+    }
+
+    key = lua_tostring(l, 2);
+    if (!key)
+        lua_pushnil(l);
+    else if (!strcmp(key, "width"))
+        lua_pushinteger(l, packed->width);
+    else if (!strcmp(key, "count"))
+        lua_pushinteger(l, (lua_Integer)packed->count);
+    else if (!strcmp(key, "type"))
+        lua_pushstring(l, ckv3_packed_types[packed->type].name);
+    else
+        lua_rawget(l, lua_upvalueindex(1));
+
+    return 1;
+}
+
+static int ckv3_packed_newindex(lua_State *l)
+{
+    ckv3_packed_t *packed = ckv3_check_packed(l);
+    lua_Integer i = luaL_checkinteger(l, 2);
+
+    luaL_argcheck(l, i >= 1 && (size_t)i <= packed->count * packed->width,
+                  2, "index out of range");
+    packed->data[i - 1] = (float)luaL_checknumber(l, 3);
+
+    return 0;
+}
+
+static int ckv3_packed_len(lua_State *l)
+{
+    ckv3_packed_t *packed = ckv3_check_packed(l);
+
+    lua_pushinteger(l, (lua_Integer)(packed->count * packed->width));
+    return 1;
+}
+
+/* The floats as one binary string, in native byte order */
+static int ckv3_packed_raw(lua_State *l)
+{
+    ckv3_packed_t *packed = ckv3_check_packed(l);
+
+    lua_pushlstring(l, (const char *)packed->data,
+                    packed->count * packed->width * sizeof(float));
+    return 1;
+}
+
+/* The float buffer itself, valid while packed is alive */
+static int ckv3_packed_pointer(lua_State *l)
+{
+    ckv3_packed_t *packed = ckv3_check_packed(l);
+
+    lua_pushlightuserdata(l, packed->data);
+    return 1;
+}
+
+/* Create the packed array metatable, the config userdata is on top of
+ * the stack */
+static void ckv3_packed_register(lua_State *l)
+{
+    ckv3_config_t *cfg = (ckv3_config_t *)lua_touserdata(l, -1);
+    luaL_Reg methods[] = {
+        { "__index", ckv3_packed_index },
+        { "__newindex", ckv3_packed_newindex },
+        { "__len", ckv3_packed_len },
+        { "raw", ckv3_packed_raw },
+        { "pointer", ckv3_packed_pointer },
+        { NULL, NULL }
+    };
+
+    /* The methods check their argument against their own metatable */
+    lua_newtable(l);
+    lua_pushvalue(l, -1);
+    luaL_setfuncs(l, methods, 1);
+    cfg->packed_meta = luaL_ref(l, LUA_REGISTRYINDEX);
+}
+
+/* ===== QUERIES ===== */
+
+/* Validate a value the query doesn't want, skipping containers whole */
+static void ckv3_query_skip(lua_State *l, ckv3_parse_t *ckv3,
+                            ckv_token_t *token)
+{
+    switch (token->type) {
+    case T_STRING:
+        return;
+    case T_OBJ_BEGIN:
+    case T_ARR_BEGIN:
+        ckv3->ptr = ckv_skip_container(ckv3->ptr, CKV_LEX_KV3);
+        if (ckv3->ptr)
+            return;
+        token->type = T_END;
+        token->index = (int)strlen(ckv3->data);
+        ckv3_throw_parse_error(l, ckv3, "container end", token);
+        break;
+    default:
+        ckv3_throw_parse_error(l, ckv3, "value", token);
+    }
+}
+
+/* Scan an object like ckv3_parse() (the top level of the
+ * source when root is set) up to its end. Returns the start of what
+ * follows the last key equal to key, decode() keeps the last duplicate,
+ * or NULL */
+static const char *ckv3_query_object(lua_State *l, ckv3_parse_t *ckv3,
+                                     const char *key, size_t key_len,
+                                     int root)
+{
+    const ckv_token_type_t end = root ? T_END : T_OBJ_END;
+    ckv_token_t token;
+    const char *match = NULL, *value;
+    int hit;
+
+    ckv3_next_token(ckv3, &token);
+    if (token.type == end)
+        return NULL;
+
+    while (1) {
+        if (token.type != T_STRING)
+            ckv3_throw_parse_error(l, ckv3, "object key string", &token);
+
+        hit = key && (size_t)token.string_len == key_len &&
+              !memcmp(token.value.string, key, key_len);
+
+        /* "type" value, or a container */
+        value = ckv3->ptr;
+        ckv3_next_token(ckv3, &token);
+        if (token.type == T_STRING)
+            ckv3_next_token(ckv3, &token);
+        else if (token.type != T_OBJ_BEGIN && token.type != T_ARR_BEGIN)
+            ckv3_throw_parse_error(l, ckv3, "unexpected token", &token);
+        ckv3_query_skip(l, ckv3, &token);
+        if (hit)
+            match = value;
+
+        ckv3_next_token(ckv3, &token);
+        if (token.type == end)
+            return match;
+    }
+}
+
+/* query(data, path): the value decode(data)[k1][k2].. or nil. Containers
+ * off the path are skipped by bracket counting, so they are not
+ * validated. Typed values and arrays on the path are decoded to index
+ * into them */
+static int ckv3_query(lua_State *l)
+{
+    ckv3_parse_t ckv3;
+    ckv_token_t token;
+    const char *key;
+    size_t ckv3_len, key_len;
+    int path, count, k;
+
+    luaL_argcheck(l, lua_gettop(l) == 2, 2, "expected 2 arguments");
+
+    ckv3.cfg = ckv3_fetch_config(l);
+    CKV_STAT(ckv3.stats = &ckv3.cfg->stats);
+    ckv3.data = luaL_checklstring(l, 1, &ckv3_len);
+    count = ckv_query_path(l, 2);
+    path = lua_gettop(l);
+    ckv3.index = NULL;
+    ckv3.current_depth = 0;
+    ckv3.packed = ckv3.cfg->decode_packed_arrays;
+    ckv3.ptr = ckv3.data;
+
+    if (ckv3_len >= 2 && (!ckv3.data[0] || !ckv3.data[1]))
+        luaL_error(l, "KV parser does not support UTF-16 or UTF-32");
+
+    ckv3.tmp = ckv_scratch_get(&ckv3.cfg->scratch, ckv3_len);
+
+    ckv3_next_token(&ckv3, &token);
+    if (token.type != T_STRING)
+        ckv3_throw_parse_error(l, &ckv3, "Must begin with string", &token);
+    ckv3.ptr = ckv3.data;
+
+    for (k = 1; ; k++) {
+        key = ckv_query_key(l, path, k, &key_len);
+        ckv3.ptr = ckv3_query_object(l, &ckv3, key, key_len, k == 1);
+        if (!ckv3.ptr)
+            break;
+
+        ckv3_next_token(&ckv3, &token);
+        if (token.type == T_OBJ_BEGIN && k < count)
+            continue;
+
+        /* Built like ckv3_parse_key() */
+        if (token.type == T_STRING) {
+            lua_createtable(l, 2, 0);
+            ckv3_push_key(l, &ckv3, &token);
+            lua_rawseti(l, -2, 1);
+            ckv3_next_token(&ckv3, &token);
+            ckv3_process_value(l, &ckv3, &token);
+            lua_rawseti(l, -2, 2);
+        } else {
+            ckv3_process_value(l, &ckv3, &token);
+        }
+        ckv3_parse_release(&ckv3);
+        ckv_query_tail(l, path, k + 1, count);
+
+        return 1;
+    }
+
+    ckv3_parse_release(&ckv3);
+    lua_pushnil(l);
+
+    return 1;
+}
+
+/* ===== BINARY CACHE ===== */
+
+static int ckv3_encode_binary(lua_State *l)
+{
+    ckv3_config_t *cfg = ckv3_arg_init(l, 1);
+
+    ckv_binary_encode(l, 1, cfg->encode_max_depth);
+
+    return 1;
+}
+
+static int ckv3_decode_binary(lua_State *l)
+{
+    ckv3_config_t *cfg;
+    const char *data;
+    size_t len;
+
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+
+    cfg = ckv3_fetch_config(l);
+    data = luaL_checklstring(l, 1, &len);
+    if (ckv_binary_decode(l, data, len, cfg->decode_max_depth) != 0)
+        luaL_error(l, "Invalid binary KV data");
+
+    return 1;
+}
+
+/* decode() of a file, through a binary cache of it */
+static int ckv3_decode_file_cached(lua_State *l)
+{
+    char path[CKV_PATH_MAX];
+    ckv3_config_t *cfg;
+    ckv_file_t file;
+
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+
+    cfg = ckv3_fetch_config(l);
+    luaL_argcheck(l, strlen(luaL_checkstring(l, 1)) < sizeof(path), 1,
+                  "path too long");
+    strcpy(path, lua_tostring(l, 1));
+
+    if (ckv_cache_load(l, path, CKV_DIALECT_KV3, cfg->decode_max_depth))
+        return 1;
+
+    if (ckv_file_open(&file, path) != 0)
+        return luaL_fileresult(l, 0, path);
+
+    /* The cache only holds plain tables, so no packed arrays here */
+    lua_settop(l, 0);
+    lua_pushlstring(l, file.data, file.len);
+    ckv_file_close(&file);
+    ckv3_decode_text(l, 0);
+
+    ckv_cache_store(l, path, -1, 0, CKV_DIALECT_KV3, cfg->encode_max_depth);
+
+    return 1;
+}
 
 /* Return ckv3 module table */
 static int lua_ckv3_new(lua_State *l)
 {
     luaL_Reg reg[] = {
         { "encode", ckv3_encode },
+        { "encode_to", ckv3_encode_to },
+        { "encode_to_file", ckv3_encode_to_file },
         { "decode", ckv3_decode },
+        { "query", ckv3_query },
+        { "encode_binary", ckv3_encode_binary },
+        { "decode_binary", ckv3_decode_binary },
+        { "decode_file_cached", ckv3_decode_file_cached },
+        { "encode_keep_buffer", ckv3_cfg_encode_keep_buffer },
+        { "encode_compact", ckv3_cfg_encode_compact },
+        { "encode_sort_keys", ckv3_cfg_encode_sort_keys },
+        { "encode_buffer_stats", ckv3_encode_buffer_stats },
+        { "stats", ckv3_stats },
+        { "decode_presize", ckv3_cfg_decode_presize },
+        { "decode_key_cache", ckv3_cfg_decode_key_cache },
+        { "decode_scratch_limit", ckv3_cfg_decode_scratch_limit },
+        { "decode_packed_arrays", ckv3_cfg_decode_packed_arrays },
         { NULL, NULL }
     };
 
@@ -908,6 +2349,8 @@ static int lua_ckv3_new(lua_State *l)
 
     /* Register functions with config data as upvalue */
     ckv3_create_config(l);
+    ckv3_packed_register(l);
+    ckv3_decoder_register(l);
     luaL_setfuncs(l, reg, 1);
 
     return 1;
@@ -920,6 +2363,5 @@ LUALIB_API int luaopen_ckv3(lua_State *l)
 #endif
 {
     lua_ckv3_new(l);
-    InitTabCache();
     return 1;
 }
\ No newline at end of file